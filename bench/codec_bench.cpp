@@ -0,0 +1,62 @@
+#include "include/checksum.hpp"
+#include "include/codec.hpp"
+
+#include <boost/archive/iterators/base64_from_binary.hpp>
+#include <boost/archive/iterators/transform_width.hpp>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+namespace
+{
+std::string Random_Bytes(size_t n)
+{
+    std::mt19937 rng(7);
+    std::string ret(n, '\0');
+    for (auto& c : ret)
+        c = static_cast<char>(rng());
+    return ret;
+}
+
+std::string To_Base64(const std::string& bin)
+{
+    namespace ar_iters = boost::archive::iterators;
+    using ItBase64T = ar_iters::base64_from_binary<
+                        ar_iters::transform_width<std::string::const_iterator, 6, 8>>;
+    std::string ret(ItBase64T(bin.begin()), ItBase64T(bin.end()));
+    ret.append((3 - bin.size() % 3) % 3, '=');
+    return ret;
+}
+} // namespace
+
+// What the Upload-Checksum header costs once the body is digested: the
+// header value decoded and compared with the digest
+TEST_CASE("Upload-Checksum header", "[Codec]")
+{
+    for (size_t digest_sz : {4, 8, 20, 32}) // crc32c, xxh3, sha1, sha256
+    {
+        const auto digest = Random_Bytes(digest_sz);
+        const auto b64 = To_Base64(digest);
+        std::vector<unsigned char> out(tus::Base64DecodedSize(b64));
+        const auto suffix = std::to_string(digest_sz) + " byte digest";
+
+        BENCHMARK("Base64Decode, " + suffix) { return tus::Base64Decode(b64, out.data()); };
+        BENCHMARK("Base64Matches, " + suffix) { return tus::Base64Matches(b64, digest); };
+    }
+}
+
+TEST_CASE("Chunk digests", "[Checksum]")
+{
+    const auto data = Random_Bytes(4 * 1024 * 1024);
+    for (const char* alg : {"crc32c", "xxh3", "sha1", "sha256"})
+        for (size_t chunk_sz : {size_t(4 * 1024), size_t(64 * 1024), data.size()})
+            BENCHMARK(std::string(alg) + ", " + std::to_string(chunk_sz / 1024) + " KiB")
+            {
+                auto sum = tus::ChecksumRegistry::Instance().Create(alg);
+                sum->Update(data.data(), chunk_sz);
+                return sum->Digest();
+            };
+}
@@ -0,0 +1,114 @@
+#include "include/files_manager.hpp"
+
+#include <boost/asio/buffer.hpp>
+#include <boost/beast/core/multi_buffer.hpp>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+using tus::FilesManager;
+
+namespace
+{
+std::string New_Upload(FilesManager& fm, size_t length)
+{
+    auto res = fm.NewTmpFilesResource();
+    REQUIRE(res.Initialize(length) == static_cast<std::errc>(0));
+    const auto uuid = res.Uuid();
+    fm.Persist(res);
+    return uuid;
+}
+
+std::vector<boost::asio::const_buffer> Split(const std::string& data, size_t seg_sz)
+{
+    std::vector<boost::asio::const_buffer> ret;
+    for (size_t pos = 0; pos < data.size(); pos += seg_sz)
+        ret.emplace_back(data.data() + pos, std::min(seg_sz, data.size() - pos));
+    return ret;
+}
+} // namespace
+
+TEST_CASE("FileResource::Write", "[FilesManager]")
+{
+    FilesManager fm(".");
+    const std::string data(1024 * 1024, 'w');
+    const auto uuid = New_Upload(fm, data.size());
+    auto [res, fres] = fm.GetFileResource(uuid);
+    REQUIRE(res == static_cast<std::errc>(0));
+
+    BENCHMARK("1 MiB, one buffer")
+    {
+        return fres.Write(0, boost::asio::const_buffer(data.data(), data.size()));
+    };
+    // As a request body arrives in
+    boost::beast::multi_buffer body;
+    boost::asio::buffer_copy(body.prepare(data.size()), boost::asio::buffer(data));
+    body.commit(data.size());
+    BENCHMARK("1 MiB, multi_buffer") { return fres.Write(0, body); };
+    for (size_t seg_sz : {64 * 1024, 4 * 1024, 1024})
+    {
+        const auto bufs = Split(data, seg_sz);
+        BENCHMARK("1 MiB in " + std::to_string(bufs.size()) + " segments") { return fres.Write(0, bufs); };
+    }
+
+    fres.Delete();
+    fres.Commit();
+}
+
+TEST_CASE("FileResource::ChecksumSha1Hex", "[FilesManager]")
+{
+    FilesManager fm(".");
+    const std::string data(4 * 1024 * 1024, 's');
+    const auto uuid = New_Upload(fm, data.size());
+    auto [res, fres] = fm.GetFileResource(uuid);
+    REQUIRE(res == static_cast<std::errc>(0));
+    REQUIRE(fres.Write(data));
+
+    for (size_t chunk_sz : {size_t(4 * 1024), size_t(64 * 1024), size_t(1024 * 1024), data.size()})
+        BENCHMARK(std::to_string(chunk_sz / 1024) + " KiB") { return fres.ChecksumSha1Hex(0, chunk_sz); };
+
+    fres.Delete();
+    fres.Commit();
+}
+
+// Latency of acquiring and releasing an upload while other threads do the
+// same, on uploads of their own or on the very same one
+TEST_CASE("FilesManager::GetFileResource under contention", "[FilesManager]")
+{
+    FilesManager fm(".");
+    const auto mine = New_Upload(fm, 100);
+    const unsigned others = std::max(2u, std::thread::hardware_concurrency()) - 1;
+    std::vector<std::string> theirs;
+    for (unsigned t = 0; t < others; ++t)
+        theirs.push_back(New_Upload(fm, 100));
+
+    auto acquire = [&fm](const std::string& uuid) {
+        auto [res, fres] = fm.GetFileResource(uuid);
+        return res;
+    };
+    auto with_others = [&](const std::string& name, bool same_upload) {
+        std::atomic<bool> stop{false};
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < others; ++t)
+            workers.emplace_back([&, t] {
+                const auto& uuid = same_upload ? mine : theirs[t];
+                while (!stop.load(std::memory_order_relaxed))
+                    acquire(uuid);
+            });
+        // Busy answers count as well, they are what a contended upload costs
+        BENCHMARK(std::string(name)) { return acquire(mine); };
+        stop = true;
+        for (auto& w : workers)
+            w.join();
+    };
+
+    BENCHMARK("alone") { return acquire(mine); };
+    with_others(std::to_string(others) + " threads on other uploads", false);
+    with_others(std::to_string(others) + " threads on the same upload", true);
+
+    fm.RmAllFiles();
+}
@@ -0,0 +1,118 @@
+#include "include/tus_manager.hpp"
+
+#include <boost/archive/iterators/base64_from_binary.hpp>
+#include <boost/archive/iterators/transform_width.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <string>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+
+using tus::FilesManager;
+using tus::TusManager;
+
+namespace
+{
+http::request<http::dynamic_body> Make_Req(http::verb verb, const std::string& target)
+{
+    http::request<http::dynamic_body> req{verb, target, 11};
+    req.set(http::field::host, "localhost");
+    req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+    req.set("Tus-Resumable", "1.0.0");
+    return req;
+}
+
+std::string New_Upload(FilesManager& fm, size_t length)
+{
+    auto res = fm.NewTmpFilesResource();
+    REQUIRE(res.Initialize(length) == static_cast<std::errc>(0));
+    const auto uuid = res.Uuid();
+    fm.Persist(res);
+    return "/files/" + uuid;
+}
+
+std::string To_Base64(const std::string& bin)
+{
+    namespace ar_iters = boost::archive::iterators;
+    using ItBase64T = ar_iters::base64_from_binary<
+                        ar_iters::transform_width<std::string::const_iterator, 6, 8>>;
+    std::string ret(ItBase64T(bin.begin()), ItBase64T(bin.end()));
+    ret.append((3 - bin.size() % 3) % 3, '=');
+    return ret;
+}
+
+void Set_Body(http::request<http::dynamic_body>& req, const std::string& data)
+{
+    req.set(http::field::content_type, TusManager::PATCH_EXPECTED_CONTENT_TYPE);
+    auto& body = req.body();
+    body.consume(body.size());
+    body.commit(boost::asio::buffer_copy(body.prepare(data.size()), boost::asio::buffer(data)));
+    req.content_length(data.size());
+}
+} // namespace
+
+// Whole requests held in memory, each answered the way the server answers
+// it once the body has arrived
+TEST_CASE("TusManager::MakeResponse", "[TusManager]")
+{
+    FilesManager fm(".");
+    TusManager tm(fm);
+    const std::string chunk(4 * 1024, 'p');
+
+    auto options = Make_Req(http::verb::options, "/files");
+    BENCHMARK("OPTIONS") { return tm.MakeResponse(options); };
+
+    auto head = Make_Req(http::verb::head, New_Upload(fm, 100));
+    BENCHMARK("HEAD") { return tm.MakeResponse(head); };
+
+    auto post = Make_Req(http::verb::post, "/files");
+    post.set(TusManager::TAG_UPLOAD_LENGTH, "100");
+    post.set(TusManager::TAG_UPLOAD_METADATA, "filename YmVuY2g=");
+    BENCHMARK("POST") { return tm.MakeResponse(post); };
+    fm.RmAllFiles();
+
+    auto post_with_upload = Make_Req(http::verb::post, "/files");
+    post_with_upload.set(TusManager::TAG_UPLOAD_LENGTH, std::to_string(chunk.size()));
+    Set_Body(post_with_upload, chunk);
+    BENCHMARK("POST with 4 KiB") { return tm.MakeResponse(post_with_upload); };
+    fm.RmAllFiles();
+
+    // Every PATCH goes on where the one before ended
+    for (const auto& [name, checksum] : {std::pair{"PATCH 4 KiB", ""},
+                                         std::pair{"PATCH 4 KiB, sha1", "sha1 "}})
+        BENCHMARK_ADVANCED(std::string(name))(Catch::Benchmark::Chronometer meter)
+        {
+            auto patch = Make_Req(http::verb::patch, New_Upload(fm, chunk.size() * meter.runs()));
+            Set_Body(patch, chunk);
+            if (*checksum)
+            {
+                // Every chunk is the same, and so is its digest
+                tus::Sha1 sha1;
+                sha1.Update(chunk.data(), chunk.size());
+                const auto digest = sha1.Digest();
+                patch.set(TusManager::TAG_UPLOAD_CHECKSUM, checksum + To_Base64(digest));
+            }
+            meter.measure([&](int i) {
+                patch.set(TusManager::TAG_UPLOAD_OFFSET, std::to_string(i * chunk.size()));
+                return tm.MakeResponse(patch);
+            });
+            fm.RmAllFiles();
+        };
+
+    BENCHMARK_ADVANCED("DELETE")(Catch::Benchmark::Chronometer meter)
+    {
+        std::vector<http::request<http::dynamic_body>> deletes;
+        for (int i = 0; i < meter.runs(); ++i)
+            deletes.push_back(Make_Req(http::verb::delete_, New_Upload(fm, 100)));
+        meter.measure([&](int i) { return tm.MakeResponse(deletes[i]); });
+        fm.RmAllFiles();
+    };
+
+    auto metrics = Make_Req(http::verb::get, "/metrics");
+    BENCHMARK("GET /metrics") { return tm.MakeResponse(metrics); };
+}
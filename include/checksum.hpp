@@ -0,0 +1,135 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace tus
+{
+
+// Incremental digest of an Upload-Checksum algorithm
+class Checksum
+{
+public:
+    virtual ~Checksum() = default;
+
+    virtual void Update(const void* data, size_t size) = 0;
+    // Binary digest, as it is carried base64 encoded in Upload-Checksum.
+    // Integer digests (crc32c, xxh3) are in network byte order.
+    virtual std::string Digest() = 0;
+};
+
+// Algorithms advertised in Tus-Checksum-Algorithm, looked up by name
+class ChecksumRegistry
+{
+public:
+    using Factory = std::function<std::unique_ptr<Checksum>()>;
+
+    static ChecksumRegistry& Instance();
+
+    // Registration is meant for startup, before requests are served
+    void Register(const std::string& name, Factory factory);
+
+    // nullptr when the algorithm is unknown
+    std::unique_ptr<Checksum> Create(std::string_view name) const;
+
+    // Comma separated, for Tus-Checksum-Algorithm
+    const std::string& Names() const { return names_; }
+
+private:
+    ChecksumRegistry();
+
+    std::map<std::string, Factory, std::less<>> factories_;
+    std::string names_;
+};
+
+// SHA-1 with a choice of compression kernel. Single streams are fastest
+// with the SHA extensions. UpdateMany() moves up to eight Avx2x8 hashers
+// (say, the chunks of concurrent uploads) through their blocks in lockstep,
+// one stream per 32 bit lane, which outruns SHA-NI when the lanes are full.
+class Sha1 : public Checksum
+{
+public:
+    enum class Kernel { Scalar, ShaNi, Avx2x8 };
+
+    static bool Supported(Kernel kernel);
+    // Best kernel for hashing one stream at a time
+    static Kernel Fastest();
+    // Best kernel for hashers advanced together with UpdateMany()
+    static Kernel FastestMany();
+
+    // Unsupported kernels fall back to Scalar
+    explicit Sha1(Kernel kernel = Fastest());
+
+    void Update(const void* data, size_t size) override;
+    std::string Digest() override;
+
+    Kernel GetKernel() const { return kernel_; }
+
+    // Same as hashers[i]->Update(pieces[i]) for every i
+    static void UpdateMany(Sha1* const* hashers, const std::string_view* pieces, size_t n);
+
+private:
+    void compress(const unsigned char* p, size_t nblocks);
+
+    Kernel kernel_;
+    std::array<uint32_t, 5> state_;
+    std::array<unsigned char, 64> block_;
+    size_t block_len_ = 0;
+    uint64_t total_len_ = 0;
+};
+
+// Castagnoli CRC; SSE4.2 crc32 over three interleaved streams merged with
+// PCLMULQDQ when the CPU has them, slicing-by-8 tables otherwise.
+class Crc32c : public Checksum
+{
+    uint32_t crc_ = 0;
+
+public:
+    void Update(const void* data, size_t size) override { crc_ = Extend(crc_, data, size); }
+    std::string Digest() override;
+
+    uint32_t Value() const { return crc_; }
+    static uint32_t Extend(uint32_t crc, const void* data, size_t size);
+};
+
+// SHA-NI when available
+class Sha256 : public Checksum
+{
+    std::array<uint32_t, 8> state_;
+    std::array<unsigned char, 64> block_;
+    size_t block_len_ = 0;
+    uint64_t total_len_ = 0;
+
+public:
+    Sha256();
+
+    void Update(const void* data, size_t size) override;
+    std::string Digest() override;
+};
+
+// 64 bit XXH3 with the default secret and seed 0; the stripe accumulation
+// loop uses AVX2 when available.
+class Xxh3 : public Checksum
+{
+    alignas(64) std::array<uint64_t, 8> acc_;
+    alignas(64) std::array<unsigned char, 256> buffer_;
+    size_t buffered_ = 0;
+    size_t stripes_so_far_ = 0;
+    uint64_t total_len_ = 0;
+
+public:
+    Xxh3();
+
+    void Update(const void* data, size_t size) override;
+    std::string Digest() override;
+
+    uint64_t Value() const;
+    static uint64_t Hash(const void* data, size_t size);
+};
+
+} // namespace tus
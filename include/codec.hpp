@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace tus
+{
+
+// Text encodings of digests, as carried in headers. Nothing here allocates
+// except HexEncode(), which returns its result.
+
+enum class Base64Kernel { Scalar, Ssse3, Avx2 };
+
+bool Base64Supported(Base64Kernel kernel);
+Base64Kernel Base64Fastest();
+
+// Size that b64 decodes to; npos when the length is not a whole number of
+// quads or the padding is longer than two characters
+size_t Base64DecodedSize(std::string_view b64);
+
+// Decodes the padded standard alphabet (RFC 4648 section 4) into out, which
+// must hold Base64DecodedSize(b64) bytes. False on malformed input, in which
+// case out is left partially written.
+bool Base64Decode(std::string_view b64, unsigned char* out,
+                  Base64Kernel kernel = Base64Fastest());
+
+// Whether b64 is well formed and decodes to exactly bin
+bool Base64Matches(std::string_view b64, std::string_view bin,
+                   Base64Kernel kernel = Base64Fastest());
+
+// Upper case, two digits per byte
+std::string HexEncode(std::string_view bin);
+
+} // namespace tus
@@ -0,0 +1,21 @@
+#pragma once
+
+namespace tus
+{
+
+// Instruction set extensions available at runtime. Accelerated kernels are
+// compiled with per-function target attributes and selected with these, so
+// the binary itself keeps running on any x86-64 (or non-x86) machine.
+struct CpuFeatures
+{
+    bool ssse3 = false;
+    bool sse41 = false;
+    bool sse42 = false;
+    bool pclmul = false;
+    bool avx2 = false;
+    bool sha = false;
+
+    static const CpuFeatures& Get();
+};
+
+} // namespace tus
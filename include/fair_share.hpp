@@ -0,0 +1,106 @@
+#pragma once
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <unordered_map>
+
+namespace tus
+{
+
+// Shares the bandwidth of upload bodies among clients. A connection asks
+// for the bytes of a body with Acquire() and reads nothing of it from the
+// socket until they are granted, so a client sending more than its share
+// is held back by TCP flow control instead of being buffered. Every client
+// has a token bucket of client_rate, all of them share one of total_rate;
+// clients waiting for them are served by deficit round-robin, a quantum of
+// bytes each per round, however many connections each one has.
+class FairShare
+{
+public:
+    struct Config
+    {
+        // Bytes per second of the upload bodies of one client, and of all
+        // clients together; 0 for no limit
+        uint64_t client_rate = 0;
+        uint64_t total_rate = 0;
+        // Bytes a bucket holds, what can be read at once after a pause
+        uint64_t burst = 256 * 1024;
+        // Bytes a waiting client is given per round
+        uint64_t quantum = 64 * 1024;
+        // Clients are told apart by their address, and by the value of this
+        // key in the Upload-Metadata of the upload if it has one
+        std::string metadata_key;
+    };
+
+    // Bytes that may be read, at least one and at most what was asked for;
+    // called on the scheduler's strand, should just hand them over
+    using Granted = std::function<void(uint64_t)>;
+
+    FairShare(boost::asio::io_context& ioc, const Config& config);
+    FairShare(const FairShare&) = delete;
+    FairShare& operator=(const FairShare&) = delete;
+
+    // Without limits nothing needs to be acquired
+    bool Enabled() const { return config_.client_rate > 0 || config_.total_rate > 0; }
+    const Config& GetConfig() const { return config_; }
+
+    void Acquire(const std::string& client, uint64_t bytes, Granted granted);
+    // Gives back granted bytes that were not read after all
+    void Release(const std::string& client, uint64_t bytes);
+    // Drops the waiters, never granted then, with the connections they
+    // hold, and stops the timer; what is acquired later is dropped too.
+    // Like any object of the io_context, this must not be destroyed while
+    // the io_context still runs.
+    void Stop();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Bucket
+    {
+        double tokens;
+        Clock::time_point last;
+
+        void refill(Clock::time_point now, uint64_t rate, uint64_t burst);
+        // Tokens there are, all of them without a rate
+        uint64_t available(uint64_t rate) const;
+        // Time until there are n
+        Clock::duration until(uint64_t n, uint64_t rate) const;
+    };
+
+    struct Waiter
+    {
+        uint64_t bytes;
+        Granted granted;
+    };
+
+    struct Client
+    {
+        Bucket bucket;
+        uint64_t deficit = 0;
+        std::deque<Waiter> waiting;
+    };
+
+    // Both on the strand of timer_
+    void dispatch();
+    // Drops the clients that wait for nothing and have a full bucket
+    void prune(Clock::time_point now);
+
+    const Config config_;
+    boost::asio::steady_timer timer_;
+    bool timer_armed_ = false;
+    bool stopped_ = false;
+    Bucket total_;
+    std::unordered_map<std::string, Client> clients_;
+    // Clients waiting, in the order of their next turn
+    std::deque<Client*> active_;
+    size_t prune_at_ = 64;
+};
+
+} // namespace tus
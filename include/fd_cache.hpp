@@ -0,0 +1,76 @@
+#pragma once
+
+#include "include/upload_registry.hpp"
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace tus
+{
+
+// Data file descriptors of uploads that are open but not in use, least
+// recently used first out. An upload's descriptor is taken out while a
+// request works on it and put back when it is done, so eviction never
+// closes a descriptor that is being used; an upload is in here at most once.
+class FdCache
+{
+public:
+    struct Stats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+    };
+
+    // Up to a quarter of RLIMIT_NOFILE
+    static size_t MaxCapacity();
+    static size_t DefaultCapacity();
+
+    explicit FdCache(size_t capacity = DefaultCapacity());
+    // Closes everything still cached
+    ~FdCache();
+    FdCache(const FdCache&) = delete;
+    FdCache& operator=(const FdCache&) = delete;
+
+    // Clamped to MaxCapacity(); 0 turns caching off
+    void SetCapacity(size_t capacity);
+    size_t Capacity() const;
+
+    // The descriptor leaves the cache with this, the caller owns it
+    std::optional<int> Take(const UploadKey& key);
+    // Ownership comes back; closed right away if the upload is cached
+    // already or nothing can be cached
+    void Put(const UploadKey& key, int fd);
+    // Closes the upload's descriptor, if cached
+    void Drop(const UploadKey& key);
+
+    size_t Size() const;
+    Stats GetStats() const;
+
+private:
+    struct KeyHash
+    {
+        size_t operator()(const UploadKey& key) const
+        {
+            return static_cast<size_t>((key.hi ^ key.lo) * 0x9e3779b97f4a7c15ULL);
+        }
+    };
+    using Lru = std::list<std::pair<UploadKey, int>>;
+
+    static void close(int fd);
+    // Unlinks the least recently used beyond capacity_ into evicted
+    void shrink(std::vector<int>& evicted);
+
+    mutable std::mutex mtx_;
+    size_t capacity_;
+    Lru lru_; // most recently put first
+    std::unordered_map<UploadKey, Lru::iterator, KeyHash> index_;
+    Stats stats_;
+};
+
+} // namespace tus
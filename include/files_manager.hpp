@@ -1,14 +1,25 @@
 #pragma once
 
-#include <boost/uuid/uuid_generators.hpp>
+#include "include/fd_cache.hpp"
+#include "include/group_commit.hpp"
+#include "include/journal.hpp"
+#include "include/storage_executor.hpp"
+#include "include/upload_registry.hpp"
+
 #include <boost/beast.hpp>
 
+#include <sys/uio.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <ios>
 #include <limits>
+#include <memory>
 #include <mutex>
-#include <fstream>
-#include <unordered_set>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace tus
 {
@@ -25,9 +36,10 @@ class TmpFilesResource
     const std::string uuid_;
     bool persisted_;
     bool do_erase_;
+    // Upload-Length taken from the ledger by Initialize()
+    size_t reserved_;
 
-    std::ofstream md_ostr_;
-    std::ofstream dt_ostr_;
+    int dt_fd_;
 
     // Assure only FilesManager get it created
     TmpFilesResource(FilesManager& files_man, const std::string& uuid);
@@ -35,7 +47,11 @@ class TmpFilesResource
 public:
     ~TmpFilesResource() noexcept;
 
-    std::errc Initialize(size_t totlen, const std::string_view& md_comment = "");
+    // Reserves totlen in the ledger and on disk, then journals the upload.
+    // file_too_large if totlen alone exceeds the quota, no_space_on_device if
+    // the quota or the volume has no room left for it.
+    std::errc Initialize(size_t totlen, const std::string_view& md_comment = "",
+                         const std::string_view& concat = "");
 
     const std::string& Uuid() const { return uuid_; }
 };
@@ -45,6 +61,8 @@ struct Metadata
     std::streamoff offset;
     size_t length;
     std::string comment;
+    // Upload-Concat as given at creation: empty, "partial" or "final;<urls>"
+    std::string concat;
 };
 
 class FileResource
@@ -53,13 +71,20 @@ class FileResource
 
     FilesManager& files_man_;
 
-    const std::string& uuid_;
-    mutable std::fstream fstream_dt_;
-    mutable std::fstream fstream_md_;
+    const std::string uuid_;
+    // The data file is accessed with positioned I/O only, so there is no
+    // seek state; write_end_ is where the last write ended and what Commit()
+    // journals as the upload offset.
+    int dt_fd_;
+    std::streamoff write_end_;
+    // Bytes written since the last Commit(), what a grouped commit flushes
+    uint64_t dirty_ = 0;
     bool delete_mark_;
     bool do_release_mark_;
 
-    bool updateOffsetMetadata();
+    // pwritev() of all of iov, resuming after short writes; 0 on error
+    size_t writeAll(std::streamoff offset_sz, iovec* iov, int iovcnt);
+    void close() noexcept;
 
     // Make sure FileResource is only acquired from owner FilesManager
     FileResource(FilesManager& fm, const std::string& uuid);
@@ -71,52 +96,274 @@ public:
     FileResource(const FileResource&) = delete;
     FileResource(FileResource&&);
 
-    bool IsOpen() const { return fstream_dt_.is_open() && fstream_md_.is_open(); }
+    bool IsOpen() const { return dt_fd_ >= 0; }
 
+    // As of the last Commit(), or the last one durable when commits are
+    // grouped
     Metadata GetMetadata() const;
-    std::string ChecksumSha1Hex(std::ifstream::pos_type begpos = 0, std::streamoff count = 0) const;
+    std::string ChecksumSha1Hex(std::streamoff begpos = 0, std::streamoff count = 0) const;
 
-    size_t Write(std::streamoff offset_sz, const boost::beast::multi_buffer& body);
+    // Writes all of bufs at offset_sz with as few pwritev() calls as the
+    // sequence allows; returns the bytes written, 0 on error
+    template <typename ConstBufferSequence>
+    size_t Write(std::streamoff offset_sz, const ConstBufferSequence& bufs);
+    size_t Write(std::streamoff offset_sz, const boost::beast::multi_buffer& body)
+    {
+        return Write(offset_sz, body.cdata());
+    }
+    // Appends where the last write ended
     bool Write(const std::string_view& data)
     {
-        return !!fstream_dt_.write(data.data(), data.size());
+        return Write(write_end_, boost::asio::const_buffer(data.data(), data.size())) == data.size();
     }
+    // Copies the first size bytes of part's data to where the last write
+    // ended: cloned when part is the whole file so far and the file system
+    // shares extents, with copy_file_range() otherwise, which lets the
+    // kernel do the copy or reflink it
+    bool Append(const FileResource& part, size_t size);
+    // Write() carried out by storage, done is called from its thread
+    void WriteAsync(StorageExecutor& storage, std::streamoff offset_sz,
+                    const void* data, size_t size, StorageExecutor::Completion done);
+    // Moves size bytes waiting in pipe_fd into the data file at offset_sz
+    // with splice(), so they never pass through user space; returns the
+    // bytes moved, less than size on error
+    size_t Splice(int pipe_fd, std::streamoff offset_sz, size_t size);
 
     void Delete() noexcept { delete_mark_ = true; }
-    bool Commit();
+    // Stores the upload offset, or deletes the upload if marked so; the
+    // result tells whether the offset was stored, or handed over to be
+    // once its data is durable when commits are grouped. durable, if
+    // given, is called once the offset and the data before it are as
+    // durable as FilesManager::SetDurability() asks: right away unless
+    // commits are grouped, later from GroupCommit's thread otherwise. The
+    // resource is free to go meanwhile.
+    bool Commit(GroupCommit::Done durable = nullptr);
 };
 
+template <typename ConstBufferSequence>
+size_t FileResource::Write(std::streamoff offset_sz, const ConstBufferSequence& bufs)
+{
+    if (dt_fd_ < 0)
+        return 0;
+
+    // A multi_buffer body has a handful of segments, so one batch is the
+    // common case; longer sequences take one syscall per batch
+    constexpr int Iov_Batch = 64;
+    iovec iov[Iov_Batch];
+    int iovcnt = 0;
+    size_t ret = 0, pending = 0;
+    for (auto it = boost::asio::buffer_sequence_begin(bufs);
+         it != boost::asio::buffer_sequence_end(bufs); ++it)
+    {
+        const boost::asio::const_buffer constbuf = *it;
+        if (constbuf.size() == 0)
+            continue;
+        iov[iovcnt++] = {const_cast<void*>(constbuf.data()), constbuf.size()};
+        pending += constbuf.size();
+        if (iovcnt == Iov_Batch)
+        {
+            if (writeAll(offset_sz + ret, iov, iovcnt) != pending)
+                return 0;
+            ret += pending;
+            iovcnt = 0;
+            pending = 0;
+        }
+    }
+    if (iovcnt > 0)
+    {
+        if (writeAll(offset_sz + ret, iov, iovcnt) != pending)
+            return 0;
+        ret += pending;
+    }
+    write_end_ = offset_sz + ret;
+    dirty_ += ret;
+    return ret;
+}
+
+// Outcome of FilesManager::Recover()
+struct RecoveryStats
+{
+    size_t recovered = 0;   // uploads registered again
+    size_t repaired = 0;    // of those, how many had their offset cut back to the data on disk
+    size_t skipped = 0;     // no data file, or unreadable metadata files
+    size_t imported = 0;    // of those recovered, how many from metadata files into the journal
+    uint64_t torn = 0;      // bytes at the end of the journal that were dropped
+    uint64_t reserved = 0;  // Upload-Length of the recovered uploads together
+    bool clean = false;     // journal left by a clean shutdown, data files were not checked
+    std::chrono::microseconds elapsed{0};
+};
+
+// What FilesManager::ReapExpired() removed
+struct ReapStats
+{
+    size_t files = 0;       // uploads removed
+    uint64_t bytes = 0;     // disk space their files took
+};
+
+// How FileResource::Commit() makes an upload offset durable
+enum class Durability
+{
+    // Journaled and left to the page cache (the default)
+    None,
+    // Every commit fdatasync()s the data file, then journals the offset and
+    // fdatasync()s the journal
+    Sync,
+    // Commits have the data file synced in a batch with those of other
+    // uploads by a GroupCommit, which then journals their offsets and syncs
+    // the journal once for them all; until then the offset is not visible
+    // either. Durable callbacks are called when their batch has been
+    // flushed
+    Group,
+};
+
+// Registry of uploads living in dirpath_; safe to share between the worker
+// threads of the server.
 class FilesManager
 {
     friend class TmpFilesResource;
     friend class FileResource;
 
     std::string dirpath_;
-    mutable std::mutex fname_mtx_;
-    std::unordered_set<std::string> all_fnames_;
-    std::unordered_set<std::string> inuse_fnames_;
-    boost::uuids::random_generator random_uuid_generator_;
+    // Uploads are opened and removed relative to this, never by full path
+    int dir_fd_;
+    UploadRegistry registry_;
+    // What the registry holds, for the next Recover(); every change is
+    // made to the registry first, so that a compaction taking its snapshot
+    // in between still ends up with the change
+    Journal journal_;
+    std::mutex compact_mtx_;
+    // Descriptors of uploads not in use, for the next request on them
+    FdCache fd_cache_;
+    std::atomic<uint64_t> quota_{0};
+    std::atomic<uint64_t> reserved_{0};
+    // Expiry times in the registry are milliseconds of the system clock
+    std::atomic<int64_t> ttl_ms_{0};
+    std::mutex reap_mtx_;
+    size_t reap_shard_ = 0;
+    std::atomic<size_t> reclaimed_files_{0};
+    std::atomic<uint64_t> reclaimed_bytes_{0};
+    Durability durability_ = Durability::None;
+    std::unique_ptr<GroupCommit> group_commit_;
 
 public:
+    static const std::string JOURNAL_FNAME;
+    // Of the metadata files that uploads had before there was a journal
     static const std::string METADATA_FNAME_SUFFIX;
 
-    explicit FilesManager(const std::string& dirpath) : dirpath_(dirpath) {}
+    explicit FilesManager(const std::string& dirpath);
+    ~FilesManager() noexcept;
+    FilesManager(const FilesManager&) = delete;
+    FilesManager& operator=(const FilesManager&) = delete;
+
+    // Registers the uploads already in dirpath_ by replaying the journal an
+    // earlier run left, before anything is written. Every upload's offset
+    // is checked against its data file by the given number of threads,
+    // unless the journal was compacted at a clean shutdown and trust_clean
+    // is set. Uploads from before there was a journal, with a metadata file
+    // each, are imported into it when it is empty. The journal is compacted
+    // to what was recovered, so it is never trusted as clean twice.
+    RecoveryStats Recover(unsigned threads = 1, bool trust_clean = true);
+    // Rewrites the journal with a record per upload; clean marks it as
+    // written at a clean shutdown, so that the next start trusts it. That
+    // is refused while an upload is in use or commits may still be grouped
+    // (see FlushCommits()), as offsets could follow that are not durable.
+    bool CompactJournal(bool clean = false);
+    // Compacts once the journal has grown to twice its size after the last
+    // compaction, and by a few MiB at least; every commit calls it, the one
+    // that finds it grown compacts while the others go on
+    bool CompactJournalIfGrown();
+    uint64_t JournalSize() const { return journal_.Size(); }
 
     TmpFilesResource NewTmpFilesResource();
     void Persist(TmpFilesResource& tmpres);
 
     std::pair<std::errc, FileResource>
         GetFileResource(const std::string& uuid);
-
-    size_t Size() const { return all_fnames_.size(); }
+    // What the registry holds about the upload, whether or not a request is
+    // working on it; no I/O
+    std::pair<std::errc, Metadata> GetMetadata(const std::string& uuid);
+    // Read-only descriptor of the upload's data file, without acquiring the
+    // upload, so that any number of readers can share it with a writer; the
+    // caller closes it
+    std::pair<std::errc, int> OpenData(const std::string& uuid);
+
+    size_t Size() const;
+    // Uploads a request is working on
+    size_t InUse() const;
     size_t RmAllFiles();
 
+    // Ledger of the bytes promised to uploads, the sum of their Upload-Length.
+    // A quota of 0 leaves only the volume as the limit.
+    void SetQuota(uint64_t bytes) { quota_ = bytes; }
+    uint64_t Quota() const { return quota_; }
+    uint64_t Reserved() const { return reserved_; }
+
+    // Uploads expire ttl after they were created or last written to; 0 (the
+    // default) keeps them forever. Expired uploads are missing for
+    // GetFileResource() right away and are removed by ReapExpired().
+    void SetTtl(std::chrono::milliseconds ttl) { ttl_ms_ = ttl.count(); }
+    std::chrono::milliseconds Ttl() const { return std::chrono::milliseconds(ttl_ms_); }
+    // Epoch if the upload is unknown or does not expire
+    std::chrono::system_clock::time_point Expires(const std::string& uuid) const;
+
+    // Removes at most max_files uploads that expired by now and are not in
+    // use. Every call sweeps on from the registry shard where the previous
+    // one stopped, so a call stays short however many uploads there are; a
+    // call made while another one runs returns at once.
+    ReapStats ReapExpired(size_t max_files,
+                          std::chrono::system_clock::time_point now = std::chrono::system_clock::now());
+    // Totals of all ReapExpired() calls
+    ReapStats Reclaimed() const { return {reclaimed_files_, reclaimed_bytes_}; }
+
+    // Meant for startup, before requests are served; group configures the
+    // batches of Durability::Group
+    void SetDurability(Durability mode, const GroupCommit::Config& group = {});
+    Durability GetDurability() const { return durability_; }
+    // Makes the grouped commits pending durable and calls their callbacks
+    // now, later ones are synced as they come. For shutdown, once requests
+    // are no longer served but before what the callbacks hand over to goes
+    // away
+    void FlushCommits()
+    {
+        if (group_commit_)
+            group_commit_->Stop();
+    }
+    // All zero unless commits are grouped
+    GroupCommit::Stats GroupCommitStats() const
+    {
+        return group_commit_ ? group_commit_->GetStats() : GroupCommit::Stats{};
+    }
+
+    // Uploads whose descriptors are kept open between requests, see FdCache
+    void SetFdCacheCapacity(size_t uploads) { fd_cache_.SetCapacity(uploads); }
+    FdCache::Stats FdCacheStats() const { return fd_cache_.GetStats(); }
+
 private:
     std::errc release(FileResource& fres) noexcept;
-
-    const std::string& newUniqueFileName();
+    // Hands the descriptor to fd_cache_ and clears it, if open
+    void cacheFd(const std::string& uuid, int& dt_fd) noexcept;
+    // Records a write: restarts the upload's time to live and moves its
+    // offset in the registry
+    void touch(const std::string& uuid, std::streamoff offset) noexcept;
+    // touch(), then journals the offset
+    bool storeOffset(const std::string& uuid, std::streamoff offset);
+    // CompactJournal() with compact_mtx_ held
+    bool compactJournal(bool clean);
+    // Journals that the upload is gone, after it left the registry
+    void journalDelete(const UploadKey& key) noexcept;
+    int64_t expiryAfter(int64_t activity_ms) const;
+
+    std::errc reserve(uint64_t bytes);
+    void unreserve(uint64_t bytes) noexcept;
+
+    std::string newUniqueFileName();
     std::string makeFPath(const std::string_view& sv) const;
 
+    // Cuts offsets beyond the data back and drops uploads without data
+    void checkData(std::vector<Journal::Record>& uploads, unsigned threads, RecoveryStats& stats) const;
+    // Uploads with a metadata file each, as Create records
+    std::vector<Journal::Record> scanMetadataFiles(unsigned threads, RecoveryStats& stats) const;
+
     bool deleteFiles(const std::string& uuid) noexcept;
     void erase(const std::string& uuid, bool delete_files) noexcept;
 };
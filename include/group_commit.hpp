@@ -0,0 +1,87 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace tus
+{
+
+// Makes the commits of many uploads durable together. A commit hands over
+// a duplicate of its upload's data file descriptor and is done once one
+// thread has fdatasync()ed the data files of its whole batch, stored the
+// offset of each commit whose data is durable, then synced the metadata
+// they share once. A batch is flushed interval after its first commit, or
+// as soon as its commits have written bytes between them, whichever comes
+// first. Only the metadata sync is shared: the data files are still synced
+// one after the other, so a flush of N uploads saves N - 1 metadata syncs.
+class GroupCommit
+{
+public:
+    struct Config
+    {
+        std::chrono::microseconds interval{2000};
+        uint64_t bytes = 16 * 1024 * 1024;
+    };
+
+    struct Stats
+    {
+        uint64_t batches = 0;
+        uint64_t commits = 0;
+        uint64_t failures = 0;  // commits whose sync failed
+    };
+
+    // Whether the files of the commit are durable, called on the flushing
+    // thread; should just hand the result over
+    using Done = std::function<void(bool)>;
+    // Stores the offset of one commit, once its data is durable
+    using Store = std::function<bool()>;
+    // Makes the metadata of the batch durable, after its offsets were stored
+    using SyncMeta = std::function<bool()>;
+
+    explicit GroupCommit(SyncMeta sync_meta);
+    GroupCommit(SyncMeta sync_meta, const Config& config);
+    // Nothing may be pending by then, see Stop()
+    ~GroupCommit();
+    GroupCommit(const GroupCommit&) = delete;
+    GroupCommit& operator=(const GroupCommit&) = delete;
+
+    // Takes ownership of data_fd; bytes is what the commit wrote
+    void Add(int data_fd, uint64_t bytes, Store store, Done done);
+    // Flushes what is pending and ends the flushing thread, so that the
+    // callbacks run while what they hand over to still exists; commits
+    // added later are flushed one by one on the adding thread
+    void Stop();
+    // After Stop(), nothing is ever pending
+    bool Stopped() const;
+
+    Stats GetStats() const;
+
+private:
+    struct Commit
+    {
+        int data_fd;
+        Store store;
+        Done done;
+    };
+
+    void run();
+    void flush(std::vector<Commit>& batch);
+
+    const SyncMeta sync_meta_;
+    const Config config_;
+    mutable std::mutex mtx_;
+    std::condition_variable cv_;
+    std::vector<Commit> pending_;
+    uint64_t pending_bytes_ = 0;
+    std::chrono::steady_clock::time_point first_;
+    bool stop_ = false;
+    Stats stats_;
+    std::thread flusher_;
+};
+
+} // namespace tus
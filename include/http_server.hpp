@@ -0,0 +1,89 @@
+#pragma once
+
+#include "include/fair_share.hpp"
+#include "include/storage_executor.hpp"
+#include "include/tus_manager.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+namespace tus
+{
+
+class HttpServer
+{
+public:
+    struct Config
+    {
+        // Time allowed to receive and answer one request
+        std::chrono::seconds request_timeout{60};
+        // Time a kept-alive connection may sit idle between requests
+        std::chrono::seconds idle_timeout{30};
+        // Connection is closed after this many requests, 0 means unlimited
+        unsigned max_requests_per_connection = 0;
+        // Upload bodies are read and written to disk in pieces of this size
+        size_t body_piece_size = 64 * 1024;
+        // Limit for bodies of other requests, which are read into memory
+        std::uint64_t max_buffered_body = 1024 * 1024;
+        // Upload bodies are spliced from the socket through a pipe into the
+        // file instead of being read into pieces, unless they carry an
+        // Upload-Checksum; a chunked PATCH, without Content-Length, is
+        // refused with 400 either way
+        bool splice_uploads = false;
+        // Downloads are sent with sendfile() in pieces of at most this size,
+        // each on storage, so a large one does not hold up the others
+        size_t download_piece_size = 1024 * 1024;
+        // Expired uploads are removed every reap_interval, at most
+        // reap_batch of them each time; 0 turns the reaper off
+        std::chrono::milliseconds reap_interval{1000};
+        size_t reap_batch = 32;
+        // Event loop lag is sampled for Metrics this often; 0 turns it off
+        std::chrono::milliseconds lag_probe_interval{100};
+        // Upload bodies are read from the socket at these rates, without
+        // any by default
+        FairShare::Config fair_share;
+    };
+
+private:
+    boost::asio::io_context& ioc_;
+    boost::asio::ip::tcp::acceptor acceptor_;
+    TusManager& tus_man_;
+    const Config config_;
+    std::unique_ptr<StorageExecutor> own_storage_;
+    StorageExecutor& storage_;
+    FairShare fair_share_;
+    // All three only touched on the timers' strand
+    boost::asio::steady_timer reap_timer_;
+    boost::asio::steady_timer lag_timer_;
+    bool running_ = false;
+
+public:
+    // Upload bodies are written through storage, which has to outlive the
+    // server; without one the server makes its own
+    HttpServer(boost::asio::io_context& ioc, const boost::asio::ip::tcp::endpoint& endpoint,
+               TusManager& tm);
+    HttpServer(boost::asio::io_context& ioc, const boost::asio::ip::tcp::endpoint& endpoint,
+               TusManager& tm, const Config& config);
+    HttpServer(boost::asio::io_context& ioc, const boost::asio::ip::tcp::endpoint& endpoint,
+               TusManager& tm, const Config& config, StorageExecutor& storage);
+
+    // Starts accepting, reaping and probing the loop's lag; every accepted
+    // connection gets its own strand so io_context may be run() on any
+    // number of threads.
+    void Start();
+    void Stop();
+
+    boost::asio::ip::tcp::endpoint LocalEndpoint() const { return acceptor_.local_endpoint(); }
+
+private:
+    void accept();
+    void scheduleReap();
+    void scheduleLagProbe();
+};
+
+} // namespace tus
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "include/upload_registry.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <shared_mutex>
+#include <string>
+
+namespace tus
+{
+
+// Append-only log of what happens to uploads: their creation, every offset
+// they commit and their removal, one checksummed record each, all in one
+// file of the upload directory. Replaying it from the start gives the state
+// of every upload. Rewrite() compacts it to one record per upload alive;
+// records appended meanwhile are carried over, so appending never waits
+// for more than the swap of the files.
+class Journal
+{
+public:
+    enum class Type : uint8_t
+    {
+        Create = 1, // length, comment and concat; offset and time as of then
+        Offset = 2, // offset committed at time
+        Delete = 3,
+        Clean = 4,  // last record of a journal rewritten at a clean shutdown
+    };
+
+    struct Record
+    {
+        Type type = Type::Offset;
+        UploadKey key;
+        // Milliseconds of the system clock
+        int64_t time_ms = 0;
+        int64_t offset = 0;
+        uint64_t length = 0;
+        std::string comment;
+        std::string concat;
+    };
+
+    struct ReplayStats
+    {
+        size_t records = 0;
+        // Bytes after the last good record, left by a crash in an append
+        uint64_t torn = 0;
+        // Ends with a Clean record
+        bool clean = false;
+    };
+
+    using Emit = std::function<void(const Record&)>;
+
+    // Opens fname in the directory, creating it if need be
+    Journal(int dir_fd, const std::string& fname);
+    ~Journal();
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    bool IsOpen() const { return fd_ >= 0; }
+
+    // One write() of the whole record, safe from any thread
+    bool Append(const Record& rec);
+    // fdatasync() of what was appended so far
+    bool Sync();
+
+    // f for every record up to the first one that is torn or corrupt;
+    // meant for startup, before anything is appended
+    bool Replay(const Emit& f, ReplayStats& stats) const;
+    // Replaces the journal by what snapshot emits, then what was appended
+    // after the snapshot was taken, then a Clean record if clean is set.
+    // snapshot runs with appends held off and should be quick; the new file
+    // is synced and renamed over the old one.
+    bool Rewrite(const std::function<void(const Emit&)>& snapshot, bool clean = false);
+
+    uint64_t Size() const { return size_; }
+    // Size right after the last Rewrite(), or at opening
+    uint64_t BaseSize() const { return base_size_; }
+
+private:
+    static void encode(const Record& rec, std::string& out);
+    // Parses the record at the start of data, returns its size; 0 if data
+    // is short of a whole record or it does not check out
+    static size_t decode(const char* data, size_t size, Record& rec);
+
+    const int dir_fd_;
+    const std::string fname_;
+    // Appends take the shared side, Rewrite() the exclusive one
+    mutable std::shared_mutex mtx_;
+    int fd_;
+    std::atomic<uint64_t> size_{0};
+    std::atomic<uint64_t> base_size_{0};
+};
+
+} // namespace tus
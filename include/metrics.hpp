@@ -0,0 +1,106 @@
+#pragma once
+
+#include <boost/beast/http/verb.hpp>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace tus
+{
+
+// Counters of the server, exposed in the Prometheus text format. Every
+// thread records into a shard of its own, which only it writes to, so
+// recording is a thread-local lookup and plain relaxed stores; Render()
+// sums the shards, which may be a moment behind each other.
+class Metrics
+{
+public:
+    enum class Verb { Options, Head, Post, Patch, Delete, Get, Other };
+    static constexpr size_t Verb_Count = 7;
+    // Status codes 100-599 are counted apiece, latencies by status class
+    static constexpr unsigned Status_Min = 100;
+    static constexpr unsigned Status_Max = 599;
+    static constexpr size_t Class_Count = 5;
+    // Upper bounds in seconds, the last bucket being +Inf
+    static constexpr std::array<double, 14> Latency_Buckets = {
+        0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 5};
+
+    // Value computed by the caller at render time
+    struct Gauge
+    {
+        std::string name;
+        std::string help;
+        double value;
+    };
+
+    static Metrics& Instance();
+    static Verb VerbOf(boost::beast::http::verb verb);
+
+    Metrics();
+    ~Metrics();
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    // A request answered with status after elapsed since its headers arrived
+    void Request(Verb verb, unsigned status, std::chrono::nanoseconds elapsed);
+    // Upload body bytes that reached the data files
+    void BytesWritten(uint64_t bytes);
+    // Time spent digesting upload bodies for Upload-Checksum
+    void ChecksumTime(std::chrono::nanoseconds elapsed);
+    void ConnectionOpened();
+    void ConnectionClosed();
+    // How late a timer of the event loop fired
+    void LoopLag(std::chrono::nanoseconds lag);
+
+    uint64_t Requests(Verb verb, unsigned status) const;
+    uint64_t BytesWritten() const;
+    int64_t OpenConnections() const;
+
+    std::string Render(const std::vector<Gauge>& gauges = {}) const;
+
+private:
+    struct Histogram
+    {
+        std::array<std::atomic<uint64_t>, Latency_Buckets.size() + 1> buckets{};
+        std::atomic<uint64_t> sum_ns{0};
+    };
+
+    struct Shard
+    {
+        std::thread::id owner;
+        std::array<std::array<std::atomic<uint64_t>, Status_Max - Status_Min + 1>, Verb_Count> requests{};
+        std::array<std::array<Histogram, Class_Count>, Verb_Count> latency;
+        std::atomic<uint64_t> bytes_written{0};
+        std::atomic<uint64_t> checksum_ns{0};
+        std::atomic<uint64_t> conns_opened{0};
+        std::atomic<uint64_t> conns_closed{0};
+        Histogram loop_lag;
+    };
+
+    // Only the owner thread adds, so no read-modify-write is needed
+    static void add(std::atomic<uint64_t>& counter, uint64_t n)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    static void observe(Histogram& hist, std::chrono::nanoseconds elapsed);
+    template <typename Field>
+    uint64_t sum(Field&& field) const;
+
+    Shard& local();
+
+    // Tells instances apart in the threads' cache of their last shard
+    const uint64_t id_;
+    mutable std::mutex shards_mtx_;
+    // Kept after their thread exits, its counts stay in the totals
+    std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+} // namespace tus
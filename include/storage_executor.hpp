@@ -0,0 +1,42 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <functional>
+#include <memory>
+
+namespace tus
+{
+
+// Runs file I/O away from the network threads, so that a slow or congested
+// disk delays only the uploads waiting on it. Completions are called from
+// the executor's own threads and should just hand the result over, e.g. by
+// posting to the connection's strand.
+class StorageExecutor
+{
+public:
+    enum class Backend { Uring, ThreadPool };
+
+    // Bytes written, or -errno
+    using Completion = std::function<void(ssize_t)>;
+
+    // io_uring when the kernel allows it, the thread pool otherwise; threads
+    // serve Run() and, for the pool, the writes as well
+    static std::unique_ptr<StorageExecutor> Create(unsigned threads = 2);
+    // nullptr if the backend is not available here
+    static std::unique_ptr<StorageExecutor> Create(Backend backend, unsigned threads = 2);
+
+    // Waits for everything submitted so far to complete
+    virtual ~StorageExecutor() = default;
+
+    virtual Backend GetBackend() const = 0;
+
+    // Writes all of [data, data + size) to fd at offset, resuming short
+    // writes; the buffer must stay valid until done is called
+    virtual void Write(int fd, const void* data, size_t size, off_t offset, Completion done) = 0;
+    // Blocking file work that has no asynchronous form (metadata updates,
+    // opening and removing files)
+    virtual void Run(std::function<void()> work) = 0;
+};
+
+} // namespace tus
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace tus
+{
+
+// Spans of request processing, for finding out which phase of a slow
+// request was slow. Every thread records into a ring buffer of its own that
+// only it writes to, so recording takes no lock and the last Ring_Size
+// spans of each thread are kept. ChromeJson() dumps them in the Chrome
+// trace event format, for chrome://tracing or Perfetto.
+//
+// The BETUS_TRACE_* macros are how the server records; they compile to
+// nothing unless BETUS_TRACING is defined (cmake -DBETUS_TRACING=ON).
+class Trace
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+#ifdef BETUS_TRACING
+    static constexpr bool Enabled = true;
+#else
+    static constexpr bool Enabled = false;
+#endif
+    // Spans kept per thread, 32 bytes each
+    static constexpr size_t Ring_Size = 16 * 1024;
+
+    // Ids of requests start at 1, 0 is for spans outside of any request
+    static uint64_t NewRequest();
+    // The request that spans recorded by this thread belong to
+    static uint64_t CurrentRequest() { return current_; }
+    static void SetCurrentRequest(uint64_t id) { current_ = id; }
+
+    // name has to be a string literal, or live as long
+    static void Record(const char* name, Clock::time_point begin, Clock::time_point end);
+
+    // Every span still in the rings, a thread per ring
+    static std::string ChromeJson();
+    static bool Dump(const std::string& path);
+    // Empties the rings; only for when no thread is recording
+    static void Clear();
+
+private:
+    static thread_local uint64_t current_;
+};
+
+// Span from construction to destruction
+class TraceSpan
+{
+    const char* const name_;
+    const Trace::Clock::time_point begin_;
+
+public:
+    explicit TraceSpan(const char* name) : name_(name), begin_(Trace::Clock::now()) {}
+    ~TraceSpan() { Trace::Record(name_, begin_, Trace::Clock::now()); }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+// Spans recorded in its scope belong to request id
+class TraceRequest
+{
+    const uint64_t prev_;
+
+public:
+    explicit TraceRequest(uint64_t id) : prev_(Trace::CurrentRequest()) { Trace::SetCurrentRequest(id); }
+    ~TraceRequest() { Trace::SetCurrentRequest(prev_); }
+    TraceRequest(const TraceRequest&) = delete;
+    TraceRequest& operator=(const TraceRequest&) = delete;
+};
+
+} // namespace tus
+
+#define BETUS_TRACE_CAT2(a, b) a##b
+#define BETUS_TRACE_CAT(a, b) BETUS_TRACE_CAT2(a, b)
+
+#ifdef BETUS_TRACING
+// The rest of the scope is a span
+#define BETUS_TRACE_SPAN(name) ::tus::TraceSpan BETUS_TRACE_CAT(betus_trace_span_, __LINE__)(name)
+// Spans in the rest of the scope belong to request id
+#define BETUS_TRACE_REQUEST(id) ::tus::TraceRequest BETUS_TRACE_CAT(betus_trace_request_, __LINE__)(id)
+// Assigns a new request id to var
+#define BETUS_TRACE_NEW_REQUEST(var) ((var) = ::tus::Trace::NewRequest())
+// Span from the time_point since, taken with BETUS_TRACE_MARK, to now
+#define BETUS_TRACE_MARK(since) ((since) = ::tus::Trace::Clock::now())
+#define BETUS_TRACE_SINCE(name, since) ::tus::Trace::Record(name, since, ::tus::Trace::Clock::now())
+#else
+#define BETUS_TRACE_SPAN(name) static_cast<void>(0)
+#define BETUS_TRACE_REQUEST(id) static_cast<void>(0)
+#define BETUS_TRACE_NEW_REQUEST(var) static_cast<void>(0)
+#define BETUS_TRACE_MARK(since) static_cast<void>(0)
+#define BETUS_TRACE_SINCE(name, since) static_cast<void>(0)
+#endif
@@ -1,19 +1,128 @@
 #pragma once
 
+#include "include/checksum.hpp"
 #include "include/files_manager.hpp"
+#include "include/metrics.hpp"
+#include "include/trace.hpp"
 
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 
+#include <functional>
+#include <memory>
 #include <string>
 #include <unordered_set>
 
 namespace tus
 {
 
+// Body of a PATCH, or of a creation-with-upload POST, whose headers have
+// already been validated by TusManager::BeginUpload. Pieces are written to
+// the data file as they arrive so the chunk is never held in memory.
+class UploadStream
+{
+    friend class TusManager;
+
+    FileResource fres_;
+    const std::string uuid_;
+    const boost::beast::http::verb verb_;
+    const std::streamoff offset_;
+    std::streamoff written_;
+    bool failed_;
+    // Piece handed to WriteAsync(), until Written()
+    const void* pending_data_;
+    size_t pending_size_;
+    std::string checksum_b64_;
+    // Digest of the chunk, fed with every piece as it is written
+    std::unique_ptr<Checksum> checksum_;
+#ifdef BETUS_TRACING
+    // When the piece of WriteAsync() went to storage
+    Trace::Clock::time_point pending_since_;
+#endif
+
+    UploadStream(FileResource&& fres, const std::string& uuid,
+                 boost::beast::http::verb verb, std::streamoff offset);
+    // Feeds checksum_, if any, and accounts the time it took
+    void digest(const void* data, size_t size);
+
+public:
+    // Upload offset the next piece will be written at
+    std::streamoff Offset() const { return offset_ + written_; }
+    // Upload-Metadata the upload was created with
+    std::string Metadata() const;
+
+    bool Write(const void* data, size_t size);
+
+    // Write() carried out by storage: done gets the result on a storage
+    // thread and the stream must not be touched until that result has been
+    // passed to Written(), typically back on the connection's strand.
+    void WriteAsync(StorageExecutor& storage, const void* data, size_t size,
+                    StorageExecutor::Completion done);
+    // Accounts the piece of the last WriteAsync(); false if it failed
+    bool Written(ssize_t res);
+
+    // Bytes can go from the socket to the file untouched unless a checksum
+    // has to be computed over them
+    bool CanSplice() const { return !checksum_; }
+    // Moves size bytes waiting in pipe_fd to the file, blocking like
+    // Write(); false if it failed
+    bool Splice(int pipe_fd, size_t size);
+
+    // The whole sequence goes to the file in one gathering write
+    template <typename ConstBufferSequence>
+    bool Write(const ConstBufferSequence& bufs)
+    {
+        if (failed_)
+            return false;
+        BETUS_TRACE_SPAN("write");
+        const auto size = boost::asio::buffer_size(bufs);
+        const auto cnt = fres_.Write(Offset(), bufs);
+        if (cnt != size)
+            failed_ = true;
+        else
+            for (auto it = boost::asio::buffer_sequence_begin(bufs);
+                 it != boost::asio::buffer_sequence_end(bufs); ++it)
+            {
+                const boost::asio::const_buffer buf = *it;
+                digest(buf.data(), buf.size());
+            }
+        written_ += cnt;
+        Metrics::Instance().BytesWritten(cnt);
+        return !failed_;
+    }
+};
+
+// Answer to a GET whose headers TusManager::BeginDownload has made: the
+// bytes [Offset(), Offset() + Left()) of the data file, sent by the server
+// from the file to the socket with sendfile(), never through a buffer.
+class DownloadStream
+{
+    friend class TusManager;
+
+    const int fd_;
+    std::streamoff offset_;
+    size_t left_;
+
+    DownloadStream(int fd, std::streamoff offset, size_t size);
+
+public:
+    ~DownloadStream();
+    DownloadStream(const DownloadStream&) = delete;
+    DownloadStream& operator=(const DownloadStream&) = delete;
+
+    std::streamoff Offset() const { return offset_; }
+    size_t Left() const { return left_; }
+
+    // sendfile() of at most max_size bytes to sock_fd, which may be non
+    // blocking; returns what it returned, the bytes sent or -1 with errno
+    // set. Blocks on the disk for uncached data, as any read would.
+    ssize_t SendTo(int sock_fd, size_t max_size);
+};
+
 class TusManager
 {
     FilesManager& files_man_;
+    bool serve_partial_ = false;
 
 public:
     static const std::string TAG_TUS_RESUMABLE;
@@ -25,12 +134,12 @@ public:
     static const std::string TAG_UPLOAD_METADATA;
     static const std::string TAG_UPLOAD_OFFSET;
     static const std::string TAG_UPLOAD_CHECKSUM;
+    static const std::string TAG_UPLOAD_CONCAT;
+    static const std::string TAG_UPLOAD_EXPIRES;
 
     static const std::string TUS_SUPPORTED_VERSION;
     static const std::string TUS_SUPPORTED_VERSIONS;
     static const std::string TUS_SUPPORTED_EXTENSIONS;
-    static const std::string TUS_SUPPORTED_CHECKSUM;
-    static const std::string TUS_SUPPORTED_CHECKSUMS;
     static const std::string TUS_SUPPORTED_MAXSZ;
     static const std::string PATCH_EXPECTED_CONTENT_TYPE;
 
@@ -38,21 +147,81 @@ public:
 
     boost::beast::http::response<boost::beast::http::dynamic_body> MakeResponse(const boost::beast::http::request<boost::beast::http::dynamic_body>& req);
 
+    // Streaming ingest: requests for which HasUploadBody() holds should be
+    // validated with BeginUpload() as soon as their headers are parsed. A
+    // null return means resp is complete and the body must not be read.
+    // Otherwise the body goes to UploadStream::Write() and FinishUpload()
+    // completes resp; AbortUpload() is for bodies that never fully arrive.
+    static bool HasUploadBody(const boost::beast::http::request_header<>& req);
+    // Requests whose answer copies file data (creating a final upload out of
+    // partial ones); a server should answer them off its network threads
+    static bool CopiesData(const boost::beast::http::request_header<>& req);
+    std::unique_ptr<UploadStream> BeginUpload(const boost::beast::http::request_header<>& req,
+                                              boost::beast::http::response<boost::beast::http::dynamic_body>& resp);
+    // resp is complete when done is called: right away, or once the commit
+    // is durable when commits are grouped (see Durability), from another
+    // thread. Without done this waits for that itself.
+    void FinishUpload(UploadStream& upload,
+                      boost::beast::http::response<boost::beast::http::dynamic_body>& resp,
+                      std::function<void()> done = nullptr);
+    void AbortUpload(UploadStream& upload);
+
+    // Downloads: GET /files/<uuid> is answered with BeginDownload() instead
+    // of MakeResponse(), which rejects it; the GETs MakeResponse() answers
+    // are /metrics, and /debug/trace when tracing is compiled in. resp gets
+    // the headers only, with the Content-Length of the DownloadStream
+    // returned; a null return means resp is complete, without a body to
+    // send. A single byte range is served if the request asks for one, ETag
+    // names the content so far.
+    static bool IsDownload(const boost::beast::http::request_header<>& req);
+    std::unique_ptr<DownloadStream> BeginDownload(const boost::beast::http::request_header<>& req,
+                                                  boost::beast::http::response<boost::beast::http::dynamic_body>& resp);
+    // Uploads still being written to are downloadable up to their offset
+    // when set; otherwise only complete ones are (the default)
+    void SetServePartial(bool serve) { serve_partial_ = serve; }
+
     size_t DeleteAllFiles()
     {
         return files_man_.RmAllFiles();
     }
+    // See FilesManager::ReapExpired()
+    ReapStats ReapExpired(size_t max_files)
+    {
+        return files_man_.ReapExpired(max_files);
+    }
 
 
 private:
+    static void initResponse(const boost::beast::http::request_header<>& req,
+                             boost::beast::http::response<boost::beast::http::dynamic_body>& resp);
+    void setExpires(const std::string& uuid,
+                    boost::beast::http::response<boost::beast::http::dynamic_body>& resp) const;
+
     void processOptions(const boost::beast::http::request<boost::beast::http::dynamic_body>& req,
                         boost::beast::http::response<boost::beast::http::dynamic_body>& resp);
     void processHead(const boost::beast::http::request<boost::beast::http::dynamic_body>& req,
                      boost::beast::http::response<boost::beast::http::dynamic_body>& resp);
+    // GET /metrics, the Prometheus text format of Metrics::Instance()
+    void processMetrics(const boost::beast::http::request<boost::beast::http::dynamic_body>& req,
+                        boost::beast::http::response<boost::beast::http::dynamic_body>& resp);
+    // GET /debug/trace, the spans of Trace in the Chrome trace format; only
+    // answered when tracing is compiled in
+    void processTrace(const boost::beast::http::request<boost::beast::http::dynamic_body>& req,
+                      boost::beast::http::response<boost::beast::http::dynamic_body>& resp);
     void processPost(const boost::beast::http::request<boost::beast::http::dynamic_body>& req,
                      boost::beast::http::response<boost::beast::http::dynamic_body>& resp);
-    void processPatch(const boost::beast::http::request<boost::beast::http::dynamic_body>& req,
-                      boost::beast::http::response<boost::beast::http::dynamic_body>& resp);
+    void processConcatFinal(const boost::beast::http::request<boost::beast::http::dynamic_body>& req,
+                            boost::beast::http::response<boost::beast::http::dynamic_body>& resp);
+    std::unique_ptr<UploadStream> beginPatch(const boost::beast::http::request_header<>& req,
+                                             boost::beast::http::response<boost::beast::http::dynamic_body>& resp);
+    void finishPatch(UploadStream& upload,
+                     boost::beast::http::response<boost::beast::http::dynamic_body>& resp,
+                     std::function<void()> done);
+    std::unique_ptr<UploadStream> beginCreationWithUpload(const boost::beast::http::request_header<>& req,
+                                                          boost::beast::http::response<boost::beast::http::dynamic_body>& resp);
+    void finishCreationWithUpload(UploadStream& upload,
+                                  boost::beast::http::response<boost::beast::http::dynamic_body>& resp,
+                                  std::function<void()> done);
     void processDelete(const boost::beast::http::request<boost::beast::http::dynamic_body>& req,
                        boost::beast::http::response<boost::beast::http::dynamic_body>& resp);
 };
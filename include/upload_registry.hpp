@@ -0,0 +1,155 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace tus
+{
+
+// Binary form of the lower case 8-4-4-4-12 uuid that names an upload
+struct UploadKey
+{
+    uint64_t hi = 0;
+    uint64_t lo = 0;
+
+    static std::optional<UploadKey> Parse(std::string_view uuid);
+    std::string ToString() const;
+
+    bool operator==(const UploadKey& o) const { return hi == o.hi && lo == o.lo; }
+};
+
+// Concurrent set of uploads, each entry telling that an upload exists,
+// whether a request is working on it, when it expires and what a HEAD
+// reports about it. Keys are spread over shards with a reader-writer lock
+// each: acquiring, releasing, setting the expiry or the offset and looking
+// up only take the shared side and change the entry atomically, inserting,
+// erasing and describing take the exclusive side of one shard.
+class UploadRegistry
+{
+public:
+    enum class Acquire { Acquired, Busy, Missing };
+
+    // Upload-Offset, and what is fixed when an upload is initialized:
+    // Upload-Length, Upload-Metadata and Upload-Concat
+    struct Info
+    {
+        int64_t offset = -1;
+        size_t length = 0;
+        std::string comment;
+        std::string concat;
+        // False until Describe(), only the offset may be known then
+        bool described = false;
+    };
+
+    static constexpr size_t Shard_Count = 64;
+
+    // False if the key is already there. Expiry times are in the caller's
+    // unit, 0 meaning never.
+    bool Insert(const UploadKey& key, bool in_use, int64_t expires = 0);
+    // An entry that expired by now counts as Missing; now = 0 skips that
+    Acquire TryAcquire(const UploadKey& key, int64_t now = 0);
+    // False if the key was not there or not in use
+    bool Release(const UploadKey& key);
+    bool Erase(const UploadKey& key);
+
+    bool SetExpiry(const UploadKey& key, int64_t expires);
+    // 0 if the key is not there or never expires
+    int64_t Expiry(const UploadKey& key) const;
+    // The offset of info is only taken if none was set yet, so that a
+    // description read from disk never undoes a later SetOffset()
+    bool Describe(const UploadKey& key, const Info& info);
+    bool SetOffset(const UploadKey& key, int64_t offset);
+    // nullopt if the key is not there or expired by now; now = 0 skips that
+    std::optional<Info> Lookup(const UploadKey& key, int64_t now = 0) const;
+
+    // Appends the keys in shard shard_idx that expired by now and are not
+    // in use, so that a large registry can be swept a shard at a time
+    void Expired(size_t shard_idx, int64_t now, std::vector<UploadKey>& out) const;
+
+    size_t Size() const;
+    // Erases everything, returns how many entries there were
+    size_t Clear();
+
+    // f(const UploadKey&, bool in_use) for every entry, one shard at a time
+    template <typename Func>
+    void ForEach(Func&& f) const;
+    // f(const UploadKey&, const Info&, int64_t expires) for every described
+    // entry, one shard at a time
+    template <typename Func>
+    void ForEachDescribed(Func&& f) const;
+
+private:
+    struct Entry
+    {
+        std::atomic<bool> in_use{false};
+        std::atomic<int64_t> expires{0};
+        std::atomic<int64_t> offset{-1};
+        // Written under the exclusive lock only
+        bool described = false;
+        size_t length = 0;
+        std::string comment;
+        std::string concat;
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const UploadKey& key) const { return Mix(key); }
+    };
+
+    struct alignas(64) Shard
+    {
+        mutable std::shared_mutex mtx;
+        std::unordered_map<UploadKey, Entry, KeyHash> entries;
+    };
+
+    static size_t Mix(const UploadKey& key)
+    {
+        return static_cast<size_t>((key.hi ^ key.lo) * 0x9e3779b97f4a7c15ULL);
+    }
+    Shard& shard(const UploadKey& key) { return shards_[Mix(key) >> 58]; }
+    const Shard& shard(const UploadKey& key) const { return shards_[Mix(key) >> 58]; }
+
+    std::array<Shard, Shard_Count> shards_;
+};
+
+template <typename Func>
+void UploadRegistry::ForEach(Func&& f) const
+{
+    for (const auto& sh : shards_)
+    {
+        std::shared_lock lock(sh.mtx);
+        for (const auto& [key, entry] : sh.entries)
+            f(key, entry.in_use.load(std::memory_order_acquire));
+    }
+}
+
+template <typename Func>
+void UploadRegistry::ForEachDescribed(Func&& f) const
+{
+    Info info;
+    info.described = true;
+    for (const auto& sh : shards_)
+    {
+        std::shared_lock lock(sh.mtx);
+        for (const auto& [key, entry] : sh.entries)
+        {
+            if (!entry.described)
+                continue;
+            info.offset = entry.offset.load(std::memory_order_relaxed);
+            info.length = entry.length;
+            info.comment = entry.comment;
+            info.concat = entry.concat;
+            f(key, info, entry.expires.load(std::memory_order_relaxed));
+        }
+    }
+}
+
+} // namespace tus
@@ -0,0 +1,37 @@
+#include "include/checksum.hpp"
+
+namespace tus
+{
+
+ChecksumRegistry& ChecksumRegistry::Instance()
+{
+    static ChecksumRegistry registry;
+    return registry;
+}
+
+ChecksumRegistry::ChecksumRegistry()
+{
+    Register("sha1", [] { return std::make_unique<Sha1>(); });
+    Register("sha256", [] { return std::make_unique<Sha256>(); });
+    Register("crc32c", [] { return std::make_unique<Crc32c>(); });
+    Register("xxh3", [] { return std::make_unique<Xxh3>(); });
+}
+
+void ChecksumRegistry::Register(const std::string& name, Factory factory)
+{
+    if (!factories_.emplace(name, std::move(factory)).second)
+        return;
+    if (!names_.empty())
+        names_ += ',';
+    names_ += name;
+}
+
+std::unique_ptr<Checksum> ChecksumRegistry::Create(std::string_view name) const
+{
+    auto it = factories_.find(name);
+    if (it == factories_.end())
+        return nullptr;
+    return it->second();
+}
+
+} // namespace tus
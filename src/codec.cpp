@@ -0,0 +1,251 @@
+#include "include/codec.hpp"
+#include "include/cpu_features.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace tus
+{
+
+namespace
+{
+constexpr uint8_t Invalid = 0xff;
+
+struct Base64_Table
+{
+    uint8_t value[256];
+
+    Base64_Table()
+    {
+        memset(value, Invalid, sizeof(value));
+        const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        for (uint8_t i = 0; i < 64; ++i)
+            value[static_cast<unsigned char>(alphabet[i])] = i;
+    }
+};
+
+const Base64_Table& Table()
+{
+    static const Base64_Table table;
+    return table;
+}
+
+// Whole unpadded quads; len is a multiple of 4
+bool Decode_Quads_Sw(const char* in, size_t len, unsigned char* out)
+{
+    const auto& t = Table().value;
+    for (; len > 0; len -= 4, in += 4, out += 3)
+    {
+        const uint8_t a = t[static_cast<unsigned char>(in[0])];
+        const uint8_t b = t[static_cast<unsigned char>(in[1])];
+        const uint8_t c = t[static_cast<unsigned char>(in[2])];
+        const uint8_t d = t[static_cast<unsigned char>(in[3])];
+        if ((a | b | c | d) & 0x80)
+            return false;
+        const uint32_t v = (uint32_t(a) << 18) | (uint32_t(b) << 12) | (uint32_t(c) << 6) | d;
+        out[0] = static_cast<unsigned char>(v >> 16);
+        out[1] = static_cast<unsigned char>(v >> 8);
+        out[2] = static_cast<unsigned char>(v);
+    }
+    return true;
+}
+
+#if defined(__x86_64__)
+// Classifies and translates 16 characters at once by their nibbles, then
+// packs the 6 bit values (W. Mula, D. Lemire, "Faster Base64 Encoding and
+// Decoding using AVX2 Instructions"). The stores are full registers, so the
+// loops stop while there is still room for the spill behind the 12 or 24
+// useful bytes.
+__attribute__((target("ssse3")))
+size_t Decode_Ssse3(const char* in, size_t len, unsigned char* out, bool& ok)
+{
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                         0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                         0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+    const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+    size_t done = 0;
+    for (; len - done >= 24; done += 16, out += 12)
+    {
+        __m128i str = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + done));
+        const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+        const __m128i lo = _mm_shuffle_epi8(lut_lo, _mm_and_si128(str, mask_2f));
+        const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0xffff)
+        {
+            ok = false;
+            return done;
+        }
+        const __m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+        str = _mm_add_epi8(str, _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles)));
+
+        const __m128i merged = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+        const __m128i packed = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(packed, pack));
+    }
+    ok = true;
+    return done;
+}
+
+__attribute__((target("avx2")))
+size_t Decode_Avx2(const char* in, size_t len, unsigned char* out, bool& ok)
+{
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+                                            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+    const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+
+    size_t done = 0;
+    for (; len - done >= 44; done += 32, out += 24)
+    {
+        __m256i str = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + done));
+        const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+        const __m256i lo = _mm256_shuffle_epi8(lut_lo, _mm256_and_si256(str, mask_2f));
+        const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        if (!_mm256_testz_si256(lo, hi))
+        {
+            ok = false;
+            return done;
+        }
+        const __m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+        str = _mm256_add_epi8(str, _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles)));
+
+        const __m256i merged = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+        const __m256i packed = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+        const __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(packed, pack), compact);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), bytes);
+    }
+    ok = true;
+    return done;
+}
+#endif
+
+bool Decode_Quads(const char* in, size_t len, unsigned char* out, Base64Kernel kernel)
+{
+    size_t done = 0;
+    bool ok = true;
+    if (!Base64Supported(kernel))
+        kernel = Base64Kernel::Scalar;
+#if defined(__x86_64__)
+    if (kernel == Base64Kernel::Avx2)
+        done = Decode_Avx2(in, len, out, ok);
+    else if (kernel == Base64Kernel::Ssse3)
+        done = Decode_Ssse3(in, len, out, ok);
+#endif
+    return ok && Decode_Quads_Sw(in + done, len - done, out + done / 4 * 3);
+}
+} // namespace
+
+bool Base64Supported(Base64Kernel kernel)
+{
+#if defined(__x86_64__)
+    switch (kernel)
+    {
+    case Base64Kernel::Scalar:
+        return true;
+    case Base64Kernel::Ssse3:
+        return CpuFeatures::Get().ssse3;
+    case Base64Kernel::Avx2:
+        return CpuFeatures::Get().avx2;
+    }
+    return false;
+#else
+    return kernel == Base64Kernel::Scalar;
+#endif
+}
+
+Base64Kernel Base64Fastest()
+{
+    static const Base64Kernel kernel = Base64Supported(Base64Kernel::Avx2)  ? Base64Kernel::Avx2  :
+                                       Base64Supported(Base64Kernel::Ssse3) ? Base64Kernel::Ssse3 :
+                                                                              Base64Kernel::Scalar;
+    return kernel;
+}
+
+size_t Base64DecodedSize(std::string_view b64)
+{
+    if (b64.size() % 4)
+        return std::string_view::npos;
+    size_t pad = 0;
+    for (; pad < b64.size() && b64[b64.size() - 1 - pad] == '='; ++pad)
+        ;
+    if (pad > 2)
+        return std::string_view::npos;
+    return b64.size() / 4 * 3 - pad;
+}
+
+bool Base64Decode(std::string_view b64, unsigned char* out, Base64Kernel kernel)
+{
+    const size_t outlen = Base64DecodedSize(b64);
+    if (outlen == std::string_view::npos)
+        return false;
+    if (b64.empty())
+        return true;
+
+    // The last quad may be padded; everything before it is decoded in bulk
+    const size_t body = b64.size() - 4;
+    if (!Decode_Quads(b64.data(), body, out, kernel))
+        return false;
+
+    char last[4];
+    memcpy(last, b64.data() + body, 4);
+    const size_t pad = body / 4 * 3 + 3 - outlen;
+    for (size_t i = 4 - pad; i < 4; ++i)
+        last[i] = 'A';
+    unsigned char tail[3];
+    if (!Decode_Quads_Sw(last, 4, tail))
+        return false;
+    memcpy(out + body / 4 * 3, tail, 3 - pad);
+    return true;
+}
+
+bool Base64Matches(std::string_view b64, std::string_view bin, Base64Kernel kernel)
+{
+    if (Base64DecodedSize(b64) != bin.size())
+        return false;
+
+    // Digests fit in one go; longer input is compared a slice at a time
+    constexpr size_t Slice_Chars = 256;
+    unsigned char buf[Slice_Chars / 4 * 3];
+    while (b64.size() > Slice_Chars)
+    {
+        if (!Decode_Quads(b64.data(), Slice_Chars, buf, kernel) ||
+            memcmp(buf, bin.data(), sizeof(buf)) != 0)
+            return false;
+        b64.remove_prefix(Slice_Chars);
+        bin.remove_prefix(sizeof(buf));
+    }
+    return Base64Decode(b64, buf, kernel) && memcmp(buf, bin.data(), bin.size()) == 0;
+}
+
+std::string HexEncode(std::string_view bin)
+{
+    const char* digits = "0123456789ABCDEF";
+    std::string ret(2 * bin.size(), '\0');
+    for (size_t i = 0; i < bin.size(); ++i)
+    {
+        const auto uc = static_cast<unsigned char>(bin[i]);
+        ret[2 * i] = digits[uc >> 4];
+        ret[2 * i + 1] = digits[uc & 0x0f];
+    }
+    return ret;
+}
+
+} // namespace tus
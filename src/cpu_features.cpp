@@ -0,0 +1,48 @@
+#include "include/cpu_features.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace tus
+{
+
+namespace
+{
+CpuFeatures Detect_Cpu_Features()
+{
+    CpuFeatures ret;
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return ret;
+    ret.ssse3 = ecx & bit_SSSE3;
+    ret.sse41 = ecx & bit_SSE4_1;
+    ret.sse42 = ecx & bit_SSE4_2;
+    ret.pclmul = ecx & bit_PCLMUL;
+    const bool os_saves_ymm = [ecx]() {
+        if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+            return false;
+        unsigned xcr0_lo, xcr0_hi;
+        __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        return (xcr0_lo & 0x6) == 0x6;
+    }();
+
+    if (__get_cpuid_max(0, nullptr) >= 7)
+    {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        ret.avx2 = os_saves_ymm && (ebx & bit_AVX2);
+        ret.sha = ebx & bit_SHA;
+    }
+#endif
+    return ret;
+}
+} // namespace
+
+const CpuFeatures& CpuFeatures::Get()
+{
+    static const CpuFeatures features = Detect_Cpu_Features();
+    return features;
+}
+
+} // namespace tus
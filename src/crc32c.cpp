@@ -0,0 +1,151 @@
+#include "include/checksum.hpp"
+#include "include/cpu_features.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace tus
+{
+
+namespace
+{
+constexpr uint32_t Crc32c_Poly = 0x82f63b78; // reflected Castagnoli polynomial
+
+struct Slice8_Tables
+{
+    uint32_t t[8][256];
+
+    Slice8_Tables()
+    {
+        for (uint32_t n = 0; n < 256; ++n)
+        {
+            uint32_t crc = n;
+            for (int k = 0; k < 8; ++k)
+                crc = crc & 1 ? (crc >> 1) ^ Crc32c_Poly : crc >> 1;
+            t[0][n] = crc;
+        }
+        for (uint32_t n = 0; n < 256; ++n)
+            for (int k = 1; k < 8; ++k)
+                t[k][n] = (t[k - 1][n] >> 8) ^ t[0][t[k - 1][n] & 0xff];
+    }
+};
+
+const Slice8_Tables& Tables()
+{
+    static const Slice8_Tables tables;
+    return tables;
+}
+
+uint32_t Crc32c_Sw(uint32_t crc, const unsigned char* p, size_t size)
+{
+    const auto& t = Tables().t;
+    crc = ~crc;
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        word ^= crc;
+        crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^
+              t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff] ^
+              t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^
+              t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+    }
+    for (; size > 0; --size)
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+// Bytes per stream; three streams keep the 3 cycle latency crc32 unit busy
+constexpr size_t Stream_Len = 2048;
+
+// x^n mod P in the reflected domain
+uint32_t X_Pow_Mod(size_t n)
+{
+    uint32_t ret = 0x80000000; // x^0
+    for (; n > 0; --n)
+        ret = ret & 1 ? (ret >> 1) ^ Crc32c_Poly : ret >> 1;
+    return ret;
+}
+
+// crc32 of a 64 bit value multiplies it by x^32, and carry-less product of
+// two reflected values gains another x, so shifting a register by n bytes
+// needs the constant x^(8n - 33)
+struct Shift_Constants
+{
+    uint64_t by_one_stream = X_Pow_Mod(8 * Stream_Len - 33);
+    uint64_t by_two_streams = X_Pow_Mod(2 * 8 * Stream_Len - 33);
+};
+
+__attribute__((target("sse4.2,pclmul")))
+uint32_t Shift_Crc(uint32_t crc, uint64_t k)
+{
+    const __m128i prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128(static_cast<int>(crc)),
+                                              _mm_cvtsi64_si128(static_cast<long long>(k)), 0);
+    return static_cast<uint32_t>(_mm_crc32_u64(0, static_cast<uint64_t>(_mm_cvtsi128_si64(prod))));
+}
+
+__attribute__((target("sse4.2")))
+uint64_t Crc32c_Hw_Run(uint64_t crc, const unsigned char* p, size_t size)
+{
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc = _mm_crc32_u64(crc, word);
+    }
+    for (; size > 0; --size)
+        crc = _mm_crc32_u8(static_cast<uint32_t>(crc), *p++);
+    return crc;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+uint32_t Crc32c_Hw(uint32_t crc, const unsigned char* p, size_t size)
+{
+    static const Shift_Constants shift;
+
+    uint64_t crc0 = ~crc;
+    for (; size >= 3 * Stream_Len; size -= 3 * Stream_Len, p += 3 * Stream_Len)
+    {
+        uint64_t crc1 = 0, crc2 = 0;
+        for (size_t i = 0; i < Stream_Len; i += 8)
+        {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, p + i, 8);
+            memcpy(&w1, p + Stream_Len + i, 8);
+            memcpy(&w2, p + 2 * Stream_Len + i, 8);
+            crc0 = _mm_crc32_u64(crc0, w0);
+            crc1 = _mm_crc32_u64(crc1, w1);
+            crc2 = _mm_crc32_u64(crc2, w2);
+        }
+        crc0 = Shift_Crc(static_cast<uint32_t>(crc0), shift.by_two_streams) ^
+               Shift_Crc(static_cast<uint32_t>(crc1), shift.by_one_stream) ^ crc2;
+    }
+    return ~static_cast<uint32_t>(Crc32c_Hw_Run(crc0, p, size));
+}
+#endif
+} // namespace
+
+uint32_t Crc32c::Extend(uint32_t crc, const void* data, size_t size)
+{
+    const auto p = static_cast<const unsigned char*>(data);
+#if defined(__x86_64__)
+    static const bool use_hw = CpuFeatures::Get().sse42 && CpuFeatures::Get().pclmul;
+    if (use_hw)
+        return Crc32c_Hw(crc, p, size);
+#endif
+    return Crc32c_Sw(crc, p, size);
+}
+
+std::string Crc32c::Digest()
+{
+    std::string ret(4, '\0');
+    for (int i = 0; i < 4; ++i)
+        ret[i] = static_cast<char>(crc_ >> (24 - 8 * i));
+    return ret;
+}
+
+} // namespace tus
@@ -0,0 +1,170 @@
+#include "include/fair_share.hpp"
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/strand.hpp>
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+namespace asio = boost::asio;
+
+namespace tus
+{
+
+FairShare::FairShare(asio::io_context& ioc, const Config& config)
+    : config_(config), timer_(asio::make_strand(ioc)),
+      total_{static_cast<double>(config.burst), Clock::now()}
+{
+}
+
+void FairShare::Acquire(const std::string& client, uint64_t bytes, Granted granted)
+{
+    asio::post(timer_.get_executor(), [this, client, bytes, granted = std::move(granted)]() mutable
+    {
+        if (stopped_)
+            return;
+        const auto now = Clock::now();
+        auto [it, added] = clients_.try_emplace(client);
+        auto& cl = it->second;
+        if (added)
+            cl.bucket = {static_cast<double>(config_.burst), now};
+        if (cl.waiting.empty())
+            active_.push_back(&cl);
+        cl.waiting.push_back({std::max<uint64_t>(bytes, 1), std::move(granted)});
+        if (clients_.size() >= prune_at_)
+            prune(now);
+        dispatch();
+    });
+}
+
+void FairShare::Release(const std::string& client, uint64_t bytes)
+{
+    asio::post(timer_.get_executor(), [this, client, bytes]
+    {
+        if (stopped_)
+            return;
+        const double cap = config_.burst;
+        total_.tokens = std::min(cap, total_.tokens + bytes);
+        if (const auto it = clients_.find(client); it != clients_.end())
+            it->second.bucket.tokens = std::min(cap, it->second.bucket.tokens + bytes);
+        if (!active_.empty())
+            dispatch();
+    });
+}
+
+// A client's turn adds a quantum to its deficit, which its waiters are
+// granted from as long as both buckets have the tokens; a client they run
+// short for gives its turn to the next one and the round resumes once the
+// buckets filled up enough for it. A round without any grant ends this.
+void FairShare::dispatch()
+{
+    const auto now = Clock::now();
+    total_.refill(now, config_.total_rate, config_.burst);
+    auto wait = Clock::duration::max();
+    for (size_t idle = 0; !active_.empty() && idle < active_.size();)
+    {
+        auto& cl = *active_.front();
+        active_.pop_front();
+        cl.bucket.refill(now, config_.client_rate, config_.burst);
+        const auto deficit = cl.deficit;
+        cl.deficit += config_.quantum;
+
+        bool granted = false;
+        while (!cl.waiting.empty())
+        {
+            auto& w = cl.waiting.front();
+            // Short of a whole quantum the reads would only get smaller
+            const auto unit = std::min({w.bytes, config_.quantum, config_.burst});
+            const auto avail = std::min(cl.bucket.available(config_.client_rate),
+                                        total_.available(config_.total_rate));
+            if (cl.deficit < unit)
+                break;
+            if (avail < unit)
+            {
+                wait = std::min(wait, std::max(cl.bucket.until(unit, config_.client_rate),
+                                               total_.until(unit, config_.total_rate)));
+                break;
+            }
+            const auto n = std::min({w.bytes, cl.deficit, avail});
+            cl.bucket.tokens -= n;
+            total_.tokens -= n;
+            cl.deficit -= n;
+            auto done = std::move(w.granted);
+            cl.waiting.pop_front();
+            done(n);
+            granted = true;
+        }
+
+        if (cl.waiting.empty())
+            cl.deficit = 0;
+        else
+        {   // A turn without tokens is not counted
+            if (!granted)
+                cl.deficit = deficit;
+            active_.push_back(&cl);
+        }
+        idle = granted ? 0 : idle + 1;
+    }
+
+    if (active_.empty() || timer_armed_)
+        return;
+    timer_armed_ = true;
+    timer_.expires_at(now + std::max<Clock::duration>(wait, std::chrono::milliseconds(1)));
+    timer_.async_wait([this](boost::system::error_code ec)
+    {
+        if (ec == asio::error::operation_aborted)
+            return;
+        timer_armed_ = false;
+        dispatch();
+    });
+}
+
+void FairShare::Stop()
+{
+    asio::post(timer_.get_executor(), [this]
+    {
+        stopped_ = true;
+        timer_.cancel();
+        active_.clear();
+        clients_.clear();
+    });
+}
+
+void FairShare::prune(Clock::time_point now)
+{
+    for (auto it = clients_.begin(); it != clients_.end();)
+    {
+        it->second.bucket.refill(now, config_.client_rate, config_.burst);
+        if (it->second.waiting.empty() && it->second.bucket.available(config_.client_rate) >= config_.burst)
+            it = clients_.erase(it);
+        else
+            ++it;
+    }
+    prune_at_ = std::max<size_t>(64, 2 * clients_.size());
+}
+
+void FairShare::Bucket::refill(Clock::time_point now, uint64_t rate, uint64_t burst)
+{
+    if (rate == 0)
+        return;
+    const std::chrono::duration<double> elapsed = now - last;
+    tokens = std::min(static_cast<double>(burst), tokens + elapsed.count() * rate);
+    last = now;
+}
+
+uint64_t FairShare::Bucket::available(uint64_t rate) const
+{
+    if (rate == 0)
+        return std::numeric_limits<uint64_t>::max();
+    return tokens > 0 ? static_cast<uint64_t>(tokens) : 0;
+}
+
+FairShare::Clock::duration FairShare::Bucket::until(uint64_t n, uint64_t rate) const
+{
+    if (rate == 0 || tokens >= n)
+        return Clock::duration::zero();
+    return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>((n - tokens) / rate));
+}
+
+} // namespace tus
@@ -0,0 +1,132 @@
+#include "include/fd_cache.hpp"
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace tus
+{
+
+size_t FdCache::MaxCapacity()
+{
+    rlimit lim;
+    if (::getrlimit(RLIMIT_NOFILE, &lim) != 0)
+        return 0;
+    if (lim.rlim_cur == RLIM_INFINITY)
+        return size_t(1) << 20;
+    return static_cast<size_t>(lim.rlim_cur / 4);
+}
+
+size_t FdCache::DefaultCapacity()
+{
+    return std::min<size_t>(MaxCapacity(), 1024);
+}
+
+FdCache::FdCache(size_t capacity) : capacity_(std::min(capacity, MaxCapacity()))
+{
+}
+
+FdCache::~FdCache()
+{
+    for (const auto& [key, fd] : lru_)
+        close(fd);
+}
+
+void FdCache::SetCapacity(size_t capacity)
+{
+    std::vector<int> evicted;
+    {
+        std::lock_guard lock(mtx_);
+        capacity_ = std::min(capacity, MaxCapacity());
+        shrink(evicted);
+    }
+    for (int fd : evicted)
+        close(fd);
+}
+
+size_t FdCache::Capacity() const
+{
+    std::lock_guard lock(mtx_);
+    return capacity_;
+}
+
+std::optional<int> FdCache::Take(const UploadKey& key)
+{
+    std::lock_guard lock(mtx_);
+    const auto it = index_.find(key);
+    if (it == index_.end())
+    {
+        ++stats_.misses;
+        return std::nullopt;
+    }
+    ++stats_.hits;
+    const auto ret = it->second->second;
+    lru_.erase(it->second);
+    index_.erase(it);
+    return ret;
+}
+
+void FdCache::Put(const UploadKey& key, int fd)
+{
+    std::vector<int> evicted;
+    {
+        std::lock_guard lock(mtx_);
+        if (capacity_ == 0 || index_.count(key) > 0)
+            evicted.push_back(fd);
+        else
+        {
+            lru_.emplace_front(key, fd);
+            index_.emplace(key, lru_.begin());
+            shrink(evicted);
+        }
+    }
+    for (int e : evicted)
+        close(e);
+}
+
+void FdCache::Drop(const UploadKey& key)
+{
+    int fd;
+    {
+        std::lock_guard lock(mtx_);
+        const auto it = index_.find(key);
+        if (it == index_.end())
+            return;
+        fd = it->second->second;
+        lru_.erase(it->second);
+        index_.erase(it);
+    }
+    close(fd);
+}
+
+size_t FdCache::Size() const
+{
+    std::lock_guard lock(mtx_);
+    return lru_.size();
+}
+
+FdCache::Stats FdCache::GetStats() const
+{
+    std::lock_guard lock(mtx_);
+    return stats_;
+}
+
+void FdCache::close(int fd)
+{
+    if (fd >= 0)
+        ::close(fd);
+}
+
+void FdCache::shrink(std::vector<int>& evicted)
+{
+    while (lru_.size() > capacity_)
+    {
+        evicted.push_back(lru_.back().second);
+        index_.erase(lru_.back().first);
+        lru_.pop_back();
+        ++stats_.evictions;
+    }
+}
+
+} // namespace tus
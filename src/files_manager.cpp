@@ -1,62 +1,269 @@
 #include "include/files_manager.hpp"
-
-#include <boost/algorithm/hex.hpp>
-#include <boost/uuid/uuid_io.hpp>
-#include <boost/uuid/sha1.hpp>
-
-#include <fstream>
+#include "include/checksum.hpp"
+#include "include/codec.hpp"
+#include "include/trace.hpp"
+
+#include <boost/uuid/uuid_generators.hpp>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
 #include <ios>
 #include <iostream>
 #include <string>
 #include <system_error>
+#include <thread>
+#include <unordered_map>
 
 namespace tus
 {
 
 namespace http = boost::beast::http;
 
+const std::string FilesManager::JOURNAL_FNAME = ".journal";
 const std::string FilesManager::METADATA_FNAME_SUFFIX = ".mdata";
 static const std::string Empty_String;
 
+namespace
+{
+// Snapshot of the uploads that came with the metadata files, no longer written
+const std::string Legacy_Index_Fname = ".index";
+constexpr size_t Metadata_Fixed_Len = sizeof(Metadata::offset) + sizeof(Metadata::length);
+// Journal growth below which compacting is not worth it
+constexpr uint64_t Compact_Min_Bytes = 4 << 20;
+
+int64_t Now_Ms(std::chrono::system_clock::time_point now = std::chrono::system_clock::now())
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+}
+
+struct Key_Hash
+{
+    size_t operator()(const UploadKey& key) const
+    {
+        return static_cast<size_t>((key.hi ^ key.lo) * 0x9e3779b97f4a7c15ULL);
+    }
+};
+
+// Closes the descriptor when leaving scope
+struct Scoped_Fd
+{
+    int fd;
+    ~Scoped_Fd() { if (fd >= 0) ::close(fd); }
+};
+
+// Metadata file layout: offset and length in binary, the end of that line,
+// then the comment line and the concat line. Files written before there was
+// a concat line end after the comment. A file whose fixed line does not end
+// there was torn or is not one of these, and reads as no offset.
+Metadata Read_Metadata(int fd)
+{
+    Metadata ret{ -1, 0, "", ""};
+
+    std::string buf;
+    char chunk[512];
+    for (off_t pos = 0;;)
+    {
+        const auto n = ::pread(fd, chunk, sizeof(chunk), pos);
+        if (n <= 0)
+            break;
+        buf.append(chunk, n);
+        pos += n;
+        if (buf.size() > Metadata_Fixed_Len + 1)
+        {
+            const auto eol = buf.find('\n', Metadata_Fixed_Len + 1);
+            if (eol != std::string::npos && buf.find('\n', eol + 1) != std::string::npos)
+                break;
+        }
+    }
+
+    if (buf.size() >= sizeof(ret.offset))
+        std::memcpy(&ret.offset, buf.data(), sizeof(ret.offset));
+    if (buf.size() >= Metadata_Fixed_Len)
+        std::memcpy(&ret.length, buf.data() + sizeof(ret.offset), sizeof(ret.length));
+    if (buf.size() > Metadata_Fixed_Len)
+    {
+        if (buf[Metadata_Fixed_Len] != '\n')
+            return {-1, 0, "", ""};
+        const auto beg = Metadata_Fixed_Len + 1;
+        const auto eol = buf.find('\n', beg);
+        if (beg < buf.size())
+            ret.comment = buf.substr(beg, eol - beg);
+        if (eol != std::string::npos && eol + 1 < buf.size())
+            ret.concat = buf.substr(eol + 1, buf.find('\n', eol + 1) - eol - 1);
+    }
+    return ret;
+}
+
+// The upload of a metadata file as a Create record, its time being when
+// the file was last written to, as every write ended with storing the offset
+bool Read_Metadata_File(int dir_fd, const std::string& uuid, Journal::Record& rec)
+{
+    struct stat st;
+    const Scoped_Fd md{::openat(dir_fd, (uuid + FilesManager::METADATA_FNAME_SUFFIX).c_str(),
+                                O_RDONLY | O_CLOEXEC)};
+    if (md.fd < 0 || ::fstat(md.fd, &st) != 0 || static_cast<size_t>(st.st_size) < Metadata_Fixed_Len)
+        return false;
+
+    auto meta = Read_Metadata(md.fd);
+    if (meta.offset < 0 || static_cast<size_t>(meta.offset) > meta.length)
+        return false;
+    rec = {Journal::Type::Create, *UploadKey::Parse(uuid),
+           static_cast<int64_t>(st.st_mtim.tv_sec) * 1000 + st.st_mtim.tv_nsec / 1000000,
+           meta.offset, meta.length, std::move(meta.comment), std::move(meta.concat)};
+    return true;
+}
+
+enum class Upload_State { Intact, Repaired, Broken };
+
+// An offset beyond the end of the data file means the journal got ahead of
+// the data (say, on a crash before the page cache was written back); the
+// upload then resumes from what is actually there.
+Upload_State Check_Data(int dir_fd, const std::string& uuid, int64_t& offset)
+{
+    struct stat st;
+    if (::fstatat(dir_fd, uuid.c_str(), &st, 0) != 0)
+        return Upload_State::Broken;
+    if (offset <= st.st_size)
+        return Upload_State::Intact;
+    offset = st.st_size;
+    return Upload_State::Repaired;
+}
+
+// f(t, i) for i below n, spread over threads each taking every threads-th
+template <typename Func>
+unsigned Parallel_For(size_t n, unsigned threads, Func&& f)
+{
+    threads = static_cast<unsigned>(std::min<size_t>(threads, n / 64 + 1));
+    auto work = [&](unsigned t) {
+        for (size_t i = t; i < n; i += threads)
+            f(t, i);
+    };
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < threads; ++t)
+        workers.emplace_back(work, t);
+    work(0);
+    for (auto& w : workers)
+        w.join();
+    return threads;
+}
+
+int Open_At(int dir_fd, const std::string& fname, int flags)
+{
+    int fd;
+    do
+        fd = ::openat(dir_fd, fname.c_str(), flags | O_CLOEXEC, 0666);
+    while (fd < 0 && errno == EINTR);
+    return fd;
+}
+
+// Whether the file fd was opened from still has a name; a cached
+// descriptor outlives its file being removed behind our back
+bool Is_Linked(int fd)
+{
+    struct stat st;
+    return ::fstat(fd, &st) == 0 && st.st_nlink > 0;
+}
+
+bool Sync_Data(int fd)
+{
+    int ret;
+    do
+        ret = ::fdatasync(fd);
+    while (ret != 0 && errno == EINTR);
+    return ret == 0;
+}
+
+// The data file gets its blocks up front, so that a long upload does not
+// run out of space halfway and is laid out in few extents. Its size stays
+// as it is: that tells how much data has arrived.
+std::errc Preallocate(int fd, size_t len)
+{
+    int res;
+    do
+        res = ::fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, len);
+    while (res != 0 && errno == EINTR);
+    if (res == 0)
+        return static_cast<std::errc>(0);
+    if (errno == ENOSPC || errno == EDQUOT)
+        return std::errc::no_space_on_device;
+    if (errno == EFBIG)
+        return std::errc::file_too_large;
+
+    // No fallocate() on this file system; posix_fallocate() would grow the
+    // file, so only the free space is checked
+    struct statvfs st;
+    if (::fstatvfs(fd, &st) == 0 && static_cast<uint64_t>(st.f_bavail) * st.f_frsize < len)
+        return std::errc::no_space_on_device;
+    return static_cast<std::errc>(0);
+}
+} // namespace
+
 TmpFilesResource::TmpFilesResource(FilesManager& files_man, const std::string& uuid)
-    : files_man_(files_man), uuid_(uuid), persisted_(false), do_erase_(true)
+    : files_man_(files_man), uuid_(uuid), persisted_(false), do_erase_(true), reserved_(0)
 {
-    md_ostr_.open(files_man_.makeFPath(uuid_ + FilesManager::METADATA_FNAME_SUFFIX));
-    dt_ostr_.open(files_man_.makeFPath(uuid_));
+    dt_fd_ = Open_At(files_man_.dir_fd_, uuid_, O_RDWR | O_CREAT | O_TRUNC);
 }
 
 TmpFilesResource::~TmpFilesResource() noexcept
 {
-    md_ostr_.close();
-    dt_ostr_.close();
+    if (do_erase_ && persisted_) // the first PATCH finds it open
+        files_man_.cacheFd(uuid_, dt_fd_);
+    if (dt_fd_ >= 0)
+        ::close(dt_fd_);
+    if (do_erase_ && !persisted_)
+        files_man_.unreserve(reserved_);
     if (do_erase_)
         files_man_.erase(uuid_, !persisted_);
 }
 
-std::errc TmpFilesResource::Initialize(size_t totlen, const std::string_view& md_comment)
+std::errc TmpFilesResource::Initialize(size_t totlen, const std::string_view& md_comment,
+                                       const std::string_view& concat)
 {
-    if (!dt_ostr_.good() || !md_ostr_.good())
+    if (dt_fd_ < 0)
         return std::errc::bad_file_descriptor;
 
-    if (dt_ostr_)
-    {
-        dt_ostr_.seekp(totlen, std::ios_base::beg);
-        dt_ostr_.seekp(0, std::ios_base::beg);
-    }
-    if (md_ostr_)
-    {
-        decltype(Metadata::offset) offset = 0;
-        md_ostr_.write(reinterpret_cast<const char*>(&offset), sizeof(offset));
-        md_ostr_.write(reinterpret_cast<const char*>(&totlen), sizeof(totlen));
-        md_ostr_ << std::endl;
-    }
-    if (!md_comment.empty() && md_ostr_.good())
-        md_ostr_ << md_comment << '\n';
-    md_ostr_ << '\n';
+    if (const auto err = files_man_.reserve(totlen); static_cast<bool>(err))
+        return err;
+    auto unreserve = [this, totlen](std::errc err) {
+        files_man_.unreserve(totlen);
+        return err;
+    };
+    if (const auto err = Preallocate(dt_fd_, totlen); static_cast<bool>(err))
+        return unreserve(err);
+
+    const auto key = UploadKey::Parse(uuid_);
+    if (!key)
+        return unreserve(std::errc::bad_file_descriptor);
+    files_man_.registry_.Describe(*key, {0, totlen, std::string(md_comment), std::string(concat), true});
+    files_man_.touch(uuid_, 0);
+    if (!files_man_.journal_.Append({Journal::Type::Create, *key, Now_Ms(), 0, totlen,
+                                     std::string(md_comment), std::string(concat)}))
+        return unreserve(std::errc::bad_file_descriptor);
+    reserved_ = totlen;
+    return static_cast<std::errc>(0);
+}
 
-    if (!md_ostr_ || !dt_ostr_)
-        return std::errc::bad_file_descriptor;
-    else return static_cast<std::errc>(0);
+FilesManager::FilesManager(const std::string& dirpath)
+    : dirpath_(dirpath), dir_fd_(::open(dirpath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)),
+      journal_(dir_fd_, JOURNAL_FNAME)
+{
+    if (dir_fd_ < 0)
+        std::cerr << "open " << dirpath_ << " failed: " << std::strerror(errno) << std::endl;
+}
+
+FilesManager::~FilesManager() noexcept
+{
+    if (dir_fd_ >= 0)
+        ::close(dir_fd_);
 }
 
 TmpFilesResource FilesManager::NewTmpFilesResource()
@@ -72,30 +279,17 @@ void FilesManager::Persist(TmpFilesResource& tmpres)
 std::pair<std::errc, FileResource>
 FilesManager::GetFileResource(const std::string& uuid)
 {
-    auto it = all_fnames_.begin();
-    bool inserted = false;
-    {
-        std::lock_guard lock(fname_mtx_);
+    BETUS_TRACE_SPAN("acquire");
+    const auto key = UploadKey::Parse(uuid);
+    const auto acq = key ? registry_.TryAcquire(*key, Now_Ms()) : UploadRegistry::Acquire::Missing;
 
-        it = all_fnames_.find(uuid);
-        if (it != all_fnames_.end())
-        {
-            auto it1 = inuse_fnames_.find(uuid);
-            if (it1 == inuse_fnames_.end())
-            {
-                inserted = true;
-                inuse_fnames_.insert(uuid);
-            }
-        }
-    }
-
-    if (it == all_fnames_.end())
+    if (acq == UploadRegistry::Acquire::Missing)
     {
         return std::pair<std::errc, FileResource>(
                    std::errc::no_such_file_or_directory,
                    FileResource(*this, Empty_String));
     }
-    if (inserted)
+    if (acq == UploadRegistry::Acquire::Acquired)
     {
         return std::pair<std::errc, FileResource>(
                    static_cast<std::errc>(0),
@@ -106,51 +300,415 @@ FilesManager::GetFileResource(const std::string& uuid)
                FileResource(*this, Empty_String));
 }
 
+std::pair<std::errc, Metadata> FilesManager::GetMetadata(const std::string& uuid)
+{
+    const auto key = UploadKey::Parse(uuid);
+    auto info = key ? registry_.Lookup(*key, Now_Ms()) : std::nullopt;
+    // Not described while being created
+    if (!info || !info->described)
+        return {std::errc::no_such_file_or_directory, Metadata{-1, 0, "", ""}};
+    return {static_cast<std::errc>(0),
+            Metadata{info->offset, info->length, std::move(info->comment), std::move(info->concat)}};
+}
+
+std::pair<std::errc, int> FilesManager::OpenData(const std::string& uuid)
+{
+    const auto key = UploadKey::Parse(uuid);
+    if (!key || !registry_.Lookup(*key, Now_Ms()))
+        return {std::errc::no_such_file_or_directory, -1};
+    const int fd = Open_At(dir_fd_, uuid, O_RDONLY);
+    if (fd < 0)
+        return {errno == ENOENT ? std::errc::no_such_file_or_directory : std::errc::io_error, -1};
+    return {static_cast<std::errc>(0), fd};
+}
+
+RecoveryStats FilesManager::Recover(unsigned threads, bool trust_clean)
+{
+    const auto start = std::chrono::steady_clock::now();
+    threads = std::max(1u, threads);
+
+    RecoveryStats stats;
+    std::unordered_map<UploadKey, Journal::Record, Key_Hash> live;
+    Journal::ReplayStats replay;
+    const bool replayed = journal_.Replay([&live](const Journal::Record& rec) {
+        switch (rec.type)
+        {
+        case Journal::Type::Create:
+            live[rec.key] = rec;
+            break;
+        case Journal::Type::Offset:
+            if (const auto it = live.find(rec.key); it != live.end())
+            {
+                it->second.offset = rec.offset;
+                it->second.time_ms = rec.time_ms;
+            }
+            break;
+        case Journal::Type::Delete:
+            live.erase(rec.key);
+            break;
+        case Journal::Type::Clean:
+            break;
+        }
+    }, replay);
+    if (!replayed)
+        std::cerr << "recover: " << JOURNAL_FNAME << " is not a journal, ignoring it" << std::endl;
+    stats.torn = replay.torn;
+
+    std::vector<Journal::Record> uploads;
+    uploads.reserve(live.size());
+    for (auto& [key, rec] : live)
+        uploads.push_back(std::move(rec));
+    live.clear();
+    if (replay.records == 0)
+    {
+        uploads = scanMetadataFiles(threads, stats);
+        stats.imported = uploads.size();
+    }
+    else if (replay.clean && trust_clean)
+        stats.clean = true;
+    else
+        checkData(uploads, threads, stats);
+
+    for (const auto& rec : uploads)
+        if (registry_.Insert(rec.key, false, expiryAfter(rec.time_ms)))
+        {
+            registry_.Describe(rec.key, {rec.offset, rec.length, rec.comment, rec.concat, true});
+            stats.reserved += rec.length;
+            ++stats.recovered;
+        }
+    reserved_ += stats.reserved;
+
+    // Repairs and imports are only journaled by this
+    if (!CompactJournal())
+        std::cerr << "recover: compacting the journal failed" << std::endl;
+    else if (stats.imported > 0)
+    {
+        for (const auto& rec : uploads)
+            ::unlinkat(dir_fd_, (rec.key.ToString() + METADATA_FNAME_SUFFIX).c_str(), 0);
+        ::unlinkat(dir_fd_, Legacy_Index_Fname.c_str(), 0);
+    }
+
+    stats.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::steady_clock::now() - start);
+    return stats;
+}
+
+bool FilesManager::CompactJournal(bool clean)
+{
+    if (clean)
+    {
+        bool in_use = group_commit_ && !group_commit_->Stopped();
+        registry_.ForEach([&in_use](const UploadKey&, bool used) { in_use = in_use || used; });
+        if (in_use)
+        {
+            std::cerr << "compact: uploads still in use, the journal is not marked clean" << std::endl;
+            return false;
+        }
+    }
+    std::lock_guard lock(compact_mtx_);
+    return compactJournal(clean);
+}
+
+bool FilesManager::CompactJournalIfGrown()
+{
+    auto grown = [this] {
+        return journal_.Size() >= std::max(Compact_Min_Bytes, 2 * journal_.BaseSize());
+    };
+    if (!grown())
+        return false;
+    // One committer compacts, the others go on appending
+    std::unique_lock lock(compact_mtx_, std::try_to_lock);
+    return lock && grown() && compactJournal(false);
+}
+
+bool FilesManager::compactJournal(bool clean)
+{
+    const int64_t ttl = ttl_ms_;
+    const auto now = Now_Ms();
+    return journal_.Rewrite([this, ttl, now](const Journal::Emit& emit) {
+        Journal::Record rec;
+        rec.type = Journal::Type::Create;
+        registry_.ForEachDescribed([&](const UploadKey& key, const UploadRegistry::Info& info,
+                                       int64_t expires) {
+            // The last write is only known from the expiry, if there is one
+            rec.key = key;
+            rec.time_ms = ttl > 0 && expires > 0 ? expires - ttl : now;
+            rec.offset = info.offset;
+            rec.length = info.length;
+            rec.comment = info.comment;
+            rec.concat = info.concat;
+            emit(rec);
+        });
+    }, clean);
+}
+
+void FilesManager::checkData(std::vector<Journal::Record>& uploads, unsigned threads,
+                             RecoveryStats& stats) const
+{
+    std::vector<char> broken(uploads.size(), 0);
+    std::vector<RecoveryStats> part(threads);
+    threads = Parallel_For(uploads.size(), threads, [&](unsigned t, size_t i) {
+        auto& rec = uploads[i];
+        const auto uuid = rec.key.ToString();
+        switch (Check_Data(dir_fd_, uuid, rec.offset))
+        {
+        case Upload_State::Repaired:
+            ++part[t].repaired;
+            break;
+        case Upload_State::Intact:
+            break;
+        case Upload_State::Broken:
+            std::cerr << "recover: skipping " << uuid << std::endl;
+            ++part[t].skipped;
+            broken[i] = 1;
+            break;
+        }
+    });
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        stats.repaired += part[t].repaired;
+        stats.skipped += part[t].skipped;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < uploads.size(); ++i)
+        if (!broken[i] && kept++ != i)
+            uploads[kept - 1] = std::move(uploads[i]);
+    uploads.resize(kept);
+}
+
+std::vector<Journal::Record> FilesManager::scanMetadataFiles(unsigned threads, RecoveryStats& stats) const
+{
+    namespace fs = std::filesystem;
+
+    std::vector<std::string> candidates;
+    std::error_code ec;
+    for (fs::directory_iterator it(dirpath_, ec), end; !ec && it != end; it.increment(ec))
+    {
+        auto name = it->path().filename().string();
+        if (name.size() <= METADATA_FNAME_SUFFIX.size() ||
+                name.compare(name.size() - METADATA_FNAME_SUFFIX.size(),
+                             METADATA_FNAME_SUFFIX.size(), METADATA_FNAME_SUFFIX) != 0)
+            continue;
+        name.resize(name.size() - METADATA_FNAME_SUFFIX.size());
+        if (UploadKey::Parse(name))
+            candidates.push_back(std::move(name));
+    }
+
+    // readdir is sequential, the metadata reads are spread over the threads
+    std::vector<Journal::Record> ret(candidates.size());
+    std::vector<char> found(candidates.size(), 0);
+    std::vector<size_t> skipped(threads);
+    Parallel_For(candidates.size(), threads, [&](unsigned t, size_t i) {
+        if (Read_Metadata_File(dir_fd_, candidates[i], ret[i]))
+            found[i] = 1;
+        else
+        {
+            std::cerr << "recover: skipping " << candidates[i] << std::endl;
+            ++skipped[t];
+        }
+    });
+    for (auto n : skipped)
+        stats.skipped += n;
+    size_t kept = 0;
+    for (size_t i = 0; i < ret.size(); ++i)
+        if (found[i] && kept++ != i)
+            ret[kept - 1] = std::move(ret[i]);
+    ret.resize(kept);
+
+    checkData(ret, threads, stats);
+    return ret;
+}
+
 size_t FilesManager::RmAllFiles()
 {
-    std::lock_guard lock(fname_mtx_);
+    std::vector<UploadKey> keys;
+    registry_.ForEach([&keys](const UploadKey& key, bool) { keys.push_back(key); });
+    for (const auto& key : keys)
+    {
+        const auto info = registry_.Lookup(key);
+        if (!registry_.Erase(key))
+            continue;
+        journalDelete(key);
+        fd_cache_.Drop(key);
+        unreserve(info ? info->length : 0);
+        deleteFiles(key.ToString());
+    }
+    return keys.size();
+}
 
-    auto ret = all_fnames_.size();
-    for (const auto& fuuid : all_fnames_)
-        deleteFiles(fuuid);
+size_t FilesManager::Size() const
+{
+    return registry_.Size();
+}
 
-    all_fnames_.clear();
-    inuse_fnames_.clear();
+size_t FilesManager::InUse() const
+{
+    size_t ret = 0;
+    registry_.ForEach([&ret](const UploadKey&, bool in_use) { ret += in_use; });
     return ret;
 }
 
 std::errc FilesManager::release(FileResource& fres) noexcept
 {
-    std::lock_guard lock(fname_mtx_);
-
-    auto it = all_fnames_.find(fres.uuid_);
-    if (it == all_fnames_.end())
+    const auto key = UploadKey::Parse(fres.uuid_);
+    if (!key)
         return std::errc::no_such_file_or_directory;
     if (fres.delete_mark_)
-        all_fnames_.erase(it);
+    {
+        if (!registry_.Erase(*key))
+            return std::errc::no_such_file_or_directory;
+        journalDelete(*key);
+        return static_cast<std::errc>(0);
+    }
+    // Cached before the release, so the next to acquire it finds it
+    cacheFd(fres.uuid_, fres.dt_fd_);
+    if (registry_.Release(*key))
+        return static_cast<std::errc>(0);
+    fd_cache_.Drop(*key); // erased meanwhile
+    return std::errc::no_such_file_or_directory;
+}
 
-    it = inuse_fnames_.find(fres.uuid_);
-    if (it == inuse_fnames_.end())
-        return std::errc::no_such_file_or_directory;
-    inuse_fnames_.erase(it);
+void FilesManager::cacheFd(const std::string& uuid, int& dt_fd) noexcept
+{
+    const auto key = UploadKey::Parse(uuid);
+    if (!key || dt_fd < 0)
+        return;
+    fd_cache_.Put(*key, dt_fd);
+    dt_fd = -1;
+}
 
+void FilesManager::journalDelete(const UploadKey& key) noexcept
+{
+    if (!journal_.Append({Journal::Type::Delete, key, Now_Ms(), 0, 0, "", ""}))
+        std::cerr << "journaling the removal of " << key.ToString() << " failed" << std::endl;
+}
+
+std::errc FilesManager::reserve(uint64_t bytes)
+{
+    const uint64_t quota = quota_;
+    if (quota > 0 && bytes > quota)
+        return std::errc::file_too_large;
+
+    auto cur = reserved_.load();
+    do {
+        if (quota > 0 && cur + bytes > quota)
+            return std::errc::no_space_on_device;
+    } while (!reserved_.compare_exchange_weak(cur, cur + bytes));
     return static_cast<std::errc>(0);
 }
 
-const std::string& FilesManager::newUniqueFileName()
+void FilesManager::unreserve(uint64_t bytes) noexcept
+{
+    reserved_ -= bytes;
+}
+
+std::chrono::system_clock::time_point FilesManager::Expires(const std::string& uuid) const
+{
+    const auto key = UploadKey::Parse(uuid);
+    const auto expires = key ? registry_.Expiry(*key) : 0;
+    return std::chrono::system_clock::time_point(std::chrono::milliseconds(expires));
+}
+
+ReapStats FilesManager::ReapExpired(size_t max_files, std::chrono::system_clock::time_point now)
+{
+    std::unique_lock lock(reap_mtx_, std::try_to_lock);
+    if (!lock.owns_lock())
+        return {};
+
+    const auto now_ms = Now_Ms(now);
+    std::vector<UploadKey> expired;
+    for (size_t i = 0; i < UploadRegistry::Shard_Count && expired.size() < max_files; ++i)
+    {
+        registry_.Expired(reap_shard_, now_ms, expired);
+        reap_shard_ = (reap_shard_ + 1) % UploadRegistry::Shard_Count;
+    }
+    if (expired.size() > max_files)
+        expired.resize(max_files);
+
+    ReapStats ret;
+    for (const auto& key : expired)
+    {
+        // Touched since it was listed, or being worked on
+        if (registry_.TryAcquire(key) != UploadRegistry::Acquire::Acquired)
+            continue;
+        const auto expires = registry_.Expiry(key);
+        if (expires == 0 || expires > now_ms)
+        {
+            registry_.Release(key);
+            continue;
+        }
+
+        const auto uuid = key.ToString();
+        fd_cache_.Drop(key);
+        struct stat st;
+        if (::fstatat(dir_fd_, uuid.c_str(), &st, 0) == 0)
+            ret.bytes += static_cast<uint64_t>(st.st_blocks) * 512;
+        const auto info = registry_.Lookup(key);
+        unreserve(info ? info->length : 0);
+        deleteFiles(uuid);
+        registry_.Erase(key);
+        journalDelete(key);
+        ++ret.files;
+    }
+    reclaimed_files_ += ret.files;
+    reclaimed_bytes_ += ret.bytes;
+    return ret;
+}
+
+void FilesManager::SetDurability(Durability mode, const GroupCommit::Config& group)
 {
-    std::lock_guard lock(fname_mtx_);
+    durability_ = mode;
+    if (group_commit_)
+        group_commit_->Stop();
+    group_commit_.reset();
+    if (mode == Durability::Group)
+        group_commit_ = std::make_unique<GroupCommit>([this] { return journal_.Sync(); }, group);
+}
 
-    std::string uuidstr;
-    auto it = all_fnames_.cbegin();
+void FilesManager::touch(const std::string& uuid, std::streamoff offset) noexcept
+{
+    if (const auto key = UploadKey::Parse(uuid))
+    {
+        registry_.SetOffset(*key, offset);
+        registry_.SetExpiry(*key, expiryAfter(Now_Ms()));
+    }
+}
+
+bool FilesManager::storeOffset(const std::string& uuid, std::streamoff offset)
+{
+    const auto key = UploadKey::Parse(uuid);
+    if (!key)
+        return false;
+    BETUS_TRACE_SPAN("store offset");
+    touch(uuid, offset);
+    const bool ret = journal_.Append({Journal::Type::Offset, *key, Now_Ms(), offset, 0, "", ""});
+    CompactJournalIfGrown();
+    return ret;
+}
+
+int64_t FilesManager::expiryAfter(int64_t activity_ms) const
+{
+    const int64_t ttl = ttl_ms_;
+    return ttl > 0 ? activity_ms + ttl : 0;
+}
+
+std::string FilesManager::newUniqueFileName()
+{
+    // boost's generator is not thread safe, every worker has its own
+    thread_local boost::uuids::random_generator random_uuid_generator;
+
+    UploadKey key;
     do {
-        boost::uuids::uuid uuid = random_uuid_generator_();
-        uuidstr = to_string(uuid);
-        it = all_fnames_.find(uuidstr);
-    } while (it != all_fnames_.cend());
+        const boost::uuids::uuid uuid = random_uuid_generator();
+        key = UploadKey{};
+        for (size_t i = 0; i < 8; ++i)
+        {
+            key.hi = (key.hi << 8) | uuid.data[i];
+            key.lo = (key.lo << 8) | uuid.data[8 + i];
+        }
+    } while (!registry_.Insert(key, true));
 
-    inuse_fnames_.emplace(uuidstr);
-    return *all_fnames_.emplace(uuidstr).first;
+    return key.ToString();
 }
 
 std::string FilesManager::makeFPath(const std::string_view& sv) const
@@ -162,163 +720,302 @@ std::string FilesManager::makeFPath(const std::string_view& sv) const
 
 bool FilesManager::deleteFiles(const std::string& uuid) noexcept
 {
-    auto rm_or_log = [](const std::string & fpath) {
-        auto res = ::remove(fpath.c_str());
-        if (res)
-            std::cerr << "remove " << fpath << " failed: " << res << std::endl;
-        return res;
-    };
-    auto ret = rm_or_log(makeFPath(uuid));
-    ret |= rm_or_log(makeFPath(uuid + FilesManager::METADATA_FNAME_SUFFIX));
-    return !ret;
+    const auto res = ::unlinkat(dir_fd_, uuid.c_str(), 0);
+    if (res)
+        std::cerr << "remove " << makeFPath(uuid) << " failed: " << res << std::endl;
+    return !res;
 }
 
 void FilesManager::erase(const std::string& uuid, bool delete_files) noexcept
 {
-    std::lock_guard lock(fname_mtx_);
-
+    const auto key = UploadKey::Parse(uuid);
+    if (!key)
+        return;
     if (delete_files)
     {
         deleteFiles(uuid);
-        all_fnames_.erase(uuid);
+        if (registry_.Erase(*key))
+            journalDelete(*key);
     }
-    inuse_fnames_.erase(uuid);
+    else
+        registry_.Release(*key);
 }
 
 FileResource::FileResource(FilesManager& fm, const std::string& uuid)
-    : files_man_(fm), uuid_(uuid), delete_mark_(false), do_release_mark_(true)
+    : files_man_(fm), uuid_(uuid), dt_fd_(-1), write_end_(0),
+      delete_mark_(false), do_release_mark_(true)
 {
     if (uuid_.empty()) return;
-    fstream_dt_.open(files_man_.makeFPath(uuid_));
-    fstream_md_.open(files_man_.makeFPath(uuid_ + FilesManager::METADATA_FNAME_SUFFIX));
+    if (const auto key = UploadKey::Parse(uuid_))
+        if (const auto fd = files_man_.fd_cache_.Take(*key))
+        {
+            if (Is_Linked(*fd))
+            {
+                dt_fd_ = *fd;
+                return;
+            }
+            ::close(*fd);
+        }
+    BETUS_TRACE_SPAN("open");
+    dt_fd_ = Open_At(files_man_.dir_fd_, uuid_, O_RDWR);
 }
 
 FileResource::FileResource(TmpFilesResource&& tmpres)
-    : files_man_(tmpres.files_man_), uuid_(tmpres.uuid_), delete_mark_(false), do_release_mark_(true)
+    : files_man_(tmpres.files_man_), uuid_(tmpres.uuid_), dt_fd_(tmpres.dt_fd_),
+      write_end_(0), delete_mark_(false), do_release_mark_(true)
 {
-    tmpres.dt_ostr_.close();
-    tmpres.md_ostr_.close();
+    // The descriptor is taken over as it is, no reopening
+    tmpres.dt_fd_ = -1;
     tmpres.persisted_ = true;
     tmpres.do_erase_ = false;
-
-    if (uuid_.empty()) return;
-    fstream_dt_.open(files_man_.makeFPath(uuid_));
-    fstream_md_.open(files_man_.makeFPath(uuid_ + FilesManager::METADATA_FNAME_SUFFIX));
 }
 
 FileResource::FileResource(FileResource&& o)
-    : files_man_(o.files_man_), uuid_(o.uuid_),
-      fstream_dt_(std::move(o.fstream_dt_)), fstream_md_(std::move(o.fstream_md_)),
-      delete_mark_(o.delete_mark_), do_release_mark_(true)
+    : files_man_(o.files_man_), uuid_(o.uuid_), dt_fd_(o.dt_fd_),
+      write_end_(o.write_end_), dirty_(o.dirty_), delete_mark_(o.delete_mark_), do_release_mark_(true)
 {
+    o.dt_fd_ = -1;
     o.do_release_mark_ = false;
 }
 
 FileResource::~FileResource() noexcept
 {
-    fstream_dt_.close();
-    fstream_md_.close();
-
     if (do_release_mark_ && !uuid_.empty())
         files_man_.release(*this);
+    close();
 }
 
-Metadata FileResource::GetMetadata() const
+void FileResource::close() noexcept
 {
-    Metadata ret{ -1, 0, ""};
-
-    if (!fstream_md_.is_open())
-        return ret;
-    fstream_md_.seekg(0, std::ios_base::beg);
-
-    fstream_md_.read(reinterpret_cast<char*>(&ret.offset), sizeof(ret.offset));
-    if (fstream_md_.bad())
-        ret.offset = -1;
-    fstream_md_.read(reinterpret_cast<char*>(&ret.length), sizeof(ret.length));
-    if (fstream_md_.bad())
-        ret.length = 0;
-    std::getline(fstream_md_, ret.comment);
-    assert(ret.comment.empty());
-    std::getline(fstream_md_, ret.comment);
+    if (dt_fd_ >= 0)
+        ::close(dt_fd_);
+    dt_fd_ = -1;
+}
 
+size_t FileResource::writeAll(std::streamoff offset_sz, iovec* iov, int iovcnt)
+{
+    size_t ret = 0;
+    while (iovcnt > 0)
+    {
+        const auto n = ::pwritev(dt_fd_, iov, iovcnt, offset_sz + ret);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        ret += n;
+        // Skip what went out, the rest is written on the next round
+        for (size_t left = n; left > 0; )
+        {
+            if (left < iov->iov_len)
+            {
+                iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+                iov->iov_len -= left;
+                break;
+            }
+            left -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+    }
     return ret;
 }
 
-std::string FileResource::ChecksumSha1Hex(std::ifstream::pos_type begpos, std::streamoff count) const
+void FileResource::WriteAsync(StorageExecutor& storage, std::streamoff offset_sz,
+                              const void* data, size_t size, StorageExecutor::Completion done)
 {
-    using boost::uuids::detail::sha1;
-    using boost::algorithm::hex;
+    if (dt_fd_ < 0)
+        return done(-EBADF);
+    // write_end_ is set on the storage thread; the owner reads it only after
+    // having been handed the completion
+    storage.Write(dt_fd_, data, size, offset_sz,
+                  [this, offset_sz, size, done = std::move(done)](ssize_t res) {
+        if (res == static_cast<ssize_t>(size))
+        {
+            write_end_ = offset_sz + res;
+            dirty_ += res;
+        }
+        done(res);
+    });
+}
+
+size_t FileResource::Splice(int pipe_fd, std::streamoff offset_sz, size_t size)
+{
+    if (dt_fd_ < 0)
+        return 0;
 
+    size_t done = 0;
+    while (done < size)
+    {
+        loff_t off = offset_sz + done;
+        const auto n = ::splice(pipe_fd, nullptr, dt_fd_, &off, size - done, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EINVAL)
+        {   // file system cannot be spliced to, copy through user space
+            char buf[16 * 1024];
+            while (done < size)
+            {
+                const auto r = ::read(pipe_fd, buf, std::min(sizeof(buf), size - done));
+                if (r < 0 && errno == EINTR)
+                    continue;
+                if (r <= 0)
+                    break;
+                iovec iov{buf, static_cast<size_t>(r)};
+                if (writeAll(offset_sz + done, &iov, 1) != static_cast<size_t>(r))
+                    break;
+                done += r;
+            }
+            break;
+        }
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    if (done == size)
+    {
+        write_end_ = offset_sz + done;
+        dirty_ += done;
+    }
+    return done;
+}
+
+bool FileResource::Append(const FileResource& part, size_t size)
+{
+    if (dt_fd_ < 0 || part.dt_fd_ < 0)
+        return false;
+
+    if (write_end_ == 0 && ::ioctl(dt_fd_, FICLONE, part.dt_fd_) == 0)
+    {   // part's data file may hold more than was acknowledged
+        struct stat st;
+        if (::fstat(dt_fd_, &st) == 0 && static_cast<size_t>(st.st_size) >= size &&
+                (static_cast<size_t>(st.st_size) == size || ::ftruncate(dt_fd_, size) == 0))
+        {
+            write_end_ = size;
+            dirty_ += size;
+            return true;
+        }
+    }
+
+    loff_t in = 0, out = write_end_;
+    while (static_cast<size_t>(in) < size)
+    {
+        const auto n = ::copy_file_range(part.dt_fd_, &in, dt_fd_, &out, size - in, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL))
+        {   // no in-kernel copy here, through user space then
+            char buf[64 * 1024];
+            while (static_cast<size_t>(in) < size)
+            {
+                const auto r = ::pread(part.dt_fd_, buf, std::min(sizeof(buf), size - in), in);
+                if (r < 0 && errno == EINTR)
+                    continue;
+                if (r <= 0)
+                    return false;
+                iovec iov{buf, static_cast<size_t>(r)};
+                if (writeAll(out, &iov, 1) != static_cast<size_t>(r))
+                    return false;
+                in += r;
+                out += r;
+            }
+            break;
+        }
+        if (n <= 0) // part is shorter than it claims
+            return false;
+    }
+    dirty_ += out - write_end_;
+    write_end_ = out;
+    return true;
+}
+
+Metadata FileResource::GetMetadata() const
+{
+    const auto key = UploadKey::Parse(uuid_);
+    auto info = key ? files_man_.registry_.Lookup(*key) : std::nullopt;
+    if (!info || !info->described)
+        return Metadata{ -1, 0, "", ""};
+    return Metadata{info->offset, info->length, std::move(info->comment), std::move(info->concat)};
+}
+
+std::string FileResource::ChecksumSha1Hex(std::streamoff begpos, std::streamoff count) const
+{
     std::string ret;
 
-    if (!fstream_dt_.is_open())
+    struct stat st;
+    if (dt_fd_ < 0 || ::fstat(dt_fd_, &st) != 0)
         return ret;
-    const auto filesz = [this]() {
-        fstream_dt_.seekg(0, std::ios_base::end);
-        return fstream_dt_.tellg();
-    }();
+    const std::streamoff filesz = st.st_size;
     if (begpos >= filesz)
         return ret;
     if (count == 0) count = filesz - begpos;
     if (count > (filesz - begpos))
         return ret;
-    fstream_dt_.seekg(begpos, std::ios_base::beg);
 
-    sha1 gen;
-    char datblock[2048];
-    for (; count > 0 && !fstream_dt_.eof() && fstream_dt_.good();
-            count -= fstream_dt_.gcount())
+    Sha1 gen;
+    char datblock[16 * 1024];
+    while (count > 0)
     {
-        fstream_dt_.readsome(datblock,
-                             std::min(count, static_cast<std::ifstream::off_type>(2048)));
-        gen.process_block(datblock, datblock + fstream_dt_.gcount());
+        const auto n = ::pread(dt_fd_, datblock,
+                               std::min<std::streamoff>(count, sizeof(datblock)), begpos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return std::string();
+        gen.Update(datblock, n);
+        begpos += n;
+        count -= n;
     }
 
-    ret.reserve(42);
-    sha1::digest_type dig;
-    gen.get_digest(dig);
-    hex(std::begin(dig), std::end(dig), std::back_inserter(ret));
-
-    return ret;
-}
-
-size_t FileResource::Write(std::streamoff offset_sz, const boost::beast::multi_buffer& body)
-{
-    if (!fstream_dt_.is_open())
-        return 0;
-    fstream_dt_.seekp(offset_sz, std::ios_base::beg);
-    assert(offset_sz == fstream_dt_.tellp());
-
-    const auto& buf = body.cdata();
-    size_t ret = 0;
-    for (const auto& constbuf : buf)
-    {
-        auto datp = static_cast<const char*>(constbuf.data());
-        ret += constbuf.size();
-        if (!Write({datp, constbuf.size()}))
-            return 0;
-    }
-    return ret;
+    return HexEncode(gen.Digest());
 }
 
-bool FileResource::Commit()
+bool FileResource::Commit(GroupCommit::Done durable)
 {
+    BETUS_TRACE_SPAN("commit");
     if (delete_mark_)
     {
-        fstream_dt_.close();
-        fstream_md_.close();
-        return files_man_.deleteFiles(uuid_);
+        const auto length = GetMetadata().length;
+        close();
+        files_man_.unreserve(length);
+        const bool ret = files_man_.deleteFiles(uuid_);
+        if (durable)
+            durable(ret);
+        return ret;
     }
-    return updateOffsetMetadata();
-}
 
-bool FileResource::updateOffsetMetadata()
-{
-    if (!fstream_md_.is_open() || !fstream_dt_.is_open())
+    auto* const group = files_man_.durability_ == Durability::Group ? files_man_.group_commit_.get() : nullptr;
+    const bool sync = files_man_.durability_ == Durability::Sync;
+    if (sync && (dt_fd_ < 0 || !Sync_Data(dt_fd_)))
+    {
+        if (durable)
+            durable(false);
         return false;
-    decltype(Metadata::offset) newoff = fstream_dt_.tellp();
-
-    fstream_md_.seekp(0, std::ios_base::beg);
-    return !!fstream_md_.write(reinterpret_cast<const char*>(&newoff), sizeof(newoff));
+    }
+    if (group && dt_fd_ >= 0)
+    {   // The flusher stores the offset once the data is durable
+        const int dt = ::fcntl(dt_fd_, F_DUPFD_CLOEXEC, 0);
+        if (dt >= 0)
+        {
+            group->Add(dt, dirty_, [&fm = files_man_, uuid = uuid_, offset = write_end_] {
+                return fm.storeOffset(uuid, offset);
+            }, std::move(durable));
+            dirty_ = 0;
+            return true;
+        }
+        // out of descriptors, sync right here then
+        if (!Sync_Data(dt_fd_))
+        {
+            if (durable)
+                durable(false);
+            return false;
+        }
+    }
+    const bool ret = dt_fd_ >= 0 && files_man_.storeOffset(uuid_, write_end_) &&
+                     (!(sync || group) || files_man_.journal_.Sync());
+    if (ret)
+        dirty_ = 0;
+    if (durable)
+        durable(ret);
+    return ret;
 }
 } // namespace tus
@@ -0,0 +1,142 @@
+#include "include/group_commit.hpp"
+
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+#include <utility>
+
+namespace tus
+{
+
+namespace
+{
+bool Sync(int fd)
+{
+    int ret;
+    do
+        ret = ::fdatasync(fd);
+    while (ret != 0 && errno == EINTR);
+    return ret == 0;
+}
+} // namespace
+
+GroupCommit::GroupCommit(SyncMeta sync_meta) : GroupCommit(std::move(sync_meta), Config())
+{
+}
+
+GroupCommit::GroupCommit(SyncMeta sync_meta, const Config& config)
+    : sync_meta_(std::move(sync_meta)), config_(config)
+{
+    flusher_ = std::thread([this] { run(); });
+}
+
+GroupCommit::~GroupCommit()
+{
+    {
+        std::lock_guard lock(mtx_);
+        assert(pending_.empty() && "GroupCommit destroyed with commits pending, Stop() it first");
+    }
+    Stop();
+}
+
+void GroupCommit::Add(int data_fd, uint64_t bytes, Store store, Done done)
+{
+    bool wake;
+    {
+        std::unique_lock lock(mtx_);
+        if (stop_)
+        {
+            lock.unlock();
+            std::vector<Commit> single{{data_fd, std::move(store), std::move(done)}};
+            return flush(single);
+        }
+        const bool first = pending_.empty();
+        if (first)
+            first_ = std::chrono::steady_clock::now();
+        pending_.push_back({data_fd, std::move(store), std::move(done)});
+        pending_bytes_ += bytes;
+        // The flusher sleeps until the batch is due otherwise
+        wake = first || pending_bytes_ >= config_.bytes;
+    }
+    if (wake)
+        cv_.notify_one();
+}
+
+void GroupCommit::Stop()
+{
+    {
+        std::lock_guard lock(mtx_);
+        stop_ = true;
+    }
+    cv_.notify_one();
+    if (flusher_.joinable())
+        flusher_.join();
+}
+
+bool GroupCommit::Stopped() const
+{
+    std::lock_guard lock(mtx_);
+    return stop_;
+}
+
+GroupCommit::Stats GroupCommit::GetStats() const
+{
+    std::lock_guard lock(mtx_);
+    return stats_;
+}
+
+void GroupCommit::run()
+{
+    std::vector<Commit> batch;
+    std::unique_lock lock(mtx_);
+    for (;;)
+    {
+        cv_.wait(lock, [this] { return stop_ || !pending_.empty(); });
+        if (pending_.empty())
+            return;
+        // Commits arriving meanwhile join the batch
+        cv_.wait_until(lock, first_ + config_.interval,
+                       [this] { return stop_ || pending_bytes_ >= config_.bytes; });
+        batch.swap(pending_);
+        pending_bytes_ = 0;
+        lock.unlock();
+
+        flush(batch);
+        batch.clear();
+
+        lock.lock();
+    }
+}
+
+void GroupCommit::flush(std::vector<Commit>& batch)
+{
+    // Offsets are stored only once their data is durable, so that none can
+    // reach the disk pointing past durable data
+    std::vector<bool> ok(batch.size());
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        ok[i] = Sync(batch[i].data_fd);
+        ::close(batch[i].data_fd);
+    }
+    for (size_t i = 0; i < batch.size(); ++i)
+        ok[i] = ok[i] && batch[i].store();
+    const bool meta_ok = sync_meta_();
+    size_t failures = 0;
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        ok[i] = ok[i] && meta_ok;
+        failures += !ok[i];
+    }
+    {
+        std::lock_guard lock(mtx_);
+        ++stats_.batches;
+        stats_.commits += batch.size();
+        stats_.failures += failures;
+    }
+    for (size_t i = 0; i < batch.size(); ++i)
+        if (batch[i].done)
+            batch[i].done(ok[i]);
+}
+
+} // namespace tus
@@ -0,0 +1,651 @@
+#include "include/http_server.hpp"
+#include "include/metrics.hpp"
+#include "include/trace.hpp"
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace asio = boost::asio;
+using tcp = asio::ip::tcp;
+
+namespace tus
+{
+
+namespace
+{
+// Value of key in an Upload-Metadata header, still base64 encoded
+std::string_view Metadata_Value(std::string_view metadata, std::string_view key)
+{
+    while (!metadata.empty())
+    {
+        const auto comma = metadata.find(',');
+        auto pair = metadata.substr(0, comma);
+        metadata.remove_prefix(comma == std::string_view::npos ? metadata.size() : comma + 1);
+        while (!pair.empty() && pair.front() == ' ')
+            pair.remove_prefix(1);
+        const auto space = pair.find(' ');
+        if (pair.substr(0, space) == key)
+            return space == std::string_view::npos ? std::string_view() : pair.substr(space + 1);
+    }
+    return {};
+}
+
+class HttpConnection : public std::enable_shared_from_this<HttpConnection>
+{
+    tcp::socket socket_;
+    asio::steady_timer deadline_;
+    beast::flat_buffer buffer_{4096};
+    TusManager& tus_man_;
+    StorageExecutor& storage_;
+    FairShare& fair_share_;
+    const HttpServer::Config config_;
+    unsigned served_ = 0;
+    bool closing_ = false;
+    // Of the request being answered, for Metrics
+    http::verb verb_ = http::verb::unknown;
+    std::chrono::steady_clock::time_point started_;
+    // Its spans carry this, see Trace; handlers doing its work on whatever
+    // thread set it as the thread's current request
+    uint64_t trace_id_ = 0;
+
+    // Headers are parsed first, then the parser is moved into one of the
+    // body parsers depending on whether the body is an upload to stream.
+    std::optional<http::request_parser<http::empty_body>> header_parser_;
+    std::optional<http::request_parser<http::dynamic_body>> parser_;
+    std::optional<http::request_parser<http::buffer_body>> upload_parser_;
+    std::unique_ptr<UploadStream> upload_;
+    std::vector<char> piece_;
+    // With a FairShare, the client the upload is accounted to and the bytes
+    // of its body granted but not read yet
+    std::string client_;
+    uint64_t granted_ = 0;
+    // Spliced uploads: the pipe between socket and file, created with the
+    // first one, and the body bytes still to come from the socket
+    int pipe_[2] = {-1, -1};
+    size_t pipe_sz_ = 0;
+    size_t splice_left_ = 0;
+    // Downloads: the socket as storage sends to it, a duplicate so that a
+    // timeout closing socket_ meanwhile cannot hand its number to another
+    // file; the body itself never passes through the serializer
+    std::unique_ptr<DownloadStream> download_;
+    int send_fd_ = -1;
+    std::optional<http::response_serializer<http::dynamic_body>> serializer_;
+
+    http::response<http::dynamic_body> response_;
+
+public:
+    HttpConnection(tcp::socket socket, TusManager& tm, StorageExecutor& storage, FairShare& fair_share,
+                   const HttpServer::Config& config)
+        : socket_(std::move(socket)), deadline_{socket_.get_executor()},
+          tus_man_(tm), storage_(storage), fair_share_(fair_share), config_(config)
+    {
+        Metrics::Instance().ConnectionOpened();
+    }
+
+    ~HttpConnection()
+    {
+        Metrics::Instance().ConnectionClosed();
+        for (int fd : pipe_)
+            if (fd >= 0)
+                ::close(fd);
+        if (send_fd_ >= 0)
+            ::close(send_fd_);
+    }
+
+    void handle_request()
+    {
+        auto self = shared_from_this();
+
+        read_reply_request_async(self);
+        set_socket_timeout(self);
+    }
+
+private:
+    // Pipelined requests already sitting in buffer_ are parsed from there, so
+    // they are answered in order without another socket read.
+    void read_reply_request_async(const std::shared_ptr<HttpConnection>& self)
+    {
+        parser_.reset();
+        upload_parser_.reset();
+        header_parser_.emplace();
+        // BeginUpload refuses upload bodies without a Content-Length or with
+        // one past their Upload-Length, other bodies are read into memory
+        // and limited there
+        header_parser_->body_limit(std::numeric_limits<std::uint64_t>::max());
+        deadline_.expires_after(served_ == 0 ? config_.request_timeout : config_.idle_timeout);
+
+        http::async_read_header( socket_, buffer_, *header_parser_,
+                                 [this, self](beast::error_code ec, std::size_t bytes_transferred)
+        {
+            boost::ignore_unused(bytes_transferred);
+            if (ec)
+                return close_gracefully();
+
+            deadline_.expires_after(config_.request_timeout);
+            ++served_;
+            verb_ = header_parser_->get().method();
+            started_ = std::chrono::steady_clock::now();
+            BETUS_TRACE_NEW_REQUEST(trace_id_);
+            BETUS_TRACE_REQUEST(trace_id_);
+            if (TusManager::HasUploadBody(header_parser_->get()))
+                start_upload_async(self);
+            else
+                read_whole_request_async(self);
+        });
+    }
+
+    void read_whole_request_async(const std::shared_ptr<HttpConnection>& self)
+    {
+        parser_.emplace(std::move(*header_parser_));
+        parser_->body_limit(config_.max_buffered_body);
+
+        http::async_read( socket_, buffer_, *parser_,
+                          [this, self](beast::error_code ec, std::size_t bytes_transferred)
+        {
+            boost::ignore_unused(bytes_transferred);
+            if (ec)
+                return close_gracefully();
+
+            BETUS_TRACE_REQUEST(trace_id_);
+            if (TusManager::IsDownload(parser_->get()))
+                return start_download_async(self);
+            if (!TusManager::CopiesData(parser_->get()))
+            {
+                response_ = tus_man_.MakeResponse(parser_->get());
+                return write_response_async(self);
+            }
+            storage_.Run([this, self]
+            {
+                BETUS_TRACE_REQUEST(trace_id_);
+                response_ = tus_man_.MakeResponse(parser_->get());
+                asio::post(socket_.get_executor(), [this, self] { write_response_async(self); });
+            });
+        });
+    }
+
+    void start_upload_async(const std::shared_ptr<HttpConnection>& self)
+    {
+        response_ = {};
+        upload_ = tus_man_.BeginUpload(header_parser_->get(), response_);
+        if (!upload_)
+        {
+            if (!header_parser_->is_done()) // body is left unread on the wire
+                response_.keep_alive(false);
+            return write_response_async(self);
+        }
+
+        upload_parser_.emplace(std::move(*header_parser_));
+        if (upload_parser_->is_done())
+            return finish_upload_async(self);
+        if (fair_share_.Enabled())
+            client_ = client_key();
+        if (can_splice())
+            return splice_buffered_async(self);
+        piece_.resize(config_.body_piece_size);
+        read_upload_piece_async(self);
+    }
+
+    // A checksummed body has to be digested in user space. Chunked bodies
+    // never get here: a PATCH without Content-Length is refused before.
+    bool can_splice()
+    {
+        if (!config_.splice_uploads || !upload_->CanSplice() || !upload_parser_->content_length())
+            return false;
+        if (pipe_[0] < 0)
+        {
+            if (::pipe2(pipe_, O_CLOEXEC) != 0)
+            {
+                pipe_[0] = pipe_[1] = -1;
+                return false;
+            }
+            ::fcntl(pipe_[1], F_SETPIPE_SZ, static_cast<int>(config_.body_piece_size));
+            const int sz = ::fcntl(pipe_[1], F_GETPIPE_SZ);
+            pipe_sz_ = sz > 0 ? sz : 4096;
+        }
+        beast::error_code ec;
+        socket_.native_non_blocking(true, ec);
+        return !ec;
+    }
+
+    // Body bytes that arrived together with the headers are already in
+    // buffer_ and are written from there, the rest is spliced
+    void splice_buffered_async(const std::shared_ptr<HttpConnection>& self)
+    {
+        const size_t body_sz = *upload_parser_->content_length();
+        const size_t buffered = std::min(buffer_.size(), body_sz);
+        splice_left_ = body_sz - buffered;
+        upload_->WriteAsync(storage_, buffer_.data().data(), buffered, [this, self, buffered](ssize_t res)
+        {
+            asio::post(socket_.get_executor(), [this, self, buffered, res]
+            {
+                BETUS_TRACE_REQUEST(trace_id_);
+                buffer_.consume(buffered);
+                if (!upload_->Written(res))
+                {
+                    response_.keep_alive(false);
+                    return finish_upload_async(self);
+                }
+                splice_piece_async(self);
+            });
+        });
+    }
+
+    // Socket to pipe here without blocking, as much as the pipe holds; pipe
+    // to file on storage. The pipe is empty again whenever this is entered.
+    void splice_piece_async(const std::shared_ptr<HttpConnection>& self)
+    {
+        if (splice_left_ == 0)
+            return finish_upload_async(self);
+        if (await_share(self, std::min(splice_left_, pipe_sz_), [this, self] { splice_piece_async(self); }))
+            return;
+
+        const auto n = ::splice(socket_.native_handle(), nullptr, pipe_[1], nullptr,
+                                shared(std::min(splice_left_, pipe_sz_)), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        {
+            socket_.async_wait(tcp::socket::wait_read, [this, self](beast::error_code ec)
+            {
+                if (ec)
+                    return abort_upload_async(self);
+                splice_piece_async(self);
+            });
+            return;
+        }
+        if (n <= 0) // peer went away or the socket failed
+            return abort_upload_async(self);
+
+        splice_left_ -= n;
+        share_used(n);
+        storage_.Run([this, self, n]
+        {
+            BETUS_TRACE_REQUEST(trace_id_);
+            const bool written = upload_->Splice(pipe_[0], n);
+            asio::post(socket_.get_executor(), [this, self, written]
+            {
+                deadline_.expires_after(config_.request_timeout);
+                if (!written)
+                {
+                    response_.keep_alive(false);
+                    return finish_upload_async(self);
+                }
+                splice_piece_async(self);
+            });
+        });
+    }
+
+    void read_upload_piece_async(const std::shared_ptr<HttpConnection>& self)
+    {
+        const auto left = upload_parser_->content_length_remaining();
+        if (await_share(self, left ? std::min<uint64_t>(*left, piece_.size()) : piece_.size(),
+                        [this, self] { read_upload_piece_async(self); }))
+            return;
+
+        auto& body = upload_parser_->get().body();
+        body.data = piece_.data();
+        body.size = shared(piece_.size());
+
+        http::async_read( socket_, buffer_, *upload_parser_,
+                          [this, self](beast::error_code ec, std::size_t)
+        {
+            if (ec == http::error::need_buffer)
+                ec = {};
+            const auto piece_sz = shared(piece_.size()) - upload_parser_->get().body().size;
+            share_used(piece_sz);
+            write_upload_piece_async(self, piece_sz, ec);
+        });
+    }
+
+    // The piece goes to storage while this connection waits for it, without
+    // holding up the others; piece_ is not read into until it completes.
+    void write_upload_piece_async(const std::shared_ptr<HttpConnection>& self, size_t piece_sz,
+                                  beast::error_code read_ec)
+    {
+        upload_->WriteAsync(storage_, piece_.data(), piece_sz, [this, self, read_ec](ssize_t res)
+        {
+            asio::post(socket_.get_executor(), [this, self, read_ec, res]
+            {
+                BETUS_TRACE_REQUEST(trace_id_);
+                const bool written = upload_->Written(res);
+                if (read_ec)
+                    return abort_upload_async(self);
+
+                deadline_.expires_after(config_.request_timeout);
+                if (!written)
+                {
+                    response_.keep_alive(false);
+                    return finish_upload_async(self);
+                }
+                if (!upload_parser_->is_done())
+                    return read_upload_piece_async(self);
+                finish_upload_async(self);
+            });
+        });
+    }
+
+    // Finishing stores the new offset, so it runs on storage as well; the
+    // answer waits for the offset to be durable, if commits are grouped
+    void finish_upload_async(const std::shared_ptr<HttpConnection>& self)
+    {
+        release_share();
+        storage_.Run([this, self]
+        {
+            BETUS_TRACE_REQUEST(trace_id_);
+            tus_man_.FinishUpload(*upload_, response_, [this, self]
+            {
+                asio::post(socket_.get_executor(), [this, self]
+                {
+                    upload_.reset();
+                    write_response_async(self);
+                });
+            });
+        });
+    }
+
+    void abort_upload_async(const std::shared_ptr<HttpConnection>& self)
+    {
+        release_share();
+        storage_.Run([this, self]
+        {
+            BETUS_TRACE_REQUEST(trace_id_);
+            tus_man_.AbortUpload(*upload_);
+            asio::post(socket_.get_executor(), [this, self]
+            {
+                upload_.reset();
+                close_gracefully();
+            });
+        });
+    }
+
+    // Uploads of one address share its bandwidth, or of one address and
+    // metadata value if a key is configured
+    std::string client_key()
+    {
+        beast::error_code ec;
+        auto key = socket_.remote_endpoint(ec).address().to_string();
+        if (const auto& md_key = fair_share_.GetConfig().metadata_key; !md_key.empty())
+            if (const auto val = Metadata_Value(upload_->Metadata(), md_key); !val.empty())
+                key.append(" ").append(val);
+        return key;
+    }
+
+    // Nothing of the body is read from the socket before the fair share
+    // grants it: with nothing granted, asks for up to bytes and returns
+    // true, next continues on the strand once granted. The socket is not
+    // read meanwhile, so a client over its share fills its TCP window and
+    // waits.
+    template <typename Next>
+    bool await_share(const std::shared_ptr<HttpConnection>& self, uint64_t bytes, Next next)
+    {
+        if (!fair_share_.Enabled() || granted_ > 0)
+            return false;
+        fair_share_.Acquire(client_, bytes, [this, self, next](uint64_t n)
+        {
+            asio::post(socket_.get_executor(), [this, n, next]
+            {
+                granted_ = n;
+                deadline_.expires_after(config_.request_timeout);
+                next();
+            });
+        });
+        return true;
+    }
+
+    // At most bytes, or what is granted of them
+    size_t shared(size_t bytes) const
+    {
+        return fair_share_.Enabled() ? std::min<uint64_t>(bytes, granted_) : bytes;
+    }
+
+    void share_used(size_t bytes)
+    {
+        granted_ -= std::min<uint64_t>(granted_, bytes);
+    }
+
+    void release_share()
+    {
+        if (granted_ > 0)
+            fair_share_.Release(client_, granted_);
+        granted_ = 0;
+    }
+
+    void start_download_async(const std::shared_ptr<HttpConnection>& self)
+    {
+        response_ = {};
+        download_ = tus_man_.BeginDownload(parser_->get(), response_);
+        if (!download_)
+            return write_response_async(self);
+
+        limit_requests();
+        serializer_.emplace(response_);
+        http::async_write_header( socket_, *serializer_,
+                                  [this, self](beast::error_code ec, std::size_t)
+        {
+            if (!ec)
+                socket_.native_non_blocking(true, ec);
+            if (!ec && send_fd_ < 0)
+                send_fd_ = ::fcntl(socket_.native_handle(), F_DUPFD_CLOEXEC, 0);
+            if (ec || send_fd_ < 0)
+                return end_download(self, false);
+            send_download_piece_async(self);
+        });
+    }
+
+    // sendfile() reads the file, so it runs on storage; a full socket sends
+    // it back here to wait until the socket is writable
+    void send_download_piece_async(const std::shared_ptr<HttpConnection>& self)
+    {
+        if (download_->Left() == 0)
+            return end_download(self, true);
+
+        storage_.Run([this, self]
+        {
+            BETUS_TRACE_REQUEST(trace_id_);
+            BETUS_TRACE_SPAN("sendfile");
+            const auto n = download_->SendTo(send_fd_, config_.download_piece_size);
+            const int err = n < 0 ? errno : 0;
+            asio::post(socket_.get_executor(), [this, self, n, err]
+            {
+                if (!socket_.is_open()) // timed out meanwhile
+                    return end_download(self, false);
+                if (n < 0 && (err == EAGAIN || err == EINTR))
+                {
+                    socket_.async_wait(tcp::socket::wait_write, [this, self](beast::error_code ec)
+                    {
+                        if (ec)
+                            return end_download(self, false);
+                        send_download_piece_async(self);
+                    });
+                    return;
+                }
+                if (n <= 0) // peer went away, or the file got shorter
+                    return end_download(self, false);
+                deadline_.expires_after(config_.request_timeout);
+                send_download_piece_async(self);
+            });
+        });
+    }
+
+    void end_download(const std::shared_ptr<HttpConnection>& self, bool sent)
+    {
+        if (sent)
+            answered();
+        download_.reset();
+        serializer_.reset();
+        if (send_fd_ >= 0)
+            ::close(send_fd_);
+        send_fd_ = -1;
+        if (!sent || response_.need_eof())
+            return close_gracefully();
+        read_reply_request_async(self);
+    }
+
+    void answered()
+    {
+        BETUS_TRACE_REQUEST(trace_id_);
+        BETUS_TRACE_SINCE("request", started_);
+        Metrics::Instance().Request(Metrics::VerbOf(verb_), response_.result_int(),
+                                    std::chrono::steady_clock::now() - started_);
+    }
+
+    void limit_requests()
+    {
+        if (config_.max_requests_per_connection > 0 &&
+            served_ >= config_.max_requests_per_connection)
+            response_.keep_alive(false);
+    }
+
+    void write_response_async(const std::shared_ptr<HttpConnection>& self)
+    {
+        limit_requests();
+
+        http::async_write( socket_, response_,
+                           [this, self](beast::error_code ec, std::size_t)
+        {
+            if (!ec)
+                answered();
+            if (ec || response_.need_eof())
+                return close_gracefully();
+            read_reply_request_async(self);
+        });
+    }
+
+    void close_gracefully()
+    {
+        beast::error_code ec;
+        closing_ = true;
+        socket_.shutdown(tcp::socket::shutdown_send, ec);
+        deadline_.cancel();
+    }
+
+    // Re-armed by every expires_after() above: the wait is aborted then and
+    // resumes against the new expiry.
+    void set_socket_timeout(const std::shared_ptr<HttpConnection>& self)
+    {
+        deadline_.async_wait(
+            [this, self](beast::error_code ec)
+        {
+            if (closing_ || !socket_.is_open())
+                return;
+            if (deadline_.expiry() <= asio::steady_timer::clock_type::now())
+            {
+                socket_.close(ec);
+                return;
+            }
+            set_socket_timeout(self);
+        });
+    }
+};
+} // namespace
+
+HttpServer::HttpServer(asio::io_context& ioc, const tcp::endpoint& endpoint, TusManager& tm)
+    : HttpServer(ioc, endpoint, tm, Config())
+{
+}
+
+HttpServer::HttpServer(asio::io_context& ioc, const tcp::endpoint& endpoint, TusManager& tm,
+                       const Config& config)
+    : ioc_(ioc), acceptor_(ioc, endpoint), tus_man_(tm), config_(config),
+      own_storage_(StorageExecutor::Create()), storage_(*own_storage_), fair_share_(ioc, config.fair_share),
+      reap_timer_(asio::make_strand(ioc)), lag_timer_(reap_timer_.get_executor())
+{
+}
+
+HttpServer::HttpServer(asio::io_context& ioc, const tcp::endpoint& endpoint, TusManager& tm,
+                       const Config& config, StorageExecutor& storage)
+    : ioc_(ioc), acceptor_(ioc, endpoint), tus_man_(tm), config_(config), storage_(storage),
+      fair_share_(ioc, config.fair_share), reap_timer_(asio::make_strand(ioc)),
+      lag_timer_(reap_timer_.get_executor())
+{
+}
+
+void HttpServer::Start()
+{
+    accept();
+    asio::post(reap_timer_.get_executor(), [this]
+    {
+        running_ = true;
+        if (config_.reap_interval.count() > 0)
+            scheduleReap();
+        if (config_.lag_probe_interval.count() > 0)
+            scheduleLagProbe();
+    });
+}
+
+void HttpServer::Stop()
+{
+    beast::error_code ec;
+    acceptor_.close(ec);
+    fair_share_.Stop();
+    asio::post(reap_timer_.get_executor(), [this]
+    {
+        running_ = false;
+        reap_timer_.cancel();
+        lag_timer_.cancel();
+    });
+}
+
+// Files are removed on storage, a few at a time, while the timer already
+// runs towards the next round
+void HttpServer::scheduleReap()
+{
+    reap_timer_.expires_after(config_.reap_interval);
+    reap_timer_.async_wait([this](beast::error_code ec)
+    {
+        if (ec == asio::error::operation_aborted || !running_)
+            return;
+        storage_.Run([&tm = tus_man_, batch = config_.reap_batch] { tm.ReapExpired(batch); });
+        scheduleReap();
+    });
+}
+
+// A timer due now fires as soon as a thread of the loop gets to it; how
+// much later than that is how long handlers kept the threads busy
+void HttpServer::scheduleLagProbe()
+{
+    lag_timer_.expires_after(config_.lag_probe_interval);
+    lag_timer_.async_wait([this](beast::error_code ec)
+    {
+        if (ec == asio::error::operation_aborted || !running_)
+            return;
+        Metrics::Instance().LoopLag(asio::steady_timer::clock_type::now() - lag_timer_.expiry());
+        scheduleLagProbe();
+    });
+}
+
+void HttpServer::accept()
+{
+    // The socket's executor is a strand: all handlers of one connection are
+    // serialized while different connections run in parallel.
+    acceptor_.async_accept(asio::make_strand(ioc_),
+                           [this](beast::error_code ec, tcp::socket socket)
+    {
+        if (ec == asio::error::operation_aborted)
+            return;
+        if (!ec)
+            std::make_shared<HttpConnection>(std::move(socket), tus_man_, storage_, fair_share_, config_)
+                ->handle_request();
+        else
+            std::cerr << "Error while async_accept on acceptor: " << ec.message() << '\n';
+        accept();
+    });
+}
+
+} // namespace tus
@@ -0,0 +1,310 @@
+#include "include/journal.hpp"
+#include "include/checksum.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+
+namespace tus
+{
+
+namespace
+{
+const std::string Magic = "betus-journal 1\n";
+// Record layout: crc32c of the rest, length of the body, then the body:
+// type, key, time and what the type carries. Integers are in host order,
+// strings are preceded by their length.
+constexpr size_t Head_Len = 2 * sizeof(uint32_t);
+constexpr size_t Max_Body_Len = 1 << 20;
+constexpr size_t Read_Chunk = 1 << 20;
+
+int Open_At(int dir_fd, const std::string& fname, int flags)
+{
+    int fd;
+    do
+        fd = ::openat(dir_fd, fname.c_str(), flags | O_CLOEXEC, 0666);
+    while (fd < 0 && errno == EINTR);
+    return fd;
+}
+
+bool Write_All(int fd, const char* data, size_t size)
+{
+    while (size > 0)
+    {
+        const auto n = ::write(fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool Sync_Data(int fd)
+{
+    int ret;
+    do
+        ret = ::fdatasync(fd);
+    while (ret != 0 && errno == EINTR);
+    return ret == 0;
+}
+
+template <typename T>
+void Put(std::string& out, T val)
+{
+    out.append(reinterpret_cast<const char*>(&val), sizeof(val));
+}
+
+void Put_String(std::string& out, const std::string& str)
+{
+    Put(out, static_cast<uint32_t>(str.size()));
+    out += str;
+}
+
+// Reads from a body, failing once past its end
+struct Reader
+{
+    const char* pos;
+    const char* end;
+
+    template <typename T>
+    bool Get(T& val)
+    {
+        if (end - pos < static_cast<ptrdiff_t>(sizeof(val)))
+            return false;
+        std::memcpy(&val, pos, sizeof(val));
+        pos += sizeof(val);
+        return true;
+    }
+
+    bool Get_String(std::string& str)
+    {
+        uint32_t len;
+        if (!Get(len) || end - pos < static_cast<ptrdiff_t>(len))
+            return false;
+        str.assign(pos, len);
+        pos += len;
+        return true;
+    }
+};
+} // namespace
+
+Journal::Journal(int dir_fd, const std::string& fname)
+    : dir_fd_(dir_fd), fname_(fname), fd_(Open_At(dir_fd, fname, O_RDWR | O_CREAT | O_APPEND))
+{
+    struct stat st;
+    if (fd_ < 0 || ::fstat(fd_, &st) != 0)
+        return;
+    if (st.st_size == 0 && Write_All(fd_, Magic.data(), Magic.size()))
+        st.st_size = Magic.size();
+    size_ = base_size_ = st.st_size;
+}
+
+Journal::~Journal()
+{
+    if (fd_ >= 0)
+        ::close(fd_);
+}
+
+bool Journal::Append(const Record& rec)
+{
+    thread_local std::string buf;
+    buf.clear();
+    encode(rec, buf);
+
+    std::shared_lock lock(mtx_);
+    if (fd_ < 0)
+        return false;
+    // O_APPEND places every record whole after the others, whatever the
+    // threads appending
+    ssize_t n;
+    do
+        n = ::write(fd_, buf.data(), buf.size());
+    while (n < 0 && errno == EINTR);
+    if (n > 0)
+        size_ += n;
+    return n == static_cast<ssize_t>(buf.size());
+}
+
+bool Journal::Sync()
+{
+    std::shared_lock lock(mtx_);
+    return fd_ >= 0 && Sync_Data(fd_);
+}
+
+bool Journal::Replay(const Emit& f, ReplayStats& stats) const
+{
+    std::shared_lock lock(mtx_);
+    if (fd_ < 0)
+        return false;
+
+    std::string buf;
+    size_t pos = 0;
+    uint64_t file_pos = 0, consumed = 0;
+    auto fill = [&] {
+        buf.erase(0, pos);
+        pos = 0;
+        const auto old = buf.size();
+        buf.resize(old + Read_Chunk);
+        ssize_t n;
+        do
+            n = ::pread(fd_, buf.data() + old, Read_Chunk, file_pos);
+        while (n < 0 && errno == EINTR);
+        buf.resize(old + std::max<ssize_t>(n, 0));
+        file_pos += std::max<ssize_t>(n, 0);
+        return n > 0;
+    };
+
+    while (buf.size() < Magic.size() && fill())
+        ;
+    if (buf.compare(0, Magic.size(), Magic) != 0)
+        return false;
+    pos = consumed = Magic.size();
+
+    Record rec;
+    for (;;)
+    {
+        const auto n = decode(buf.data() + pos, buf.size() - pos, rec);
+        // Short of the longest record, it may just not be read in yet
+        if (n == 0 && buf.size() - pos < Head_Len + Max_Body_Len && fill())
+            continue;
+        if (n == 0)
+            break;
+        pos += n;
+        consumed += n;
+        ++stats.records;
+        stats.clean = rec.type == Type::Clean;
+        f(rec);
+    }
+    stats.torn = file_pos - consumed;
+    stats.clean = stats.clean && stats.torn == 0;
+    return true;
+}
+
+bool Journal::Rewrite(const std::function<void(const Emit&)>& snapshot, bool clean)
+{
+    const auto tmpname = fname_ + ".tmp";
+    int tmp = Open_At(dir_fd_, tmpname, O_RDWR | O_CREAT | O_TRUNC | O_APPEND);
+    if (tmp < 0)
+        return false;
+    auto fail = [&] {
+        ::close(tmp);
+        ::unlinkat(dir_fd_, tmpname.c_str(), 0);
+        return false;
+    };
+
+    std::string buf = Magic;
+    off_t mark;
+    {
+        std::unique_lock lock(mtx_);
+        struct stat st;
+        if (fd_ < 0 || ::fstat(fd_, &st) != 0)
+            return fail();
+        snapshot([&buf](const Record& rec) { encode(rec, buf); });
+        mark = st.st_size;
+    }
+    // The bulk is written with appends going on
+    if (!Write_All(tmp, buf.data(), buf.size()) || !Sync_Data(tmp))
+        return fail();
+
+    std::unique_lock lock(mtx_);
+    // What was appended since the snapshot comes after it
+    for (;;)
+    {
+        buf.resize(Read_Chunk);
+        const auto n = ::pread(fd_, buf.data(), buf.size(), mark);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return fail();
+        if (n == 0)
+            break;
+        if (!Write_All(tmp, buf.data(), n))
+            return fail();
+        mark += n;
+    }
+    if (clean)
+    {
+        buf.clear();
+        encode({Type::Clean, {}, 0, 0, 0, "", ""}, buf);
+        if (!Write_All(tmp, buf.data(), buf.size()))
+            return fail();
+    }
+    struct stat st;
+    if (!Sync_Data(tmp) || ::fstat(tmp, &st) != 0 ||
+            ::renameat(dir_fd_, tmpname.c_str(), dir_fd_, fname_.c_str()) != 0)
+        return fail();
+    // The rename is durable with the directory
+    if (::fsync(dir_fd_) != 0)
+        std::cerr << "fsync of the journal's directory failed: " << std::strerror(errno) << std::endl;
+    ::close(fd_);
+    fd_ = tmp;
+    size_ = base_size_ = st.st_size;
+    return true;
+}
+
+void Journal::encode(const Record& rec, std::string& out)
+{
+    const auto beg = out.size();
+    out.append(Head_Len, '\0');
+    Put(out, rec.type);
+    Put(out, rec.key.hi);
+    Put(out, rec.key.lo);
+    Put(out, rec.time_ms);
+    if (rec.type == Type::Create || rec.type == Type::Offset)
+        Put(out, rec.offset);
+    if (rec.type == Type::Create)
+    {
+        Put(out, rec.length);
+        Put_String(out, rec.comment);
+        Put_String(out, rec.concat);
+    }
+    const auto body_len = static_cast<uint32_t>(out.size() - beg - Head_Len);
+    std::memcpy(out.data() + beg + sizeof(uint32_t), &body_len, sizeof(body_len));
+    const auto crc = Crc32c::Extend(0, out.data() + beg + sizeof(uint32_t), sizeof(body_len) + body_len);
+    std::memcpy(out.data() + beg, &crc, sizeof(crc));
+}
+
+size_t Journal::decode(const char* data, size_t size, Record& rec)
+{
+    if (size < Head_Len)
+        return 0;
+    uint32_t crc, body_len;
+    std::memcpy(&crc, data, sizeof(crc));
+    std::memcpy(&body_len, data + sizeof(crc), sizeof(body_len));
+    if (body_len > Max_Body_Len || size < Head_Len + body_len ||
+            crc != Crc32c::Extend(0, data + sizeof(crc), sizeof(body_len) + body_len))
+        return 0;
+
+    Reader rd{data + Head_Len, data + Head_Len + body_len};
+    if (!rd.Get(rec.type) || !rd.Get(rec.key.hi) || !rd.Get(rec.key.lo) || !rd.Get(rec.time_ms))
+        return 0;
+    switch (rec.type)
+    {
+    case Type::Create:
+        if (!rd.Get(rec.offset) || !rd.Get(rec.length) || !rd.Get_String(rec.comment) ||
+                !rd.Get_String(rec.concat))
+            return 0;
+        break;
+    case Type::Offset:
+        if (!rd.Get(rec.offset))
+            return 0;
+        break;
+    case Type::Delete:
+    case Type::Clean:
+        break;
+    default:
+        return 0;
+    }
+    return Head_Len + body_len;
+}
+
+} // namespace tus
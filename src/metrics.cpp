@@ -0,0 +1,245 @@
+#include "include/metrics.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+namespace tus
+{
+
+namespace
+{
+std::atomic<uint64_t> Next_Id{1};
+
+// The shard this thread recorded into last, and for which instance
+struct Last_Shard
+{
+    uint64_t id = 0;
+    void* shard = nullptr;
+};
+thread_local Last_Shard Last;
+
+const char* const Verb_Names[Metrics::Verb_Count] = {"OPTIONS", "HEAD", "POST", "PATCH", "DELETE", "GET",
+                                                       "OTHER"};
+const char* const Class_Names[Metrics::Class_Count] = {"1xx", "2xx", "3xx", "4xx", "5xx"};
+
+double Seconds(uint64_t ns)
+{
+    return static_cast<double>(ns) / 1e9;
+}
+} // namespace
+
+Metrics& Metrics::Instance()
+{
+    static Metrics metrics;
+    return metrics;
+}
+
+Metrics::Verb Metrics::VerbOf(boost::beast::http::verb verb)
+{
+    namespace http = boost::beast::http;
+    switch (verb)
+    {
+    case http::verb::options: return Verb::Options;
+    case http::verb::head:    return Verb::Head;
+    case http::verb::post:    return Verb::Post;
+    case http::verb::patch:   return Verb::Patch;
+    case http::verb::delete_: return Verb::Delete;
+    case http::verb::get:     return Verb::Get;
+    default:                  return Verb::Other;
+    }
+}
+
+Metrics::Metrics() : id_(Next_Id++)
+{
+}
+
+Metrics::~Metrics() = default;
+
+Metrics::Shard& Metrics::local()
+{
+    if (Last.id == id_)
+        return *static_cast<Shard*>(Last.shard);
+
+    const auto me = std::this_thread::get_id();
+    std::lock_guard lock(shards_mtx_);
+    Shard* found = nullptr;
+    for (const auto& sh : shards_)
+        if (sh->owner == me)
+            found = sh.get();
+    if (!found)
+    {
+        shards_.push_back(std::make_unique<Shard>());
+        found = shards_.back().get();
+        found->owner = me;
+    }
+    Last = {id_, found};
+    return *found;
+}
+
+void Metrics::observe(Histogram& hist, std::chrono::nanoseconds elapsed)
+{
+    const auto ns = static_cast<uint64_t>(std::max<int64_t>(elapsed.count(), 0));
+    const double secs = Seconds(ns);
+    size_t b = 0;
+    while (b < Latency_Buckets.size() && secs > Latency_Buckets[b])
+        ++b;
+    add(hist.buckets[b], 1);
+    add(hist.sum_ns, ns);
+}
+
+void Metrics::Request(Verb verb, unsigned status, std::chrono::nanoseconds elapsed)
+{
+    if (status < Status_Min || status > Status_Max)
+        return;
+    auto& sh = local();
+    const auto v = static_cast<size_t>(verb);
+    add(sh.requests[v][status - Status_Min], 1);
+    observe(sh.latency[v][status / 100 - 1], elapsed);
+}
+
+void Metrics::BytesWritten(uint64_t bytes)
+{
+    add(local().bytes_written, bytes);
+}
+
+void Metrics::ChecksumTime(std::chrono::nanoseconds elapsed)
+{
+    add(local().checksum_ns, elapsed.count());
+}
+
+void Metrics::ConnectionOpened()
+{
+    add(local().conns_opened, 1);
+}
+
+void Metrics::ConnectionClosed()
+{
+    add(local().conns_closed, 1);
+}
+
+void Metrics::LoopLag(std::chrono::nanoseconds lag)
+{
+    observe(local().loop_lag, lag);
+}
+
+template <typename Field>
+uint64_t Metrics::sum(Field&& field) const
+{
+    std::lock_guard lock(shards_mtx_);
+    uint64_t ret = 0;
+    for (const auto& sh : shards_)
+        ret += field(*sh).load(std::memory_order_relaxed);
+    return ret;
+}
+
+uint64_t Metrics::Requests(Verb verb, unsigned status) const
+{
+    if (status < Status_Min || status > Status_Max)
+        return 0;
+    return sum([&](const Shard& sh) -> auto& {
+        return sh.requests[static_cast<size_t>(verb)][status - Status_Min];
+    });
+}
+
+uint64_t Metrics::BytesWritten() const
+{
+    return sum([](const Shard& sh) -> auto& { return sh.bytes_written; });
+}
+
+int64_t Metrics::OpenConnections() const
+{
+    return static_cast<int64_t>(sum([](const Shard& sh) -> auto& { return sh.conns_opened; })) -
+           static_cast<int64_t>(sum([](const Shard& sh) -> auto& { return sh.conns_closed; }));
+}
+
+std::string Metrics::Render(const std::vector<Gauge>& gauges) const
+{
+    // Totals first, each shard read once under the lock
+    std::array<std::array<uint64_t, Status_Max - Status_Min + 1>, Verb_Count> requests{};
+    std::array<std::array<std::array<uint64_t, Latency_Buckets.size() + 2>, Class_Count>, Verb_Count> latency{};
+    std::array<uint64_t, Latency_Buckets.size() + 2> loop_lag{};
+    uint64_t bytes_written = 0, checksum_ns = 0, opened = 0, closed = 0;
+    // The buckets of a histogram followed by its sum
+    auto total = [](auto& out, const Histogram& hist) {
+        for (size_t b = 0; b < hist.buckets.size(); ++b)
+            out[b] += hist.buckets[b].load(std::memory_order_relaxed);
+        out.back() += hist.sum_ns.load(std::memory_order_relaxed);
+    };
+    {
+        std::lock_guard lock(shards_mtx_);
+        for (const auto& sh : shards_)
+        {
+            for (size_t v = 0; v < Verb_Count; ++v)
+            {
+                for (size_t s = 0; s < requests[v].size(); ++s)
+                    requests[v][s] += sh->requests[v][s].load(std::memory_order_relaxed);
+                for (size_t c = 0; c < Class_Count; ++c)
+                    total(latency[v][c], sh->latency[v][c]);
+            }
+            total(loop_lag, sh->loop_lag);
+            bytes_written += sh->bytes_written.load(std::memory_order_relaxed);
+            checksum_ns += sh->checksum_ns.load(std::memory_order_relaxed);
+            opened += sh->conns_opened.load(std::memory_order_relaxed);
+            closed += sh->conns_closed.load(std::memory_order_relaxed);
+        }
+    }
+
+    std::ostringstream os;
+    os.precision(9);
+    auto header = [&os](const char* name, const char* type, const char* help) {
+        os << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
+    };
+    // Cumulative buckets, then _sum and _count; labels end with a comma
+    auto histogram = [&os](const char* name, const std::string& labels, const auto& hist) {
+        uint64_t cnt = 0;
+        for (size_t b = 0; b < Latency_Buckets.size(); ++b)
+        {
+            cnt += hist[b];
+            os << name << "_bucket{" << labels << "le=\"" << Latency_Buckets[b] << "\"} " << cnt << '\n';
+        }
+        cnt += hist[Latency_Buckets.size()];
+        os << name << "_bucket{" << labels << "le=\"+Inf\"} " << cnt << '\n';
+        const auto trimmed = labels.empty() ? labels : "{" + labels.substr(0, labels.size() - 1) + "}";
+        os << name << "_sum" << trimmed << ' ' << Seconds(hist.back()) << '\n';
+        os << name << "_count" << trimmed << ' ' << cnt << '\n';
+    };
+
+    header("betus_requests_total", "counter", "Requests answered, by method and status.");
+    for (size_t v = 0; v < Verb_Count; ++v)
+        for (size_t s = 0; s < requests[v].size(); ++s)
+            if (requests[v][s] > 0)
+                os << "betus_requests_total{method=\"" << Verb_Names[v] << "\",status=\""
+                   << s + Status_Min << "\"} " << requests[v][s] << '\n';
+
+    header("betus_request_duration_seconds", "histogram",
+           "Time from the request headers to the end of the response, by method and status class.");
+    for (size_t v = 0; v < Verb_Count; ++v)
+        for (size_t c = 0; c < Class_Count; ++c)
+        {
+            uint64_t cnt = 0;
+            for (size_t b = 0; b <= Latency_Buckets.size(); ++b)
+                cnt += latency[v][c][b];
+            if (cnt > 0)
+                histogram("betus_request_duration_seconds",
+                          std::string("method=\"") + Verb_Names[v] + "\",code=\"" + Class_Names[c] + "\",",
+                          latency[v][c]);
+        }
+
+    header("betus_upload_bytes_written_total", "counter", "Upload body bytes written to data files.");
+    os << "betus_upload_bytes_written_total " << bytes_written << '\n';
+    header("betus_checksum_seconds_total", "counter", "Time spent computing Upload-Checksum digests.");
+    os << "betus_checksum_seconds_total " << Seconds(checksum_ns) << '\n';
+    header("betus_connections_open", "gauge", "Client connections currently open.");
+    os << "betus_connections_open " << static_cast<int64_t>(opened - closed) << '\n';
+    header("betus_event_loop_lag_seconds", "histogram", "How late event loop timers fired.");
+    histogram("betus_event_loop_lag_seconds", "", loop_lag);
+
+    for (const auto& g : gauges)
+    {
+        header(g.name.c_str(), "gauge", g.help.c_str());
+        os << g.name << ' ' << g.value << '\n';
+    }
+    return os.str();
+}
+
+} // namespace tus
@@ -1,15 +1,21 @@
-#include <boost/beast/core.hpp>
-#include <boost/beast/http.hpp>
-#include <boost/beast/version.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/signal_set.hpp>
 
+#include <unistd.h>
+
+#include "include/http_server.hpp"
+#include "include/trace.hpp"
 #include "include/tus_manager.hpp"
 
+#include <algorithm>
 #include <chrono>
+#include <cstdlib>
+#include <functional>
 #include <iostream>
-#include <memory>
+#include <string_view>
+#include <thread>
+#include <vector>
 
-namespace beast = boost::beast;
-namespace http = beast::http;
 namespace asio = boost::asio;
 using tcp = asio::ip::tcp;
 
@@ -19,94 +25,25 @@ namespace tus
 static FilesManager fm("files");
 static TusManager tus_(fm);
 
-
-class HttpConnection : public std::enable_shared_from_this<HttpConnection>
-{
-    tcp::socket socket_;
-    asio::steady_timer deadline_;
-    beast::flat_buffer buffer_{4096};
-
-    http::request<http::dynamic_body> request_;
-    http::response<http::dynamic_body> response_;
-
-public:
-    HttpConnection(tcp::socket socket)
-        : socket_(std::move(socket)), deadline_{socket_.get_executor(), std::chrono::seconds(60)}
-    {
-    }
-
-    void handle_request()
-    {
-        auto self = shared_from_this();
-
-        read_reply_request_async(self);
-        set_socket_timeout(self);
-    }
-
-private:
-    void read_reply_request_async(const std::shared_ptr<HttpConnection>& self)
-    {
-        http::async_read( socket_, buffer_, request_,
-                          [this, self](beast::error_code ec, std::size_t bytes_transferred)
-        {
-            boost::ignore_unused(bytes_transferred);
-            if (!ec)
-            {
-                response_ = tus_.MakeResponse(request_);
-                write_response_async(self);
-            }
-        });
-    }
-
-    void write_response_async(const std::shared_ptr<HttpConnection>& self)
-    {
-        http::async_write( socket_, response_,
-                           [this, self](beast::error_code ec, std::size_t)
-        {
-            if (!ec)
-            {
-                socket_.shutdown(tcp::socket::shutdown_send, ec);
-                deadline_.cancel();
-            }
-        });
-    }
-
-    void set_socket_timeout(const std::shared_ptr<HttpConnection>& self)
-    {
-        deadline_.async_wait(
-            [this, self](beast::error_code ec)
-        {
-            if (!ec)
-            {
-                socket_.close(ec);
-            }
-        });
-    }
-};
-
-void http_server(tcp::acceptor& acceptor, tcp::socket& socket)
-{
-    acceptor.async_accept(socket,
-                          [&acceptor, &socket](beast::error_code ec)
-    {
-        if (!ec)
-            std::make_shared<HttpConnection>(std::move(socket))->handle_request();
-        else
-            std::cerr << "Error while async_accept on acceptor: " << ec.message() << '\n';
-        http_server(acceptor, socket);
-    });
-}
 } // namespace tus
 
 int main(int argc, char* argv[])
 {
-    if (argc != 3)
+    if (argc < 3 || argc > 9)
     {
-        std::cerr << "Usage: " << argv[0] << " <address> <port>\n";
+        std::cerr << "Usage: " << argv[0] << " <address> <port> [threads] [quota_bytes] [ttl_seconds] [durability]"
+                     " [client_rate] [total_rate]\n";
         std::cerr << "  For IPv4, try:\n";
         std::cerr << "    receiver 0.0.0.0 80\n";
         std::cerr << "  For IPv6, try:\n";
         std::cerr << "    receiver 0::0 80\n";
+        std::cerr << "  threads defaults to the number of hardware threads\n";
+        std::cerr << "  quota_bytes caps the space reserved by all uploads, 0 (default) for no cap\n";
+        std::cerr << "  ttl_seconds removes uploads not written to for that long, 0 (default) keeps them\n";
+        std::cerr << "  durability is none (default), sync to fdatasync every commit, or group to sync\n"
+                     "    the commits of concurrent uploads together\n";
+        std::cerr << "  client_rate caps the upload bytes per second of each client address, total_rate\n"
+                     "    of all of them, shared fairly among the clients; 0 (default) for no cap\n";
 
         return EXIT_FAILURE;
     }
@@ -115,14 +52,101 @@ int main(int argc, char* argv[])
     {
         auto const address = asio::ip::make_address(argv[1]);
         unsigned short port = static_cast<unsigned short>(std::atoi(argv[2]));
+        const int threads = argc >= 4 ? std::max(1, std::atoi(argv[3]))
+                                      : std::max(1u, std::thread::hardware_concurrency());
+        if (argc >= 5)
+            tus::fm.SetQuota(std::strtoull(argv[4], nullptr, 10));
+        if (argc >= 6)
+            tus::fm.SetTtl(std::chrono::seconds(std::strtoll(argv[5], nullptr, 10)));
+        if (argc >= 7)
+        {
+            const std::string_view mode = argv[6];
+            if (mode == "sync")
+                tus::fm.SetDurability(tus::Durability::Sync);
+            else if (mode == "group")
+                tus::fm.SetDurability(tus::Durability::Group);
+            else if (mode != "none")
+            {
+                std::cerr << "Unknown durability " << mode << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+
+        const auto rec = tus::fm.Recover(threads);
+        std::cerr << "Recovered " << rec.recovered << " uploads";
+        if (rec.repaired || rec.skipped || rec.imported)
+            std::cerr << " (" << rec.repaired << " repaired, " << rec.skipped << " skipped, "
+                      << rec.imported << " imported from metadata files)";
+        if (rec.torn)
+            std::cerr << ", dropped " << rec.torn << " torn bytes of the journal";
+        std::cerr << (rec.clean ? " from a clean journal" : " checking their data")
+                  << " in " << rec.elapsed.count() / 1000.0 << " ms, " << rec.reserved << " bytes reserved"
+                  << std::endl;
+
+        asio::io_context ioc{threads};
+
+        // After the io_context: storage completions post to its strands, and
+        // the connections they write for live in its handlers
+        auto storage = tus::StorageExecutor::Create();
+        std::cerr << "Storage I/O through "
+                  << (storage->GetBackend() == tus::StorageExecutor::Backend::Uring ? "io_uring" : "a thread pool")
+                  << std::endl;
+
+        tus::HttpServer::Config config;
+        config.splice_uploads = true;
+        if (argc >= 8)
+            config.fair_share.client_rate = std::strtoull(argv[7], nullptr, 10);
+        if (argc >= 9)
+            config.fair_share.total_rate = std::strtoull(argv[8], nullptr, 10);
+        tus::HttpServer server{ioc, {address, port}, tus::tus_, config, *storage};
+        server.Start();
+
+        // With tracing compiled in, SIGUSR1 dumps the spans so far
+        asio::signal_set dump_signal(ioc);
+        std::function<void()> await_dump = [&] {
+            dump_signal.async_wait([&](const boost::system::error_code& ec, int) {
+                if (ec)
+                    return;
+                const auto path = "betus-trace-" + std::to_string(::getpid()) + ".json";
+                std::cerr << (tus::Trace::Dump(path) ? "Trace written to " : "Trace could not be written to ")
+                          << path << std::endl;
+                await_dump();
+            });
+        };
+        if (tus::Trace::Enabled)
+        {
+            dump_signal.add(SIGUSR1);
+            await_dump();
+        }
+
+        asio::signal_set signals(ioc, SIGINT, SIGTERM);
+        signals.async_wait([&](const boost::system::error_code&, int) {
+            server.Stop();
+            dump_signal.cancel();
+            ioc.stop();
+        });
 
-        asio::io_context ioc{1};
-
-        tcp::acceptor acceptor{ioc, {address, port}};
-        tcp::socket socket{ioc};
-        tus::http_server(acceptor, socket);
-
+        std::vector<std::thread> workers;
+        workers.reserve(threads - 1);
+        for (int i = 1; i < threads; ++i)
+            workers.emplace_back([&ioc] { ioc.run(); });
         ioc.run();
+
+        for (auto& w : workers)
+            w.join();
+        // Completes what the stopped connections left to storage, while the
+        // io_context their completions post to is still there
+        storage.reset();
+        // Then the commits they grouped, whose callbacks post to it as well
+        tus::fm.FlushCommits();
+
+        const auto reclaimed = tus::fm.Reclaimed();
+        std::cerr << "Reclaimed " << reclaimed.files << " expired uploads, " << reclaimed.bytes << " bytes"
+                  << std::endl;
+        // Last, with nothing left to commit, so that the clean journal is
+        // as durable as everything it lets the next start skip checking
+        if (!tus::fm.CompactJournal(true))
+            std::cerr << "Journal could not be compacted, next start will check every upload" << std::endl;
     }
     catch (std::exception const& e)
     {
@@ -132,4 +156,3 @@ int main(int argc, char* argv[])
 
     return EXIT_SUCCESS;
 }
-
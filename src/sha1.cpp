@@ -0,0 +1,415 @@
+#include "include/checksum.hpp"
+#include "include/cpu_features.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace tus
+{
+
+namespace
+{
+constexpr uint32_t Sha1_K[4] = {0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6};
+
+inline uint32_t Rotl(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+inline uint32_t Load_Be32(const unsigned char* p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+void Sha1_Blocks_Sw(uint32_t* state, const unsigned char* p, size_t nblocks)
+{
+    for (; nblocks > 0; --nblocks, p += 64)
+    {
+        uint32_t w[16];
+        for (int i = 0; i < 16; ++i)
+            w[i] = Load_Be32(p + 4 * i);
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+        for (int i = 0; i < 80; ++i)
+        {
+            if (i >= 16)
+                w[i % 16] = Rotl(w[(i - 3) % 16] ^ w[(i - 8) % 16] ^ w[(i - 14) % 16] ^ w[i % 16], 1);
+            uint32_t f;
+            if (i < 20)
+                f = (b & c) | (~b & d);
+            else if (i < 40 || i >= 60)
+                f = b ^ c ^ d;
+            else
+                f = (b & c) | (b & d) | (c & d);
+            const uint32_t t = Rotl(a, 5) + f + e + Sha1_K[i / 20] + w[i % 16];
+            e = d; d = c; c = Rotl(b, 30); b = a; a = t;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d; state[4] += e;
+    }
+}
+
+#if defined(__x86_64__)
+// Twenty groups of four rounds; message words M[g % 4] rotate through the
+// groups and E alternates between two registers as sha1nexte requires.
+__attribute__((target("sha,sse4.1,ssse3")))
+void Sha1_Blocks_Ni(uint32_t* state, const unsigned char* p, size_t nblocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0x1B);
+    __m128i e0 = _mm_set_epi32(static_cast<int>(state[4]), 0, 0, 0);
+
+    for (; nblocks > 0; --nblocks, p += 64)
+    {
+        const __m128i abcd_save = abcd;
+        const __m128i e0_save = e0;
+        __m128i e1;
+        __m128i m[4];
+
+#pragma GCC unroll 20
+        for (int g = 0; g < 20; ++g)
+        {
+            if (g < 4)
+                m[g] = _mm_shuffle_epi8(
+                           _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * g)), mask);
+            __m128i& e_cur = g % 2 ? e1 : e0;
+            __m128i& e_next = g % 2 ? e0 : e1;
+            if (g == 0)
+                e_cur = _mm_add_epi32(e_cur, m[0]);
+            else
+                e_cur = _mm_sha1nexte_epu32(e_cur, m[g % 4]);
+            e_next = abcd;
+            if (g >= 3 && g <= 18)
+                m[(g + 1) % 4] = _mm_sha1msg2_epu32(m[(g + 1) % 4], m[g % 4]);
+            switch (g / 5)
+            {
+            case 0: abcd = _mm_sha1rnds4_epu32(abcd, e_cur, 0); break;
+            case 1: abcd = _mm_sha1rnds4_epu32(abcd, e_cur, 1); break;
+            case 2: abcd = _mm_sha1rnds4_epu32(abcd, e_cur, 2); break;
+            default: abcd = _mm_sha1rnds4_epu32(abcd, e_cur, 3); break;
+            }
+            if (g >= 1 && g <= 16)
+                m[(g - 1) % 4] = _mm_sha1msg1_epu32(m[(g - 1) % 4], m[g % 4]);
+            if (g >= 2 && g <= 17)
+                m[(g + 2) % 4] = _mm_xor_si128(m[(g + 2) % 4], m[g % 4]);
+        }
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = static_cast<uint32_t>(_mm_extract_epi32(e0, 3));
+}
+
+template <int N>
+__attribute__((target("avx2"), always_inline))
+inline __m256i Rotl_X8(__m256i x)
+{
+    return _mm256_or_si256(_mm256_slli_epi32(x, N), _mm256_srli_epi32(x, 32 - N));
+}
+
+// Eight 32 byte rows, one per lane, become eight vectors of word i
+__attribute__((target("avx2"), always_inline))
+inline void Transpose_8x8(__m256i* r)
+{
+    __m256i t[8], u[8];
+    for (int i = 0; i < 8; i += 2)
+    {
+        t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+    }
+    for (int i = 0; i < 8; i += 4)
+    {
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+    for (int i = 0; i < 4; ++i)
+    {
+        r[i] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+        r[i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+    }
+}
+
+// Eight independent streams, one per 32 bit lane. Lane i compresses
+// nblocks blocks from data[i] into states[i]; a lane whose advance is 0
+// keeps re-reading the same block, for padding out a partial group.
+__attribute__((target("avx2")))
+void Sha1_Blocks_X8(uint32_t* const* states, const unsigned char* const* data,
+                    const size_t* advance, size_t nblocks)
+{
+    const __m256i bswap = _mm256_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL,
+                                            0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m256i h[5];
+    for (int j = 0; j < 5; ++j)
+        h[j] = _mm256_set_epi32(states[7][j], states[6][j], states[5][j], states[4][j],
+                                states[3][j], states[2][j], states[1][j], states[0][j]);
+
+    const unsigned char* p[8];
+    std::copy(data, data + 8, p);
+    for (; nblocks > 0; --nblocks)
+    {
+        __m256i w[16];
+        for (int half = 0; half < 2; ++half)
+        {
+            for (int i = 0; i < 8; ++i)
+                w[8 * half + i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p[i] + 32 * half));
+            Transpose_8x8(w + 8 * half);
+        }
+        for (int i = 0; i < 16; ++i)
+            w[i] = _mm256_shuffle_epi8(w[i], bswap);
+
+        __m256i a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+#pragma GCC unroll 80
+        for (int i = 0; i < 80; ++i)
+        {
+            if (i >= 16)
+                w[i % 16] = Rotl_X8<1>(_mm256_xor_si256(
+                                _mm256_xor_si256(w[(i - 3) % 16], w[(i - 8) % 16]),
+                                _mm256_xor_si256(w[(i - 14) % 16], w[i % 16])));
+            __m256i f;
+            if (i < 20)
+                f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_andnot_si256(b, d));
+            else if (i < 40 || i >= 60)
+                f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+            else
+                f = _mm256_or_si256(_mm256_and_si256(b, c),
+                                    _mm256_and_si256(d, _mm256_or_si256(b, c)));
+            const __m256i t = _mm256_add_epi32(
+                                  _mm256_add_epi32(Rotl_X8<5>(a), f),
+                                  _mm256_add_epi32(_mm256_add_epi32(e, w[i % 16]),
+                                                   _mm256_set1_epi32(static_cast<int>(Sha1_K[i / 20]))));
+            e = d; d = c; c = Rotl_X8<30>(b); b = a; a = t;
+        }
+        h[0] = _mm256_add_epi32(h[0], a);
+        h[1] = _mm256_add_epi32(h[1], b);
+        h[2] = _mm256_add_epi32(h[2], c);
+        h[3] = _mm256_add_epi32(h[3], d);
+        h[4] = _mm256_add_epi32(h[4], e);
+
+        for (int i = 0; i < 8; ++i)
+            p[i] += advance[i];
+    }
+
+    alignas(32) uint32_t out[5][8];
+    for (int j = 0; j < 5; ++j)
+        _mm256_store_si256(reinterpret_cast<__m256i*>(out[j]), h[j]);
+    for (int i = 0; i < 8; ++i)
+        for (int j = 0; j < 5; ++j)
+            states[i][j] = out[j][i];
+}
+#endif
+
+bool Avx2_Supported()
+{
+#if defined(__x86_64__)
+    return CpuFeatures::Get().avx2;
+#else
+    return false;
+#endif
+}
+
+bool Sha_Ni_Supported()
+{
+#if defined(__x86_64__)
+    const auto& cpu = CpuFeatures::Get();
+    return cpu.sha && cpu.sse41 && cpu.ssse3;
+#else
+    return false;
+#endif
+}
+} // namespace
+
+bool Sha1::Supported(Kernel kernel)
+{
+    switch (kernel)
+    {
+    case Kernel::Scalar:
+        return true;
+    case Kernel::ShaNi:
+        return Sha_Ni_Supported();
+    case Kernel::Avx2x8:
+        return Avx2_Supported();
+    }
+    return false;
+}
+
+Sha1::Kernel Sha1::Fastest()
+{
+    static const Kernel kernel = Supported(Kernel::ShaNi) ? Kernel::ShaNi : Kernel::Scalar;
+    return kernel;
+}
+
+Sha1::Kernel Sha1::FastestMany()
+{
+    static const Kernel kernel = Supported(Kernel::Avx2x8) ? Kernel::Avx2x8 :
+                                 Supported(Kernel::ShaNi)  ? Kernel::ShaNi  : Kernel::Scalar;
+    return kernel;
+}
+
+Sha1::Sha1(Kernel kernel)
+    : kernel_(Supported(kernel) ? kernel : Kernel::Scalar),
+      state_{0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0}
+{
+}
+
+void Sha1::compress(const unsigned char* p, size_t nblocks)
+{
+    switch (kernel_)
+    {
+#if defined(__x86_64__)
+    case Kernel::ShaNi:
+        return Sha1_Blocks_Ni(state_.data(), p, nblocks);
+    case Kernel::Avx2x8:
+    {   // a lone stream occupies every lane, only the first is kept
+        uint32_t scratch[7][5];
+        uint32_t* states[8] = {state_.data()};
+        const unsigned char* data[8];
+        size_t advance[8] = {64};
+        for (int i = 1; i < 8; ++i)
+            states[i] = scratch[i - 1];
+        std::fill(data, data + 8, p);
+        return Sha1_Blocks_X8(states, data, advance, nblocks);
+    }
+#endif
+    default:
+        return Sha1_Blocks_Sw(state_.data(), p, nblocks);
+    }
+}
+
+void Sha1::Update(const void* data, size_t size)
+{
+    auto p = static_cast<const unsigned char*>(data);
+    total_len_ += size;
+
+    if (block_len_ > 0)
+    {
+        const auto n = std::min(size, block_.size() - block_len_);
+        memcpy(block_.data() + block_len_, p, n);
+        block_len_ += n;
+        p += n;
+        size -= n;
+        if (block_len_ < block_.size())
+            return;
+        compress(block_.data(), 1);
+        block_len_ = 0;
+    }
+    if (size >= 64)
+    {
+        compress(p, size / 64);
+        p += size & ~size_t(63);
+        size &= 63;
+    }
+    memcpy(block_.data(), p, size);
+    block_len_ = size;
+}
+
+void Sha1::UpdateMany(Sha1* const* hashers, const std::string_view* pieces, size_t n)
+{
+    struct Lane
+    {
+        Sha1* hasher;
+        const unsigned char* p;
+        size_t size;
+    };
+    std::vector<Lane> lanes;
+    for (size_t i = 0; i < n; ++i)
+    {
+        auto& h = *hashers[i];
+        auto p = reinterpret_cast<const unsigned char*>(pieces[i].data());
+        auto size = pieces[i].size();
+        if (h.kernel_ != Kernel::Avx2x8)
+        {
+            h.Update(p, size);
+            continue;
+        }
+        // Top up the pending partial block first so that the remaining
+        // whole blocks can be read in place
+        if (h.block_len_ > 0)
+        {
+            const auto fill = std::min(size, h.block_.size() - h.block_len_);
+            h.Update(p, fill);
+            p += fill;
+            size -= fill;
+        }
+        if (size >= 64)
+            lanes.push_back({&h, p, size});
+        else
+            h.Update(p, size);
+    }
+
+#if defined(__x86_64__)
+    static const unsigned char idle_block[64] = {};
+    uint32_t idle_states[8][5];
+    for (size_t first = 0; first + 1 < lanes.size(); first += 8)
+    {
+        const size_t cnt = std::min<size_t>(8, lanes.size() - first);
+        Lane* group = lanes.data() + first;
+        while (true)
+        {
+            // Lockstep over the blocks every still busy lane has left
+            size_t busy = 0, nblocks = SIZE_MAX;
+            for (size_t i = 0; i < cnt; ++i)
+                if (group[i].size >= 64)
+                {
+                    ++busy;
+                    nblocks = std::min(nblocks, group[i].size / 64);
+                }
+            if (busy < 2)
+                break;
+
+            uint32_t* states[8];
+            const unsigned char* data[8];
+            size_t advance[8];
+            for (size_t i = 0; i < 8; ++i)
+            {
+                if (i < cnt && group[i].size >= 64)
+                {
+                    states[i] = group[i].hasher->state_.data();
+                    data[i] = group[i].p;
+                    advance[i] = 64;
+                }
+                else
+                {
+                    states[i] = idle_states[i];
+                    data[i] = idle_block;
+                    advance[i] = 0;
+                }
+            }
+            Sha1_Blocks_X8(states, data, advance, nblocks);
+            for (size_t i = 0; i < cnt; ++i)
+                if (group[i].size >= 64)
+                {
+                    group[i].p += 64 * nblocks;
+                    group[i].size -= 64 * nblocks;
+                    group[i].hasher->total_len_ += 64 * nblocks;
+                }
+        }
+    }
+#endif
+    for (auto& lane : lanes)
+        lane.hasher->Update(lane.p, lane.size);
+}
+
+std::string Sha1::Digest()
+{
+    const uint64_t bits = total_len_ * 8;
+    unsigned char pad[72] = {0x80};
+    const size_t padlen = (block_len_ < 56 ? 56 : 120) - block_len_;
+    for (int i = 0; i < 8; ++i)
+        pad[padlen + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+    Update(pad, padlen + 8);
+
+    std::string ret(20, '\0');
+    for (int i = 0; i < 5; ++i)
+        for (int j = 0; j < 4; ++j)
+            ret[4 * i + j] = static_cast<char>(state_[i] >> (24 - 8 * j));
+    return ret;
+}
+
+} // namespace tus
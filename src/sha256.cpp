@@ -0,0 +1,177 @@
+#include "include/checksum.hpp"
+#include "include/cpu_features.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace tus
+{
+
+namespace
+{
+alignas(16) constexpr uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+inline uint32_t Rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+inline uint32_t Load_Be32(const unsigned char* p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+void Sha256_Blocks_Sw(uint32_t* state, const unsigned char* p, size_t nblocks)
+{
+    for (; nblocks > 0; --nblocks, p += 64)
+    {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+            w[i] = Load_Be32(p + 4 * i);
+        for (int i = 16; i < 64; ++i)
+        {
+            const uint32_t s0 = Rotr(w[i - 15], 7) ^ Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const uint32_t s1 = Rotr(w[i - 2], 17) ^ Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i)
+        {
+            const uint32_t t1 = h + (Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25)) +
+                                ((e & f) ^ (~e & g)) + K[i] + w[i];
+            const uint32_t t2 = (Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22)) +
+                                ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#if defined(__x86_64__)
+// Four rounds per group; message words W[g % 4] rotate through the groups
+__attribute__((target("sha,sse4.1,ssse3")))
+void Sha256_Blocks_Ni(uint32_t* state, const unsigned char* p, size_t nblocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state));
+    __m128i state1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4));
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);                 // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1B);           // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);   // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);        // CDGH
+
+    for (; nblocks > 0; --nblocks, p += 64)
+    {
+        const __m128i abef_save = state0;
+        const __m128i cdgh_save = state1;
+        __m128i w[4];
+
+#pragma GCC unroll 16
+        for (int g = 0; g < 16; ++g)
+        {
+            if (g < 4)
+                w[g] = _mm_shuffle_epi8(
+                           _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16 * g)), mask);
+            __m128i msg = _mm_add_epi32(w[g % 4],
+                                        _mm_load_si128(reinterpret_cast<const __m128i*>(K + 4 * g)));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            if (g >= 3 && g <= 14)
+            {
+                const __m128i t = _mm_alignr_epi8(w[g % 4], w[(g + 3) % 4], 4);
+                w[(g + 1) % 4] = _mm_sha256msg2_epu32(_mm_add_epi32(w[(g + 1) % 4], t), w[g % 4]);
+            }
+            msg = _mm_shuffle_epi32(msg, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+            if (g >= 1 && g <= 12)
+                w[(g + 3) % 4] = _mm_sha256msg1_epu32(w[(g + 3) % 4], w[g % 4]);
+        }
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);              // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);           // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);        // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);           // HGFE
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state), state0);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), state1);
+}
+#endif
+
+void Sha256_Blocks(uint32_t* state, const unsigned char* p, size_t nblocks)
+{
+#if defined(__x86_64__)
+    static const bool use_ni = CpuFeatures::Get().sha && CpuFeatures::Get().sse41 &&
+                               CpuFeatures::Get().ssse3;
+    if (use_ni)
+        return Sha256_Blocks_Ni(state, p, nblocks);
+#endif
+    Sha256_Blocks_Sw(state, p, nblocks);
+}
+} // namespace
+
+Sha256::Sha256()
+    : state_{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+             0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19}
+{
+}
+
+void Sha256::Update(const void* data, size_t size)
+{
+    auto p = static_cast<const unsigned char*>(data);
+    total_len_ += size;
+
+    if (block_len_ > 0)
+    {
+        const auto n = std::min(size, block_.size() - block_len_);
+        memcpy(block_.data() + block_len_, p, n);
+        block_len_ += n;
+        p += n;
+        size -= n;
+        if (block_len_ < block_.size())
+            return;
+        Sha256_Blocks(state_.data(), block_.data(), 1);
+        block_len_ = 0;
+    }
+    if (size >= 64)
+    {
+        Sha256_Blocks(state_.data(), p, size / 64);
+        p += size & ~size_t(63);
+        size &= 63;
+    }
+    memcpy(block_.data(), p, size);
+    block_len_ = size;
+}
+
+std::string Sha256::Digest()
+{
+    const uint64_t bits = total_len_ * 8;
+    unsigned char pad[72] = {0x80};
+    const size_t padlen = (block_len_ < 56 ? 56 : 120) - block_len_;
+    for (int i = 0; i < 8; ++i)
+        pad[padlen + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+    Update(pad, padlen + 8);
+
+    std::string ret(32, '\0');
+    for (int i = 0; i < 8; ++i)
+        for (int j = 0; j < 4; ++j)
+            ret[4 * i + j] = static_cast<char>(state_[i] >> (24 - 8 * j));
+    return ret;
+}
+
+} // namespace tus
@@ -0,0 +1,365 @@
+#include "include/storage_executor.hpp"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace tus
+{
+
+namespace
+{
+ssize_t Pwrite_All(int fd, const void* data, size_t size, off_t offset)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        const auto n = ::pwrite(fd, static_cast<const char*>(data) + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -errno;
+        if (n == 0)
+            return -EIO;
+        done += n;
+    }
+    return done;
+}
+
+class ThreadPoolStorage : public StorageExecutor
+{
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> jobs_;
+    bool stopping_ = false;
+    std::vector<std::thread> threads_;
+
+public:
+    explicit ThreadPoolStorage(unsigned threads)
+    {
+        for (unsigned i = 0; i < std::max(1u, threads); ++i)
+            threads_.emplace_back([this] { work(); });
+    }
+
+    ~ThreadPoolStorage() override
+    {
+        {
+            std::lock_guard lock(mtx_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        for (auto& t : threads_)
+            t.join();
+    }
+
+    Backend GetBackend() const override { return Backend::ThreadPool; }
+
+    void Write(int fd, const void* data, size_t size, off_t offset, Completion done) override
+    {
+        Run([fd, data, size, offset, done = std::move(done)] {
+            done(Pwrite_All(fd, data, size, offset));
+        });
+    }
+
+    void Run(std::function<void()> work) override
+    {
+        {
+            std::lock_guard lock(mtx_);
+            jobs_.push_back(std::move(work));
+        }
+        cv_.notify_one();
+    }
+
+private:
+    // Jobs queued before stopping are still run
+    void work()
+    {
+        for (;;)
+        {
+            std::unique_lock lock(mtx_);
+            cv_.wait(lock, [this] { return stopping_ || !jobs_.empty(); });
+            if (jobs_.empty())
+                return;
+            auto job = std::move(jobs_.front());
+            jobs_.pop_front();
+            lock.unlock();
+            job();
+        }
+    }
+};
+
+int Io_Uring_Setup(unsigned entries, io_uring_params* params)
+{
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+int Io_Uring_Enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    int ret;
+    do
+        ret = static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                                         nullptr, 0));
+    while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+// Writes go through a submission ring shared by all network threads; one
+// reaper thread waits for completions, resubmits the rest of short writes
+// and calls the completions. Submissions beyond what the completion ring
+// holds wait in a backlog, so nothing is ever dropped.
+class UringStorage : public StorageExecutor
+{
+    struct Op
+    {
+        int fd;
+        const char* data;
+        size_t size;
+        off_t offset;
+        size_t done;
+        Completion complete;
+    };
+
+    int ring_fd_ = -1;
+    void* ring_ = MAP_FAILED;
+    size_t ring_sz_ = 0;
+    io_uring_sqe* sqes_ = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqes_sz_ = 0;
+
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned sq_mask_;
+    unsigned sq_entries_;
+    unsigned* sq_array_;
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned cq_mask_;
+    unsigned cq_entries_;
+    io_uring_cqe* cqes_;
+
+    std::mutex mtx_;
+    size_t inflight_ = 0;
+    std::deque<Op*> backlog_;
+    bool stopping_ = false;
+    std::thread reaper_;
+
+    std::unique_ptr<ThreadPoolStorage> pool_;
+
+public:
+    explicit UringStorage(unsigned threads) : pool_(std::make_unique<ThreadPoolStorage>(threads)) {}
+
+    ~UringStorage() override
+    {
+        // Queued work may still write
+        pool_.reset();
+        if (reaper_.joinable())
+        {
+            // The reaper leaves once this no-op and everything before it
+            // completed
+            unsigned pushed;
+            {
+                std::lock_guard lock(mtx_);
+                stopping_ = true;
+                pushed = queue(nullptr);
+            }
+            enter(pushed);
+            reaper_.join();
+        }
+        unmap();
+    }
+
+    bool Setup(unsigned entries)
+    {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        ring_fd_ = Io_Uring_Setup(entries, &params);
+        if (ring_fd_ < 0)
+            return false;
+        // Single mmap for both rings came with 5.4, IORING_OP_WRITE with
+        // the current-position feature in 5.6
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_RW_CUR_POS))
+            return false;
+
+        ring_sz_ = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        ring_ = ::mmap(nullptr, ring_sz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd_, IORING_OFF_SQ_RING);
+        if (ring_ == MAP_FAILED)
+            return false;
+        sqes_sz_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe*>(::mmap(nullptr, sqes_sz_, PROT_READ | PROT_WRITE,
+                                                  MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+        if (sqes_ == MAP_FAILED)
+            return false;
+
+        auto at = [this](unsigned off) { return reinterpret_cast<unsigned*>(static_cast<char*>(ring_) + off); };
+        sq_head_ = at(params.sq_off.head);
+        sq_tail_ = at(params.sq_off.tail);
+        sq_mask_ = *at(params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        sq_array_ = at(params.sq_off.array);
+        cq_head_ = at(params.cq_off.head);
+        cq_tail_ = at(params.cq_off.tail);
+        cq_mask_ = *at(params.cq_off.ring_mask);
+        cq_entries_ = params.cq_entries;
+        cqes_ = reinterpret_cast<io_uring_cqe*>(at(params.cq_off.cqes));
+
+        reaper_ = std::thread([this] { reap(); });
+        return true;
+    }
+
+    Backend GetBackend() const override { return Backend::Uring; }
+
+    void Write(int fd, const void* data, size_t size, off_t offset, Completion done) override
+    {
+        auto op = new Op{fd, static_cast<const char*>(data), size, offset, 0, std::move(done)};
+        unsigned pushed;
+        {
+            std::lock_guard lock(mtx_);
+            pushed = queue(op);
+        }
+        enter(pushed);
+    }
+
+    void Run(std::function<void()> work) override
+    {
+        pool_->Run(std::move(work));
+    }
+
+private:
+    // Puts op in the submission ring, or in the backlog behind the others;
+    // returns the number of entries that went to the ring. mtx_ is held,
+    // nullptr is the no-op that wakes the reaper up.
+    unsigned queue(Op* op)
+    {
+        if (backlog_.empty() && push(op))
+            return 1;
+        backlog_.push_back(op);
+        return 0;
+    }
+
+    // False if either ring is full: the submission ring until the entries
+    // in it are entered, the completion ring until the reaper catches up
+    bool push(Op* op)
+    {
+        const unsigned tail = *sq_tail_;
+        if (inflight_ >= cq_entries_ || tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+            return false;
+
+        const unsigned idx = tail & sq_mask_;
+        io_uring_sqe& sqe = sqes_[idx];
+        std::memset(&sqe, 0, sizeof(sqe));
+        if (op)
+        {
+            sqe.opcode = IORING_OP_WRITE;
+            sqe.fd = op->fd;
+            sqe.addr = reinterpret_cast<uint64_t>(op->data + op->done);
+            sqe.len = static_cast<uint32_t>(std::min<size_t>(op->size - op->done, 1u << 30));
+            sqe.off = op->offset + op->done;
+        }
+        else
+            sqe.opcode = IORING_OP_NOP;
+        sqe.user_data = reinterpret_cast<uint64_t>(op);
+        sq_array_[idx] = idx;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        ++inflight_;
+        return true;
+    }
+
+    // Outside mtx_: a buffered write that does not have to wait for the
+    // disk is carried out right in this call
+    void enter(unsigned to_submit)
+    {
+        if (to_submit > 0 && Io_Uring_Enter(ring_fd_, to_submit, 0, 0) < 0)
+            std::cerr << "io_uring_enter failed: " << std::strerror(errno) << std::endl;
+    }
+
+    void reap()
+    {
+        std::vector<std::pair<Op*, int>> done;
+        for (;;)
+        {
+            if (Io_Uring_Enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS) < 0)
+                std::cerr << "io_uring_enter failed: " << std::strerror(errno) << std::endl;
+
+            done.clear();
+            unsigned head = *cq_head_;
+            const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head)
+            {
+                const auto& cqe = cqes_[head & cq_mask_];
+                done.emplace_back(reinterpret_cast<Op*>(cqe.user_data), cqe.res);
+            }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+            std::vector<Op*> resubmit;
+            for (auto [op, res] : done)
+            {
+                if (!op)
+                    continue;
+                if (res > 0 && op->done + res < op->size)
+                {
+                    op->done += res;
+                    resubmit.push_back(op);
+                    continue;
+                }
+                op->complete(res < 0 ? res : res == 0 ? -EIO : static_cast<ssize_t>(op->done + res));
+                delete op;
+            }
+
+            unsigned pushed = 0;
+            {
+                std::lock_guard lock(mtx_);
+                inflight_ -= done.size();
+                for (auto op : resubmit)
+                    pushed += queue(op);
+                for (; !backlog_.empty() && push(backlog_.front()); ++pushed)
+                    backlog_.pop_front();
+                if (stopping_ && inflight_ == 0 && backlog_.empty())
+                    return;
+            }
+            enter(pushed);
+        }
+    }
+
+    void unmap()
+    {
+        if (sqes_ != MAP_FAILED)
+            ::munmap(sqes_, sqes_sz_);
+        if (ring_ != MAP_FAILED)
+            ::munmap(ring_, ring_sz_);
+        if (ring_fd_ >= 0)
+            ::close(ring_fd_);
+    }
+};
+} // namespace
+
+std::unique_ptr<StorageExecutor> StorageExecutor::Create(unsigned threads)
+{
+    if (auto ret = Create(Backend::Uring, threads))
+        return ret;
+    return Create(Backend::ThreadPool, threads);
+}
+
+std::unique_ptr<StorageExecutor> StorageExecutor::Create(Backend backend, unsigned threads)
+{
+    if (backend == Backend::ThreadPool)
+        return std::make_unique<ThreadPoolStorage>(threads);
+
+    auto ret = std::make_unique<UringStorage>(threads);
+    if (!ret->Setup(256))
+        return nullptr;
+    return ret;
+}
+
+} // namespace tus
@@ -0,0 +1,150 @@
+#include "include/trace.hpp"
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace tus
+{
+
+namespace
+{
+// A thread's spans; only that thread writes, readers copy the slots and
+// then check how far the writer went meanwhile
+struct Ring
+{
+    struct Slot
+    {
+        std::atomic<const char*> name{nullptr};
+        std::atomic<uint64_t> request{0};
+        std::atomic<int64_t> begin_ns{0};
+        std::atomic<int64_t> dur_ns{0};
+    };
+
+    explicit Ring(unsigned thread) : tid(thread) {}
+
+    const unsigned tid;
+    std::array<Slot, Trace::Ring_Size> slots;
+    // Spans ever recorded; the last Ring_Size of them are in slots
+    std::atomic<uint64_t> head{0};
+};
+
+std::atomic<uint64_t> Next_Request{1};
+
+std::mutex Rings_Mtx;
+// Kept after their thread exits, so that its spans can still be dumped
+std::vector<std::unique_ptr<Ring>> Rings;
+
+thread_local Ring* Local_Ring = nullptr;
+
+Ring& Local()
+{
+    if (!Local_Ring)
+    {
+        std::lock_guard lock(Rings_Mtx);
+        Rings.push_back(std::make_unique<Ring>(static_cast<unsigned>(Rings.size() + 1)));
+        Local_Ring = Rings.back().get();
+    }
+    return *Local_Ring;
+}
+
+struct Event
+{
+    const char* name;
+    uint64_t request;
+    int64_t begin_ns;
+    int64_t dur_ns;
+};
+} // namespace
+
+thread_local uint64_t Trace::current_ = 0;
+
+uint64_t Trace::NewRequest()
+{
+    return Next_Request.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Trace::Record(const char* name, Clock::time_point begin, Clock::time_point end)
+{
+    auto& ring = Local();
+    const auto i = ring.head.load(std::memory_order_relaxed);
+    auto& slot = ring.slots[i % Ring_Size];
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.request.store(current_, std::memory_order_relaxed);
+    slot.begin_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(begin.time_since_epoch()).count(),
+                        std::memory_order_relaxed);
+    slot.dur_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count(),
+                      std::memory_order_relaxed);
+    ring.head.store(i + 1, std::memory_order_release);
+}
+
+std::string Trace::ChromeJson()
+{
+    std::string ret = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    const auto pid = ::getpid();
+    bool first = true;
+    char line[256];
+
+    std::lock_guard lock(Rings_Mtx);
+    std::vector<Event> events;
+    for (const auto& ring : Rings)
+    {
+        const auto end = ring->head.load(std::memory_order_acquire);
+        const auto begin = end > Ring_Size ? end - Ring_Size : 0;
+        events.clear();
+        for (auto i = begin; i < end; ++i)
+        {
+            const auto& slot = ring->slots[i % Ring_Size];
+            events.push_back({slot.name.load(std::memory_order_relaxed),
+                              slot.request.load(std::memory_order_relaxed),
+                              slot.begin_ns.load(std::memory_order_relaxed),
+                              slot.dur_ns.load(std::memory_order_relaxed)});
+        }
+        // Slots the writer went round to while they were copied are torn
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const auto now = ring->head.load(std::memory_order_relaxed);
+        const auto torn = now > Ring_Size + begin ? now - Ring_Size - begin : 0;
+
+        std::snprintf(line, sizeof(line),
+                      "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,"
+                      "\"args\":{\"name\":\"thread %u\"}}",
+                      first ? "" : ",", static_cast<int>(pid), ring->tid, ring->tid);
+        ret += line;
+        first = false;
+        for (size_t e = torn; e < events.size(); ++e)
+        {
+            const auto& ev = events[e];
+            // Microseconds with the nanoseconds as decimals
+            std::snprintf(line, sizeof(line),
+                          ",{\"name\":\"%s\",\"cat\":\"betus\",\"ph\":\"X\",\"ts\":%lld.%03lld,"
+                          "\"dur\":%lld.%03lld,\"pid\":%d,\"tid\":%u,\"args\":{\"request\":%llu}}",
+                          ev.name, static_cast<long long>(ev.begin_ns / 1000),
+                          static_cast<long long>(ev.begin_ns % 1000), static_cast<long long>(ev.dur_ns / 1000),
+                          static_cast<long long>(ev.dur_ns % 1000), static_cast<int>(pid), ring->tid,
+                          static_cast<unsigned long long>(ev.request));
+            ret += line;
+        }
+    }
+    ret += "]}\n";
+    return ret;
+}
+
+bool Trace::Dump(const std::string& path)
+{
+    std::ofstream out(path, std::ios::trunc);
+    out << ChromeJson();
+    return static_cast<bool>(out.flush());
+}
+
+void Trace::Clear()
+{
+    std::lock_guard lock(Rings_Mtx);
+    for (const auto& ring : Rings)
+        ring->head.store(0, std::memory_order_relaxed);
+}
+
+} // namespace tus
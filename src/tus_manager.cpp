@@ -1,26 +1,33 @@
 #include "include/tus_manager.hpp"
+#include "include/codec.hpp"
+#include "include/metrics.hpp"
 
 #include <boost/asio.hpp>
 #include <boost/beast/http/field.hpp>
 #include <boost/beast/http/fields.hpp>
 #include <boost/beast/http/status.hpp>
 
-#include <boost/archive/iterators/binary_from_base64.hpp>
-#include <boost/archive/iterators/transform_width.hpp>
+#include <sys/sendfile.h>
+#include <unistd.h>
 
+#include <cerrno>
 #include <iostream>
 #include <algorithm>
 #include <charconv>
+#include <chrono>
+#include <ctime>
+#include <future>
 #include <string>
 #include <string_view>
 #include <system_error>
+#include <vector>
 
 namespace http = boost::beast::http;
 
 namespace
 {
 template <typename NumType, typename T>
-auto Parse_Number_From_Req(const http::request<http::dynamic_body>& req, const T& tag)
+auto Parse_Number_From_Req(const http::request_header<>& req, const T& tag)
 {
     auto it = req.find(tag);
     std::pair<bool, NumType> ret(it != req.cend(), static_cast<NumType>(0));
@@ -31,7 +38,7 @@ auto Parse_Number_From_Req(const http::request<http::dynamic_body>& req, const T
 }
 
 template <typename T>
-auto Parse_From_Req(const http::request<http::dynamic_body>& req, const T& tag)
+auto Parse_From_Req(const http::request_header<>& req, const T& tag)
 {
     auto it = req.find(tag);
     std::pair<bool, std::string> ret(it != req.cend(), "");
@@ -40,48 +47,128 @@ auto Parse_From_Req(const http::request<http::dynamic_body>& req, const T& tag)
     return ret;
 }
 
-std::string Base64_To_Bin(const std::string_view &shastr)
+// Same rules as message::keep_alive(), which plain headers do not offer
+bool Keep_Alive(const http::request_header<>& req)
 {
-    namespace ar_iters = boost::archive::iterators;
-    using ItBinaryT = ar_iters::transform_width<
-                        ar_iters::binary_from_base64<std::string::const_iterator>,
-                        8, 6>;
+    const auto it = req.find(http::field::connection);
+    if (it == req.cend())
+        return req.version() >= 11;
+    http::token_list tokens(it->value());
+    if (req.version() < 11)
+        return tokens.exists("keep-alive");
+    return !tokens.exists("close");
+}
 
-    std::string input(std::begin(shastr), std::end(shastr));
-    std::string output;
-    output.reserve(24);
+// For answers given in place: waits until the commit is durable
+bool Commit_Durably(tus::FileResource& fres)
+{
+    std::promise<bool> durable;
+    auto fut = durable.get_future();
+    fres.Commit([&durable](bool ok) { durable.set_value(ok); });
+    return fut.get();
+}
+}
 
-    size_t pad_chars(std::count(input.begin(), input.end(), '='));
-    std::replace(input.begin(), input.end(), '=', 'A');
-    try
-    {
-        std::copy(ItBinaryT(input.begin()), ItBinaryT(input.end()),
-                  std::back_inserter(output));
-    } catch (std::exception const &) {}
-    output.resize(output.size() - pad_chars);
-    return output;
+namespace tus
+{
+
+UploadStream::UploadStream(FileResource&& fres, const std::string& uuid,
+                           http::verb verb, std::streamoff offset)
+    : fres_(std::move(fres)), uuid_(uuid), verb_(verb), offset_(offset), written_(0), failed_(false),
+      pending_data_(nullptr), pending_size_(0)
+{
 }
 
-bool CheckSum_Match(const std::string_view& hexstr, const std::string_view& b64_bin)
+std::string UploadStream::Metadata() const
 {
-    const char* digits = "0123456789ABCDEF";
-    assert(!(hexstr.size() % 2));
+    return fres_.GetMetadata().comment;
+}
 
-    if (2 * b64_bin.size() != hexstr.size())
+bool UploadStream::Write(const void* data, size_t size)
+{
+    if (failed_)
         return false;
-    for (size_t i = 0; i < hexstr.size(); i += 2)
-    {
-        unsigned char uc = b64_bin[i / 2];
-        if (hexstr[i]   != digits[(uc & 0xf0) >> 4] ||
-            hexstr[i+1] != digits[(uc & 0x0f)])
-            return false;
-    }
-    return true;
+    BETUS_TRACE_SPAN("write");
+    const auto cnt = fres_.Write(offset_ + written_, boost::asio::const_buffer(data, size));
+    if (cnt != size)
+        failed_ = true;
+    digest(data, cnt);
+    written_ += cnt;
+    Metrics::Instance().BytesWritten(cnt);
+    return !failed_;
 }
+
+void UploadStream::digest(const void* data, size_t size)
+{
+    if (!checksum_)
+        return;
+    BETUS_TRACE_SPAN("checksum");
+    const auto start = std::chrono::steady_clock::now();
+    checksum_->Update(data, size);
+    Metrics::Instance().ChecksumTime(std::chrono::steady_clock::now() - start);
 }
 
-namespace tus
+void UploadStream::WriteAsync(StorageExecutor& storage, const void* data, size_t size,
+                              StorageExecutor::Completion done)
 {
+    pending_data_ = data;
+    pending_size_ = size;
+    BETUS_TRACE_MARK(pending_since_);
+    if (failed_)
+        return done(-EIO);
+    if (size == 0)
+        return done(0);
+    fres_.WriteAsync(storage, Offset(), data, size, std::move(done));
+}
+
+bool UploadStream::Written(ssize_t res)
+{
+    BETUS_TRACE_SINCE("write", pending_since_);
+    const size_t cnt = res > 0 ? res : 0;
+    if (failed_ || cnt != pending_size_)
+        failed_ = true;
+    digest(pending_data_, cnt);
+    written_ += cnt;
+    Metrics::Instance().BytesWritten(cnt);
+    pending_data_ = nullptr;
+    pending_size_ = 0;
+    return !failed_;
+}
+
+bool UploadStream::Splice(int pipe_fd, size_t size)
+{
+    if (failed_)
+        return false;
+    BETUS_TRACE_SPAN("splice");
+    const auto cnt = fres_.Splice(pipe_fd, Offset(), size);
+    if (cnt != size)
+        failed_ = true;
+    written_ += cnt;
+    Metrics::Instance().BytesWritten(cnt);
+    return !failed_;
+}
+
+DownloadStream::DownloadStream(int fd, std::streamoff offset, size_t size)
+    : fd_(fd), offset_(offset), left_(size)
+{
+}
+
+DownloadStream::~DownloadStream()
+{
+    ::close(fd_);
+}
+
+ssize_t DownloadStream::SendTo(int sock_fd, size_t max_size)
+{
+    off_t off = offset_;
+    const auto n = ::sendfile(sock_fd, fd_, &off, std::min(left_, max_size));
+    if (n > 0)
+    {
+        offset_ += n;
+        left_ -= n;
+    }
+    return n;
+}
 
 const std::string TusManager::TAG_TUS_RESUMABLE   = "Tus-Resumable";
 const std::string TusManager::TAG_TUS_VERSION     = "Tus-Version";
@@ -92,25 +179,124 @@ const std::string TusManager::TAG_UPLOAD_LENGTH   = "Upload-Length";
 const std::string TusManager::TAG_UPLOAD_METADATA = "Upload-Metadata";
 const std::string TusManager::TAG_UPLOAD_OFFSET   = "Upload-Offset";
 const std::string TusManager::TAG_UPLOAD_CHECKSUM = "Upload-Checksum";
+const std::string TusManager::TAG_UPLOAD_CONCAT   = "Upload-Concat";
+const std::string TusManager::TAG_UPLOAD_EXPIRES  = "Upload-Expires";
 
 const std::string TusManager::TUS_SUPPORTED_VERSION       = "1.0.0";
 const std::string TusManager::TUS_SUPPORTED_VERSIONS      = "1.0.0";
-const std::string TusManager::TUS_SUPPORTED_EXTENSIONS    = "creation,creation-with-upload,terminate,checksum";
-const std::string TusManager::TUS_SUPPORTED_CHECKSUM      = "sha1";
-const std::string TusManager::TUS_SUPPORTED_CHECKSUMS     = "sha1";
-const std::string TusManager::TUS_SUPPORTED_MAXSZ         = "1073741824";
+const std::string TusManager::TUS_SUPPORTED_EXTENSIONS    = "creation,creation-with-upload,terminate,checksum,concatenation,expiration";
+const size_t Max_Upload_Size = 1073741824;
+const std::string TusManager::TUS_SUPPORTED_MAXSZ         = std::to_string(Max_Upload_Size);
 const std::string TusManager::PATCH_EXPECTED_CONTENT_TYPE = "application/offset+octet-stream";
 
 const unsigned Http_Status_Checksum_Mismatch = 460;
 
+namespace
+{
+const std::string Concat_Partial = "partial";
+const std::string Concat_Final_Prefix = "final;";
+
+// RFC 7231 IMF-fixdate, as Upload-Expires wants it
+std::string Http_Date(std::chrono::system_clock::time_point tp)
+{
+    const auto t = std::chrono::system_clock::to_time_t(tp);
+    std::tm tm;
+    gmtime_r(&t, &tm);
+    char buf[32];
+    return std::string(buf, std::strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm));
+}
+
+// Upload-Concat of a creation that is not a final one: absent or partial
+std::pair<bool, std::string> Creation_Concat(const http::request_header<>& req)
+{
+    const auto [found, val] = Parse_From_Req(req, TusManager::TAG_UPLOAD_CONCAT);
+    if (!found)
+        return {true, ""};
+    return {val == Concat_Partial, val};
+}
+
+enum class Range_Kind { Whole, Part, Unsatisfiable };
+
+// A single "bytes=" range of RFC 7233 over size bytes. Anything else, such
+// as several ranges or a malformed one, gets the whole content, which the
+// RFC allows.
+Range_Kind Parse_Range(std::string_view spec, size_t size, size_t& first, size_t& count)
+{
+    constexpr std::string_view unit = "bytes=";
+    if (spec.substr(0, unit.size()) != unit || spec.find(',') != std::string_view::npos)
+        return Range_Kind::Whole;
+    spec.remove_prefix(unit.size());
+    const auto dash = spec.find('-');
+    if (dash == std::string_view::npos)
+        return Range_Kind::Whole;
+    auto number = [](std::string_view sv, size_t& out) {
+        const auto [ptr, ec] = std::from_chars(sv.data(), sv.data() + sv.size(), out);
+        return !sv.empty() && ec == std::errc() && ptr == sv.data() + sv.size();
+    };
+    const auto first_sv = spec.substr(0, dash), last_sv = spec.substr(dash + 1);
+
+    size_t beg = 0, last = 0;
+    if (first_sv.empty()) // the last bytes
+    {
+        if (!number(last_sv, last))
+            return Range_Kind::Whole;
+        if (last == 0 || size == 0)
+            return Range_Kind::Unsatisfiable;
+        count = std::min(last, size);
+        first = size - count;
+        return Range_Kind::Part;
+    }
+    if (!number(first_sv, beg))
+        return Range_Kind::Whole;
+    if (last_sv.empty())
+        last = size - 1;
+    else if (!number(last_sv, last) || last < beg)
+        return Range_Kind::Whole;
+    if (beg >= size)
+        return Range_Kind::Unsatisfiable;
+    first = beg;
+    count = std::min(last, size - 1) - beg + 1;
+    return Range_Kind::Part;
+}
+
+// If-None-Match: "*" or a list of entity tags, compared weakly
+bool Etag_Listed(std::string_view list, std::string_view etag)
+{
+    while (!list.empty())
+    {
+        const auto comma = list.find(',');
+        auto tag = list.substr(0, comma);
+        list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+        while (!tag.empty() && tag.front() == ' ')
+            tag.remove_prefix(1);
+        while (!tag.empty() && tag.back() == ' ')
+            tag.remove_suffix(1);
+        if (tag.substr(0, 2) == "W/")
+            tag.remove_prefix(2);
+        if (tag == "*" || tag == etag)
+            return true;
+    }
+    return false;
+}
+
+// Status for a TmpFilesResource::Initialize() that failed
+http::status Creation_Error_Status(std::errc err)
+{
+    if (err == std::errc::file_too_large)
+        return http::status::payload_too_large;
+    if (err == std::errc::no_space_on_device)
+        return http::status::insufficient_storage;
+    std::cerr << "write error: metadata couldn't be written/opened" << std::endl;
+    return http::status::internal_server_error;
+}
+}
+
 
 http::response<http::dynamic_body>
 TusManager::MakeResponse(const http::request<http::dynamic_body>& req)
 {
     http::response<http::dynamic_body> resp;
-    resp.version(req.version());
-    resp.keep_alive(false);
-    resp.set(http::field::server, "BeTus 0.1");
+    initResponse(req, resp);
 
     switch (req.method())
     {
@@ -123,17 +309,36 @@ TusManager::MakeResponse(const http::request<http::dynamic_body>& req)
         break;
 
     case http::verb::post:
-        processPost(req, resp);
-        break;
-
+        if (!HasUploadBody(req))
+        {
+            processPost(req, resp);
+            break;
+        }
+        [[fallthrough]];
     case http::verb::patch:
-        processPatch(req, resp);
+        if (auto upload = BeginUpload(req, resp))
+        {
+            upload->Write(req.body().cdata());
+            FinishUpload(*upload, resp);
+        }
         break;
 
     case http::verb::delete_:
         processDelete(req, resp);
         break;
 
+    case http::verb::get:
+        if (req.target() == "/metrics")
+        {
+            processMetrics(req, resp);
+            break;
+        }
+        if (Trace::Enabled && req.target() == "/debug/trace")
+        {
+            processTrace(req, resp);
+            break;
+        }
+        [[fallthrough]];
     default:
         resp.result(http::status::bad_request);
         break;
@@ -143,18 +348,196 @@ TusManager::MakeResponse(const http::request<http::dynamic_body>& req)
     return resp;
 }
 
+bool TusManager::CopiesData(const http::request_header<>& req)
+{
+    if (req.method() != http::verb::post)
+        return false;
+    const auto it = req.find(TAG_UPLOAD_CONCAT);
+    return it != req.cend() && it->value().starts_with(Concat_Final_Prefix);
+}
+
+bool TusManager::HasUploadBody(const http::request_header<>& req)
+{
+    if (req.method() == http::verb::patch)
+        return true;
+    if (req.method() != http::verb::post)
+        return false;
+    const auto [cl_found, contentlen] = Parse_Number_From_Req<size_t>(req, http::field::content_length);
+    // creation-with-upload; a body of unknown length is refused as one
+    return (cl_found && contentlen > 0) || req.count(http::field::transfer_encoding) > 0;
+}
+
+std::unique_ptr<UploadStream>
+TusManager::BeginUpload(const http::request_header<>& req, http::response<http::dynamic_body>& resp)
+{
+    BETUS_TRACE_SPAN("begin upload");
+    initResponse(req, resp);
+
+    std::unique_ptr<UploadStream> ret;
+    if (req.method() == http::verb::patch)
+        ret = beginPatch(req, resp);
+    else if (req.method() == http::verb::post)
+        ret = beginCreationWithUpload(req, resp);
+    else
+        resp.result(http::status::bad_request);
+
+    if (!ret)
+        resp.set(http::field::content_length, resp.body().size());
+    return ret;
+}
+
+void TusManager::FinishUpload(UploadStream& upload, http::response<http::dynamic_body>& resp,
+                              std::function<void()> done)
+{
+    BETUS_TRACE_SPAN("finish upload");
+    if (!done)
+    {
+        std::promise<void> durable;
+        FinishUpload(upload, resp, [&durable] { durable.set_value(); });
+        durable.get_future().wait();
+        return;
+    }
+    resp.set(http::field::content_length, resp.body().size());
+    if (upload.verb_ == http::verb::post)
+        finishCreationWithUpload(upload, resp, std::move(done));
+    else
+        finishPatch(upload, resp, std::move(done));
+}
+
+void TusManager::AbortUpload(UploadStream& upload)
+{
+    BETUS_TRACE_SPAN("abort upload");
+    if (upload.verb_ == http::verb::post)
+    {   // client never learnt the location, nothing to resume
+        upload.fres_.Delete();
+        upload.fres_.Commit();
+        return;
+    }
+    // Keep what reached the disk so that the client may resume from there,
+    // unless the chunk has to be verified as a whole.
+    if (!upload.failed_ && upload.written_ > 0 && upload.checksum_b64_.empty())
+        upload.fres_.Commit();
+}
+
+bool TusManager::IsDownload(const http::request_header<>& req)
+{
+    return req.method() == http::verb::get && req.target().starts_with("/files/");
+}
+
+std::unique_ptr<DownloadStream>
+TusManager::BeginDownload(const http::request_header<>& req, http::response<http::dynamic_body>& resp)
+{
+    BETUS_TRACE_SPAN("begin download");
+    initResponse(req, resp);
+    resp.set(http::field::content_length, "0");
+    if (!req.target().starts_with("/files/"))
+    {
+        resp.result(http::status::not_found);
+        return nullptr;
+    }
+
+    const std::string fileUUID(req.target().begin() + strlen("/files/"), req.target().end());
+    const auto [res, md] = files_man_.GetMetadata(fileUUID);
+    if (res == std::errc::no_such_file_or_directory)
+    {
+        resp.result(http::status::not_found);
+        return nullptr;
+    }
+    if (static_cast<bool>(res))
+    {
+        resp.result(http::status::internal_server_error);
+        return nullptr;
+    }
+    if (md.offset < 0)
+    {
+        resp.result(http::status::gone);
+        return nullptr;
+    }
+    const size_t avail = md.offset;
+    if (avail < md.length && !serve_partial_)
+    {
+        resp.result(http::status::conflict);
+        return nullptr;
+    }
+
+    // Bytes below the offset are never written again, so the uuid and the
+    // offset name the content
+    const auto etag = '"' + fileUUID + '-' + std::to_string(avail) + '"';
+    resp.set(http::field::etag, etag);
+    resp.set(http::field::accept_ranges, "bytes");
+    if (avail < md.length)
+        resp.set(http::field::cache_control, "no-store");
+    if (const auto it = req.find(http::field::if_none_match);
+            it != req.cend() && Etag_Listed({it->value().data(), it->value().size()}, etag))
+    {
+        resp.set(http::field::content_length, std::to_string(avail));
+        resp.result(http::status::not_modified);
+        return nullptr;
+    }
+
+    size_t first = 0, count = avail;
+    auto range = Range_Kind::Whole;
+    if (const auto it = req.find(http::field::range); it != req.cend())
+    {   // If-Range dates are not kept, only the entity tag can match
+        const auto ir = req.find(http::field::if_range);
+        if (ir == req.cend() || ir->value() == etag)
+            range = Parse_Range({it->value().data(), it->value().size()}, avail, first, count);
+    }
+    if (range == Range_Kind::Unsatisfiable)
+    {
+        resp.set(http::field::content_range, "bytes */" + std::to_string(avail));
+        resp.result(http::status::range_not_satisfiable);
+        return nullptr;
+    }
+
+    const auto [open_res, fd] = files_man_.OpenData(fileUUID);
+    if (static_cast<bool>(open_res))
+    {
+        resp.result(open_res == std::errc::no_such_file_or_directory ? http::status::not_found
+                                                                     : http::status::internal_server_error);
+        return nullptr;
+    }
+    if (range == Range_Kind::Part)
+    {
+        resp.set(http::field::content_range, "bytes " + std::to_string(first) + '-' +
+                 std::to_string(first + count - 1) + '/' + std::to_string(avail));
+        resp.result(http::status::partial_content);
+    }
+    else
+        resp.result(http::status::ok);
+    resp.set(http::field::content_type, "application/octet-stream");
+    resp.set(http::field::content_length, std::to_string(count));
+    return std::unique_ptr<DownloadStream>(new DownloadStream(fd, first, count));
+}
+
+void TusManager::setExpires(const std::string& uuid, http::response<http::dynamic_body>& resp) const
+{
+    const auto expires = files_man_.Expires(uuid);
+    if (expires != std::chrono::system_clock::time_point())
+        resp.set(TAG_UPLOAD_EXPIRES, Http_Date(expires));
+}
+
+void TusManager::initResponse(const http::request_header<>& req,
+                              http::response<http::dynamic_body>& resp)
+{
+    resp.version(req.version());
+    resp.keep_alive(Keep_Alive(req));
+    resp.set(http::field::server, "BeTus 0.1");
+}
+
 namespace
 {
-bool Common_Checks(const http::request<http::dynamic_body>& req,
+bool Common_Checks(const http::request_header<>& req,
                    http::response<http::dynamic_body>& resp);
 std::pair<bool, size_t>
-Patch_Checks(const http::request<http::dynamic_body>& req,
+Patch_Checks(const http::request_header<>& req,
              http::response<http::dynamic_body>& resp);
 }
 
 void TusManager::processOptions(const http::request<http::dynamic_body>& req,
                                 http::response<http::dynamic_body>& resp)
 {
+    BETUS_TRACE_SPAN("OPTIONS");
     resp.set(TAG_TUS_RESUMABLE, TusManager::TUS_SUPPORTED_VERSION);
 
     if (!req.target().starts_with("/files")) // HTTP target is wrong
@@ -172,33 +555,29 @@ void TusManager::processOptions(const http::request<http::dynamic_body>& req,
     resp.set(TAG_TUS_VERSION, TUS_SUPPORTED_VERSIONS);
     resp.set(TAG_TUS_MAXSZ, TUS_SUPPORTED_MAXSZ);
     resp.set(TAG_TUS_EXTENSION, TUS_SUPPORTED_EXTENSIONS);
-    resp.set(TAG_TUS_CHECKSUM_ALG, TUS_SUPPORTED_CHECKSUMS);
+    resp.set(TAG_TUS_CHECKSUM_ALG, ChecksumRegistry::Instance().Names());
     resp.result(http::status::no_content);
 }
 
 void TusManager::processHead(const http::request<http::dynamic_body>& req,
                              http::response<http::dynamic_body>& resp)
 {
+    BETUS_TRACE_SPAN("HEAD");
     if (!Common_Checks(req, resp)) return;
 
+    // Served from memory, also while a PATCH is working on the upload
     const std::string fileUUID(req.target().begin() + strlen("/files/"), req.target().end());
-    auto [res, fres] = files_man_.GetFileResource(fileUUID);
-    if (res == std::errc::device_or_resource_busy)
-    {
-        resp.result(http::status::conflict);
-        return;
-    }
+    const auto [res, md] = files_man_.GetMetadata(fileUUID);
     if (res == std::errc::no_such_file_or_directory)
     {
         resp.result(http::status::not_found);
         return;
     }
-    if (static_cast<bool>(res) || !fres.IsOpen())
+    if (static_cast<bool>(res))
     {
         resp.result(http::status::internal_server_error);
         return;
     }
-    const auto md = fres.GetMetadata();
     if (md.offset < 0)
     {
         resp.result(http::status::gone);
@@ -210,115 +589,302 @@ void TusManager::processHead(const http::request<http::dynamic_body>& req,
         resp.set(TAG_UPLOAD_LENGTH, std::to_string(md.length));
     if (!md.comment.empty())
         resp.set(TAG_UPLOAD_METADATA, md.comment);
+    if (!md.concat.empty())
+        resp.set(TAG_UPLOAD_CONCAT, md.concat);
+    setExpires(fileUUID, resp);
 
     resp.set(http::field::cache_control, "no-store");
     resp.result(http::status::no_content);
 }
 
+void TusManager::processMetrics(const http::request<http::dynamic_body>&,
+                                http::response<http::dynamic_body>& resp)
+{
+    const auto text = Metrics::Instance().Render({
+        {"betus_uploads", "Uploads in the registry.", static_cast<double>(files_man_.Size())},
+        {"betus_uploads_in_use", "Uploads a request is working on.", static_cast<double>(files_man_.InUse())},
+        {"betus_reserved_bytes", "Sum of the Upload-Length of all uploads.",
+         static_cast<double>(files_man_.Reserved())},
+    });
+    boost::beast::ostream(resp.body()) << text;
+    resp.set(http::field::content_type, "text/plain; version=0.0.4");
+    resp.set(http::field::cache_control, "no-store");
+    resp.result(http::status::ok);
+}
+
+void TusManager::processTrace(const http::request<http::dynamic_body>&,
+                              http::response<http::dynamic_body>& resp)
+{
+    boost::beast::ostream(resp.body()) << Trace::ChromeJson();
+    resp.set(http::field::content_type, "application/json");
+    resp.set(http::field::cache_control, "no-store");
+    resp.result(http::status::ok);
+}
+
 void TusManager::processPost(const http::request<http::dynamic_body>& req,
                              http::response<http::dynamic_body>& resp)
 {
+    BETUS_TRACE_SPAN("POST");
     if (!Common_Checks(req, resp)) return;
+    if (CopiesData(req))
+        return processConcatFinal(req, resp);
 
     const auto [ul_found, uploadlen] = Parse_Number_From_Req<size_t>(req, TAG_UPLOAD_LENGTH);
-    if (!ul_found || uploadlen == 0) // we don't support "Deferred Length" yet
+    const auto [concat_ok, concat] = Creation_Concat(req);
+    if (!ul_found || uploadlen == 0 || !concat_ok) // we don't support "Deferred Length" yet
     {
         resp.result(http::status::bad_request);
         return;
     }
+    if (uploadlen > Max_Upload_Size)
+    {
+        resp.result(http::status::payload_too_large);
+        return;
+    }
 
     auto newres = files_man_.NewTmpFilesResource();
     {
         const auto [md_found, mtdata] = Parse_From_Req(req, TAG_UPLOAD_METADATA);
-        if (static_cast<bool>(newres.Initialize(uploadlen, mtdata)))
+        if (const auto err = newres.Initialize(uploadlen, mtdata, concat); static_cast<bool>(err))
         {
-            std::cerr << "write error: metadata couldn't be written/opened" << std::endl;
-            resp.result(http::status::internal_server_error);
+            resp.result(Creation_Error_Status(err));
             return;
         }
     }
+    files_man_.Persist(newres);
 
-    if (const auto [cl_found, contentlen] = Parse_Number_From_Req<size_t>(req, http::field::content_length);
-            cl_found && contentlen > 0) // creation-with-upload support
+    resp.set(http::field::location, "http://127.0.0.1:8080/files/" + newres.Uuid());
+    setExpires(newres.Uuid(), resp);
+    resp.result(http::status::created);
+}
+
+// The parts are held until the final upload has been assembled from them, so
+// that none of them is patched or deleted meanwhile; they are left in place
+// afterwards and may be deleted by the client.
+void TusManager::processConcatFinal(const http::request<http::dynamic_body>& req,
+                                    http::response<http::dynamic_body>& resp)
+{
+    const auto concat = Parse_From_Req(req, TAG_UPLOAD_CONCAT).second;
+    std::vector<std::string> uuids;
+    for (size_t pos = Concat_Final_Prefix.size(); pos < concat.size(); )
     {
-        if (const auto [ct_found, ct_val] = Parse_From_Req(req, http::field::content_type);
-                !ct_found || ct_val != TusManager::PATCH_EXPECTED_CONTENT_TYPE) // Content-Type not found or wrong
+        const auto end = std::min(concat.find(' ', pos), concat.size());
+        const std::string_view url(concat.data() + pos, end - pos);
+        pos = end + 1;
+        if (url.empty())
+            continue;
+        const auto fpos = url.find("/files/");
+        if (fpos == std::string_view::npos)
         {
-            resp.result(http::status::unsupported_media_type);
+            resp.result(http::status::bad_request);
             return;
         }
+        uuids.emplace_back(url.substr(fpos + strlen("/files/")));
+    }
+    if (uuids.empty() || req.find(TAG_UPLOAD_LENGTH) != req.cend())
+    {
+        resp.result(http::status::bad_request);
+        return;
+    }
 
-        FileResource fres(std::move(newres));
-        auto res = fres.Write(0, req.body());
-        if (res < 1)
+    std::vector<std::pair<FileResource, size_t>> parts;
+    parts.reserve(uuids.size());
+    size_t total = 0;
+    for (const auto& uuid : uuids)
+    {
+        auto [res, fres] = files_man_.GetFileResource(uuid);
+        if (res == std::errc::no_such_file_or_directory)
+        {
+            resp.result(http::status::not_found);
+            return;
+        }
+        if (res == std::errc::device_or_resource_busy)
         {
-            std::cerr << "initial write error: data couldn't be written" << std::endl;
+            resp.result(http::status::conflict);
+            return;
+        }
+        if (static_cast<bool>(res) || !fres.IsOpen())
+        {
+            resp.result(http::status::internal_server_error);
+            return;
+        }
+        const auto md = fres.GetMetadata();
+        if (md.concat != Concat_Partial || md.offset < 0 || static_cast<size_t>(md.offset) != md.length)
+        {   // only finished partial uploads are concatenated
+            resp.result(http::status::bad_request);
+            return;
+        }
+        total += md.length;
+        parts.emplace_back(std::move(fres), md.length);
+    }
+    if (total > Max_Upload_Size)
+    {
+        resp.result(http::status::payload_too_large);
+        return;
+    }
+
+    auto newres = files_man_.NewTmpFilesResource();
+    const auto [md_found, mtdata] = Parse_From_Req(req, TAG_UPLOAD_METADATA);
+    if (const auto err = newres.Initialize(total, mtdata, concat); static_cast<bool>(err))
+    {
+        resp.result(Creation_Error_Status(err));
+        return;
+    }
+    const std::string uuid = newres.Uuid();
+    FileResource fres(std::move(newres));
+    for (const auto& [part, length] : parts)
+        if (!fres.Append(part, length))
+        {
+            std::cerr << uuid << ": concatenation failed" << std::endl;
             fres.Delete();
             fres.Commit();
             resp.result(http::status::internal_server_error);
             return;
         }
+    if (!Commit_Durably(fres))
+    {
+        resp.result(http::status::internal_server_error);
+        return;
+    }
 
+    resp.set(http::field::location, "http://127.0.0.1:8080/files/" + uuid);
+    setExpires(uuid, resp);
+    resp.result(http::status::created);
+}
+
+std::unique_ptr<UploadStream>
+TusManager::beginCreationWithUpload(const http::request_header<>& req,
+                                    http::response<http::dynamic_body>& resp)
+{
+    if (!Common_Checks(req, resp)) return nullptr;
+
+    const auto [ul_found, uploadlen] = Parse_Number_From_Req<size_t>(req, TAG_UPLOAD_LENGTH);
+    const auto [concat_ok, concat] = Creation_Concat(req); // a final upload takes no body
+    if (!ul_found || uploadlen == 0 || !concat_ok) // we don't support "Deferred Length" yet
+    {
+        resp.result(http::status::bad_request);
+        return nullptr;
+    }
+    if (uploadlen > Max_Upload_Size)
+    {
+        resp.result(http::status::payload_too_large);
+        return nullptr;
+    }
+    if (const auto [ct_found, ct_val] = Parse_From_Req(req, http::field::content_type);
+            !ct_found || ct_val != TusManager::PATCH_EXPECTED_CONTENT_TYPE) // Content-Type not found or wrong
+    {
+        resp.result(http::status::unsupported_media_type);
+        return nullptr;
+    }
+    if (const auto [cl_found, contentlen] = Parse_Number_From_Req<size_t>(req, http::field::content_length);
+            !cl_found || contentlen > uploadlen)
+    {
+        resp.result(cl_found ? http::status::payload_too_large : http::status::bad_request);
+        return nullptr;
+    }
+
+    auto newres = files_man_.NewTmpFilesResource();
+    {
+        const auto [md_found, mtdata] = Parse_From_Req(req, TAG_UPLOAD_METADATA);
+        if (const auto err = newres.Initialize(uploadlen, mtdata, concat); static_cast<bool>(err))
+        {
+            resp.result(Creation_Error_Status(err));
+            return nullptr;
+        }
+    }
+
+    const std::string uuid = newres.Uuid();
+    return std::unique_ptr<UploadStream>(
+               new UploadStream(FileResource(std::move(newres)), uuid, http::verb::post, 0));
+}
+
+void TusManager::finishCreationWithUpload(UploadStream& upload,
+                                          http::response<http::dynamic_body>& resp,
+                                          std::function<void()> done)
+{
+    auto& fres = upload.fres_;
+    if (upload.failed_ || upload.written_ < 1)
+    {
+        std::cerr << "initial write error: data couldn't be written" << std::endl;
+        fres.Delete();
         fres.Commit();
-        resp.set(TAG_UPLOAD_OFFSET, res);
+        resp.result(http::status::internal_server_error);
+        return done();
     }
-    else
-        files_man_.Persist(newres);
 
-    resp.set(http::field::location, "http://127.0.0.1:8080/files/" + newres.Uuid());
-    resp.result(http::status::created);
+    fres.Commit([this, &upload, &resp, done = std::move(done)](bool durable) {
+        if (!durable)
+            resp.result(http::status::internal_server_error);
+        else
+        {
+            resp.set(TAG_UPLOAD_OFFSET, upload.written_);
+            resp.set(http::field::location, "http://127.0.0.1:8080/files/" + upload.uuid_);
+            setExpires(upload.uuid_, resp);
+            resp.result(http::status::created);
+        }
+        done();
+    });
 }
 
-void TusManager::processPatch(const http::request<http::dynamic_body>& req,
-                              http::response<http::dynamic_body>& resp)
+std::unique_ptr<UploadStream>
+TusManager::beginPatch(const http::request_header<>& req,
+                       http::response<http::dynamic_body>& resp)
 {
-    if (!Common_Checks(req, resp)) return;
+    if (!Common_Checks(req, resp)) return nullptr;
 
     const std::string fileUUID(req.target().begin() + strlen("/files/"), req.target().end());
     const auto [ok, offset_val] = Patch_Checks(req, resp);
-    if (!ok) return;
+    if (!ok) return nullptr;
 
     const auto [uc_found, uc_val] = Parse_From_Req(req, TAG_UPLOAD_CHECKSUM);
-    auto uc_spaceit = std::find(uc_val.begin(), uc_val.end(), ' ');
-    if (uc_found &&
-        !std::equal(std::begin(TUS_SUPPORTED_CHECKSUM), std::end(TUS_SUPPORTED_CHECKSUM),
-                    uc_val.begin(), uc_spaceit)) // supported checksum?
+    const auto uc_spaceit = std::find(uc_val.begin(), uc_val.end(), ' ');
+    std::unique_ptr<Checksum> checksum;
+    if (uc_found)
     {
-        resp.result(http::status::bad_request);
-        return;
+        checksum = ChecksumRegistry::Instance().Create(std::string_view(uc_val.data(), uc_spaceit - uc_val.begin()));
+        if (!checksum || uc_spaceit == uc_val.end()) // supported checksum?
+        {
+            resp.result(http::status::bad_request);
+            return nullptr;
+        }
     }
 
     auto [res, fres] = files_man_.GetFileResource(fileUUID);
     if (res == std::errc::no_such_file_or_directory)
     {
         resp.result(http::status::not_found);
-        return;
+        return nullptr;
     }
     if (res == std::errc::device_or_resource_busy)
     {
         resp.result(http::status::conflict);
-        return;
+        return nullptr;
     }
     if (static_cast<bool>(res) || !fres.IsOpen())
     {
         resp.result(http::status::internal_server_error);
-        return;
+        return nullptr;
     }
 
     const auto md = fres.GetMetadata();
     if (md.offset < 0)
     {
         resp.result(http::status::not_found);
-        return;
+        return nullptr;
+    }
+    if (md.concat.compare(0, Concat_Final_Prefix.size(), Concat_Final_Prefix) == 0)
+    {   // assembled at creation, never written to
+        resp.result(http::status::forbidden);
+        return nullptr;
     }
     if (static_cast<size_t>(md.offset) != offset_val)
     {
         std::cerr << fileUUID << ": Offset mismatch " << md.offset << " != " << offset_val << std::endl;
         resp.result(http::status::conflict);
-        return;
+        return nullptr;
     }
     if (const auto [found, cl] = Parse_Number_From_Req<size_t>(req, http::field::content_length);
-            !found || offset_val + cl > md.length)
+            !found || cl > md.length - offset_val)
     {
         std::cerr << fileUUID;
         if (!found)
@@ -329,38 +895,58 @@ void TusManager::processPatch(const http::request<http::dynamic_body>& req,
         else
         {
             resp.result(http::status::conflict);
-            std::cerr << ": Declared size is not sufficient to hold data " << md.length << " != " << (offset_val + cl) << std::endl;
+            std::cerr << ": Declared size is not sufficient to hold data " << md.length - offset_val << " < " << cl << std::endl;
         }
-        return;
+        return nullptr;
     }
-    auto cnt = fres.Write(offset_val, req.body());
-    if (cnt < 1)
+
+    std::unique_ptr<UploadStream> ret(
+        new UploadStream(std::move(fres), fileUUID, http::verb::patch, offset_val));
+    if (uc_found)
+    {
+        ret->checksum_b64_.assign(uc_spaceit + 1, uc_val.end());
+        ret->checksum_ = std::move(checksum);
+    }
+    return ret;
+}
+
+void TusManager::finishPatch(UploadStream& upload, http::response<http::dynamic_body>& resp,
+                             std::function<void()> done)
+{
+    auto& fres = upload.fres_;
+    const auto cnt = upload.written_;
+    if (upload.failed_ || cnt < 1)
     {
         resp.result(http::status::internal_server_error);
-        return;
+        return done();
     }
 
-    if (uc_found)
+    if (!upload.checksum_b64_.empty())
     {
-        ++uc_spaceit;
-        const auto csbin = Base64_To_Bin(
-                               std::string_view(&(*uc_spaceit), uc_val.end() - uc_spaceit));
-        const auto cshexstr = fres.ChecksumSha1Hex(offset_val, cnt);
-        if (!CheckSum_Match(cshexstr, csbin))
+        BETUS_TRACE_SPAN("verify checksum");
+        if (!Base64Matches(upload.checksum_b64_, upload.checksum_->Digest()))
         {
             resp.result(Http_Status_Checksum_Mismatch);
-            return;
+            return done();
         }
     }
-    fres.Commit();
-    resp.set(TAG_UPLOAD_OFFSET, offset_val + cnt);
-
-    resp.result(http::status::no_content);
+    fres.Commit([this, &upload, &resp, cnt, done = std::move(done)](bool durable) {
+        if (!durable)
+            resp.result(http::status::internal_server_error);
+        else
+        {
+            resp.set(TAG_UPLOAD_OFFSET, upload.offset_ + cnt);
+            setExpires(upload.uuid_, resp);
+            resp.result(http::status::no_content);
+        }
+        done();
+    });
 }
 
 void TusManager::processDelete(const http::request<http::dynamic_body>& req,
                                http::response<http::dynamic_body>& resp)
 {
+    BETUS_TRACE_SPAN("DELETE");
     if (!Common_Checks(req, resp)) return;
 
     if (const auto [clen_found, clen_val] = Parse_Number_From_Req<size_t>(req, http::field::content_length);
@@ -396,7 +982,7 @@ void TusManager::processDelete(const http::request<http::dynamic_body>& req,
 
 namespace
 {
-bool Common_Checks(const http::request<http::dynamic_body>& req,
+bool Common_Checks(const http::request_header<>& req,
                    http::response<http::dynamic_body>& resp)
 {
     resp.set(TusManager::TAG_TUS_RESUMABLE, TusManager::TUS_SUPPORTED_VERSION);
@@ -426,7 +1012,7 @@ bool Common_Checks(const http::request<http::dynamic_body>& req,
 }
 
 std::pair<bool, size_t>
-Patch_Checks(const http::request<http::dynamic_body>& req,
+Patch_Checks(const http::request_header<>& req,
              http::response<http::dynamic_body>& resp)
 {
     std::pair<bool, size_t> ret{false, 0};
@@ -0,0 +1,221 @@
+#include "include/upload_registry.hpp"
+
+namespace tus
+{
+
+namespace
+{
+int Hex_Value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+bool Is_Dash_Position(size_t i)
+{
+    return i == 8 || i == 13 || i == 18 || i == 23;
+}
+} // namespace
+
+std::optional<UploadKey> UploadKey::Parse(std::string_view uuid)
+{
+    if (uuid.size() != 36)
+        return std::nullopt;
+
+    UploadKey ret;
+    int nibbles = 0;
+    for (size_t i = 0; i < uuid.size(); ++i)
+    {
+        if (Is_Dash_Position(i))
+        {
+            if (uuid[i] != '-')
+                return std::nullopt;
+            continue;
+        }
+        const int v = Hex_Value(uuid[i]);
+        if (v < 0)
+            return std::nullopt;
+        auto& half = nibbles < 16 ? ret.hi : ret.lo;
+        half = (half << 4) | static_cast<uint64_t>(v);
+        ++nibbles;
+    }
+    return ret;
+}
+
+std::string UploadKey::ToString() const
+{
+    const char* digits = "0123456789abcdef";
+    std::string ret(36, '-');
+    int nibble = 0;
+    for (size_t i = 0; i < ret.size(); ++i)
+    {
+        if (Is_Dash_Position(i))
+            continue;
+        const uint64_t half = nibble < 16 ? hi : lo;
+        ret[i] = digits[(half >> (60 - 4 * (nibble % 16))) & 0xf];
+        ++nibble;
+    }
+    return ret;
+}
+
+bool UploadRegistry::Insert(const UploadKey& key, bool in_use, int64_t expires)
+{
+    auto& sh = shard(key);
+    std::unique_lock lock(sh.mtx);
+
+    auto [it, inserted] = sh.entries.try_emplace(key);
+    if (inserted)
+    {
+        it->second.in_use.store(in_use, std::memory_order_relaxed);
+        it->second.expires.store(expires, std::memory_order_relaxed);
+    }
+    return inserted;
+}
+
+UploadRegistry::Acquire UploadRegistry::TryAcquire(const UploadKey& key, int64_t now)
+{
+    auto& sh = shard(key);
+    std::shared_lock lock(sh.mtx);
+
+    auto it = sh.entries.find(key);
+    if (it == sh.entries.end())
+        return Acquire::Missing;
+    if (now != 0)
+    {
+        const auto expires = it->second.expires.load(std::memory_order_relaxed);
+        if (expires != 0 && expires <= now)
+            return Acquire::Missing;
+    }
+    bool expected = false;
+    if (!it->second.in_use.compare_exchange_strong(expected, true, std::memory_order_acq_rel))
+        return Acquire::Busy;
+    return Acquire::Acquired;
+}
+
+bool UploadRegistry::Release(const UploadKey& key)
+{
+    auto& sh = shard(key);
+    std::shared_lock lock(sh.mtx);
+
+    auto it = sh.entries.find(key);
+    if (it == sh.entries.end())
+        return false;
+    return it->second.in_use.exchange(false, std::memory_order_acq_rel);
+}
+
+bool UploadRegistry::Erase(const UploadKey& key)
+{
+    auto& sh = shard(key);
+    std::unique_lock lock(sh.mtx);
+    return sh.entries.erase(key) > 0;
+}
+
+bool UploadRegistry::SetExpiry(const UploadKey& key, int64_t expires)
+{
+    auto& sh = shard(key);
+    std::shared_lock lock(sh.mtx);
+
+    auto it = sh.entries.find(key);
+    if (it == sh.entries.end())
+        return false;
+    it->second.expires.store(expires, std::memory_order_relaxed);
+    return true;
+}
+
+int64_t UploadRegistry::Expiry(const UploadKey& key) const
+{
+    const auto& sh = shard(key);
+    std::shared_lock lock(sh.mtx);
+
+    auto it = sh.entries.find(key);
+    return it == sh.entries.end() ? 0 : it->second.expires.load(std::memory_order_relaxed);
+}
+
+bool UploadRegistry::Describe(const UploadKey& key, const Info& info)
+{
+    auto& sh = shard(key);
+    std::unique_lock lock(sh.mtx);
+
+    auto it = sh.entries.find(key);
+    if (it == sh.entries.end())
+        return false;
+    auto& entry = it->second;
+    entry.described = true;
+    entry.length = info.length;
+    entry.comment = info.comment;
+    entry.concat = info.concat;
+    int64_t unset = -1;
+    entry.offset.compare_exchange_strong(unset, info.offset, std::memory_order_relaxed);
+    return true;
+}
+
+bool UploadRegistry::SetOffset(const UploadKey& key, int64_t offset)
+{
+    auto& sh = shard(key);
+    std::shared_lock lock(sh.mtx);
+
+    auto it = sh.entries.find(key);
+    if (it == sh.entries.end())
+        return false;
+    it->second.offset.store(offset, std::memory_order_relaxed);
+    return true;
+}
+
+std::optional<UploadRegistry::Info> UploadRegistry::Lookup(const UploadKey& key, int64_t now) const
+{
+    const auto& sh = shard(key);
+    std::shared_lock lock(sh.mtx);
+
+    auto it = sh.entries.find(key);
+    if (it == sh.entries.end())
+        return std::nullopt;
+    const auto& entry = it->second;
+    if (now != 0)
+    {
+        const auto expires = entry.expires.load(std::memory_order_relaxed);
+        if (expires != 0 && expires <= now)
+            return std::nullopt;
+    }
+    return Info{entry.offset.load(std::memory_order_relaxed), entry.length, entry.comment, entry.concat,
+                entry.described};
+}
+
+void UploadRegistry::Expired(size_t shard_idx, int64_t now, std::vector<UploadKey>& out) const
+{
+    const auto& sh = shards_[shard_idx % Shard_Count];
+    std::shared_lock lock(sh.mtx);
+    for (const auto& [key, entry] : sh.entries)
+    {
+        const auto expires = entry.expires.load(std::memory_order_relaxed);
+        if (expires != 0 && expires <= now && !entry.in_use.load(std::memory_order_acquire))
+            out.push_back(key);
+    }
+}
+
+size_t UploadRegistry::Size() const
+{
+    size_t ret = 0;
+    for (const auto& sh : shards_)
+    {
+        std::shared_lock lock(sh.mtx);
+        ret += sh.entries.size();
+    }
+    return ret;
+}
+
+size_t UploadRegistry::Clear()
+{
+    size_t ret = 0;
+    for (auto& sh : shards_)
+    {
+        std::unique_lock lock(sh.mtx);
+        ret += sh.entries.size();
+        sh.entries.clear();
+    }
+    return ret;
+}
+
+} // namespace tus
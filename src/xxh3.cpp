@@ -0,0 +1,359 @@
+#include "include/checksum.hpp"
+#include "include/cpu_features.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace tus
+{
+
+namespace
+{
+constexpr uint32_t Prime32_1 = 0x9E3779B1U;
+constexpr uint32_t Prime32_2 = 0x85EBCA77U;
+constexpr uint32_t Prime32_3 = 0xC2B2AE3DU;
+constexpr uint64_t Prime64_1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t Prime64_2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t Prime64_3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t Prime64_4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t Prime64_5 = 0x27D4EB2F165667C5ULL;
+constexpr uint64_t Prime_Mx1 = 0x165667919E3779F9ULL;
+constexpr uint64_t Prime_Mx2 = 0x9FB21C651E98DF25ULL;
+
+constexpr size_t Stripe_Len = 64;
+constexpr size_t Secret_Consume_Rate = 8;
+constexpr size_t Secret_Size = 192;
+constexpr size_t Secret_Limit = Secret_Size - Stripe_Len;
+constexpr size_t Stripes_Per_Block = Secret_Limit / Secret_Consume_Rate;
+constexpr size_t Buffer_Stripes = 256 / Stripe_Len;
+constexpr size_t Midsize_Max = 240;
+
+alignas(64) constexpr unsigned char Secret[Secret_Size] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+inline uint64_t Read64(const unsigned char* p) { uint64_t v; memcpy(&v, p, 8); return v; }
+inline uint32_t Read32(const unsigned char* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+inline uint64_t Rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+inline uint64_t Mul128_Fold64(uint64_t lhs, uint64_t rhs)
+{
+    const unsigned __int128 product = static_cast<unsigned __int128>(lhs) * rhs;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+}
+
+uint64_t Xxh64_Avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= Prime64_2;
+    h ^= h >> 29;
+    h *= Prime64_3;
+    return h ^ (h >> 32);
+}
+
+uint64_t Xxh3_Avalanche(uint64_t h)
+{
+    h ^= h >> 37;
+    h *= Prime_Mx1;
+    return h ^ (h >> 32);
+}
+
+uint64_t Rrmxmx(uint64_t h, uint64_t len)
+{
+    h ^= Rotl64(h, 49) ^ Rotl64(h, 24);
+    h *= Prime_Mx2;
+    h ^= (h >> 35) + len;
+    h *= Prime_Mx2;
+    return h ^ (h >> 28);
+}
+
+uint64_t Mix16B(const unsigned char* in, const unsigned char* secret)
+{
+    return Mul128_Fold64(Read64(in) ^ Read64(secret), Read64(in + 8) ^ Read64(secret + 8));
+}
+
+uint64_t Hash_Short(const unsigned char* in, size_t len)
+{
+    if (len > 8)
+    {
+        const uint64_t lo = Read64(in) ^ (Read64(Secret + 24) ^ Read64(Secret + 32));
+        const uint64_t hi = Read64(in + len - 8) ^ (Read64(Secret + 40) ^ Read64(Secret + 48));
+        return Xxh3_Avalanche(len + __builtin_bswap64(lo) + hi + Mul128_Fold64(lo, hi));
+    }
+    if (len >= 4)
+    {
+        const uint64_t in64 = Read32(in + len - 4) + (static_cast<uint64_t>(Read32(in)) << 32);
+        return Rrmxmx(in64 ^ (Read64(Secret + 8) ^ Read64(Secret + 16)), len);
+    }
+    if (len > 0)
+    {
+        const uint32_t combined = (uint32_t(in[0]) << 16) | (uint32_t(in[len >> 1]) << 24) |
+                                  uint32_t(in[len - 1]) | (uint32_t(len) << 8);
+        return Xxh64_Avalanche(combined ^ (Read32(Secret) ^ Read32(Secret + 4)));
+    }
+    return Xxh64_Avalanche(Read64(Secret + 56) ^ Read64(Secret + 64));
+}
+
+uint64_t Hash_Midsize(const unsigned char* in, size_t len)
+{
+    uint64_t acc = len * Prime64_1;
+    if (len <= 128)
+    {
+        if (len > 32)
+        {
+            if (len > 64)
+            {
+                if (len > 96)
+                {
+                    acc += Mix16B(in + 48, Secret + 96);
+                    acc += Mix16B(in + len - 64, Secret + 112);
+                }
+                acc += Mix16B(in + 32, Secret + 64);
+                acc += Mix16B(in + len - 48, Secret + 80);
+            }
+            acc += Mix16B(in + 16, Secret + 32);
+            acc += Mix16B(in + len - 32, Secret + 48);
+        }
+        acc += Mix16B(in, Secret);
+        acc += Mix16B(in + len - 16, Secret + 16);
+        return Xxh3_Avalanche(acc);
+    }
+
+    const size_t rounds = len / 16;
+    for (size_t i = 0; i < 8; ++i)
+        acc += Mix16B(in + 16 * i, Secret + 16 * i);
+    acc = Xxh3_Avalanche(acc);
+    for (size_t i = 8; i < rounds; ++i)
+        acc += Mix16B(in + 16 * i, Secret + 16 * (i - 8) + 3);
+    acc += Mix16B(in + len - 16, Secret + 136 - 17);
+    return Xxh3_Avalanche(acc);
+}
+
+void Accumulate_512_Sw(uint64_t* acc, const unsigned char* in, const unsigned char* secret)
+{
+    for (size_t i = 0; i < 8; ++i)
+    {
+        const uint64_t data_val = Read64(in + 8 * i);
+        const uint64_t data_key = data_val ^ Read64(secret + 8 * i);
+        acc[i ^ 1] += data_val;
+        acc[i] += (data_key & 0xFFFFFFFF) * (data_key >> 32);
+    }
+}
+
+void Accumulate_Sw(uint64_t* acc, const unsigned char* in, const unsigned char* secret, size_t nstripes)
+{
+    for (size_t n = 0; n < nstripes; ++n)
+        Accumulate_512_Sw(acc, in + n * Stripe_Len, secret + n * Secret_Consume_Rate);
+}
+
+void Scramble_Sw(uint64_t* acc, const unsigned char* secret)
+{
+    for (size_t i = 0; i < 8; ++i)
+    {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= Read64(secret + 8 * i);
+        acc[i] = a * Prime32_1;
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+void Accumulate_Avx2(uint64_t* acc, const unsigned char* in, const unsigned char* secret, size_t nstripes)
+{
+    auto xacc = reinterpret_cast<__m256i*>(acc);
+    for (size_t n = 0; n < nstripes; ++n)
+    {
+        const auto* xin = reinterpret_cast<const __m256i*>(in + n * Stripe_Len);
+        const auto* xsecret = reinterpret_cast<const __m256i*>(secret + n * Secret_Consume_Rate);
+        for (int i = 0; i < 2; ++i)
+        {
+            const __m256i data_vec = _mm256_loadu_si256(xin + i);
+            const __m256i data_key = _mm256_xor_si256(data_vec, _mm256_loadu_si256(xsecret + i));
+            const __m256i data_key_lo = _mm256_srli_epi64(data_key, 32);
+            const __m256i product = _mm256_mul_epu32(data_key, data_key_lo);
+            const __m256i data_swap = _mm256_shuffle_epi32(data_vec, _MM_SHUFFLE(1, 0, 3, 2));
+            xacc[i] = _mm256_add_epi64(product, _mm256_add_epi64(xacc[i], data_swap));
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+void Scramble_Avx2(uint64_t* acc, const unsigned char* secret)
+{
+    auto xacc = reinterpret_cast<__m256i*>(acc);
+    const auto* xsecret = reinterpret_cast<const __m256i*>(secret);
+    const __m256i prime32 = _mm256_set1_epi32(static_cast<int>(Prime32_1));
+    for (int i = 0; i < 2; ++i)
+    {
+        const __m256i a = _mm256_xor_si256(xacc[i], _mm256_srli_epi64(xacc[i], 47));
+        const __m256i data_key = _mm256_xor_si256(a, _mm256_loadu_si256(xsecret + i));
+        const __m256i data_key_hi = _mm256_srli_epi64(data_key, 32);
+        const __m256i prod_lo = _mm256_mul_epu32(data_key, prime32);
+        const __m256i prod_hi = _mm256_mul_epu32(data_key_hi, prime32);
+        xacc[i] = _mm256_add_epi64(prod_lo, _mm256_slli_epi64(prod_hi, 32));
+    }
+}
+#endif
+
+struct Long_Kernels
+{
+    void (*accumulate)(uint64_t*, const unsigned char*, const unsigned char*, size_t) = Accumulate_Sw;
+    void (*scramble)(uint64_t*, const unsigned char*) = Scramble_Sw;
+
+    Long_Kernels()
+    {
+#if defined(__x86_64__)
+        if (CpuFeatures::Get().avx2)
+        {
+            accumulate = Accumulate_Avx2;
+            scramble = Scramble_Avx2;
+        }
+#endif
+    }
+};
+
+const Long_Kernels& Kernels()
+{
+    static const Long_Kernels kernels;
+    return kernels;
+}
+
+void Init_Acc(uint64_t* acc)
+{
+    const uint64_t init[8] = {Prime32_3, Prime64_1, Prime64_2, Prime64_3,
+                              Prime64_4, Prime32_2, Prime64_5, Prime32_1};
+    memcpy(acc, init, sizeof(init));
+}
+
+// Feeds whole stripes, scrambling the accumulators at every block boundary
+void Consume_Stripes(uint64_t* acc, size_t& stripes_so_far, const unsigned char* in, size_t nstripes)
+{
+    const auto& k = Kernels();
+    if (Stripes_Per_Block - stripes_so_far <= nstripes)
+    {
+        const size_t to_end = Stripes_Per_Block - stripes_so_far;
+        k.accumulate(acc, in, Secret + stripes_so_far * Secret_Consume_Rate, to_end);
+        k.scramble(acc, Secret + Secret_Limit);
+        k.accumulate(acc, in + to_end * Stripe_Len, Secret, nstripes - to_end);
+        stripes_so_far = nstripes - to_end;
+    }
+    else
+    {
+        k.accumulate(acc, in, Secret + stripes_so_far * Secret_Consume_Rate, nstripes);
+        stripes_so_far += nstripes;
+    }
+}
+
+uint64_t Merge_Accs(const uint64_t* acc, uint64_t total_len)
+{
+    uint64_t ret = total_len * Prime64_1;
+    for (size_t i = 0; i < 4; ++i)
+        ret += Mul128_Fold64(acc[2 * i] ^ Read64(Secret + 11 + 16 * i),
+                             acc[2 * i + 1] ^ Read64(Secret + 11 + 16 * i + 8));
+    return Xxh3_Avalanche(ret);
+}
+} // namespace
+
+Xxh3::Xxh3()
+{
+    Init_Acc(acc_.data());
+}
+
+uint64_t Xxh3::Hash(const void* data, size_t size)
+{
+    const auto in = static_cast<const unsigned char*>(data);
+    if (size <= 16)
+        return Hash_Short(in, size);
+    if (size <= Midsize_Max)
+        return Hash_Midsize(in, size);
+
+    Xxh3 state;
+    state.Update(data, size);
+    return state.Value();
+}
+
+void Xxh3::Update(const void* data, size_t size)
+{
+    auto in = static_cast<const unsigned char*>(data);
+    const auto end = in + size;
+    total_len_ += size;
+
+    if (buffered_ + size <= buffer_.size())
+    {
+        memcpy(buffer_.data() + buffered_, in, size);
+        buffered_ += size;
+        return;
+    }
+    if (buffered_ > 0)
+    {
+        const size_t fill = buffer_.size() - buffered_;
+        memcpy(buffer_.data() + buffered_, in, fill);
+        in += fill;
+        Consume_Stripes(acc_.data(), stripes_so_far_, buffer_.data(), Buffer_Stripes);
+        buffered_ = 0;
+    }
+    // At least one byte is always kept back for the final stripe
+    if (static_cast<size_t>(end - in) > buffer_.size())
+    {
+        const auto limit = end - buffer_.size();
+        do {
+            Consume_Stripes(acc_.data(), stripes_so_far_, in, Buffer_Stripes);
+            in += buffer_.size();
+        } while (in < limit);
+        memcpy(buffer_.data() + buffer_.size() - Stripe_Len, in - Stripe_Len, Stripe_Len);
+    }
+    memcpy(buffer_.data(), in, end - in);
+    buffered_ = end - in;
+}
+
+uint64_t Xxh3::Value() const
+{
+    if (total_len_ <= Midsize_Max)
+        return Hash(buffer_.data(), total_len_);
+
+    alignas(64) uint64_t acc[8];
+    memcpy(acc, acc_.data(), sizeof(acc));
+    unsigned char last_stripe[Stripe_Len];
+    const unsigned char* last_stripe_p;
+    if (buffered_ >= Stripe_Len)
+    {
+        size_t stripes_so_far = stripes_so_far_;
+        Consume_Stripes(acc, stripes_so_far, buffer_.data(), (buffered_ - 1) / Stripe_Len);
+        last_stripe_p = buffer_.data() + buffered_ - Stripe_Len;
+    }
+    else
+    {   // the tail of the previous buffer completes the last stripe
+        const size_t catchup = Stripe_Len - buffered_;
+        memcpy(last_stripe, buffer_.data() + buffer_.size() - catchup, catchup);
+        memcpy(last_stripe + catchup, buffer_.data(), buffered_);
+        last_stripe_p = last_stripe;
+    }
+    Accumulate_512_Sw(acc, last_stripe_p, Secret + Secret_Limit - 7);
+    return Merge_Accs(acc, total_len_);
+}
+
+std::string Xxh3::Digest()
+{
+    const uint64_t h = Value();
+    std::string ret(8, '\0');
+    for (int i = 0; i < 8; ++i)
+        ret[i] = static_cast<char>(h >> (56 - 8 * i));
+    return ret;
+}
+
+} // namespace tus
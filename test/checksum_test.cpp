@@ -0,0 +1,251 @@
+#include "include/checksum.hpp"
+
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+using tus::ChecksumRegistry;
+
+namespace
+{
+std::string To_Hex(const std::string& bin)
+{
+    const char* digits = "0123456789abcdef";
+    std::string ret;
+    for (unsigned char uc : bin)
+    {
+        ret += digits[uc >> 4];
+        ret += digits[uc & 0x0f];
+    }
+    return ret;
+}
+
+std::vector<unsigned char> Random_Bytes(size_t size)
+{
+    std::mt19937 rng(size);
+    std::vector<unsigned char> ret(size);
+    for (auto& c : ret)
+        c = static_cast<unsigned char>(rng());
+    return ret;
+}
+
+uint32_t Crc32c_Bitwise(const unsigned char* p, size_t size)
+{
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < size; ++i)
+    {
+        crc ^= p[i];
+        for (int k = 0; k < 8; ++k)
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+    }
+    return ~crc;
+}
+
+// Feeds data in pieces of step bytes
+std::string Digest_In_Steps(const std::string& alg, const std::vector<unsigned char>& data, size_t step)
+{
+    auto cs = ChecksumRegistry::Instance().Create(alg);
+    for (size_t off = 0; off < data.size(); off += step)
+        cs->Update(data.data() + off, std::min(step, data.size() - off));
+    return cs->Digest();
+}
+}
+
+TEST_CASE("Registry", "[Checksum]")
+{
+    auto& reg = ChecksumRegistry::Instance();
+    CHECK(reg.Names() == "sha1,sha256,crc32c,xxh3");
+    CHECK(reg.Create("md5") == nullptr);
+    CHECK(reg.Create("SHA1") == nullptr);
+    CHECK(reg.Create("") == nullptr);
+
+    auto cs = reg.Create("sha1");
+    REQUIRE(cs != nullptr);
+    cs->Update("hello world!\n", 13);
+    CHECK(To_Hex(cs->Digest()) == "f951b101989b2c3b7471710b4e78fc4dbdfa0ca6"); // echo "hello world!" | sha1sum
+}
+
+TEST_CASE("sha1 kernels", "[Checksum]")
+{
+    using Kernel = tus::Sha1::Kernel;
+    const auto kernel = GENERATE(Kernel::Scalar, Kernel::ShaNi, Kernel::Avx2x8);
+    if (!tus::Sha1::Supported(kernel))
+        return;
+    INFO("kernel " << static_cast<int>(kernel));
+
+    tus::Sha1 cs(kernel);
+    REQUIRE(cs.GetKernel() == kernel);
+    cs.Update("hello world!\n", 13);
+    CHECK(To_Hex(cs.Digest()) == "f951b101989b2c3b7471710b4e78fc4dbdfa0ca6"); // same as "Digest Hello World"
+
+    const char* two_blocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    tus::Sha1 cs2(kernel);
+    cs2.Update(two_blocks, strlen(two_blocks));
+    CHECK(To_Hex(cs2.Digest()) == "84983e441c3bd26ebaae4aa1f95129e5e54670f1");
+
+    const auto data = Random_Bytes(100000);
+    tus::Sha1 reference(Kernel::Scalar), hasher(kernel);
+    reference.Update(data.data(), data.size());
+    hasher.Update(data.data(), data.size());
+    CHECK(hasher.Digest() == reference.Digest());
+}
+
+TEST_CASE("sha1 of several streams in lockstep", "[Checksum]")
+{
+    using Kernel = tus::Sha1::Kernel;
+    const auto kernel = GENERATE(Kernel::Scalar, Kernel::ShaNi, Kernel::Avx2x8);
+    if (!tus::Sha1::Supported(kernel))
+        return;
+    INFO("kernel " << static_cast<int>(kernel));
+
+    // More streams than lanes, of unequal lengths, fed in uneven pieces
+    constexpr size_t nstreams = 11;
+    std::vector<std::vector<unsigned char>> streams;
+    for (size_t i = 0; i < nstreams; ++i)
+        streams.push_back(Random_Bytes(1000 + 3000 * i + 7 * (i % 3)));
+
+    std::vector<tus::Sha1> hashers(nstreams, tus::Sha1(kernel));
+    std::vector<tus::Sha1*> hasher_ptrs;
+    for (auto& h : hashers)
+        hasher_ptrs.push_back(&h);
+
+    std::vector<size_t> offsets(nstreams, 0);
+    for (size_t round = 0; ; ++round)
+    {
+        std::vector<std::string_view> pieces;
+        bool any = false;
+        for (size_t i = 0; i < nstreams; ++i)
+        {
+            const size_t step = 500 + 250 * ((round + i) % 5) + i;
+            const size_t cnt = std::min(step, streams[i].size() - offsets[i]);
+            pieces.emplace_back(reinterpret_cast<const char*>(streams[i].data()) + offsets[i], cnt);
+            offsets[i] += cnt;
+            any = any || cnt > 0;
+        }
+        if (!any)
+            break;
+        tus::Sha1::UpdateMany(hasher_ptrs.data(), pieces.data(), nstreams);
+    }
+
+    for (size_t i = 0; i < nstreams; ++i)
+    {
+        tus::Sha1 reference(Kernel::Scalar);
+        reference.Update(streams[i].data(), streams[i].size());
+        INFO("stream " << i);
+        CHECK(hashers[i].Digest() == reference.Digest());
+    }
+}
+
+TEST_CASE("crc32c", "[Checksum]")
+{
+    tus::Crc32c cs;
+    cs.Update("123456789", 9);
+    CHECK(cs.Value() == 0xe3069283);
+    CHECK(To_Hex(cs.Digest()) == "e3069283");
+
+    SECTION("matches the bitwise definition")
+    {
+        for (size_t size : {0, 1, 7, 8, 9, 100, 6143, 6144, 6145, 3 * 6144 + 77, 100000})
+        {
+            const auto data = Random_Bytes(size);
+            INFO("size " << size);
+            CHECK(tus::Crc32c::Extend(0, data.data(), size) == Crc32c_Bitwise(data.data(), size));
+        }
+    }
+}
+
+TEST_CASE("sha256", "[Checksum]")
+{
+    tus::Sha256 cs;
+    cs.Update("abc", 3);
+    CHECK(To_Hex(cs.Digest()) == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+
+    tus::Sha256 empty;
+    CHECK(To_Hex(empty.Digest()) == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+
+    const char* two_blocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    tus::Sha256 cs2;
+    cs2.Update(two_blocks, strlen(two_blocks));
+    CHECK(To_Hex(cs2.Digest()) == "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+}
+
+TEST_CASE("xxh3", "[Checksum]")
+{
+    CHECK(tus::Xxh3::Hash("", 0) == 0x2d06800538d394c2ULL);
+    CHECK(tus::Xxh3::Hash("a", 1) == 0xe6c632b61e964e1fULL);
+    CHECK(tus::Xxh3::Hash("abc", 3) == 0x78af5f94892f3950ULL);
+    CHECK(tus::Xxh3::Hash("123456789", 9) == 0x72dcb18b67a17dffULL);
+
+    std::vector<unsigned char> pattern(1000);
+    for (size_t i = 0; i < pattern.size(); ++i)
+        pattern[i] = static_cast<unsigned char>(i * 7 + 3);
+    CHECK(tus::Xxh3::Hash(pattern.data(), pattern.size()) == 0x6c4f14bd97bd9e82ULL);
+
+    tus::Xxh3 cs;
+    cs.Update("hello world", 11);
+    CHECK(To_Hex(cs.Digest()) == "d447b1ea40e6988b");
+}
+
+TEST_CASE("Streaming equals one shot", "[Checksum]")
+{
+    const auto alg = GENERATE(as<std::string>{}, "sha1", "sha256", "crc32c", "xxh3");
+    for (size_t size : {0, 17, 63, 64, 65, 240, 241, 1024, 1025, 70000})
+    {
+        const auto data = Random_Bytes(size);
+        const auto whole = Digest_In_Steps(alg, data, size ? size : 1);
+        for (size_t step : {1, 3, 64, 100, 255, 256, 257, 4096})
+        {
+            INFO(alg << " size " << size << " step " << step);
+            CHECK(Digest_In_Steps(alg, data, step) == whole);
+        }
+    }
+}
+
+// 8 streams of 4 MiB: GB/s per core is 32 MiB over the reported time
+TEST_CASE("sha1 kernel throughput", "[.benchmark][Checksum]")
+{
+    using Kernel = tus::Sha1::Kernel;
+    constexpr size_t nstreams = 8;
+    std::vector<std::vector<unsigned char>> streams;
+    std::vector<std::string_view> pieces;
+    for (size_t i = 0; i < nstreams; ++i)
+    {
+        streams.push_back(Random_Bytes(4 * 1024 * 1024 + i));
+        pieces.emplace_back(reinterpret_cast<const char*>(streams[i].data()), streams[i].size() - i);
+    }
+
+    for (const auto& [kernel, name] : {std::pair{Kernel::Scalar, "scalar"},
+                                       std::pair{Kernel::ShaNi, "sha-ni"},
+                                       std::pair{Kernel::Avx2x8, "avx2 x8"}})
+    {
+        if (!tus::Sha1::Supported(kernel))
+            continue;
+        BENCHMARK(std::string("sha1 ") + name + ", 8 x 4 MiB")
+        {
+            std::vector<tus::Sha1> hashers(nstreams, tus::Sha1(kernel));
+            std::vector<tus::Sha1*> hasher_ptrs;
+            for (auto& h : hashers)
+                hasher_ptrs.push_back(&h);
+            tus::Sha1::UpdateMany(hasher_ptrs.data(), pieces.data(), nstreams);
+            return hashers[0].Digest();
+        };
+    }
+}
+
+TEST_CASE("Checksum throughput", "[.benchmark][Checksum]")
+{
+    const auto data = Random_Bytes(16 * 1024 * 1024);
+
+    for (const auto& alg : {"sha1", "sha256", "crc32c", "xxh3"})
+    {
+        BENCHMARK(std::string(alg) + " of 16 MiB")
+        {
+            auto cs = ChecksumRegistry::Instance().Create(alg);
+            cs->Update(data.data(), data.size());
+            return cs->Digest();
+        };
+    }
+}
@@ -0,0 +1,195 @@
+#include "include/codec.hpp"
+
+#include <boost/algorithm/hex.hpp>
+#include <boost/archive/iterators/base64_from_binary.hpp>
+#include <boost/archive/iterators/binary_from_base64.hpp>
+#include <boost/archive/iterators/transform_width.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+using tus::Base64Kernel;
+
+namespace
+{
+// The decoder and comparison TusManager used before the codec module, kept
+// as the reference the new code must agree with
+std::string Legacy_Base64_To_Bin(const std::string_view &shastr)
+{
+    namespace ar_iters = boost::archive::iterators;
+    using ItBinaryT = ar_iters::transform_width<
+                        ar_iters::binary_from_base64<std::string::const_iterator>,
+                        8, 6>;
+
+    std::string input(std::begin(shastr), std::end(shastr));
+    std::string output;
+    output.reserve(24);
+
+    size_t pad_chars(std::count(input.begin(), input.end(), '='));
+    std::replace(input.begin(), input.end(), '=', 'A');
+    try
+    {
+        std::copy(ItBinaryT(input.begin()), ItBinaryT(input.end()),
+                  std::back_inserter(output));
+    } catch (std::exception const &) {}
+    output.resize(output.size() - pad_chars);
+    return output;
+}
+
+bool Legacy_CheckSum_Match(const std::string_view& hexstr, const std::string_view& b64_bin)
+{
+    const char* digits = "0123456789ABCDEF";
+    assert(!(hexstr.size() % 2));
+
+    if (2 * b64_bin.size() != hexstr.size())
+        return false;
+    for (size_t i = 0; i < hexstr.size(); i += 2)
+    {
+        unsigned char uc = b64_bin[i / 2];
+        if (hexstr[i]   != digits[(uc & 0xf0) >> 4] ||
+            hexstr[i+1] != digits[(uc & 0x0f)])
+            return false;
+    }
+    return true;
+}
+
+std::string Legacy_Hex(const std::string& bin)
+{
+    std::string ret;
+    boost::algorithm::hex(std::begin(bin), std::end(bin), std::back_inserter(ret));
+    return ret;
+}
+
+std::string To_Base64(const std::string& bin)
+{
+    namespace ar_iters = boost::archive::iterators;
+    using ItBase64T = ar_iters::base64_from_binary<
+                        ar_iters::transform_width<std::string::const_iterator, 6, 8>>;
+    std::string ret(ItBase64T(bin.begin()), ItBase64T(bin.end()));
+    ret.append((3 - bin.size() % 3) % 3, '=');
+    return ret;
+}
+
+std::string Random_String(std::mt19937& rng, size_t size)
+{
+    std::string ret(size, '\0');
+    for (auto& c : ret)
+        c = static_cast<char>(rng());
+    return ret;
+}
+
+std::string Decode(std::string_view b64, Base64Kernel kernel, bool& ok)
+{
+    const auto size = tus::Base64DecodedSize(b64);
+    ok = size != std::string_view::npos;
+    if (!ok)
+        return "";
+    std::vector<unsigned char> out(size);
+    ok = tus::Base64Decode(b64, out.data(), kernel);
+    return std::string(out.begin(), out.end());
+}
+}
+
+TEST_CASE("Base64 decode", "[Codec]")
+{
+    const auto kernel = GENERATE(Base64Kernel::Scalar, Base64Kernel::Ssse3, Base64Kernel::Avx2);
+    if (!tus::Base64Supported(kernel))
+        return;
+    INFO("kernel " << static_cast<int>(kernel));
+    bool ok;
+
+    CHECK(Decode("", kernel, ok).empty());
+    CHECK(ok);
+    CHECK(Decode("aGVsbG8gd29ybGQ=", kernel, ok) == "hello world");
+    CHECK(ok);
+    CHECK(Decode("aGVsbG8gd29ybGQh", kernel, ok) == "hello world!");
+    CHECK(ok);
+    CHECK(Decode("aGVsbG8gd29ybA==", kernel, ok) == "hello worl");
+    CHECK(ok);
+
+    SECTION("rejects malformed input")
+    {
+        for (const char* bad : {"aGVsbG8", "aGVsbG8gd29ybA=", "aGVsbG8gd29yb===",
+                                "aGVs=G8gd29ybGQh", "aGVsbG8gd29y bGQ", "aGVsbG8-d29ybGQh",
+                                "aGVsbG8gd29ybGQhaGVsbG8gd29ybGQhaGVsbG8gd29ybGQh*GVs"})
+        {
+            INFO(bad);
+            Decode(bad, kernel, ok);
+            CHECK(!ok);
+            CHECK(!tus::Base64Matches(bad, Legacy_Base64_To_Bin(bad), kernel));
+        }
+    }
+
+    SECTION("agrees with the legacy decoder on random input")
+    {
+        std::mt19937 rng(7);
+        for (int iter = 0; iter < 2000; ++iter)
+        {
+            const auto bin = Random_String(rng, rng() % 300);
+            const auto b64 = To_Base64(bin);
+            INFO(b64);
+            REQUIRE(Decode(b64, kernel, ok) == bin);
+            REQUIRE(ok);
+            REQUIRE(Legacy_Base64_To_Bin(b64) == bin);
+
+            // Agreement of the new and the old comparison
+            const auto hex = Legacy_Hex(bin);
+            REQUIRE(tus::HexEncode(bin) == hex);
+            REQUIRE(tus::Base64Matches(b64, bin, kernel) == Legacy_CheckSum_Match(hex, Legacy_Base64_To_Bin(b64)));
+
+            if (!bin.empty())
+            {
+                auto other = bin;
+                other[rng() % other.size()] ^= static_cast<char>(1 + rng() % 255);
+                REQUIRE(!tus::Base64Matches(b64, other, kernel));
+                REQUIRE(!Legacy_CheckSum_Match(Legacy_Hex(other), Legacy_Base64_To_Bin(b64)));
+
+                // One stray character anywhere must be caught
+                auto bad = b64;
+                bad[rng() % (bad.size() - 2)] = "-_ *.\n"[rng() % 6];
+                REQUIRE(!tus::Base64Matches(bad, bin, kernel));
+            }
+        }
+    }
+}
+
+TEST_CASE("Base64 decode throughput", "[.benchmark][Codec]")
+{
+    std::mt19937 rng(11);
+    const auto digest = Random_String(rng, 32); // sha256
+    const auto digest_b64 = To_Base64(digest);
+    const auto digest_hex = Legacy_Hex(digest);
+
+    BENCHMARK("legacy: sha256 digest hex vs decoded header")
+    {
+        return Legacy_CheckSum_Match(digest_hex, Legacy_Base64_To_Bin(digest_b64));
+    };
+    BENCHMARK("Base64Matches: sha256 digest")
+    {
+        return tus::Base64Matches(digest_b64, digest);
+    };
+
+    const auto blob = Random_String(rng, 3 * 1024 * 1024);
+    const auto blob_b64 = To_Base64(blob);
+    std::vector<unsigned char> out(blob.size());
+    BENCHMARK("legacy: decode 4 MiB")
+    {
+        return Legacy_Base64_To_Bin(blob_b64);
+    };
+    for (const auto& [kernel, name] : {std::pair{Base64Kernel::Scalar, "scalar"},
+                                       std::pair{Base64Kernel::Ssse3, "ssse3"},
+                                       std::pair{Base64Kernel::Avx2, "avx2"}})
+    {
+        if (!tus::Base64Supported(kernel))
+            continue;
+        BENCHMARK(std::string(name) + ": decode 4 MiB")
+        {
+            return tus::Base64Decode(blob_b64, out.data(), kernel);
+        };
+    }
+}
@@ -0,0 +1,146 @@
+#include "include/fair_share.hpp"
+
+#include <boost/asio/io_context.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+using tus::FairShare;
+using namespace std::chrono_literals;
+
+namespace
+{
+// An upload reading one grant after the other, as a connection does,
+// counting the bytes it got
+struct Reader
+{
+    FairShare& fs;
+    const std::string client;
+    uint64_t& got;
+
+    void Read(uint64_t bytes)
+    {
+        fs.Acquire(client, bytes, [this, bytes](uint64_t n) {
+            REQUIRE(n >= 1);
+            REQUIRE(n <= bytes);
+            got += n;
+            Read(bytes);
+        });
+    }
+};
+} // namespace
+
+TEST_CASE("Nothing is acquired without limits", "[FairShare]")
+{
+    boost::asio::io_context ioc;
+    CHECK(!FairShare(ioc, {}).Enabled());
+    FairShare::Config config;
+    config.total_rate = 1;
+    CHECK(FairShare(ioc, config).Enabled());
+}
+
+TEST_CASE("Grants come at the client's rate", "[FairShare]")
+{
+    boost::asio::io_context ioc;
+    FairShare::Config config;
+    config.client_rate = 1 << 20;
+    config.burst = 64 * 1024;
+    config.quantum = 16 * 1024;
+    FairShare fs(ioc, config);
+
+    uint64_t a = 0, b = 0;
+    Reader ra{fs, "10.0.0.1", a}, rb{fs, "10.0.0.2", b};
+    ra.Read(64 * 1024);
+    rb.Read(64 * 1024);
+    const auto start = std::chrono::steady_clock::now();
+    ioc.run_for(500ms);
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    // Each its own bucket, whatever the other one takes
+    for (const auto got : {a, b})
+    {
+        CHECK(got <= config.burst + elapsed.count() * config.client_rate + config.quantum);
+        CHECK(got >= config.burst + 0.5 * 0.5 * config.client_rate);
+    }
+}
+
+TEST_CASE("Clients share the total rate whatever their connections", "[FairShare]")
+{
+    boost::asio::io_context ioc;
+    FairShare::Config config;
+    config.total_rate = 2 << 20;
+    config.burst = 64 * 1024;
+    config.quantum = 16 * 1024;
+    FairShare fs(ioc, config);
+
+    uint64_t many = 0, one = 0;
+    std::vector<Reader> readers;
+    readers.reserve(9);
+    for (int i = 0; i < 8; ++i)
+        readers.push_back({fs, "10.0.0.1", many});
+    readers.push_back({fs, "10.0.0.2", one});
+    for (auto& r : readers)
+        r.Read(64 * 1024);
+    ioc.run_for(500ms);
+
+    const auto total = many + one;
+    CHECK(total <= config.burst + config.total_rate + config.quantum);
+    CHECK(one >= total * 2 / 5);
+    CHECK(many >= total * 2 / 5);
+}
+
+TEST_CASE("Bytes released are granted again", "[FairShare]")
+{
+    boost::asio::io_context ioc;
+    FairShare::Config config;
+    config.client_rate = 1024;
+    config.burst = config.quantum = 64 * 1024;
+    FairShare fs(ioc, config);
+
+    uint64_t first = 0, second = 0;
+    fs.Acquire("10.0.0.1", config.burst, [&](uint64_t n) { first = n; });
+    ioc.run_for(50ms);
+    REQUIRE(first == config.burst);
+
+    // A minute away at this rate, unless the first grant is given back
+    fs.Acquire("10.0.0.1", config.burst, [&](uint64_t n) { second = n; });
+    ioc.restart();
+    ioc.run_for(50ms);
+    CHECK(second == 0);
+    fs.Release("10.0.0.1", first);
+    ioc.restart();
+    ioc.run_for(50ms);
+    CHECK(second == config.burst);
+}
+
+TEST_CASE("Stopping drops the waiters", "[FairShare]")
+{
+    boost::asio::io_context ioc;
+    FairShare::Config config;
+    config.client_rate = 1024;
+    config.burst = config.quantum = 64 * 1024;
+    FairShare fs(ioc, config);
+
+    // What a waiter keeps alive, its connection
+    auto held = std::make_shared<int>(0);
+    int granted = 0;
+    fs.Acquire("10.0.0.1", config.burst, [&granted](uint64_t) { ++granted; });
+    fs.Acquire("10.0.0.1", config.burst, [&granted, held](uint64_t) { ++granted; });
+    ioc.run_for(50ms);
+    REQUIRE(granted == 1);
+    CHECK(held.use_count() == 2);
+
+    fs.Stop();
+    fs.Acquire("10.0.0.2", 1, [&granted](uint64_t) { ++granted; });
+    ioc.restart();
+    // Returns as soon as nothing is left to run, the timer included
+    ioc.run_for(10s);
+    CHECK(granted == 1);
+    CHECK(held.use_count() == 1);
+}
@@ -0,0 +1,118 @@
+#include "include/fd_cache.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <catch2/catch.hpp>
+
+using tus::FdCache;
+using tus::UploadKey;
+
+namespace
+{
+int Open_Fd()
+{
+    return ::open("/dev/null", O_RDONLY);
+}
+
+bool Is_Open(int fd)
+{
+    return ::fcntl(fd, F_GETFD) != -1;
+}
+} // namespace
+
+TEST_CASE("Take what was put", "[FdCache]")
+{
+    FdCache cache(4);
+    const UploadKey key{1, 2};
+    CHECK(!cache.Take(key));
+
+    const int fd = Open_Fd();
+    cache.Put(key, fd);
+    CHECK(cache.Size() == 1);
+    const auto got = cache.Take(key);
+    REQUIRE(got);
+    CHECK(*got == fd);
+    CHECK(cache.Size() == 0);
+    CHECK(!cache.Take(key));
+
+    const auto stats = cache.GetStats();
+    CHECK(stats.hits == 1);
+    CHECK(stats.misses == 2);
+    CHECK(stats.evictions == 0);
+    ::close(*got);
+}
+
+TEST_CASE("Eviction closes the least recently put", "[FdCache]")
+{
+    FdCache cache(2);
+    const int a = Open_Fd(), b = Open_Fd(), c = Open_Fd();
+    cache.Put({0, 1}, a);
+    cache.Put({0, 2}, b);
+    cache.Put({0, 3}, c);
+    CHECK(cache.Size() == 2);
+    CHECK(cache.GetStats().evictions == 1);
+    CHECK(!Is_Open(a));
+    CHECK(Is_Open(b));
+    CHECK(!cache.Take({0, 1}));
+
+    SECTION("shrinking evicts")
+    {
+        cache.SetCapacity(1);
+        CHECK(cache.Size() == 1);
+        CHECK(!Is_Open(b));
+        CHECK(Is_Open(c));
+    }
+
+    SECTION("dropping closes")
+    {
+        cache.Drop({0, 2});
+        CHECK(cache.Size() == 1);
+        CHECK(!Is_Open(b));
+        CHECK(cache.GetStats().evictions == 1);
+        cache.Drop({0, 2});
+    }
+}
+
+TEST_CASE("Descriptors that cannot be cached are closed", "[FdCache]")
+{
+    SECTION("already cached")
+    {
+        FdCache cache(4);
+        const int a = Open_Fd(), b = Open_Fd();
+        cache.Put({0, 1}, a);
+        cache.Put({0, 1}, b);
+        CHECK(cache.Size() == 1);
+        CHECK(Is_Open(a));
+        CHECK(!Is_Open(b));
+    }
+
+    SECTION("caching turned off")
+    {
+        FdCache cache(0);
+        const int a = Open_Fd();
+        cache.Put({0, 1}, a);
+        CHECK(cache.Size() == 0);
+        CHECK(!Is_Open(a));
+    }
+
+    SECTION("closed with the cache")
+    {
+        const int a = Open_Fd();
+        {
+            FdCache cache(4);
+            cache.Put({0, 1}, a);
+        }
+        CHECK(!Is_Open(a));
+    }
+}
+
+TEST_CASE("Capacity is bounded by RLIMIT_NOFILE", "[FdCache]")
+{
+    CHECK(FdCache::MaxCapacity() > 0);
+    CHECK(FdCache::DefaultCapacity() <= FdCache::MaxCapacity());
+    FdCache cache(static_cast<size_t>(-1));
+    CHECK(cache.Capacity() == FdCache::MaxCapacity());
+    cache.SetCapacity(3);
+    CHECK(cache.Capacity() == 3);
+}
@@ -1,8 +1,19 @@
 #include "include/files_manager.hpp"
 
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <future>
 #include <fstream>
+#include <iterator>
+#include <limits>
 #include <system_error>
 #include <thread>
+#include <tuple>
+#include <vector>
 
 
 #define CATCH_CONFIG_MAIN
@@ -356,3 +367,998 @@ TEST_CASE("Digest Hello World", "[FilesManager]")
     fm.RmAllFiles();
     REQUIRE(fm.Size() == 0);
 }
+
+namespace
+{
+// Uploads left behind in dir by an earlier FilesManager, each with its
+// first data_len bytes committed
+std::vector<std::string> Make_Uploads(const std::string& dir, size_t cnt, size_t data_len)
+{
+    tus::FilesManager fm(dir);
+    std::vector<std::string> ret;
+    const std::string data(data_len, 'x');
+    for (size_t i = 0; i < cnt; ++i)
+    {
+        auto res = fm.NewTmpFilesResource();
+        ret.push_back(res.Uuid());
+        REQUIRE(res.Initialize(1000, "filename dGVzdA==") == static_cast<std::errc>(0));
+        tus::FileResource fres(std::move(res));
+        REQUIRE(fres.Write(data));
+        REQUIRE(fres.Commit());
+    }
+    return ret;
+}
+}
+
+TEST_CASE("Recovery after restart", "[FilesManager]")
+{
+    const std::string dir = "recovery_dir";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directory(dir);
+
+    const auto uuids = Make_Uploads(dir, 5, 10);
+
+    SECTION("nothing is known before Recover")
+    {
+        tus::FilesManager fm(dir);
+        CHECK(fm.Size() == 0);
+        CHECK(fm.GetFileResource(uuids[0]).first == std::errc::no_such_file_or_directory);
+    }
+
+    SECTION("the journal gives every upload with its metadata")
+    {
+        const auto threads = GENERATE(1u, 4u);
+        tus::FilesManager fm(dir);
+        const auto stats = fm.Recover(threads);
+        CHECK(stats.recovered == uuids.size());
+        CHECK(stats.repaired == 0);
+        CHECK(stats.skipped == 0);
+        CHECK(stats.imported == 0);
+        CHECK(stats.torn == 0);
+        CHECK(!stats.clean);
+        REQUIRE(fm.Size() == uuids.size());
+
+        auto [res, fres] = fm.GetFileResource(uuids[2]);
+        REQUIRE(res == static_cast<std::errc>(0));
+        const auto md = fres.GetMetadata();
+        CHECK(md.offset == 10);
+        CHECK(md.length == 1000);
+        CHECK(md.comment == "filename dGVzdA==");
+        CHECK(stats.reserved == uuids.size() * 1000);
+        CHECK(fm.Reserved() == stats.reserved);
+        // One file per upload
+        for (const auto& uuid : uuids)
+            CHECK(!std::filesystem::exists(dir + "/" + uuid + tus::FilesManager::METADATA_FNAME_SUFFIX));
+    }
+
+    SECTION("offset beyond the data is cut back")
+    {
+        std::filesystem::resize_file(dir + "/" + uuids[1], 4);
+        {
+            tus::FilesManager fm(dir);
+            const auto stats = fm.Recover();
+            CHECK(stats.recovered == uuids.size());
+            CHECK(stats.repaired == 1);
+
+            auto [res, fres] = fm.GetFileResource(uuids[1]);
+            REQUIRE(res == static_cast<std::errc>(0));
+            CHECK(fres.GetMetadata().offset == 4);
+        }
+        // and journaled so
+        tus::FilesManager fm(dir);
+        CHECK(fm.Recover().repaired == 0);
+        CHECK(fm.GetMetadata(uuids[1]).second.offset == 4);
+    }
+
+    SECTION("uploads without data and removed ones are left out")
+    {
+        std::filesystem::remove(dir + "/" + uuids[0]);
+        std::ofstream(dir + "/notes.txt") << "junk";
+        {
+            tus::FilesManager fm(dir);
+            fm.Recover();
+            auto [res, fres] = fm.GetFileResource(uuids[4]);
+            fres.Delete();
+            fres.Commit();
+        }
+
+        tus::FilesManager fm(dir);
+        const auto stats = fm.Recover(2);
+        CHECK(stats.recovered == uuids.size() - 2);
+        CHECK(stats.skipped == 0);
+        CHECK(fm.GetFileResource(uuids[0]).first == std::errc::no_such_file_or_directory);
+        CHECK(fm.GetFileResource(uuids[3]).first == static_cast<std::errc>(0));
+        CHECK(fm.GetFileResource(uuids[4]).first == std::errc::no_such_file_or_directory);
+    }
+
+    SECTION("a torn end of the journal is dropped")
+    {
+        const auto jpath = dir + "/" + tus::FilesManager::JOURNAL_FNAME;
+        std::filesystem::resize_file(jpath, std::filesystem::file_size(jpath) - 5);
+
+        tus::FilesManager fm(dir);
+        const auto stats = fm.Recover();
+        CHECK(stats.torn > 0);
+        CHECK(stats.recovered == uuids.size());
+        // its last commit is lost, the data is still there
+        CHECK(fm.GetMetadata(uuids[4]).second.offset == 0);
+        CHECK(fm.GetMetadata(uuids[3]).second.offset == 10);
+    }
+
+    SECTION("a journal compacted at shutdown is trusted once")
+    {
+        {
+            tus::FilesManager fm(dir);
+            fm.Recover();
+            {
+                auto [res, fres] = fm.GetFileResource(uuids[4]);
+                fres.Delete();
+                fres.Commit();
+            }
+            REQUIRE(fm.CompactJournal(true));
+        }
+        std::filesystem::resize_file(dir + "/" + uuids[1], 4);
+        {
+            tus::FilesManager fm(dir);
+            const auto stats = fm.Recover();
+            CHECK(stats.clean);
+            CHECK(stats.repaired == 0);
+            CHECK(stats.recovered == uuids.size() - 1);
+            CHECK(fm.Reserved() == (uuids.size() - 1) * 1000);
+            CHECK(fm.GetFileResource(uuids[3]).first == static_cast<std::errc>(0));
+            CHECK(fm.GetFileResource(uuids[4]).first == std::errc::no_such_file_or_directory);
+        }
+        {   // a crash from now on must not trust it
+            tus::FilesManager fm(dir);
+            const auto stats = fm.Recover();
+            CHECK(!stats.clean);
+            CHECK(stats.repaired == 1);
+            CHECK(stats.recovered == uuids.size() - 1);
+        }
+    }
+
+    SECTION("a clean journal is checked when asked to")
+    {
+        {
+            tus::FilesManager fm(dir);
+            fm.Recover();
+            REQUIRE(fm.CompactJournal(true));
+        }
+        std::filesystem::resize_file(dir + "/" + uuids[1], 4);
+        tus::FilesManager fm(dir);
+        const auto stats = fm.Recover(1, false);
+        CHECK(!stats.clean);
+        CHECK(stats.repaired == 1);
+    }
+
+    SECTION("a journal is not marked clean while commits may follow")
+    {
+        tus::FilesManager fm(dir);
+        fm.Recover();
+        {
+            auto [res, fres] = fm.GetFileResource(uuids[0]);
+            REQUIRE(res == static_cast<std::errc>(0));
+            CHECK(!fm.CompactJournal(true));
+        }
+        fm.SetDurability(tus::Durability::Group);
+        CHECK(!fm.CompactJournal(true));
+        fm.FlushCommits();
+        CHECK(fm.CompactJournal(true));
+        fm.SetDurability(tus::Durability::None);
+
+        tus::FilesManager fm2(dir);
+        CHECK(fm2.Recover().clean);
+    }
+
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Recovery of uploads with metadata files", "[FilesManager]")
+{
+    const std::string dir = "legacy_dir";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directory(dir);
+
+    // As written before there was a journal: offset and length in binary,
+    // the end of that line, then the comment and concat lines
+    auto legacy_upload = [&dir](const std::string& uuid, int64_t offset, uint64_t length,
+                                const std::string& comment, const std::string& data) {
+        std::ofstream md(dir + "/" + uuid + tus::FilesManager::METADATA_FNAME_SUFFIX, std::ios::binary);
+        md.write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+        md.write(reinterpret_cast<const char*>(&length), sizeof(length));
+        md << '\n' << comment << "\npartial\n";
+        std::ofstream(dir + "/" + uuid, std::ios::binary) << data;
+    };
+    const std::string a = "0a1b2c3d-0000-4000-8000-000000000001";
+    const std::string b = "0a1b2c3d-0000-4000-8000-000000000002";
+    legacy_upload(a, 5, 100, "filename dGVzdA==", "hello");
+    legacy_upload(b, 9, 100, "", "hi");   // got ahead of its data
+    std::ofstream(dir + "/0a1b2c3d-0000-4000-8000-000000000003.mdata") << "torn";
+    // Long enough, but its fixed line is not ended
+    legacy_upload("0a1b2c3d-0000-4000-8000-000000000004", 0, 100, "", "");
+    {
+        std::fstream md(dir + "/0a1b2c3d-0000-4000-8000-000000000004.mdata",
+                        std::ios::binary | std::ios::in | std::ios::out);
+        md.seekp(sizeof(int64_t) + sizeof(uint64_t));
+        md.put('x');
+    }
+    std::ofstream(dir + "/.index") << "betus-index 2\n";
+
+    {
+        tus::FilesManager fm(dir);
+        const auto stats = fm.Recover(2);
+        CHECK(stats.imported == 2);
+        CHECK(stats.recovered == 2);
+        CHECK(stats.repaired == 1);
+        CHECK(stats.skipped == 2);
+        CHECK(fm.Reserved() == 200);
+        const auto [res, md] = fm.GetMetadata(a);
+        CHECK(res == static_cast<std::errc>(0));
+        CHECK(md.offset == 5);
+        CHECK(md.length == 100);
+        CHECK(md.comment == "filename dGVzdA==");
+        CHECK(md.concat == "partial");
+        CHECK(fm.GetMetadata(b).second.offset == 2);
+    }
+    CHECK(!std::filesystem::exists(dir + "/" + a + tus::FilesManager::METADATA_FNAME_SUFFIX));
+    CHECK(!std::filesystem::exists(dir + "/" + b + tus::FilesManager::METADATA_FNAME_SUFFIX));
+    CHECK(!std::filesystem::exists(dir + "/.index"));
+
+    // From the journal from now on
+    tus::FilesManager fm(dir);
+    const auto stats = fm.Recover();
+    CHECK(stats.imported == 0);
+    CHECK(stats.recovered == 2);
+    CHECK(fm.GetMetadata(a).second.comment == "filename dGVzdA==");
+
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Recovery of many uploads", "[.benchmark][FilesManager]")
+{
+    const std::string dir = "recovery_bench_dir";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directory(dir);
+    const auto uuids = Make_Uploads(dir, 20000, 1);
+
+    // A clean journal is trusted by the next run only, so each way is timed
+    // once, by the figure the server reports at startup
+    for (const auto& [threads, clean] : {std::pair{1u, false}, std::pair{4u, false},
+                                         std::pair{1u, true}})
+    {
+        if (clean)
+        {
+            tus::FilesManager fm(dir);
+            fm.Recover(1, false);
+            REQUIRE(fm.CompactJournal(true));
+        }
+        tus::FilesManager fm(dir);
+        const auto stats = fm.Recover(threads);
+        CHECK(stats.recovered == uuids.size());
+        CHECK(stats.clean == clean);
+        WARN((clean ? "clean journal" : "journal and data checked by " + std::to_string(threads) + " threads")
+             << ": " << stats.elapsed.count() << " us for " << stats.recovered << " uploads, "
+             << fm.JournalSize() << " bytes of journal");
+    }
+
+    std::filesystem::remove_all(dir);
+}
+
+namespace
+{
+// Body as separate segments of seg_sz bytes over data, the way pieces read
+// off a socket arrive
+std::vector<boost::asio::const_buffer> Split_Body(const std::string& data, size_t seg_sz)
+{
+    std::vector<boost::asio::const_buffer> ret;
+    for (size_t pos = 0; pos < data.size(); pos += seg_sz)
+        ret.emplace_back(data.data() + pos, std::min(seg_sz, data.size() - pos));
+    return ret;
+}
+
+// Read and write class syscalls made by this process so far
+std::pair<size_t, size_t> Io_Syscalls()
+{
+    std::ifstream is("/proc/self/io");
+    std::string key;
+    size_t val = 0, syscr = 0, syscw = 0;
+    while (is >> key >> val)
+    {
+        if (key == "syscr:")
+            syscr = val;
+        else if (key == "syscw:")
+            syscw = val;
+    }
+    return {syscr, syscw};
+}
+}
+
+TEST_CASE("Gathering write", "[FilesManager]")
+{
+    tus::FilesManager fm(".");
+    std::string uuid;
+    {
+        auto res = fm.NewTmpFilesResource();
+        REQUIRE(res.Initialize(1000) == static_cast<std::errc>(0));
+        uuid = res.Uuid();
+        fm.Persist(res);
+    }
+
+    // More segments than one pwritev() batch takes
+    std::string data;
+    for (size_t i = 0; i < 150; ++i)
+        data.append(7, 'a' + i % 26);
+    {
+        auto [res, fres] = fm.GetFileResource(uuid);
+        REQUIRE(fres.Write(3, Split_Body(data, 7)) == data.size());
+        REQUIRE(fres.Commit());
+    }
+
+    auto [res, fres] = fm.GetFileResource(uuid);
+    CHECK(fres.GetMetadata().offset == 3 + static_cast<std::streamoff>(data.size()));
+    std::ifstream is(uuid, std::ios_base::binary);
+    std::string content((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    CHECK(content.substr(3) == data);
+
+    fm.RmAllFiles();
+}
+
+TEST_CASE("Splice from a pipe", "[FilesManager]")
+{
+    tus::FilesManager fm(".");
+    std::string uuid;
+    {
+        auto res = fm.NewTmpFilesResource();
+        REQUIRE(res.Initialize(1000) == static_cast<std::errc>(0));
+        uuid = res.Uuid();
+        fm.Persist(res);
+    }
+
+    int pfd[2];
+    REQUIRE(::pipe(pfd) == 0);
+    const std::string data(600, 's');
+    REQUIRE(::write(pfd[1], data.data(), data.size()) == static_cast<ssize_t>(data.size()));
+    {
+        auto [res, fres] = fm.GetFileResource(uuid);
+        CHECK(fres.Splice(pfd[0], 5, data.size()) == data.size());
+        REQUIRE(fres.Commit());
+    }
+    ::close(pfd[0]);
+    ::close(pfd[1]);
+
+    auto [res, fres] = fm.GetFileResource(uuid);
+    CHECK(fres.GetMetadata().offset == 5 + static_cast<std::streamoff>(data.size()));
+    std::ifstream is(uuid, std::ios_base::binary);
+    std::string content((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    CHECK(content.substr(5) == data);
+
+    fm.RmAllFiles();
+}
+
+TEST_CASE("Append parts", "[FilesManager]")
+{
+    tus::FilesManager fm(".");
+    auto make = [&](size_t len, const std::string& data, const std::string& concat) {
+        auto res = fm.NewTmpFilesResource();
+        REQUIRE(res.Initialize(len, "", concat) == static_cast<std::errc>(0));
+        const auto uuid = res.Uuid();
+        tus::FileResource fres(std::move(res));
+        REQUIRE(fres.Write(data));
+        REQUIRE(fres.Commit());
+        return uuid;
+    };
+    const std::string data1(100000, '1'), data2(3333, '2');
+    const auto uuid1 = make(data1.size(), data1, "partial");
+    const auto uuid2 = make(data2.size(), data2, "partial");
+    const auto final_uuid = make(data1.size() + data2.size(), "", "final;/files/" + uuid1 + " /files/" + uuid2);
+    const auto short_uuid = make(data2.size() + 1, "", "");
+    {
+        auto [res1, part1] = fm.GetFileResource(uuid1);
+        auto [res2, part2] = fm.GetFileResource(uuid2);
+        auto [res, fres] = fm.GetFileResource(final_uuid);
+        CHECK(part1.GetMetadata().concat == "partial");
+        CHECK(fres.Append(part1, data1.size()));
+        CHECK(fres.Append(part2, data2.size()));
+        REQUIRE(fres.Commit());
+
+        auto [sres, sfres] = fm.GetFileResource(short_uuid);
+        CHECK(!sfres.Append(part2, data2.size() + 1)); // more than the part holds
+    }
+
+    auto [res, fres] = fm.GetFileResource(final_uuid);
+    const auto md = fres.GetMetadata();
+    CHECK(md.offset == static_cast<std::streamoff>(data1.size() + data2.size()));
+    CHECK(md.comment.empty());
+    CHECK(md.concat == "final;/files/" + uuid1 + " /files/" + uuid2);
+    std::ifstream is(final_uuid, std::ios_base::binary);
+    std::string content((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    CHECK(content == data1 + data2);
+
+    fm.RmAllFiles();
+}
+
+TEST_CASE("Expiration", "[FilesManager]")
+{
+    using namespace std::chrono_literals;
+    using Clock = std::chrono::system_clock;
+
+    tus::FilesManager fm(".");
+    auto create = [&] {
+        auto res = fm.NewTmpFilesResource();
+        REQUIRE(res.Initialize(1000) == static_cast<std::errc>(0));
+        fm.Persist(res);
+        return res.Uuid();
+    };
+
+    SECTION("uploads are kept without a ttl")
+    {
+        const auto uuid = create();
+        CHECK(fm.Expires(uuid) == Clock::time_point());
+        CHECK(fm.ReapExpired(100, Clock::now() + 1000h).files == 0);
+        CHECK(fm.Size() == 1);
+    }
+
+    SECTION("expired uploads are reaped in batches")
+    {
+        fm.SetTtl(60s);
+        std::vector<std::string> uuids;
+        for (int i = 0; i < 5; ++i)
+            uuids.push_back(create());
+        const auto expires = fm.Expires(uuids[0]);
+        CHECK(expires > Clock::now() + 59s);
+        CHECK(expires <= Clock::now() + 60s);
+        CHECK(fm.GetFileResource(uuids[0]).first == static_cast<std::errc>(0));
+
+        const auto later = Clock::now() + 61s;
+        CHECK(fm.ReapExpired(100).files == 0);
+        {
+            auto [res, fres] = fm.GetFileResource(uuids[4]); // in use, left alone
+            REQUIRE(res == static_cast<std::errc>(0));
+            const auto first = fm.ReapExpired(2, later);
+            CHECK(first.files == 2);
+            CHECK(first.bytes >= 2000);
+            CHECK(fm.ReapExpired(2, later).files == 2);
+            CHECK(fm.ReapExpired(2, later).files == 0);
+        }
+        CHECK(fm.Size() == 1);
+        CHECK(fm.Reserved() == 1000);
+        CHECK(fm.ReapExpired(2, later).files == 1);
+        CHECK(fm.Size() == 0);
+        CHECK(fm.Reserved() == 0);
+        CHECK(fm.Reclaimed().files == 5);
+        for (const auto& uuid : uuids)
+            CHECK(!std::filesystem::exists(uuid));
+    }
+
+    SECTION("writing restarts the time to live")
+    {
+        fm.SetTtl(60s);
+        const auto uuid = create();
+        const auto before = fm.Expires(uuid);
+        std::this_thread::sleep_for(5ms);
+        {
+            auto [res, fres] = fm.GetFileResource(uuid);
+            CHECK(fres.Write("data"));
+            CHECK(fres.Commit());
+        }
+        CHECK(fm.Expires(uuid) > before);
+    }
+
+    SECTION("recovered uploads expire after their last write")
+    {
+        const std::string dir = "expiry_dir";
+        std::filesystem::remove_all(dir);
+        std::filesystem::create_directory(dir);
+        const auto uuids = Make_Uploads(dir, 2, 10);
+        {   // last written to two hours ago
+            const auto ago = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                 (Clock::now() - 2h).time_since_epoch());
+            const int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+            tus::Journal journal(dir_fd, tus::FilesManager::JOURNAL_FNAME);
+            CHECK(journal.Append({tus::Journal::Type::Offset, *tus::UploadKey::Parse(uuids[0]),
+                                  ago.count(), 10, 0, "", ""}));
+            ::close(dir_fd);
+        }
+
+        tus::FilesManager fm2(dir);
+        fm2.SetTtl(1h);
+        fm2.Recover(1, false);
+        CHECK(fm2.GetFileResource(uuids[0]).first == std::errc::no_such_file_or_directory);
+        CHECK(fm2.GetFileResource(uuids[1]).first == static_cast<std::errc>(0));
+        CHECK(fm2.ReapExpired(10).files == 1);
+        CHECK(fm2.Size() == 1);
+        std::filesystem::remove_all(dir);
+    }
+
+    fm.RmAllFiles();
+}
+
+TEST_CASE("Descriptor cache", "[FilesManager]")
+{
+    using namespace std::chrono_literals;
+
+    tus::FilesManager fm(".");
+    std::string uuid;
+    {
+        auto res = fm.NewTmpFilesResource();
+        REQUIRE(res.Initialize(1000) == static_cast<std::errc>(0));
+        uuid = res.Uuid();
+        fm.Persist(res);
+    }
+    const auto before = fm.FdCacheStats();
+
+    SECTION("kept open between requests")
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            auto [res, fres] = fm.GetFileResource(uuid);
+            REQUIRE(res == static_cast<std::errc>(0));
+            const std::string_view data = "data";
+            CHECK(fres.Write(i * 4, boost::asio::const_buffer(data.data(), data.size())) == 4);
+            CHECK(fres.Commit());
+        }
+        const auto stats = fm.FdCacheStats();
+        CHECK(stats.hits - before.hits == 3);
+        CHECK(stats.misses == before.misses);
+        auto [res, fres] = fm.GetFileResource(uuid);
+        CHECK(fres.GetMetadata().offset == 12);
+    }
+
+    SECTION("not cached when turned off")
+    {
+        fm.SetFdCacheCapacity(0);
+        CHECK(fm.GetFileResource(uuid).first == static_cast<std::errc>(0));
+        CHECK(fm.GetFileResource(uuid).first == static_cast<std::errc>(0));
+        CHECK(fm.FdCacheStats().hits == before.hits);
+    }
+
+    SECTION("dropped on delete")
+    {
+        {
+            auto [res, fres] = fm.GetFileResource(uuid);
+            fres.Delete();
+            CHECK(fres.Commit());
+        }
+        CHECK(!std::filesystem::exists(uuid));
+        CHECK(fm.GetFileResource(uuid).first == std::errc::no_such_file_or_directory);
+        CHECK(fm.FdCacheStats().hits - before.hits == 1);
+    }
+
+    SECTION("reopened when removed behind its back")
+    {
+        CHECK(fm.GetFileResource(uuid).first == static_cast<std::errc>(0));
+        REQUIRE(::remove(uuid.c_str()) == 0);
+        auto [res, fres] = fm.GetFileResource(uuid);
+        CHECK(!fres.IsOpen());
+    }
+
+    SECTION("dropped when reaped")
+    {
+        fm.SetTtl(1s);
+        {
+            auto [res, fres] = fm.GetFileResource(uuid);
+            CHECK(fres.Commit()); // starts the time to live
+        }
+        CHECK(fm.ReapExpired(10, std::chrono::system_clock::now() + 1h).files == 1);
+        CHECK(!std::filesystem::exists(uuid));
+        CHECK(fm.GetFileResource(uuid).first == std::errc::no_such_file_or_directory);
+    }
+
+    fm.RmAllFiles();
+}
+
+TEST_CASE("Metadata in memory", "[FilesManager]")
+{
+    tus::FilesManager fm(".");
+    std::string uuid;
+    {
+        auto res = fm.NewTmpFilesResource();
+        REQUIRE(res.Initialize(1000, "filename dGVzdA==", "partial") == static_cast<std::errc>(0));
+        uuid = res.Uuid();
+        fm.Persist(res);
+    }
+
+    SECTION("described at creation")
+    {
+        const auto [res, md] = fm.GetMetadata(uuid);
+        CHECK(res == static_cast<std::errc>(0));
+        CHECK(md.offset == 0);
+        CHECK(md.length == 1000);
+        CHECK(md.comment == "filename dGVzdA==");
+        CHECK(md.concat == "partial");
+        CHECK(fm.GetMetadata(uuid + "0").first == std::errc::no_such_file_or_directory);
+    }
+
+    SECTION("follows commits while in use")
+    {
+        auto [res, fres] = fm.GetFileResource(uuid);
+        REQUIRE(res == static_cast<std::errc>(0));
+        CHECK(fres.Write("data"));
+        CHECK(fm.GetMetadata(uuid).second.offset == 0);
+        CHECK(fres.Commit());
+        CHECK(fm.GetMetadata(uuid).second.offset == 4);
+    }
+
+    SECTION("files are not read")
+    {
+        REQUIRE(::remove(uuid.c_str()) == 0);
+        const auto [res, md] = fm.GetMetadata(uuid);
+        CHECK(res == static_cast<std::errc>(0));
+        CHECK(md.length == 1000);
+    }
+
+    SECTION("recovered uploads are described by the journal")
+    {
+        const std::string dir = "metadata_dir";
+        std::filesystem::remove_all(dir);
+        std::filesystem::create_directory(dir);
+        const auto uuids = Make_Uploads(dir, 2, 10);
+
+        tus::FilesManager fm2(dir);
+        fm2.Recover();
+        auto [res, md] = fm2.GetMetadata(uuids[0]);
+        CHECK(res == static_cast<std::errc>(0));
+        CHECK(md.offset == 10);
+        CHECK(md.comment == "filename dGVzdA==");
+        std::filesystem::remove_all(dir);
+    }
+
+    fm.RmAllFiles();
+}
+
+TEST_CASE("Reserved space", "[FilesManager]")
+{
+    tus::FilesManager fm(".");
+    REQUIRE(fm.Reserved() == 0);
+
+    SECTION("data file is allocated but stays empty")
+    {
+        auto res = fm.NewTmpFilesResource();
+        REQUIRE(res.Initialize(1 << 20) == static_cast<std::errc>(0));
+        CHECK(fm.Reserved() == 1 << 20);
+        struct stat st;
+        REQUIRE(::stat(res.Uuid().c_str(), &st) == 0);
+        CHECK(st.st_size == 0);
+        CHECK(st.st_blocks * 512 >= 1 << 20);
+    }
+
+    SECTION("released when the upload goes away")
+    {
+        {
+            auto res = fm.NewTmpFilesResource();
+            REQUIRE(res.Initialize(1000) == static_cast<std::errc>(0));
+            CHECK(fm.Reserved() == 1000);
+        }
+        CHECK(fm.Reserved() == 0);
+
+        std::string uuid;
+        for (int i = 0; i < 3; ++i)
+        {
+            auto res = fm.NewTmpFilesResource();
+            REQUIRE(res.Initialize(1000) == static_cast<std::errc>(0));
+            uuid = res.Uuid();
+            fm.Persist(res);
+        }
+        CHECK(fm.Reserved() == 3000);
+        {
+            auto [res, fres] = fm.GetFileResource(uuid);
+            fres.Delete();
+            fres.Commit();
+        }
+        CHECK(fm.Reserved() == 2000);
+        fm.RmAllFiles();
+        CHECK(fm.Reserved() == 0);
+    }
+
+    SECTION("quota is enforced up front")
+    {
+        fm.SetQuota(2500);
+        auto first = fm.NewTmpFilesResource();
+        REQUIRE(first.Initialize(2000) == static_cast<std::errc>(0));
+        auto second = fm.NewTmpFilesResource();
+        CHECK(second.Initialize(3000) == std::errc::file_too_large);
+        CHECK(second.Initialize(1000) == std::errc::no_space_on_device);
+        CHECK(fm.Reserved() == 2000);
+        REQUIRE(second.Initialize(500) == static_cast<std::errc>(0));
+        CHECK(fm.Reserved() == 2500);
+    }
+
+    SECTION("more than the volume holds")
+    {
+        auto res = fm.NewTmpFilesResource();
+        CHECK(res.Initialize(std::numeric_limits<size_t>::max() / 2) != static_cast<std::errc>(0));
+        CHECK(fm.Reserved() == 0);
+    }
+
+    fm.RmAllFiles();
+}
+
+TEST_CASE("Durability", "[FilesManager]")
+{
+    tus::FilesManager fm(".");
+    const std::string data = "durable data";
+
+    // Writes data and commits, returns what the durable callback got
+    auto write_commit = [&](const std::string& uuid) {
+        auto [res, fres] = fm.GetFileResource(uuid);
+        REQUIRE(res == static_cast<std::errc>(0));
+        REQUIRE(fres.Write(data));
+        std::promise<bool> durable;
+        auto fut = durable.get_future();
+        CHECK(fres.Commit([&durable](bool ok) { durable.set_value(ok); }));
+        return fut.get();
+    };
+    auto new_upload = [&] {
+        auto res = fm.NewTmpFilesResource();
+        REQUIRE(res.Initialize(data.size()) == static_cast<std::errc>(0));
+        const auto uuid = res.Uuid();
+        fm.Persist(res);
+        return uuid;
+    };
+
+    for (auto mode : {tus::Durability::None, tus::Durability::Sync, tus::Durability::Group})
+    {
+        fm.SetDurability(mode, {std::chrono::milliseconds(5), 1 << 20});
+        CHECK(fm.GetDurability() == mode);
+        const auto uuid = new_upload();
+        CHECK(write_commit(uuid));
+        CHECK(fm.GetMetadata(uuid).second.offset == static_cast<std::streamoff>(data.size()));
+        CHECK(fm.GroupCommitStats().commits == (mode == tus::Durability::Group ? 1 : 0));
+    }
+
+    SECTION("grouped commits of concurrent uploads share flushes")
+    {
+        fm.SetDurability(tus::Durability::Group, {std::chrono::milliseconds(50), 1 << 20});
+        constexpr int Uploads = 8;
+        std::vector<std::string> uuids;
+        for (int i = 0; i < Uploads; ++i)
+            uuids.push_back(new_upload());
+        std::vector<std::thread> writers;
+        std::atomic<int> durable{0};
+        for (const auto& uuid : uuids)
+            writers.emplace_back([&, uuid] { durable += write_commit(uuid); });
+        for (auto& w : writers)
+            w.join();
+        CHECK(durable == Uploads);
+        const auto stats = fm.GroupCommitStats();
+        CHECK(stats.commits == Uploads);
+        CHECK(stats.batches < Uploads);
+    }
+
+    SECTION("grouped offsets are stored once their data is durable")
+    {
+        fm.SetDurability(tus::Durability::Group, {std::chrono::hours(1), 1 << 30});
+        const auto uuid = new_upload();
+        bool durable = false;
+        {
+            auto [res, fres] = fm.GetFileResource(uuid);
+            REQUIRE(fres.Write(data));
+            CHECK(fres.Commit([&durable](bool ok) { durable = ok; }));
+        }
+        const auto journal_size = fm.JournalSize();
+        CHECK(!durable);
+        CHECK(fm.GetMetadata(uuid).second.offset == 0);
+
+        fm.FlushCommits();
+        CHECK(durable);
+        CHECK(fm.GetMetadata(uuid).second.offset == static_cast<std::streamoff>(data.size()));
+        CHECK(fm.JournalSize() > journal_size);
+    }
+
+    SECTION("deletion is reported through the callback too")
+    {
+        fm.SetDurability(tus::Durability::Group);
+        const auto uuid = new_upload();
+        auto [res, fres] = fm.GetFileResource(uuid);
+        fres.Delete();
+        bool called = false;
+        CHECK(fres.Commit([&called](bool ok) { called = ok; }));
+        CHECK(called);
+        CHECK(fm.GroupCommitStats().commits == 0);
+    }
+
+    fm.SetDurability(tus::Durability::None);
+    fm.RmAllFiles();
+}
+
+TEST_CASE("Commits compact the journal once it grew", "[FilesManager]")
+{
+    tus::FilesManager fm(".");
+    std::string uuid;
+    {
+        auto res = fm.NewTmpFilesResource();
+        REQUIRE(res.Initialize(100) == static_cast<std::errc>(0));
+        uuid = res.Uuid();
+        fm.Persist(res);
+    }
+
+    // Without any reaper calling for it: a record per commit, a few MiB of
+    // them before the first compaction
+    uint64_t largest = 0;
+    bool shrank = false;
+    for (int i = 0; i < 1000000 && !shrank; ++i)
+    {
+        auto [err, fres] = fm.GetFileResource(uuid);
+        REQUIRE(fres.Commit());
+        const auto size = fm.JournalSize();
+        shrank = size < largest;
+        largest = std::max(largest, size);
+    }
+    CHECK(shrank);
+    CHECK(largest >= 1 << 20);
+    CHECK(fm.JournalSize() < 64 * 1024);
+    CHECK(fm.GetMetadata(uuid).first == static_cast<std::errc>(0));
+
+    fm.RmAllFiles();
+}
+
+TEST_CASE("Commits by durability", "[.benchmark][FilesManager]")
+{
+    tus::FilesManager fm(".");
+    const std::string chunk(64 * 1024, 'd');
+    constexpr int Uploads = 16, Chunks = 32;
+
+    // Every upload has a writer, as concurrent PATCHes would
+    auto run = [&] {
+        std::vector<std::string> uuids;
+        for (int i = 0; i < Uploads; ++i)
+        {
+            auto res = fm.NewTmpFilesResource();
+            REQUIRE(res.Initialize(chunk.size() * Chunks) == static_cast<std::errc>(0));
+            uuids.push_back(res.Uuid());
+            fm.Persist(res);
+        }
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> writers;
+        for (const auto& uuid : uuids)
+            writers.emplace_back([&, uuid] {
+                for (int c = 0; c < Chunks; ++c)
+                {
+                    auto [res, fres] = fm.GetFileResource(uuid);
+                    fres.Write(c * chunk.size(), boost::asio::const_buffer(chunk.data(), chunk.size()));
+                    std::promise<bool> durable;
+                    fres.Commit([&durable](bool ok) { durable.set_value(ok); });
+                    durable.get_future().wait();
+                }
+            });
+        for (auto& w : writers)
+            w.join();
+        const std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+        fm.RmAllFiles();
+        return Uploads * Chunks / secs.count();
+    };
+
+    for (const auto& [mode, name] : {std::pair{tus::Durability::None, "none"},
+                                     std::pair{tus::Durability::Sync, "fdatasync"},
+                                     std::pair{tus::Durability::Group, "group"}})
+    {
+        fm.SetDurability(mode);
+        const auto rate = run();
+        const auto stats = fm.GroupCommitStats();
+        WARN(name << ": " << rate << " commits/s of 64 KiB by " << Uploads << " writers"
+             << (mode == tus::Durability::Group ? ", " + std::to_string(stats.batches) + " flushes" : ""));
+    }
+    fm.SetDurability(tus::Durability::None);
+}
+
+TEST_CASE("Syscalls per PATCH", "[.benchmark][FilesManager]")
+{
+    tus::FilesManager fm(".");
+    std::string uuid;
+    {
+        auto res = fm.NewTmpFilesResource();
+        REQUIRE(res.Initialize(1000) == static_cast<std::errc>(0));
+        uuid = res.Uuid();
+        fm.Persist(res);
+    }
+    const auto mdname = uuid + tus::FilesManager::METADATA_FNAME_SUFFIX;
+    std::ofstream{mdname};
+    using Body = std::vector<boost::asio::const_buffer>;
+
+    // What a PATCH did before: open both files by path, seek and write every
+    // segment through the stream, seek the metadata and store the offset
+    auto legacy_patch = [&](const Body& body) {
+        std::fstream dt(uuid), md(mdname);
+        dt.seekp(0, std::ios_base::beg);
+        for (const auto& b : body)
+            dt.write(static_cast<const char*>(b.data()), b.size());
+        std::streamoff newoff = dt.tellp();
+        md.seekp(0, std::ios_base::beg);
+        md.write(reinterpret_cast<const char*>(&newoff), sizeof(newoff));
+        return newoff;
+    };
+    auto patch = [&](const Body& body) {
+        auto [res, fres] = fm.GetFileResource(uuid);
+        const auto cnt = fres.Write(0, body);
+        fres.Commit();
+        return cnt;
+    };
+
+    const std::string data(4 * 1024 * 1024, 'p');
+    for (size_t seg_sz : {64 * 1024, 1024})
+    {
+        const auto body = Split_Body(data, seg_sz);
+        const auto name = "4 MiB in " + std::to_string(body.size()) + " segments";
+
+        // Reading /proc/self/io is a read itself
+        const auto [r0, w0] = Io_Syscalls();
+        const auto [r1, w1] = Io_Syscalls();
+        legacy_patch(body);
+        const auto [r2, w2] = Io_Syscalls();
+        patch(body);
+        const auto [r3, w3] = Io_Syscalls();
+        const auto own = r1 - r0;
+        WARN(name << ": fstream " << r2 - r1 - own << " reads, " << w2 - w1 << " writes; "
+             << "pwritev " << r3 - r2 - own << " reads, " << w3 - w2 << " writes");
+
+        BENCHMARK("fstream, " + name) { return legacy_patch(body); };
+        BENCHMARK("pwritev, " + name) { return patch(body); };
+    }
+
+    fm.RmAllFiles();
+}
+
+TEST_CASE("Opens per chunked upload", "[.benchmark][FilesManager]")
+{
+    tus::FilesManager fm(".");
+    const std::string chunk(4 * 1024, 'c');
+    constexpr int Chunks = 256;
+
+    // A HEAD and a PATCH per chunk, the way a resumable client uploads
+    auto upload = [&] {
+        std::string uuid;
+        {
+            auto res = fm.NewTmpFilesResource();
+            REQUIRE(res.Initialize(chunk.size() * Chunks) == static_cast<std::errc>(0));
+            uuid = res.Uuid();
+            fm.Persist(res);
+        }
+        for (int i = 0; i < Chunks; ++i)
+        {
+            fm.GetFileResource(uuid).second.GetMetadata();
+            auto [res, fres] = fm.GetFileResource(uuid);
+            fres.Write(i * chunk.size(), boost::asio::const_buffer(chunk.data(), chunk.size()));
+            fres.Commit();
+        }
+        return uuid;
+    };
+
+    for (size_t capacity : {size_t(0), tus::FdCache::DefaultCapacity()})
+    {
+        fm.SetFdCacheCapacity(capacity);
+        const auto before = fm.FdCacheStats();
+        const auto start = std::chrono::steady_clock::now();
+        upload();
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        const auto stats = fm.FdCacheStats();
+        // Every miss opens both files
+        WARN("capacity " << capacity << ": " << 2 * (stats.misses - before.misses) << " open() for "
+             << 2 * Chunks << " requests, "
+             << std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() << " us");
+
+        BENCHMARK("1 MiB in 4 KiB chunks, capacity " + std::to_string(capacity)) { return upload(); };
+        fm.RmAllFiles();
+    }
+}
+
+TEST_CASE("Metadata lookups", "[.benchmark][FilesManager]")
+{
+    tus::FilesManager fm(".");
+    std::string uuid;
+    {
+        auto res = fm.NewTmpFilesResource();
+        REQUIRE(res.Initialize(1000, "filename dGVzdA==") == static_cast<std::errc>(0));
+        uuid = res.Uuid();
+        fm.Persist(res);
+    }
+
+    // What a HEAD did before: acquire the upload, then read its metadata file
+    BENCHMARK("acquire and read")
+    {
+        auto [res, fres] = fm.GetFileResource(uuid);
+        return fres.GetMetadata().offset;
+    };
+    BENCHMARK("from memory") { return fm.GetMetadata(uuid).second.offset; };
+
+    fm.RmAllFiles();
+}
@@ -0,0 +1,151 @@
+#include "include/group_commit.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+using tus::GroupCommit;
+using namespace std::chrono_literals;
+
+namespace
+{
+int Open_Data(const std::string& name)
+{
+    return ::open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+}
+
+bool Is_Open(int fd)
+{
+    return ::fcntl(fd, F_GETFD) != -1;
+}
+} // namespace
+
+TEST_CASE("Commits arriving together are flushed together", "[GroupCommit]")
+{
+    const std::string name = "group_commit_test";
+    {
+        std::atomic<int> meta_syncs{0}, stored{0}, stored_at_sync{-1};
+        GroupCommit gc([&] { stored_at_sync = stored.load(); ++meta_syncs; return true; }, {50ms, 1 << 30});
+        constexpr int Threads = 8;
+        std::atomic<int> durable{0};
+        std::vector<std::promise<bool>> results(Threads);
+        std::vector<int> fds;
+        std::vector<std::thread> committers;
+        for (int t = 0; t < Threads; ++t)
+        {
+            const int data = Open_Data(name);
+            REQUIRE(data >= 0);
+            fds.push_back(data);
+            committers.emplace_back([&, t, data] {
+                gc.Add(data, 100, [&stored] { ++stored; return true; }, [&, t](bool ok) {
+                    ++durable;
+                    results[t].set_value(ok);
+                });
+            });
+        }
+        for (auto& c : committers)
+            c.join();
+        // All within the interval of the first
+        for (auto& r : results)
+            CHECK(r.get_future().get());
+        CHECK(durable == Threads);
+        const auto stats = gc.GetStats();
+        CHECK(stats.batches == 1);
+        CHECK(stats.commits == Threads);
+        CHECK(stats.failures == 0);
+        CHECK(meta_syncs == 1);
+        // Every offset stored, before the one sync of them
+        CHECK(stored == Threads);
+        CHECK(stored_at_sync == Threads);
+        gc.Stop();
+        // The descriptors were handed over and are closed
+        for (int fd : fds)
+            CHECK(!Is_Open(fd));
+    }
+    ::unlink(name.c_str());
+}
+
+TEST_CASE("A batch is flushed early once it wrote enough", "[GroupCommit]")
+{
+    const std::string name = "group_commit_test";
+    {
+        auto store = [] { return true; };
+        GroupCommit gc([] { return true; }, {1h, 1000});
+        std::promise<bool> first, second;
+        gc.Add(Open_Data(name), 600, store, [&](bool ok) { first.set_value(ok); });
+        auto fut = first.get_future();
+        CHECK(fut.wait_for(50ms) == std::future_status::timeout);
+
+        gc.Add(Open_Data(name), 600, store, [&](bool ok) { second.set_value(ok); });
+        REQUIRE(fut.wait_for(10s) == std::future_status::ready);
+        CHECK(fut.get());
+        CHECK(second.get_future().get());
+        CHECK(gc.GetStats().batches == 1);
+
+        // The last batch is flushed by Stop(), not an hour later
+        bool last = false;
+        gc.Add(Open_Data(name), 1, store, [&last](bool ok) { last = ok; });
+        gc.Stop();
+        CHECK(last);
+        CHECK(gc.GetStats().batches == 2);
+
+        // and the ones after it right away
+        bool after = false;
+        gc.Add(Open_Data(name), 1, store, [&after](bool ok) { after = ok; });
+        CHECK(after);
+        CHECK(gc.GetStats().batches == 3);
+    }
+    ::unlink(name.c_str());
+}
+
+TEST_CASE("A failed sync fails the commit", "[GroupCommit]")
+{
+    bool meta_ok = true;
+    int stored = 0;
+    auto store = [&stored] { ++stored; return true; };
+    GroupCommit gc([&meta_ok] { return meta_ok; }, {1ms, 1 << 30});
+
+    SECTION("of the data")
+    {   // pipes cannot be synced
+        int pipe_fds[2];
+        REQUIRE(::pipe(pipe_fds) == 0);
+        ::close(pipe_fds[1]);
+        std::promise<bool> result;
+        gc.Add(pipe_fds[0], 1, store, [&](bool ok) { result.set_value(ok); });
+        CHECK(!result.get_future().get());
+        CHECK(gc.GetStats().failures == 1);
+        // No offset past what is durable
+        CHECK(stored == 0);
+    }
+
+    SECTION("of the metadata")
+    {
+        const std::string name = "group_commit_test";
+        meta_ok = false;
+        std::promise<bool> result;
+        gc.Add(Open_Data(name), 1, store, [&](bool ok) { result.set_value(ok); });
+        CHECK(!result.get_future().get());
+        CHECK(gc.GetStats().failures == 1);
+        CHECK(stored == 1);
+        ::unlink(name.c_str());
+    }
+
+    SECTION("of the offset")
+    {
+        const std::string name = "group_commit_test";
+        std::promise<bool> result;
+        gc.Add(Open_Data(name), 1, [] { return false; }, [&](bool ok) { result.set_value(ok); });
+        CHECK(!result.get_future().get());
+        CHECK(gc.GetStats().failures == 1);
+        ::unlink(name.c_str());
+    }
+    gc.Stop();
+}
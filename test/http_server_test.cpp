@@ -0,0 +1,778 @@
+#include "include/http_server.hpp"
+#include "include/metrics.hpp"
+
+#include <boost/asio/connect.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+namespace asio = boost::asio;
+namespace beast = boost::beast;
+namespace http = beast::http;
+using tcp = asio::ip::tcp;
+
+using tus::FilesManager;
+using tus::HttpServer;
+using tus::StorageExecutor;
+using tus::TusManager;
+
+namespace
+{
+// Runs an HttpServer on an ephemeral loopback port with the given number of
+// io_context threads for the lifetime of the object.
+class Server_Fixture
+{
+    asio::io_context ioc_;
+    HttpServer server_;
+    std::vector<std::thread> threads_;
+
+public:
+    Server_Fixture(TusManager& tm, int nthreads, const HttpServer::Config& config = HttpServer::Config())
+        : ioc_(nthreads), server_(ioc_, {asio::ip::make_address("127.0.0.1"), 0}, tm, config)
+    {
+        start(nthreads);
+    }
+
+    Server_Fixture(TusManager& tm, int nthreads, const HttpServer::Config& config, StorageExecutor& storage)
+        : ioc_(nthreads), server_(ioc_, {asio::ip::make_address("127.0.0.1"), 0}, tm, config, storage)
+    {
+        start(nthreads);
+    }
+
+    ~Server_Fixture()
+    {
+        server_.Stop();
+        ioc_.stop();
+        for (auto& t : threads_)
+            t.join();
+    }
+
+    tcp::endpoint Endpoint() const { return server_.LocalEndpoint(); }
+
+private:
+    void start(int nthreads)
+    {
+        server_.Start();
+        for (int i = 0; i < nthreads; ++i)
+            threads_.emplace_back([this] { ioc_.run(); });
+    }
+};
+
+// Storage whose every write first waits for delay, like a congested disk
+class Slow_Storage : public StorageExecutor
+{
+    std::unique_ptr<StorageExecutor> inner_;
+    const std::chrono::milliseconds delay_;
+
+public:
+    Slow_Storage(std::unique_ptr<StorageExecutor> inner, std::chrono::milliseconds delay)
+        : inner_(std::move(inner)), delay_(delay)
+    {
+    }
+
+    Backend GetBackend() const override { return inner_->GetBackend(); }
+
+    void Write(int fd, const void* data, size_t size, off_t offset, Completion done) override
+    {
+        inner_->Run([=, done = std::move(done)]() mutable {
+            std::this_thread::sleep_for(delay_);
+            inner_->Write(fd, data, size, offset, std::move(done));
+        });
+    }
+
+    void Run(std::function<void()> work) override { inner_->Run(std::move(work)); }
+};
+
+http::response<http::string_body>
+Send_Request(const tcp::endpoint& ep, http::request<http::string_body>& req)
+{
+    asio::io_context ioc;
+    tcp::socket sock(ioc);
+    sock.connect(ep);
+
+    req.set(http::field::host, "localhost");
+    req.set("Tus-Resumable", "1.0.0");
+    req.prepare_payload();
+    http::write(sock, req);
+
+    beast::flat_buffer buf;
+    http::response<http::string_body> resp;
+    http::read(sock, buf, resp);
+
+    beast::error_code ec;
+    sock.shutdown(tcp::socket::shutdown_both, ec);
+    return resp;
+}
+
+// POST a new upload and PATCH it in one go, returns its /files/<uuid>
+// target or an empty string on any failure
+std::string Create_Upload(const tcp::endpoint& ep, const std::string& payload)
+{
+    http::request<http::string_body> post{http::verb::post, "/files", 11};
+    post.set("Upload-Length", std::to_string(payload.size()));
+    const auto presp = Send_Request(ep, post);
+    if (presp.result_int() != 201)
+        return "";
+
+    const auto loc = presp.at(http::field::location);
+    const auto pos = loc.find("/files/");
+    if (pos == beast::string_view::npos)
+        return "";
+
+    const std::string target(loc.substr(pos));
+    http::request<http::string_body> patch{http::verb::patch, target, 11};
+    patch.set(http::field::content_type, "application/offset+octet-stream");
+    patch.set("Upload-Offset", "0");
+    patch.body() = payload;
+    return Send_Request(ep, patch).result_int() == 204 ? target : "";
+}
+
+bool Upload_Once(const tcp::endpoint& ep, const std::string& payload)
+{
+    return !Create_Upload(ep, payload).empty();
+}
+
+std::string Head_Upload_Offset(const tcp::endpoint& ep, const std::string& location)
+{
+    http::request<http::string_body> head{http::verb::head, location, 11};
+    asio::io_context ioc;
+    tcp::socket sock(ioc);
+    sock.connect(ep);
+    head.set(http::field::host, "localhost");
+    head.set("Tus-Resumable", "1.0.0");
+    http::write(sock, head);
+    beast::flat_buffer buf;
+    http::response_parser<http::empty_body> parser;
+    parser.skip(true);
+    http::read(sock, buf, parser);
+    return std::string(parser.get().at("Upload-Offset"));
+}
+} // namespace
+
+TEST_CASE("Serves requests over loopback", "[HttpServer]")
+{
+    FilesManager fm(".");
+    TusManager tm(fm);
+
+    for (int nthreads : {1, 4})
+    {
+        Server_Fixture srv(tm, nthreads);
+
+        http::request<http::string_body> req{http::verb::options, "/files", 11};
+        const auto resp = Send_Request(srv.Endpoint(), req);
+        CHECK(resp.result_int() == 204);
+        CHECK(resp.at("Tus-Version") == "1.0.0");
+
+        CHECK(Upload_Once(srv.Endpoint(), "hello world"));
+    }
+
+    REQUIRE(tm.DeleteAllFiles() == 2);
+}
+
+TEST_CASE("Concurrent uploads on a thread pool", "[HttpServer]")
+{
+    FilesManager fm(".");
+    TusManager tm(fm);
+    Server_Fixture srv(tm, 4);
+
+    std::atomic<int> ok{0};
+    std::vector<std::thread> clients;
+    for (int c = 0; c < 8; ++c)
+        clients.emplace_back([&] {
+            for (int i = 0; i < 10; ++i)
+                ok += Upload_Once(srv.Endpoint(), std::string(1024, 'c'));
+        });
+    for (auto& c : clients)
+        c.join();
+
+    CHECK(ok == 80);
+    CHECK(fm.Size() == 80);
+    REQUIRE(tm.DeleteAllFiles() == 80);
+}
+
+TEST_CASE("Uploads answered once grouped commits are durable", "[HttpServer]")
+{
+    FilesManager fm(".");
+    fm.SetDurability(tus::Durability::Group, {std::chrono::milliseconds(20), 1 << 20});
+    TusManager tm(fm);
+    Server_Fixture srv(tm, 4);
+
+    std::atomic<int> ok{0};
+    std::vector<std::thread> clients;
+    for (int c = 0; c < 8; ++c)
+        clients.emplace_back([&] {
+            for (int i = 0; i < 5; ++i)
+                ok += Upload_Once(srv.Endpoint(), std::string(1024, 'g'));
+        });
+    for (auto& c : clients)
+        c.join();
+
+    CHECK(ok == 40);
+    const auto stats = fm.GroupCommitStats();
+    CHECK(stats.commits == 40);
+    CHECK(stats.failures == 0);
+    CHECK(stats.batches < stats.commits);
+    REQUIRE(tm.DeleteAllFiles() == 40);
+}
+
+TEST_CASE("Persistent connections", "[HttpServer]")
+{
+    FilesManager fm(".");
+    TusManager tm(fm);
+    HttpServer::Config config;
+    config.idle_timeout = std::chrono::seconds(1);
+    Server_Fixture srv(tm, 2, config);
+
+    asio::io_context ioc;
+    tcp::socket sock(ioc);
+    sock.connect(srv.Endpoint());
+    beast::flat_buffer buf;
+
+    auto options = []() {
+        http::request<http::string_body> req{http::verb::options, "/files", 11};
+        req.set(http::field::host, "localhost");
+        req.prepare_payload();
+        return req;
+    };
+
+    SECTION("several requests on one connection")
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            auto req = options();
+            http::write(sock, req);
+            http::response<http::string_body> resp;
+            http::read(sock, buf, resp);
+            CHECK(resp.result_int() == 204);
+            CHECK(resp.keep_alive());
+        }
+    }
+
+    SECTION("pipelined requests are answered in order")
+    {
+        auto req1 = options();
+        http::request<http::string_body> req2{http::verb::head, "/files/nott-exis-tent-file", 11};
+        req2.set(http::field::host, "localhost");
+        req2.set("Tus-Resumable", "1.0.0");
+        req2.prepare_payload();
+
+        std::ostringstream oss;
+        oss << req1 << req2;
+        asio::write(sock, asio::buffer(oss.str()));
+
+        http::response<http::string_body> resp1;
+        http::read(sock, buf, resp1);
+        CHECK(resp1.result_int() == 204);
+
+        http::response_parser<http::empty_body> parser2;
+        parser2.skip(true); // response to HEAD has no body
+        http::read(sock, buf, parser2);
+        CHECK(parser2.get().result_int() == 404);
+    }
+
+    SECTION("Connection: close is honoured")
+    {
+        auto req = options();
+        req.keep_alive(false);
+        http::write(sock, req);
+        http::response<http::string_body> resp;
+        http::read(sock, buf, resp);
+        CHECK(resp.result_int() == 204);
+        CHECK(!resp.keep_alive());
+
+        beast::error_code ec;
+        http::read(sock, buf, resp, ec);
+        CHECK(ec == http::error::end_of_stream);
+    }
+
+    SECTION("idle connection is closed")
+    {
+        auto req = options();
+        http::write(sock, req);
+        http::response<http::string_body> resp;
+        http::read(sock, buf, resp);
+        CHECK(resp.result_int() == 204);
+
+        const auto start = std::chrono::steady_clock::now();
+        beast::error_code ec;
+        http::read(sock, buf, resp, ec);
+        CHECK(ec);
+        CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+    }
+}
+
+TEST_CASE("Streaming uploads", "[HttpServer]")
+{
+    FilesManager fm(".");
+    TusManager tm(fm);
+    HttpServer::Config config;
+    config.body_piece_size = 4096;
+    config.splice_uploads = GENERATE(false, true);
+    Server_Fixture srv(tm, 2, config);
+
+    const size_t total = 16 * 1024 * 1024 + 3; // above beast's default body limit
+    http::request<http::string_body> post{http::verb::post, "/files", 11};
+    post.set("Upload-Length", std::to_string(total));
+    const auto presp = Send_Request(srv.Endpoint(), post);
+    REQUIRE(presp.result_int() == 201);
+    const auto loc = presp.at(http::field::location);
+    const std::string location(loc.substr(loc.find("/files/")));
+
+    auto head_offset = [&]() { return Head_Upload_Offset(srv.Endpoint(), location); };
+    auto patch_req = [&](const std::string& offset, std::string body) {
+        http::request<http::string_body> patch{http::verb::patch, location, 11};
+        patch.set(http::field::content_type, "application/offset+octet-stream");
+        patch.set("Upload-Offset", offset);
+        patch.body() = std::move(body);
+        return patch;
+    };
+    auto file_content = [&] {
+        std::ifstream is(location.substr(std::strlen("/files/")), std::ios_base::binary);
+        return std::string((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    };
+
+    SECTION("chunk larger than the default body limit")
+    {
+        std::string data;
+        for (size_t i = 0; i < total; ++i)
+            data.push_back('a' + i % 23);
+        auto patch = patch_req("0", data);
+        CHECK(Send_Request(srv.Endpoint(), patch).result_int() == 204);
+        CHECK(head_offset() == std::to_string(total));
+        CHECK(file_content() == data);
+    }
+
+    SECTION("checksummed chunk is verified")
+    {
+        auto patch = patch_req("0", "hello world");
+        patch.set("Upload-Checksum", "sha1 Kq5sNclPz7QV2+lfQIuc6R7oRu0=");
+        CHECK(Send_Request(srv.Endpoint(), patch).result_int() == 204);
+        CHECK(head_offset() == "11");
+
+        patch = patch_req("11", "hello world");
+        patch.set("Upload-Checksum", "sha1 xNhxrROtAP3pp7t/9+0lQ67FQkE=");
+        CHECK(Send_Request(srv.Endpoint(), patch).result_int() == 460);
+        CHECK(head_offset() == "11");
+    }
+
+    SECTION("request pipelined behind a chunk is answered")
+    {
+        auto patch = patch_req("0", std::string(100000, 'p'));
+        patch.set(http::field::host, "localhost");
+        patch.set("Tus-Resumable", "1.0.0");
+        patch.prepare_payload();
+        http::request<http::string_body> head{http::verb::head, location, 11};
+        head.set(http::field::host, "localhost");
+        head.set("Tus-Resumable", "1.0.0");
+
+        asio::io_context ioc;
+        tcp::socket sock(ioc);
+        sock.connect(srv.Endpoint());
+        std::ostringstream oss;
+        oss << patch << head;
+        asio::write(sock, asio::buffer(oss.str()));
+
+        beast::flat_buffer buf;
+        http::response<http::string_body> presp;
+        http::read(sock, buf, presp);
+        CHECK(presp.result_int() == 204);
+        http::response_parser<http::empty_body> hparser;
+        hparser.skip(true);
+        http::read(sock, buf, hparser);
+        CHECK(hparser.get().at("Upload-Offset") == "100000");
+    }
+
+    SECTION("rejected headers close the connection without reading the body")
+    {
+        http::request<http::string_body> patch{http::verb::patch, location, 11};
+        patch.set(http::field::content_type, "application/offset+octet-stream");
+        patch.set("Upload-Offset", "7");
+        patch.body() = std::string(1024, 's');
+        const auto resp = Send_Request(srv.Endpoint(), patch);
+        CHECK(resp.result_int() == 409);
+        CHECK(!resp.keep_alive());
+        CHECK(head_offset() == "0");
+    }
+
+    SECTION("chunked transfer encoding is refused")
+    {
+        asio::io_context ioc;
+        tcp::socket sock(ioc);
+        sock.connect(srv.Endpoint());
+        std::ostringstream oss;
+        oss << "PATCH " << location << " HTTP/1.1\r\n"
+            << "Host: localhost\r\nTus-Resumable: 1.0.0\r\n"
+            << "Content-Type: application/offset+octet-stream\r\n"
+            << "Upload-Offset: 0\r\nTransfer-Encoding: chunked\r\n\r\n"
+            << "b\r\nhello world\r\n0\r\n\r\n";
+        asio::write(sock, asio::buffer(oss.str()));
+        beast::flat_buffer buf;
+        http::response<http::string_body> resp;
+        http::read(sock, buf, resp);
+        CHECK(resp.result_int() == 400);
+        CHECK(head_offset() == "0");
+    }
+
+    SECTION("interrupted chunk keeps the bytes that arrived")
+    {
+        {
+            asio::io_context ioc;
+            tcp::socket sock(ioc);
+            sock.connect(srv.Endpoint());
+            std::ostringstream oss;
+            oss << "PATCH " << location << " HTTP/1.1\r\n"
+                << "Host: localhost\r\nTus-Resumable: 1.0.0\r\n"
+                << "Content-Type: application/offset+octet-stream\r\n"
+                << "Upload-Offset: 0\r\nContent-Length: 10000\r\n\r\n"
+                << std::string(5000, 'i');
+            asio::write(sock, asio::buffer(oss.str()));
+            sock.shutdown(tcp::socket::shutdown_send);
+            beast::flat_buffer buf;
+            http::response<http::string_body> resp;
+            beast::error_code ec;
+            http::read(sock, buf, resp, ec);
+            CHECK(ec);
+        }
+        for (int i = 0; i < 100 && head_offset() != "5000"; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        CHECK(head_offset() == "5000");
+    }
+
+    REQUIRE(tm.DeleteAllFiles() == 1);
+}
+
+TEST_CASE("Slow storage does not hold up other requests", "[HttpServer]")
+{
+    const auto backend = GENERATE(StorageExecutor::Backend::Uring, StorageExecutor::Backend::ThreadPool);
+    auto inner = StorageExecutor::Create(backend);
+    if (!inner)
+    {
+        WARN("io_uring is not available, skipped");
+        return;
+    }
+    const auto delay = std::chrono::milliseconds(200);
+    Slow_Storage storage(std::move(inner), delay);
+
+    FilesManager fm(".");
+    TusManager tm(fm);
+    HttpServer::Config config;
+    config.body_piece_size = 4096;
+    Server_Fixture srv(tm, 1, config, storage); // a single network thread
+
+    const size_t total = 8 * config.body_piece_size;
+    auto create = [&] {
+        http::request<http::string_body> post{http::verb::post, "/files", 11};
+        post.set("Upload-Length", std::to_string(total));
+        const auto presp = Send_Request(srv.Endpoint(), post);
+        REQUIRE(presp.result_int() == 201);
+        const auto loc = presp.at(http::field::location);
+        return std::string(loc.substr(loc.find("/files/")));
+    };
+    const auto location = create();
+    // The upload being patched is busy, HEAD asks about another one
+    const auto idle_location = create();
+
+    // Every piece of this PATCH spends delay in storage
+    std::atomic<bool> patched{false};
+    unsigned patch_status = 0;
+    std::thread patcher([&] {
+        http::request<http::string_body> patch{http::verb::patch, location, 11};
+        patch.set(http::field::content_type, "application/offset+octet-stream");
+        patch.set("Upload-Offset", "0");
+        patch.body() = std::string(total, 's');
+        patch_status = Send_Request(srv.Endpoint(), patch).result_int();
+        patched = true;
+    });
+
+    using Clock = std::chrono::steady_clock;
+    Clock::duration slowest{0};
+    int probes = 0;
+    while (!patched)
+    {
+        const auto start = Clock::now();
+        http::request<http::string_body> options{http::verb::options, "/files", 11};
+        CHECK(Send_Request(srv.Endpoint(), options).result_int() == 204);
+        CHECK(Head_Upload_Offset(srv.Endpoint(), idle_location) == "0");
+        slowest = std::max(slowest, Clock::now() - start);
+        ++probes;
+    }
+    patcher.join();
+
+    CHECK(patch_status == 204);
+    CHECK(Head_Upload_Offset(srv.Endpoint(), location) == std::to_string(total));
+    INFO(probes << " OPTIONS+HEAD probes, slowest took "
+         << std::chrono::duration_cast<std::chrono::microseconds>(slowest).count() << " us");
+    CHECK(probes > 10);
+    CHECK(slowest < delay / 2);
+
+    REQUIRE(tm.DeleteAllFiles() == 2);
+}
+
+TEST_CASE("Stopping with an upload in flight on storage", "[HttpServer]")
+{
+    FilesManager fm(".");
+    TusManager tm(fm);
+    HttpServer::Config config;
+    config.body_piece_size = 4096;
+    std::string location;
+    std::thread patcher;
+    {
+        asio::io_context ioc(1);
+        // Constructed after the io_context as betusd does, so that it is
+        // drained while the strands its completions post to still exist
+        Slow_Storage storage(StorageExecutor::Create(StorageExecutor::Backend::ThreadPool),
+                             std::chrono::milliseconds(100));
+        HttpServer server(ioc, {asio::ip::make_address("127.0.0.1"), 0}, tm, config, storage);
+        server.Start();
+        std::thread net([&ioc] { ioc.run(); });
+
+        http::request<http::string_body> post{http::verb::post, "/files", 11};
+        post.set("Upload-Length", std::to_string(16 * config.body_piece_size));
+        const auto presp = Send_Request(server.LocalEndpoint(), post);
+        REQUIRE(presp.result_int() == 201);
+        const auto loc = presp.at(http::field::location);
+        location = std::string(loc.substr(loc.find("/files/")));
+
+        patcher = std::thread([&location, ep = server.LocalEndpoint(), size = 16 * config.body_piece_size] {
+            http::request<http::string_body> patch{http::verb::patch, location, 11};
+            patch.set(http::field::content_type, "application/offset+octet-stream");
+            patch.set("Upload-Offset", "0");
+            patch.body() = std::string(size, 'f');
+            try
+            {
+                Send_Request(ep, patch);
+            }
+            catch (const std::exception&) // no answer, the server is gone
+            {
+            }
+        });
+        // A piece is in storage now
+        std::this_thread::sleep_for(std::chrono::milliseconds(150));
+        server.Stop();
+        ioc.stop();
+        net.join();
+    }
+    patcher.join();
+
+    // The connection went away with the upload, which is free again
+    const auto uuid = location.substr(std::strlen("/files/"));
+    CHECK(fm.GetFileResource(uuid).first == static_cast<std::errc>(0));
+    REQUIRE(tm.DeleteAllFiles() == 1);
+}
+
+TEST_CASE("Upload bodies are read at the client's rate", "[HttpServer]")
+{
+    FilesManager fm(".");
+    TusManager tm(fm);
+    HttpServer::Config config;
+    config.splice_uploads = GENERATE(false, true);
+    config.fair_share.client_rate = 512 * 1024;
+    config.fair_share.burst = config.fair_share.quantum = 64 * 1024;
+    Server_Fixture srv(tm, 2, config);
+
+    // Two connections of one address share its rate
+    const size_t size = 256 * 1024;
+    std::atomic<int> ok{0};
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> clients;
+    for (int c = 0; c < 2; ++c)
+        clients.emplace_back([&] { ok += Upload_Once(srv.Endpoint(), std::string(size, 'r')); });
+    for (auto& c : clients)
+        c.join();
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    CHECK(ok == 2);
+    const double at_rate = static_cast<double>(2 * size - config.fair_share.burst) / config.fair_share.client_rate;
+    INFO(elapsed.count() << " s, " << at_rate << " s at the client's rate");
+    CHECK(elapsed.count() >= 0.9 * at_rate);
+    REQUIRE(tm.DeleteAllFiles() == 2);
+}
+
+TEST_CASE("Expired uploads are reaped in the background", "[HttpServer]")
+{
+    FilesManager fm(".");
+    fm.SetTtl(std::chrono::milliseconds(50));
+    TusManager tm(fm);
+    HttpServer::Config config;
+    config.reap_interval = std::chrono::milliseconds(10);
+    config.reap_batch = 2;
+    Server_Fixture srv(tm, 1, config);
+
+    for (int i = 0; i < 5; ++i)
+    {
+        http::request<http::string_body> post{http::verb::post, "/files", 11};
+        post.set("Upload-Length", "100");
+        REQUIRE(Send_Request(srv.Endpoint(), post).result_int() == 201);
+    }
+    for (int i = 0; i < 200 && fm.Size() > 0; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    CHECK(fm.Size() == 0);
+    CHECK(fm.Reclaimed().files == 5);
+    CHECK(fm.Reserved() == 0);
+}
+
+TEST_CASE("Downloads", "[HttpServer]")
+{
+    FilesManager fm(".");
+    TusManager tm(fm);
+    HttpServer::Config config;
+    config.download_piece_size = 256 * 1024; // several pieces per download
+    Server_Fixture srv(tm, 1, config);
+
+    std::string payload(4 * 1024 * 1024 + 7, '\0');
+    for (size_t i = 0; i < payload.size(); ++i)
+        payload[i] = static_cast<char>('a' + i % 26);
+    const auto location = Create_Upload(srv.Endpoint(), payload);
+    REQUIRE(!location.empty());
+
+    asio::io_context ioc;
+    tcp::socket sock(ioc);
+    sock.connect(srv.Endpoint());
+    beast::flat_buffer buf;
+    auto get = [&](const std::string& target, const char* range = nullptr) {
+        http::request<http::empty_body> req{http::verb::get, target, 11};
+        req.set(http::field::host, "localhost");
+        if (range)
+            req.set(http::field::range, range);
+        http::write(sock, req);
+        http::response_parser<http::string_body> parser;
+        parser.body_limit(payload.size() + 1);
+        http::read(sock, buf, parser);
+        return parser.release();
+    };
+
+    // one connection: all of it, then pieces of it, then a miss
+    auto resp = get(location);
+    CHECK(resp.result_int() == 200);
+    CHECK(resp.body() == payload);
+    CHECK(resp.has_content_length());
+
+    resp = get(location, "bytes=1000000-1000009");
+    CHECK(resp.result_int() == 206);
+    CHECK(resp.body() == payload.substr(1000000, 10));
+    resp = get(location, "bytes=-7");
+    CHECK(resp.body() == payload.substr(payload.size() - 7));
+
+    resp = get(location + "0");
+    CHECK(resp.result_int() == 404);
+    resp = get(location, "bytes=0-0");
+    CHECK(resp.body() == "a");
+
+    tm.DeleteAllFiles();
+}
+
+TEST_CASE("Metrics endpoint", "[HttpServer]")
+{
+    FilesManager fm(".");
+    TusManager tm(fm);
+    Server_Fixture srv(tm, 2);
+
+    auto& metrics = tus::Metrics::Instance();
+    const auto posts = metrics.Requests(tus::Metrics::Verb::Post, 201);
+    const auto written = metrics.BytesWritten();
+    REQUIRE(Upload_Once(srv.Endpoint(), "hello metrics"));
+    // Requests are counted once written, the client may read the answer first
+    for (int i = 0; i < 200 && metrics.Requests(tus::Metrics::Verb::Post, 201) == posts; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    CHECK(metrics.Requests(tus::Metrics::Verb::Post, 201) == posts + 1);
+    CHECK(metrics.BytesWritten() == written + 13);
+
+    http::request<http::string_body> req{http::verb::get, "/metrics", 11};
+    const auto resp = Send_Request(srv.Endpoint(), req);
+    CHECK(resp.result_int() == 200);
+    const auto& text = resp.body();
+    CHECK(text.find("betus_requests_total{method=\"PATCH\",status=\"204\"} ") != std::string::npos);
+    CHECK(text.find("betus_request_duration_seconds_count{method=\"POST\",code=\"2xx\"} ") != std::string::npos);
+    CHECK(text.find("betus_upload_bytes_written_total ") != std::string::npos);
+    CHECK(text.find("\nbetus_uploads 1\n") != std::string::npos);
+    CHECK(text.find("\nbetus_uploads_in_use 0\n") != std::string::npos);
+    // the scraping connection itself is open
+    CHECK(text.find("\nbetus_connections_open 0\n") == std::string::npos);
+    CHECK(text.find("# TYPE betus_event_loop_lag_seconds histogram\n") != std::string::npos);
+
+    tm.DeleteAllFiles();
+}
+
+TEST_CASE("Throughput scaling with io_context threads", "[.benchmark][HttpServer]")
+{
+    const int max_threads = std::max(2u, std::thread::hardware_concurrency());
+    const int nclients = 2 * max_threads;
+    const int uploads_per_client = 50;
+    const std::string payload(64 * 1024, 'x');
+
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2)
+    {
+        FilesManager fm(".");
+        TusManager tm(fm);
+        Server_Fixture srv(tm, nthreads);
+
+        std::atomic<int> ok{0};
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> clients;
+        for (int c = 0; c < nclients; ++c)
+            clients.emplace_back([&] {
+                for (int i = 0; i < uploads_per_client; ++i)
+                    ok += Upload_Once(srv.Endpoint(), payload);
+            });
+        for (auto& c : clients)
+            c.join();
+        const std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+
+        std::cout << "threads=" << nthreads
+                  << " uploads/s=" << ok / secs.count()
+                  << " MB/s=" << ok * payload.size() / secs.count() / (1024 * 1024)
+                  << std::endl;
+        CHECK(ok == nclients * uploads_per_client);
+        tm.DeleteAllFiles();
+    }
+}
+
+TEST_CASE("Spliced against buffered ingest", "[.benchmark][HttpServer]")
+{
+    const size_t chunk = 64 * 1024 * 1024;
+    const std::string payload(chunk, 'z');
+
+    for (bool splice : {false, true})
+    {
+        FilesManager fm(".");
+        TusManager tm(fm);
+        HttpServer::Config config;
+        config.splice_uploads = splice;
+        Server_Fixture srv(tm, 1, config);
+
+        http::request<http::string_body> post{http::verb::post, "/files", 11};
+        post.set("Upload-Length", std::to_string(chunk));
+        const auto presp = Send_Request(srv.Endpoint(), post);
+        REQUIRE(presp.result_int() == 201);
+        const auto loc = presp.at(http::field::location);
+        const std::string location(loc.substr(loc.find("/files/")));
+
+        http::request<http::string_body> patch{http::verb::patch, location, 11};
+        patch.set(http::field::content_type, "application/offset+octet-stream");
+        patch.set("Upload-Offset", "0");
+        patch.body() = payload;
+
+        const auto start = std::chrono::steady_clock::now();
+        CHECK(Send_Request(srv.Endpoint(), patch).result_int() == 204);
+        const std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+        std::cout << (splice ? "spliced" : "buffered")
+                  << " MB/s=" << chunk / secs.count() / (1024 * 1024) << std::endl;
+        tm.DeleteAllFiles();
+    }
+}
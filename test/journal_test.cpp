@@ -0,0 +1,189 @@
+#include "include/journal.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+using tus::Journal;
+using tus::UploadKey;
+
+namespace
+{
+const std::string Fname = "journal_test";
+
+std::vector<Journal::Record> Replay_All(int dir_fd, Journal::ReplayStats& stats)
+{
+    Journal journal(dir_fd, Fname);
+    std::vector<Journal::Record> ret;
+    REQUIRE(journal.Replay([&ret](const Journal::Record& rec) { ret.push_back(rec); }, stats));
+    return ret;
+}
+
+struct Dir_Fixture
+{
+    int fd = ::open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    Dir_Fixture() { ::unlinkat(fd, Fname.c_str(), 0); }
+    ~Dir_Fixture()
+    {
+        ::unlinkat(fd, Fname.c_str(), 0);
+        ::close(fd);
+    }
+};
+} // namespace
+
+TEST_CASE("Records are replayed as appended", "[Journal]")
+{
+    Dir_Fixture dir;
+    {
+        Journal journal(dir.fd, Fname);
+        REQUIRE(journal.IsOpen());
+        CHECK(journal.Append({Journal::Type::Create, {1, 2}, 1000, 0, 4096, "filename dGVzdA==", "partial"}));
+        CHECK(journal.Append({Journal::Type::Offset, {1, 2}, 2000, 512, 0, "", ""}));
+        CHECK(journal.Append({Journal::Type::Delete, {1, 2}, 3000, 0, 0, "", ""}));
+        CHECK(journal.Sync());
+        CHECK(journal.Size() == std::filesystem::file_size(Fname));
+    }
+
+    Journal::ReplayStats stats;
+    const auto recs = Replay_All(dir.fd, stats);
+    CHECK(stats.records == 3);
+    CHECK(stats.torn == 0);
+    CHECK(!stats.clean);
+    REQUIRE(recs.size() == 3);
+    CHECK(recs[0].type == Journal::Type::Create);
+    CHECK(recs[0].key == UploadKey{1, 2});
+    CHECK(recs[0].time_ms == 1000);
+    CHECK(recs[0].length == 4096);
+    CHECK(recs[0].comment == "filename dGVzdA==");
+    CHECK(recs[0].concat == "partial");
+    CHECK(recs[1].type == Journal::Type::Offset);
+    CHECK(recs[1].offset == 512);
+    CHECK(recs[1].time_ms == 2000);
+    CHECK(recs[2].type == Journal::Type::Delete);
+}
+
+TEST_CASE("Replay stops at a damaged record", "[Journal]")
+{
+    Dir_Fixture dir;
+    uint64_t second_end = 0;
+    {
+        Journal journal(dir.fd, Fname);
+        for (int64_t off : {1, 2, 3})
+        {
+            REQUIRE(journal.Append({Journal::Type::Offset, {0, 7}, 0, off, 0, "", ""}));
+            if (off == 2)
+                second_end = journal.Size();
+        }
+    }
+    const auto size = std::filesystem::file_size(Fname);
+
+    SECTION("torn by a crash")
+    {
+        std::filesystem::resize_file(Fname, size - 3);
+        Journal::ReplayStats stats;
+        const auto recs = Replay_All(dir.fd, stats);
+        CHECK(recs.size() == 2);
+        CHECK(stats.torn == size - 3 - second_end);
+    }
+
+    SECTION("corrupt in the middle")
+    {
+        {
+            const int fd = ::open(Fname.c_str(), O_WRONLY);
+            REQUIRE(::pwrite(fd, "x", 1, second_end - 1) == 1);
+            ::close(fd);
+        }
+        Journal::ReplayStats stats;
+        const auto recs = Replay_All(dir.fd, stats);
+        REQUIRE(recs.size() == 1);
+        CHECK(recs[0].offset == 1);
+        CHECK(stats.torn > 0);
+    }
+
+    SECTION("not a journal")
+    {
+        std::filesystem::resize_file(Fname, 5);
+        Journal journal(dir.fd, Fname);
+        Journal::ReplayStats stats;
+        CHECK(!journal.Replay([](const Journal::Record&) {}, stats));
+    }
+}
+
+TEST_CASE("Rewrite replaces the records by a snapshot", "[Journal]")
+{
+    Dir_Fixture dir;
+    Journal journal(dir.fd, Fname);
+    for (int i = 0; i < 100; ++i)
+        REQUIRE(journal.Append({Journal::Type::Offset, {0, 1}, 0, i, 0, "", ""}));
+    const auto grown = journal.Size();
+
+    const bool clean = GENERATE(false, true);
+    REQUIRE(journal.Rewrite([](const Journal::Emit& emit) {
+        emit({Journal::Type::Create, {0, 1}, 5, 99, 100, "", ""});
+    }, clean));
+    CHECK(journal.Size() < grown);
+    CHECK(journal.BaseSize() == journal.Size());
+    CHECK(journal.Size() == std::filesystem::file_size(Fname));
+    CHECK(!std::filesystem::exists(Fname + ".tmp"));
+
+    Journal::ReplayStats stats;
+    auto recs = Replay_All(dir.fd, stats);
+    REQUIRE(recs.size() == (clean ? 2 : 1));
+    CHECK(recs[0].type == Journal::Type::Create);
+    CHECK(recs[0].offset == 99);
+    CHECK(stats.clean == clean);
+
+    // Appending goes on in the new file and ends the clean state
+    REQUIRE(journal.Append({Journal::Type::Delete, {0, 1}, 0, 0, 0, "", ""}));
+    recs = Replay_All(dir.fd, stats = {});
+    CHECK(recs.back().type == Journal::Type::Delete);
+    CHECK(!stats.clean);
+}
+
+TEST_CASE("Appends during a rewrite are kept", "[Journal]")
+{
+    Dir_Fixture dir;
+    Journal journal(dir.fd, Fname);
+    constexpr int64_t Appends = 20000;
+    std::atomic<int64_t> appended{0};
+    std::atomic<int> failed{0};
+    std::thread writer([&] {
+        for (int64_t i = 0; i < Appends; ++i)
+        {
+            failed += !journal.Append({Journal::Type::Offset, {0, 1}, 0, i, 0, "", ""});
+            appended = i + 1;
+        }
+    });
+    while (appended < Appends / 4)
+        std::this_thread::yield();
+    int64_t seen = -1;
+    REQUIRE(journal.Rewrite([&](const Journal::Emit& emit) {
+        seen = appended;
+        emit({Journal::Type::Create, {0, 1}, 0, 0, 0, "", ""});
+    }));
+    writer.join();
+    CHECK(failed == 0);
+
+    // Everything appended after the snapshot follows it, in order; the one
+    // appended last before it may not have been counted yet
+    Journal::ReplayStats stats;
+    const auto recs = Replay_All(dir.fd, stats);
+    CHECK(recs[0].type == Journal::Type::Create);
+    REQUIRE(recs.size() >= static_cast<size_t>(Appends - seen));
+    if (seen < Appends)
+    {
+        REQUIRE(recs.size() > 1);
+        CHECK(recs[1].offset >= seen);
+        CHECK(recs[1].offset <= seen + 1);
+        CHECK(recs.back().offset == Appends - 1);
+    }
+    for (size_t i = 2; i < recs.size(); ++i)
+        REQUIRE(recs[i].offset == recs[i - 1].offset + 1);
+}
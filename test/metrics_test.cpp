@@ -0,0 +1,102 @@
+#include "include/metrics.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+using tus::Metrics;
+using namespace std::chrono_literals;
+
+TEST_CASE("Requests are counted by method and status", "[Metrics]")
+{
+    Metrics m;
+    m.Request(Metrics::Verb::Patch, 204, 200us);
+    m.Request(Metrics::Verb::Patch, 204, 3ms);
+    m.Request(Metrics::Verb::Patch, 409, 50us);
+    m.Request(Metrics::Verb::Head, 999, 1ms); // not a status, dropped
+    CHECK(m.Requests(Metrics::Verb::Patch, 204) == 2);
+    CHECK(m.Requests(Metrics::Verb::Patch, 409) == 1);
+    CHECK(m.Requests(Metrics::Verb::Head, 204) == 0);
+    CHECK(Metrics::VerbOf(boost::beast::http::verb::delete_) == Metrics::Verb::Delete);
+    CHECK(Metrics::VerbOf(boost::beast::http::verb::put) == Metrics::Verb::Other);
+
+    const auto text = m.Render({{"betus_uploads", "Uploads.", 3}});
+    CHECK(text.find("# TYPE betus_requests_total counter\n") != std::string::npos);
+    CHECK(text.find("betus_requests_total{method=\"PATCH\",status=\"204\"} 2\n") != std::string::npos);
+    CHECK(text.find("betus_requests_total{method=\"PATCH\",status=\"409\"} 1\n") != std::string::npos);
+    CHECK(text.find("method=\"HEAD\"") == std::string::npos);
+    // cumulative buckets
+    CHECK(text.find("betus_request_duration_seconds_bucket{method=\"PATCH\",code=\"2xx\",le=\"0.0001\"} 0\n")
+          != std::string::npos);
+    CHECK(text.find("betus_request_duration_seconds_bucket{method=\"PATCH\",code=\"2xx\",le=\"0.00025\"} 1\n")
+          != std::string::npos);
+    CHECK(text.find("betus_request_duration_seconds_bucket{method=\"PATCH\",code=\"2xx\",le=\"+Inf\"} 2\n")
+          != std::string::npos);
+    CHECK(text.find("betus_request_duration_seconds_sum{method=\"PATCH\",code=\"2xx\"} 0.0032\n")
+          != std::string::npos);
+    CHECK(text.find("betus_request_duration_seconds_count{method=\"PATCH\",code=\"4xx\"} 1\n")
+          != std::string::npos);
+    CHECK(text.find("# TYPE betus_uploads gauge\nbetus_uploads 3\n") != std::string::npos);
+}
+
+TEST_CASE("Every thread records into its own shard", "[Metrics]")
+{
+    Metrics m;
+    constexpr int Threads = 8, Per_Thread = 10000;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < Threads; ++t)
+        workers.emplace_back([&m] {
+            m.ConnectionOpened();
+            for (int i = 0; i < Per_Thread; ++i)
+            {
+                m.Request(Metrics::Verb::Head, 204, 10us);
+                m.BytesWritten(3);
+            }
+        });
+    for (auto& w : workers)
+        w.join();
+    // the shards of exited threads still count
+    CHECK(m.Requests(Metrics::Verb::Head, 204) == Threads * Per_Thread);
+    CHECK(m.BytesWritten() == 3 * Threads * Per_Thread);
+    CHECK(m.OpenConnections() == Threads);
+    m.ConnectionClosed();
+    CHECK(m.OpenConnections() == Threads - 1);
+
+    // a second instance starts from zero on the same threads
+    Metrics other;
+    other.BytesWritten(5);
+    m.BytesWritten(1);
+    CHECK(other.BytesWritten() == 5);
+    CHECK(m.BytesWritten() == 3 * Threads * Per_Thread + 1);
+}
+
+TEST_CASE("Recording cost", "[.benchmark][Metrics]")
+{
+    Metrics m;
+    std::atomic<uint64_t> shared{0};
+    const unsigned threads = std::max(2u, std::thread::hardware_concurrency());
+    constexpr int Per_Thread = 1000000;
+
+    auto run = [threads](auto&& record) {
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < threads; ++t)
+            workers.emplace_back([&record] {
+                for (int i = 0; i < Per_Thread; ++i)
+                    record();
+            });
+        for (auto& w : workers)
+            w.join();
+        const std::chrono::duration<double, std::nano> ns = std::chrono::steady_clock::now() - start;
+        return ns.count() / Per_Thread;
+    };
+    const auto sharded = run([&m] { m.Request(Metrics::Verb::Patch, 204, 100us); });
+    const auto contended = run([&shared] { shared.fetch_add(1, std::memory_order_relaxed); });
+    WARN(threads << " threads: " << sharded << " ns per recorded request, "
+         << contended << " ns per increment of one shared atomic");
+    CHECK(m.Requests(Metrics::Verb::Patch, 204) == threads * Per_Thread);
+}
@@ -0,0 +1,114 @@
+#include "include/storage_executor.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+
+#include <catch2/catch.hpp>
+
+using tus::StorageExecutor;
+
+namespace
+{
+// Counts completions and lets the test wait for a number of them
+class Completions
+{
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    size_t cnt_ = 0;
+
+public:
+    void Add()
+    {
+        std::lock_guard lock(mtx_);
+        ++cnt_;
+        cv_.notify_all();
+    }
+    bool WaitFor(size_t cnt)
+    {
+        std::unique_lock lock(mtx_);
+        return cv_.wait_for(lock, std::chrono::seconds(10), [&] { return cnt_ >= cnt; });
+    }
+};
+} // namespace
+
+TEST_CASE("Storage executors", "[StorageExecutor]")
+{
+    const auto backend = GENERATE(StorageExecutor::Backend::Uring, StorageExecutor::Backend::ThreadPool);
+    auto storage = StorageExecutor::Create(backend);
+    if (!storage)
+    {
+        WARN("io_uring is not available, skipped");
+        return;
+    }
+    CHECK(storage->GetBackend() == backend);
+    CHECK(StorageExecutor::Create() != nullptr);
+
+    const std::string fname = "storage_executor_test.dat";
+    const int fd = ::open(fname.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    REQUIRE(fd >= 0);
+
+    SECTION("pieces land at their offsets")
+    {
+        // More writes in flight than the rings hold
+        const size_t pieces = 1000, piece_sz = 997;
+        std::string data;
+        for (size_t i = 0; i < pieces; ++i)
+            data.append(piece_sz, 'a' + i % 26);
+
+        Completions done;
+        std::atomic<size_t> bad{0};
+        for (size_t i = 0; i < pieces; ++i)
+            storage->Write(fd, data.data() + i * piece_sz, piece_sz, i * piece_sz, [&](ssize_t res) {
+                bad += res != static_cast<ssize_t>(piece_sz);
+                done.Add();
+            });
+        REQUIRE(done.WaitFor(pieces));
+        CHECK(bad == 0);
+
+        std::ifstream is(fname, std::ios_base::binary);
+        const std::string content((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+        CHECK(content == data);
+    }
+
+    SECTION("errors are reported as -errno")
+    {
+        Completions done;
+        ssize_t result = 0;
+        storage->Write(-1, "x", 1, 0, [&](ssize_t res) {
+            result = res;
+            done.Add();
+        });
+        REQUIRE(done.WaitFor(1));
+        CHECK(result == -EBADF);
+    }
+
+    SECTION("work is run")
+    {
+        Completions done;
+        for (int i = 0; i < 10; ++i)
+            storage->Run([&] { done.Add(); });
+        CHECK(done.WaitFor(10));
+    }
+
+    SECTION("destruction waits for what was submitted")
+    {
+        const std::string data(4096, 'd');
+        std::atomic<size_t> completed{0};
+        for (size_t i = 0; i < 500; ++i)
+            storage->Write(fd, data.data(), data.size(), i * data.size(), [&](ssize_t) { ++completed; });
+        storage->Run([&] { ++completed; });
+        storage.reset();
+        CHECK(completed == 501);
+    }
+
+    ::close(fd);
+    ::unlink(fname.c_str());
+}
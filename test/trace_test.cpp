@@ -0,0 +1,119 @@
+#include "include/trace.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <catch2/catch.hpp>
+
+using tus::Trace;
+using namespace std::chrono_literals;
+
+namespace
+{
+size_t Count(const std::string& text, const std::string& what)
+{
+    size_t cnt = 0;
+    for (auto pos = text.find(what); pos != std::string::npos; pos = text.find(what, pos + 1))
+        ++cnt;
+    return cnt;
+}
+} // namespace
+
+TEST_CASE("Spans are dumped as Chrome trace events", "[Trace]")
+{
+    Trace::Clear();
+    const auto begin = Trace::Clock::now();
+    {
+        tus::TraceRequest req(42);
+        Trace::Record("store offset", begin, begin + 1500ns);
+        CHECK(Trace::CurrentRequest() == 42);
+    }
+    CHECK(Trace::CurrentRequest() == 0);
+    Trace::Record("outside", begin, begin + 2us);
+
+    const auto json = Trace::ChromeJson();
+    CHECK(json.rfind("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 0) == 0);
+    CHECK(json.find("]}\n") == json.size() - 3);
+    CHECK(json.find("\"name\":\"store offset\",\"cat\":\"betus\",\"ph\":\"X\"") != std::string::npos);
+    CHECK(json.find("\"dur\":1.500,") != std::string::npos);
+    CHECK(json.find("\"args\":{\"request\":42}") != std::string::npos);
+    CHECK(json.find("\"dur\":2.000,") != std::string::npos);
+    CHECK(json.find("\"args\":{\"request\":0}") != std::string::npos);
+    CHECK(json.find("\"name\":\"thread_name\",\"ph\":\"M\"") != std::string::npos);
+
+    // The macros record only when tracing is compiled in
+    Trace::Clear();
+    {
+        BETUS_TRACE_SPAN("macro");
+    }
+    CHECK(Count(Trace::ChromeJson(), "\"name\":\"macro\"") == (Trace::Enabled ? 1 : 0));
+
+    const auto id = Trace::NewRequest();
+    CHECK(id > 0);
+    CHECK(Trace::NewRequest() == id + 1);
+}
+
+TEST_CASE("Every thread keeps its last spans", "[Trace]")
+{
+    Trace::Clear();
+    constexpr size_t Overrun = 100;
+    std::thread([] {
+        const auto now = Trace::Clock::now();
+        for (size_t i = 0; i < Overrun; ++i)
+            Trace::Record("overwritten", now, now);
+        for (size_t i = 0; i < Trace::Ring_Size; ++i)
+            Trace::Record("kept", now, now);
+    }).join();
+    std::thread([] {
+        const auto now = Trace::Clock::now();
+        Trace::Record("other thread", now, now);
+    }).join();
+
+    // Spans of threads that exited are still there
+    const auto json = Trace::ChromeJson();
+    CHECK(Count(json, "\"name\":\"overwritten\"") == 0);
+    CHECK(Count(json, "\"name\":\"kept\"") == Trace::Ring_Size);
+    CHECK(Count(json, "\"name\":\"other thread\"") == 1);
+    Trace::Clear();
+}
+
+TEST_CASE("Dumps while threads record", "[Trace]")
+{
+    Trace::Clear();
+    std::atomic<bool> stop{false};
+    std::thread writer([&stop] {
+        while (!stop.load(std::memory_order_relaxed))
+        {
+            const auto now = Trace::Clock::now();
+            Trace::Record("busy", now, now + 1us);
+        }
+    });
+    for (int i = 0; i < 20; ++i)
+    {
+        const auto json = Trace::ChromeJson();
+        REQUIRE(json.find("]}\n") == json.size() - 3);
+        // Slots the writer overtook while being copied are left out
+        REQUIRE(Count(json, "\"name\":\"busy\"") <= Trace::Ring_Size);
+        REQUIRE(Count(json, "\"name\":\"busy\"") == Count(json, "\"dur\":1.000,"));
+    }
+    stop = true;
+    writer.join();
+    Trace::Clear();
+}
+
+TEST_CASE("Span cost", "[.benchmark][Trace]")
+{
+    Trace::Clear();
+    constexpr int Spans = 1000000;
+    const auto start = Trace::Clock::now();
+    for (int i = 0; i < Spans; ++i)
+        tus::TraceSpan span("bench");
+    const std::chrono::duration<double, std::nano> ns = Trace::Clock::now() - start;
+    WARN(ns.count() / Spans << " ns per span, two clock reads and a ring slot");
+
+    BENCHMARK("span") { tus::TraceSpan span("bench"); };
+    BENCHMARK("clock read") { return Trace::Clock::now(); };
+    Trace::Clear();
+}
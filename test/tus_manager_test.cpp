@@ -5,7 +5,12 @@
 #include <boost/beast/http/field.hpp>
 #include <boost/beast/http/fields.hpp>
 
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <string>
 #include <string_view>
 #include <system_error>
@@ -81,11 +86,13 @@ void Attach_Content_To_Req(http::request<http::dynamic_body>& req, const char *h
     req.body() = mb;
 }
 
-std::string Reserve_Location_Via_Tus(TusManager& tm, size_t total_len)
+std::string Reserve_Location_Via_Tus(TusManager& tm, size_t total_len, const char* concat = nullptr)
 {
     http::request<http::dynamic_body> req{http::verb::post, "/files", 11};
     Fill_Req(req);
     req.set("Upload-Length", total_len);
+    if (concat)
+        req.set("Upload-Concat", concat);
 
     const auto poresp = tm.MakeResponse(req);
     CHECK(poresp.result_int() == 201);
@@ -119,6 +126,19 @@ TEST_CASE("Basic", "[TusManager]")
         CHECK(resp.at(http::field::content_length) == "0");
     }
 
+    SECTION("keep-alive follows the request")
+    {
+        http::request<http::dynamic_body> req{http::verb::options, "/files", 11};
+        req.set(http::field::host, "localhost");
+        CHECK(tm.MakeResponse(req).keep_alive());
+
+        req.keep_alive(false);
+        CHECK(!tm.MakeResponse(req).keep_alive());
+
+        http::request<http::dynamic_body> req10{http::verb::options, "/files", 10};
+        CHECK(!tm.MakeResponse(req10).keep_alive());
+    }
+
     REQUIRE(tm.DeleteAllFiles() == 0);
 }
 
@@ -153,9 +173,9 @@ TEST_CASE("OPTIONS", "[TusManager]")
         REQUIRE(resp.count("Tus-Version") == 1);
         CHECK(resp.at("Tus-Version") == "1.0.0");
         REQUIRE(resp.count("Tus-Extension") == 1);
-        CHECK(resp.at("Tus-Extension") == "creation,creation-with-upload,terminate,checksum");
+        CHECK(resp.at("Tus-Extension") == "creation,creation-with-upload,terminate,checksum,concatenation,expiration");
         REQUIRE(resp.count("Tus-Checksum-Algorithm") == 1);
-        CHECK(resp.at("Tus-Checksum-Algorithm") == "sha1");
+        CHECK(resp.at("Tus-Checksum-Algorithm") == "sha1,sha256,crc32c,xxh3");
     }
 
     REQUIRE(tm.DeleteAllFiles() == 0);
@@ -222,6 +242,35 @@ TEST_CASE("POST", "[TusManager]")
         }
     }
 
+    SECTION("Too large or no room left")
+    {
+        req.set("Upload-Length", TusManager::TUS_SUPPORTED_MAXSZ + "0");
+        {
+            const auto resp = tm.MakeResponse(req);
+            CHECK(resp.result_int() == 413);
+            Check_Tus_Header_NoContent(resp);
+        }
+        fm.SetQuota(100);
+        req.set("Upload-Length", 101);
+        {
+            const auto resp = tm.MakeResponse(req);
+            CHECK(resp.result_int() == 413);
+        }
+        req.set("Upload-Length", 60);
+        {
+            const auto resp = tm.MakeResponse(req);
+            CHECK(resp.result_int() == 201);
+        }
+        {
+            const auto resp = tm.MakeResponse(req);
+            CHECK(resp.result_int() == 507);
+            Check_Tus_Header_NoContent(resp);
+            REQUIRE(resp.count("location") == 0);
+        }
+        REQUIRE(tm.DeleteAllFiles() == 1);
+        CHECK(fm.Reserved() == 0);
+    }
+
     SECTION("no content_type for initial load within")
     {
         req.set("Upload-Length", 12);
@@ -236,6 +285,35 @@ TEST_CASE("POST", "[TusManager]")
         REQUIRE(tm.DeleteAllFiles() == 0);
     }
 
+    SECTION("initial load larger than the upload")
+    {
+        Fill_Req(req, "application/offset+octet-stream");
+        req.set("Upload-Length", 5);
+        Attach_Content_To_Req(req, "Hello World");
+
+        const auto resp = tm.MakeResponse(req);
+        CHECK(resp.result_int() == 413);
+        REQUIRE(resp.count("location") == 0);
+        CHECK(fm.Reserved() == 0);
+
+        REQUIRE(tm.DeleteAllFiles() == 0);
+    }
+
+    SECTION("initial load of unknown length")
+    {
+        Fill_Req(req, "application/offset+octet-stream");
+        req.set("Upload-Length", 12);
+        Attach_Content_To_Req(req, "Hello");
+        req.erase(http::field::content_length);
+        req.set(http::field::transfer_encoding, "chunked");
+
+        const auto resp = tm.MakeResponse(req);
+        CHECK(resp.result_int() == 400);
+        REQUIRE(resp.count("location") == 0);
+
+        REQUIRE(tm.DeleteAllFiles() == 0);
+    }
+
     SECTION("Success")
     {
         req.set("Upload-Length", 12);
@@ -275,14 +353,20 @@ TEST_CASE("HEAD", "[TusManager]")
         http::request<http::dynamic_body> req{http::verb::head, location, 11 };
         Fill_Req(req);
 
-        const auto [res, fres] = fm.GetFileResource(location.substr(strlen("/files/")));
+        auto [res, fres] = fm.GetFileResource(location.substr(strlen("/files/")));
         CHECK(!std::make_error_code(res));
         CHECK(fres.IsOpen());
 
-        const auto resp = tm.MakeResponse(req);
-        REQUIRE(resp.result_int() == 409);
-        Check_Tus_Header_NoContent(resp);
-        REQUIRE(resp.count("Upload-Offset") == 0);
+        auto resp = tm.MakeResponse(req);
+        REQUIRE(resp.result_int() == 204);
+        CHECK(resp.at("Upload-Offset") == "0");
+
+        CHECK(fres.Write("Hello"));
+        CHECK(fres.Commit());
+        resp = tm.MakeResponse(req);
+        REQUIRE(resp.result_int() == 204);
+        CHECK(resp.at("Upload-Offset") == "5");
+        CHECK(resp.at("Upload-Length") == "12");
     }
     SECTION("No such resource")
     {
@@ -294,9 +378,9 @@ TEST_CASE("HEAD", "[TusManager]")
         Check_Tus_Header_NoContent(resp);
         REQUIRE(resp.count("Upload-Offset") == 0);
     }
-    SECTION("internal error - artificial")
+    SECTION("files are not read")
     {
-        { // remove file as if it was suddenly gone or corrupted
+        { // remove the data behind the server's back
             auto res = ::remove(location.data() + strlen("/files/"));
             CHECK(res == 0);
         }
@@ -304,23 +388,10 @@ TEST_CASE("HEAD", "[TusManager]")
         Fill_Req(req);
 
         const auto resp = tm.MakeResponse(req);
-        REQUIRE(resp.result_int() == 500);
-        Check_Tus_Header_NoContent(resp);
-        REQUIRE(resp.count("Upload-Offset") == 0);
-    }
-    SECTION("metadata error - artificial")
-    {
-        { // clear metadata file artificially
-            auto of = std::ofstream(location.substr(strlen("/files/")) + ".mdata");
-            CHECK(of.is_open());
-        }
-        http::request<http::dynamic_body> req{http::verb::head, location, 11 };
-        Fill_Req(req);
-
-        const auto resp = tm.MakeResponse(req);
-        REQUIRE(resp.result_int() == 410);
+        REQUIRE(resp.result_int() == 204);
         Check_Tus_Header_NoContent(resp);
-        REQUIRE(resp.count("Upload-Offset") == 0);
+        CHECK(resp.at("Upload-Offset") == "0");
+        CHECK(resp.at("Upload-Length") == "12");
     }
 
     tm.DeleteAllFiles();
@@ -361,6 +432,25 @@ TEST_CASE("PATCH", "[TusManager]")
         REQUIRE(tm.DeleteAllFiles() == 1);
     }
 
+    SECTION("Declared content wraps around past the offset")
+    {
+        http::request<http::dynamic_body> req{http::verb::patch, location, 11};
+        Fill_Req(req, "application/offset+octet-stream");
+        req.set("Upload-Offset", "0");
+        Attach_Content_To_Req(req, "Hello");
+        REQUIRE(tm.MakeResponse(req).result_int() == 204);
+
+        req.set("Upload-Offset", "5");
+        Attach_Content_To_Req(req, "World");
+        req.set(http::field::content_length, "18446744073709551611"); // 5 + this is 0
+        const auto resp = tm.MakeResponse(req);
+
+        CHECK(resp.result_int() == 409);
+        Check_Tus_Header_NoContent(resp);
+        CHECK(fm.GetMetadata(location.substr(strlen("/files/"))).second.offset == 5);
+        REQUIRE(tm.DeleteAllFiles() == 1);
+    }
+
     SECTION("Wrong offset")
     {
         http::request<http::dynamic_body> req{http::verb::patch, location, 11};
@@ -522,6 +612,26 @@ TEST_CASE("Checksum", "[TusManager]")
         REQUIRE(tm.DeleteAllFiles() == 1);
     }
 
+    SECTION("Mismatch does not advance the offset")
+    {
+        http::request<http::dynamic_body> req{http::verb::patch, location, 11};
+        Fill_Req(req, "application/offset+octet-stream");
+        req.set("Upload-Offset", "0");
+        req.set("Upload-Checksum", "sha1 Kq5sNclPz7QV2+lfQIuc6R7oRu0=");
+        Attach_Content_To_Req(req, "hello word!");
+        CHECK(tm.MakeResponse(req).result_int() == 460);
+
+        http::request<http::dynamic_body> hreq{http::verb::head, location, 11};
+        Fill_Req(hreq);
+        const auto hresp = tm.MakeResponse(hreq);
+        REQUIRE(hresp.count("Upload-Offset") == 1);
+        CHECK(hresp.at("Upload-Offset") == "0");
+
+        Attach_Content_To_Req(req, "hello world");
+        CHECK(tm.MakeResponse(req).result_int() == 204);
+        REQUIRE(tm.DeleteAllFiles() == 1);
+    }
+
     SECTION("Correct Hash - one load")
     {
         http::request<http::dynamic_body> req{http::verb::patch, location, 11};
@@ -537,6 +647,42 @@ TEST_CASE("Checksum", "[TusManager]")
         REQUIRE(tm.DeleteAllFiles() == 1);
     }
 
+    SECTION("Other algorithms")
+    {
+        const auto [alg_b64, ok] = GENERATE(table<std::string, bool>({
+            {"sha256 uU0nuZNNPgilLlLX2n2r+sSE7+N6U4DukIj3rOLvzek=", true}, // echo -n "hello world" | sha256sum | xxd -r -p | base64
+            {"crc32c yZRlqg==", true},
+            {"xxh3 1Eex6kDmmIs=", true},
+            {"crc32c 1Eex6kDmmIs=", false},
+            {"sha256 yZRlqg==", false},
+        }));
+        http::request<http::dynamic_body> req{http::verb::patch, location, 11};
+        Fill_Req(req, "application/offset+octet-stream");
+        req.set("Upload-Offset", "0");
+        req.set("Upload-Checksum", alg_b64);
+        Attach_Content_To_Req(req, "hello world");
+
+        const auto resp = tm.MakeResponse(req);
+
+        CHECK(resp.result_int() == (ok ? 204 : 460));
+        Check_Tus_Header_NoContent(resp);
+        REQUIRE(tm.DeleteAllFiles() == 1);
+    }
+
+    SECTION("Algorithm without a digest")
+    {
+        http::request<http::dynamic_body> req{http::verb::patch, location, 11};
+        Fill_Req(req, "application/offset+octet-stream");
+        req.set("Upload-Offset", "0");
+        req.set("Upload-Checksum", "sha1");
+        Attach_Content_To_Req(req, "hello world");
+
+        const auto resp = tm.MakeResponse(req);
+
+        CHECK(resp.result_int() == 400);
+        REQUIRE(tm.DeleteAllFiles() == 1);
+    }
+
     SECTION("Correct Hash - two loads")
     {
         http::request<http::dynamic_body> req{http::verb::patch, location, 11};
@@ -641,3 +787,297 @@ TEST_CASE("Terminate Extension", "[TusManager]")
 
     tm.DeleteAllFiles();
 }
+
+TEST_CASE("Concatenation Extension", "[TusManager]")
+{
+    FilesManager fm(".");
+    TusManager tm(fm);
+
+    auto patch = [&](const std::string& location, const char* data) {
+        http::request<http::dynamic_body> req{http::verb::patch, location, 11};
+        Fill_Req(req, "application/offset+octet-stream");
+        req.set("Upload-Offset", "0");
+        Attach_Content_To_Req(req, data);
+        return tm.MakeResponse(req).result_int();
+    };
+    auto head = [&](const std::string& location) {
+        http::request<http::dynamic_body> req{http::verb::head, location, 11};
+        Fill_Req(req);
+        return tm.MakeResponse(req);
+    };
+    auto post_final = [&](const std::string& concat) {
+        http::request<http::dynamic_body> req{http::verb::post, "/files", 11};
+        Fill_Req(req);
+        req.set("Upload-Concat", concat);
+        return tm.MakeResponse(req);
+    };
+
+    const auto part1 = Reserve_Location_Via_Tus(tm, 6, "partial");
+    const auto part2 = Reserve_Location_Via_Tus(tm, 5, "partial");
+    REQUIRE(patch(part1, "hello ") == 204);
+    CHECK(head(part1).at("Upload-Concat") == "partial");
+
+    SECTION("Unfinished part")
+    {
+        CHECK(post_final("final;" + part1 + " " + part2).result_int() == 400);
+        CHECK(fm.Size() == 2);
+    }
+
+    REQUIRE(patch(part2, "world") == 204);
+
+    SECTION("Final upload is assembled")
+    {
+        const std::string concat = "final;http://localhost" + part1 + " " + part2;
+        const auto resp = post_final(concat);
+        CHECK(resp.result_int() == 201);
+        Check_Tus_Header_NoContent(resp);
+        REQUIRE(resp.count("location") == 1);
+        const auto locsw = resp.at("location");
+        const std::string location(locsw.substr(locsw.find("/files/")));
+
+        const auto hresp = head(location);
+        CHECK(hresp.at("Upload-Length") == "11");
+        CHECK(hresp.at("Upload-Offset") == "11");
+        CHECK(hresp.at("Upload-Concat") == concat);
+
+        std::ifstream is(location.substr(strlen("/files/")), std::ios_base::binary);
+        const std::string content((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+        CHECK(content == "hello world");
+
+        CHECK(patch(location, "!") == 403);
+        CHECK(fm.Size() == 3);
+    }
+
+    SECTION("Invalid final uploads")
+    {
+        const auto plain = Reserve_Location_Via_Tus(tm, 3);
+        CHECK(patch(plain, "abc") == 204);
+        CHECK(post_final("final;" + part1 + " " + plain).result_int() == 400);
+        CHECK(post_final("final;" + part1 + " /files/0f1e2d3c-4b5a-6978-8796-a5b4c3d2e1f0").result_int() == 404);
+        CHECK(post_final("final;").result_int() == 400);
+        CHECK(post_final("final;" + part1 + " nowhere").result_int() == 400);
+        CHECK(post_final("whole").result_int() == 400);
+        {
+            http::request<http::dynamic_body> req{http::verb::post, "/files", 11};
+            Fill_Req(req);
+            req.set("Upload-Concat", "final;" + part1);
+            req.set("Upload-Length", 6);
+            CHECK(tm.MakeResponse(req).result_int() == 400);
+        }
+        CHECK(fm.Size() == 3);
+    }
+
+    tm.DeleteAllFiles();
+}
+
+TEST_CASE("Expiration Extension", "[TusManager]")
+{
+    FilesManager fm(".");
+    TusManager tm(fm);
+
+    SECTION("No Upload-Expires without a ttl")
+    {
+        http::request<http::dynamic_body> req{http::verb::post, "/files", 11};
+        Fill_Req(req);
+        req.set("Upload-Length", 5);
+        const auto resp = tm.MakeResponse(req);
+        CHECK(resp.result_int() == 201);
+        CHECK(resp.count("Upload-Expires") == 0);
+    }
+
+    SECTION("Upload-Expires on creation, PATCH and HEAD")
+    {
+        fm.SetTtl(std::chrono::hours(24));
+        const auto location = Reserve_Location_Via_Tus(tm, 5);
+
+        http::request<http::dynamic_body> head{http::verb::head, location, 11};
+        Fill_Req(head);
+        auto resp = tm.MakeResponse(head);
+        CHECK(resp.result_int() == 204);
+        REQUIRE(resp.count("Upload-Expires") == 1);
+        const std::string expires(resp.at("Upload-Expires"));
+        CHECK(expires.size() == 29); // Wed, 25 Jun 2014 16:00:00 GMT
+        CHECK(expires.substr(expires.size() - 4) == " GMT");
+
+        http::request<http::dynamic_body> patch{http::verb::patch, location, 11};
+        Fill_Req(patch, "application/offset+octet-stream");
+        patch.set("Upload-Offset", "0");
+        Attach_Content_To_Req(patch, "hello");
+        resp = tm.MakeResponse(patch);
+        CHECK(resp.result_int() == 204);
+        CHECK(resp.count("Upload-Expires") == 1);
+    }
+
+    tm.DeleteAllFiles();
+}
+
+TEST_CASE("Download", "[TusManager]")
+{
+    FilesManager fm(".");
+    TusManager tm(fm);
+
+    const auto location = Load_File_Via_Tus(tm); // hello world
+    const auto uuid = location.substr(strlen("/files/"));
+    auto get = [&](const std::string& target, const char* range = nullptr) {
+        http::request<http::dynamic_body> req{http::verb::get, target, 11};
+        req.set(http::field::host, "localhost");
+        if (range)
+            req.set(http::field::range, range);
+        return req;
+    };
+    http::response<http::dynamic_body> resp;
+
+    SECTION("whole upload")
+    {
+        CHECK(TusManager::IsDownload(get(location)));
+        const auto dl = tm.BeginDownload(get(location), resp);
+        REQUIRE(dl);
+        CHECK(resp.result_int() == 200);
+        CHECK(resp.at(http::field::content_length) == "11");
+        CHECK(resp.at(http::field::accept_ranges) == "bytes");
+        CHECK(resp.at(http::field::etag) == '"' + uuid + "-11\"");
+        CHECK(resp.body().size() == 0);
+        CHECK(dl->Offset() == 0);
+        CHECK(dl->Left() == 11);
+
+        SECTION("sent from the file")
+        {
+            int fds[2];
+            REQUIRE(::pipe(fds) == 0);
+            CHECK(dl->SendTo(fds[1], 4) == 4);
+            CHECK(dl->SendTo(fds[1], 100) == 7);
+            CHECK(dl->Left() == 0);
+            char buf[16];
+            CHECK(::read(fds[0], buf, sizeof(buf)) == 11);
+            CHECK(std::string(buf, 11) == "hello world");
+            ::close(fds[0]);
+            ::close(fds[1]);
+        }
+        SECTION("is still not served by MakeResponse")
+        {
+            CHECK(tm.MakeResponse(get(location)).result_int() == 400);
+        }
+        SECTION("unchanged")
+        {
+            auto req = get(location);
+            req.set(http::field::if_none_match, "\"other\", W/" + std::string(resp.at(http::field::etag)));
+            http::response<http::dynamic_body> resp2;
+            CHECK(!tm.BeginDownload(req, resp2));
+            CHECK(resp2.result_int() == 304);
+        }
+    }
+
+    SECTION("ranges")
+    {
+        auto dl = tm.BeginDownload(get(location, "bytes=6-"), resp);
+        REQUIRE(dl);
+        CHECK(resp.result_int() == 206);
+        CHECK(resp.at(http::field::content_range) == "bytes 6-10/11");
+        CHECK(resp.at(http::field::content_length) == "5");
+        CHECK(dl->Offset() == 6);
+
+        resp = {};
+        dl = tm.BeginDownload(get(location, "bytes=-3"), resp);
+        REQUIRE(dl);
+        CHECK(resp.at(http::field::content_range) == "bytes 8-10/11");
+
+        resp = {};
+        dl = tm.BeginDownload(get(location, "bytes=2-100"), resp);
+        REQUIRE(dl);
+        CHECK(resp.at(http::field::content_range) == "bytes 2-10/11");
+        CHECK(dl->Left() == 9);
+
+        // several ranges or a malformed one: the whole content
+        for (const char* range : {"bytes=0-1,4-5", "bytes=5-2", "lines=1-2", "bytes=x-"})
+        {
+            INFO(range);
+            resp = {};
+            dl = tm.BeginDownload(get(location, range), resp);
+            REQUIRE(dl);
+            CHECK(resp.result_int() == 200);
+            CHECK(dl->Left() == 11);
+        }
+
+        resp = {};
+        CHECK(!tm.BeginDownload(get(location, "bytes=11-"), resp));
+        CHECK(resp.result_int() == 416);
+        CHECK(resp.at(http::field::content_range) == "bytes */11");
+
+        // a range of content that changed meanwhile is not served
+        auto req = get(location, "bytes=6-");
+        req.set(http::field::if_range, "\"" + uuid + "-5\"");
+        resp = {};
+        dl = tm.BeginDownload(req, resp);
+        REQUIRE(dl);
+        CHECK(resp.result_int() == 200);
+    }
+
+    SECTION("uploads still being written")
+    {
+        const auto partial = Reserve_Location_Via_Tus(tm, 100);
+        CHECK(!tm.BeginDownload(get(partial), resp));
+        CHECK(resp.result_int() == 409);
+
+        tm.SetServePartial(true);
+        resp = {};
+        const auto dl = tm.BeginDownload(get(partial), resp);
+        REQUIRE(dl);
+        CHECK(resp.result_int() == 200);
+        CHECK(resp.at(http::field::cache_control) == "no-store");
+        CHECK(dl->Left() == 0);
+    }
+
+    SECTION("unknown uploads")
+    {
+        CHECK(!tm.BeginDownload(get(location + "0"), resp));
+        CHECK(resp.result_int() == 404);
+        resp = {};
+        CHECK(!tm.BeginDownload(get("/other"), resp));
+        CHECK(resp.result_int() == 404);
+    }
+
+    tm.DeleteAllFiles();
+}
+
+TEST_CASE("Checksum of 64 MiB chunks", "[.benchmark][TusManager]")
+{
+    FilesManager fm(".");
+    TusManager tm(fm);
+
+    const size_t chunk_sz = 64 * 1024 * 1024;
+    const auto location = Reserve_Location_Via_Tus(tm, chunk_sz);
+
+    beast::multi_buffer mb;
+    for (size_t left = chunk_sz; left > 0; )
+    {
+        auto bufs = mb.prepare(std::min<size_t>(left, 1024 * 1024));
+        const auto n = boost::asio::buffer_size(bufs);
+        for (const auto& b : beast::buffers_range(bufs))
+            memset(b.data(), 'b', b.size());
+        mb.commit(n);
+        left -= n;
+    }
+
+    BENCHMARK("write, then re-read the chunk for sha1")
+    {
+        auto [res, fres] = fm.GetFileResource(location.substr(strlen("/files/")));
+        fres.Write(0, mb);
+        return fres.ChecksumSha1Hex(0, chunk_sz);
+    };
+
+    // A mismatching digest leaves the offset at 0, so the same upload can be
+    // patched again on every run
+    http::request<http::dynamic_body> req{http::verb::patch, location, 11};
+    Fill_Req(req, "application/offset+octet-stream");
+    req.set("Upload-Offset", "0");
+    req.set("Upload-Checksum", "sha1 Kq5sNclPz7QV2+lfQIuc6R7oRu0=");
+    req.content_length(chunk_sz);
+    req.body() = mb;
+
+    BENCHMARK("PATCH with sha1 computed while writing")
+    {
+        return tm.MakeResponse(req).result_int();
+    };
+
+    tm.DeleteAllFiles();
+}
@@ -0,0 +1,264 @@
+#include "include/upload_registry.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+using tus::UploadKey;
+using tus::UploadRegistry;
+
+namespace
+{
+std::vector<UploadKey> Random_Keys(size_t cnt)
+{
+    std::mt19937_64 rng(cnt);
+    std::vector<UploadKey> ret(cnt);
+    for (auto& key : ret)
+        key = UploadKey{rng(), rng()};
+    return ret;
+}
+
+// What FilesManager did before the registry: one mutex over two sets of
+// uuid strings
+class Legacy_Registry
+{
+    std::mutex mtx_;
+    std::unordered_set<std::string> all_;
+    std::unordered_set<std::string> inuse_;
+
+public:
+    void Insert(const std::string& uuid)
+    {
+        std::lock_guard lock(mtx_);
+        all_.insert(uuid);
+    }
+    bool TryAcquire(const std::string& uuid)
+    {
+        std::lock_guard lock(mtx_);
+        return all_.find(uuid) != all_.end() && inuse_.insert(uuid).second;
+    }
+    void Release(const std::string& uuid)
+    {
+        std::lock_guard lock(mtx_);
+        inuse_.erase(uuid);
+    }
+};
+
+// threads workers, each acquiring and releasing random uploads; returns
+// how many acquisitions succeeded
+template <typename AcquireRelease>
+size_t Hammer(unsigned threads, size_t ops_per_thread, size_t nkeys, AcquireRelease&& acq_rel)
+{
+    std::atomic<size_t> acquired{0};
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t)
+        workers.emplace_back([&, t] {
+            std::minstd_rand rng(t + 1);
+            size_t cnt = 0;
+            for (size_t i = 0; i < ops_per_thread; ++i)
+                cnt += acq_rel(rng() % nkeys);
+            acquired += cnt;
+        });
+    for (auto& w : workers)
+        w.join();
+    return acquired;
+}
+}
+
+TEST_CASE("Upload keys", "[UploadRegistry]")
+{
+    const std::string uuid = "0f1e2d3c-4b5a-6978-8796-a5b4c3d2e1f0";
+    const auto key = UploadKey::Parse(uuid);
+    REQUIRE(key);
+    CHECK(key->hi == 0x0f1e2d3c4b5a6978ULL);
+    CHECK(key->lo == 0x8796a5b4c3d2e1f0ULL);
+    CHECK(key->ToString() == uuid);
+
+    for (const char* bad : {"", "nott-exis-tent-file", "0f1e2d3c-4b5a-6978-8796-a5b4c3d2e1f",
+                            "0f1e2d3c-4b5a-6978-8796-a5b4c3d2e1f0a", "0f1e2d3c4b5a-6978-8796-a5b4c3d2e1f0a",
+                            "0F1E2D3C-4B5A-6978-8796-A5B4C3D2E1F0", "0f1e2d3c-4b5a-6978-8796-a5b4c3d2e1g0"})
+    {
+        INFO(bad);
+        CHECK(!UploadKey::Parse(bad));
+    }
+}
+
+TEST_CASE("Registry entries", "[UploadRegistry]")
+{
+    UploadRegistry reg;
+    const auto keys = Random_Keys(1000);
+
+    CHECK(reg.TryAcquire(keys[0]) == UploadRegistry::Acquire::Missing);
+    CHECK(!reg.Release(keys[0]));
+
+    for (size_t i = 0; i < keys.size(); ++i)
+        REQUIRE(reg.Insert(keys[i], i % 2));
+    CHECK(!reg.Insert(keys[0], false));
+    CHECK(reg.Size() == keys.size());
+
+    CHECK(reg.TryAcquire(keys[0]) == UploadRegistry::Acquire::Acquired);
+    CHECK(reg.TryAcquire(keys[0]) == UploadRegistry::Acquire::Busy);
+    CHECK(reg.TryAcquire(keys[1]) == UploadRegistry::Acquire::Busy); // inserted in use
+    CHECK(reg.Release(keys[0]));
+    CHECK(!reg.Release(keys[0]));
+    CHECK(reg.TryAcquire(keys[0]) == UploadRegistry::Acquire::Acquired);
+
+    size_t in_use = 0, seen = 0;
+    reg.ForEach([&](const UploadKey&, bool busy) {
+        ++seen;
+        in_use += busy;
+    });
+    CHECK(seen == keys.size());
+    CHECK(in_use == keys.size() / 2 + 1);
+
+    CHECK(reg.Erase(keys[0]));
+    CHECK(!reg.Erase(keys[0]));
+    CHECK(reg.TryAcquire(keys[0]) == UploadRegistry::Acquire::Missing);
+    CHECK(reg.Clear() == keys.size() - 1);
+    CHECK(reg.Size() == 0);
+}
+
+TEST_CASE("Registry expiry", "[UploadRegistry]")
+{
+    UploadRegistry reg;
+    const auto keys = Random_Keys(300);
+    for (size_t i = 0; i < keys.size(); ++i)
+        REQUIRE(reg.Insert(keys[i], false, i % 3 == 0 ? 0 : 100 + static_cast<int64_t>(i)));
+
+    CHECK(reg.Expiry(keys[0]) == 0);
+    CHECK(reg.Expiry(keys[1]) == 101);
+    CHECK(reg.Expiry(Random_Keys(301).back()) == 0);
+
+    // Expired entries are missing for acquirers that pass the time
+    CHECK(reg.TryAcquire(keys[1], 101) == UploadRegistry::Acquire::Missing);
+    CHECK(reg.TryAcquire(keys[1], 100) == UploadRegistry::Acquire::Acquired);
+    CHECK(reg.TryAcquire(keys[0], 1000) == UploadRegistry::Acquire::Acquired);
+    CHECK(reg.Release(keys[0]));
+
+    // keys[1] is in use, the rest of those up to 250 expired
+    std::vector<UploadKey> expired;
+    for (size_t sh = 0; sh < UploadRegistry::Shard_Count; ++sh)
+        reg.Expired(sh, 250, expired);
+    size_t want = 0;
+    for (size_t i = 2; i <= 150; ++i)
+        want += i % 3 != 0;
+    CHECK(expired.size() == want);
+
+    CHECK(reg.SetExpiry(keys[2], 0));
+    CHECK(!reg.SetExpiry(Random_Keys(301).back(), 5));
+    expired.clear();
+    for (size_t sh = 0; sh < UploadRegistry::Shard_Count; ++sh)
+        reg.Expired(sh, 250, expired);
+    CHECK(expired.size() == want - 1);
+}
+
+TEST_CASE("Registry descriptions", "[UploadRegistry]")
+{
+    UploadRegistry reg;
+    const auto keys = Random_Keys(3);
+    REQUIRE(reg.Insert(keys[0], true, 100));
+    REQUIRE(reg.Insert(keys[1], false));
+
+    auto info = reg.Lookup(keys[0]);
+    REQUIRE(info);
+    CHECK(!info->described);
+    CHECK(info->offset == -1);
+    CHECK(!reg.Lookup(keys[0], 100));
+    CHECK(!reg.Lookup(keys[2]));
+    CHECK(!reg.Describe(keys[2], {0, 10, "", "", true}));
+
+    // in use or not makes no difference
+    CHECK(reg.Describe(keys[0], {0, 10, "name", "partial", true}));
+    info = reg.Lookup(keys[0], 99);
+    REQUIRE(info);
+    CHECK(info->described);
+    CHECK(info->offset == 0);
+    CHECK(info->length == 10);
+    CHECK(info->comment == "name");
+    CHECK(info->concat == "partial");
+    CHECK(reg.SetOffset(keys[0], 7));
+    CHECK(reg.Lookup(keys[0])->offset == 7);
+
+    // A later offset wins over a description read before it
+    CHECK(reg.SetOffset(keys[1], 5));
+    CHECK(reg.Describe(keys[1], {3, 10, "", "", true}));
+    CHECK(reg.Lookup(keys[1])->offset == 5);
+    CHECK(!reg.SetOffset(keys[2], 1));
+}
+
+TEST_CASE("Only one of concurrent acquirers wins", "[UploadRegistry]")
+{
+    UploadRegistry reg;
+    const auto keys = Random_Keys(16);
+    for (const auto& key : keys)
+        reg.Insert(key, false);
+
+    // Every worker tries each key once and never releases
+    std::atomic<size_t> acquired{0};
+    std::vector<std::thread> workers;
+    for (int t = 0; t < 8; ++t)
+        workers.emplace_back([&] {
+            for (const auto& key : keys)
+                acquired += reg.TryAcquire(key) == UploadRegistry::Acquire::Acquired;
+        });
+    for (auto& w : workers)
+        w.join();
+    CHECK(acquired == keys.size());
+
+    // and paired acquire/release never leaves an entry stuck in use
+    Hammer(8, 20000, keys.size(), [&](size_t i) {
+        if (reg.TryAcquire(keys[i]) != UploadRegistry::Acquire::Acquired)
+            return 0;
+        reg.Release(keys[i]);
+        return 1;
+    });
+    for (const auto& key : keys)
+        CHECK(reg.Release(key));
+    reg.ForEach([](const UploadKey&, bool busy) { CHECK(!busy); });
+}
+
+TEST_CASE("Registry contention", "[.benchmark][UploadRegistry]")
+{
+    constexpr size_t nkeys = 100000;
+    constexpr size_t ops = 200000;
+    const auto keys = Random_Keys(nkeys);
+    std::vector<std::string> uuids;
+    for (const auto& key : keys)
+        uuids.push_back(key.ToString());
+
+    Legacy_Registry legacy;
+    UploadRegistry reg;
+    for (size_t i = 0; i < nkeys; ++i)
+    {
+        legacy.Insert(uuids[i]);
+        reg.Insert(keys[i], false);
+    }
+
+    for (unsigned threads : {1u, 4u, 16u})
+    {
+        BENCHMARK("single mutex, string sets, " + std::to_string(threads) + " threads")
+        {
+            return Hammer(threads, ops / threads, nkeys, [&](size_t i) {
+                if (!legacy.TryAcquire(uuids[i]))
+                    return 0;
+                legacy.Release(uuids[i]);
+                return 1;
+            });
+        };
+        BENCHMARK("sharded registry, " + std::to_string(threads) + " threads")
+        {
+            return Hammer(threads, ops / threads, nkeys, [&](size_t i) {
+                if (reg.TryAcquire(keys[i]) != UploadRegistry::Acquire::Acquired)
+                    return 0;
+                reg.Release(keys[i]);
+                return 1;
+            });
+        };
+    }
+}
@@ -0,0 +1,466 @@
+// Load generator: drives a running betusd over loopback through the whole
+// tus flow (POST, PATCH chunks, HEAD and resume after a cut connection,
+// DELETE) from many connections at once, then reports latency percentiles
+// per verb and the upload throughput.
+
+#include "include/checksum.hpp"
+
+#include <boost/archive/iterators/base64_from_binary.hpp>
+#include <boost/archive/iterators/transform_width.hpp>
+#include <boost/asio/connect.hpp>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace asio = boost::asio;
+namespace beast = boost::beast;
+namespace http = beast::http;
+using tcp = asio::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+
+struct Options
+{
+    std::string host = "127.0.0.1";
+    std::string port = "8080";
+    unsigned concurrency = 8;
+    size_t uploads = 64;
+    size_t upload_size = 16 * 1024 * 1024;
+    size_t chunk_size = 1024 * 1024;
+    bool checksum = false;
+    // Chance that a PATCH is cut off halfway through its body
+    double disconnect = 0;
+    bool keep = false;
+};
+
+void Usage(const char* prog)
+{
+    std::cerr << "Usage: " << prog << " [options]\n"
+              << "  --host <address>       server address, 127.0.0.1 by default\n"
+              << "  --port <port>          server port, 8080 by default\n"
+              << "  --concurrency <n>      connections uploading at once, 8 by default\n"
+              << "  --uploads <n>          uploads in total, 64 by default\n"
+              << "  --upload-size <bytes>  Upload-Length of every upload, 16M by default\n"
+              << "  --chunk-size <bytes>   body of every PATCH, 1M by default\n"
+              << "  --checksum             send an Upload-Checksum (sha1) with every PATCH\n"
+              << "  --disconnect <p>       cut a PATCH off halfway through its body with chance p,\n"
+              << "                         then HEAD the upload and resume from its offset\n"
+              << "  --keep                 do not DELETE the uploads once they are complete\n"
+              << "  Sizes take a K, M or G suffix.\n";
+}
+
+// 16M, 256K, 1G, or plain bytes; 0 when malformed
+size_t Parse_Size(const std::string& s)
+{
+    char* end = nullptr;
+    const auto n = std::strtoull(s.c_str(), &end, 10);
+    if (end == s.c_str())
+        return 0;
+    const std::string suffix(end);
+    if (suffix.empty())
+        return n;
+    if (suffix == "K" || suffix == "k")
+        return n << 10;
+    if (suffix == "M" || suffix == "m")
+        return n << 20;
+    if (suffix == "G" || suffix == "g")
+        return n << 30;
+    return 0;
+}
+
+std::optional<Options> Parse_Args(int argc, char* argv[])
+{
+    Options opts;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--checksum")
+        {
+            opts.checksum = true;
+            continue;
+        }
+        if (arg == "--keep")
+        {
+            opts.keep = true;
+            continue;
+        }
+        if (i + 1 == argc)
+            return std::nullopt;
+        const std::string val = argv[++i];
+        if (arg == "--host")
+            opts.host = val;
+        else if (arg == "--port")
+            opts.port = val;
+        else if (arg == "--concurrency")
+            opts.concurrency = std::max(1, std::atoi(val.c_str()));
+        else if (arg == "--uploads")
+            opts.uploads = std::strtoull(val.c_str(), nullptr, 10);
+        else if (arg == "--upload-size")
+            opts.upload_size = Parse_Size(val);
+        else if (arg == "--chunk-size")
+            opts.chunk_size = Parse_Size(val);
+        else if (arg == "--disconnect")
+            opts.disconnect = std::clamp(std::atof(val.c_str()), 0.0, 1.0);
+        else
+            return std::nullopt;
+    }
+    if (opts.upload_size == 0 || opts.chunk_size == 0)
+        return std::nullopt;
+    return opts;
+}
+
+std::string To_Base64(const std::string& bin)
+{
+    namespace ar_iters = boost::archive::iterators;
+    using ItBase64T = ar_iters::base64_from_binary<
+                        ar_iters::transform_width<std::string::const_iterator, 6, 8>>;
+    std::string ret(ItBase64T(bin.begin()), ItBase64T(bin.end()));
+    ret.append((3 - bin.size() % 3) % 3, '=');
+    return ret;
+}
+
+enum class Verb { Post, Patch, Head, Delete };
+constexpr size_t Verb_Count = 4;
+const char* const Verb_Names[Verb_Count] = {"POST", "PATCH", "HEAD", "DELETE"};
+
+// What a worker saw; merged into one when all are done
+struct Tally
+{
+    // Microseconds, one entry per answered request
+    std::vector<double> latency[Verb_Count];
+    uint64_t bytes = 0;         // upload bytes the server acknowledged
+    size_t completed = 0;       // uploads that reached their length
+    size_t failed = 0;          // uploads given up on
+    size_t disconnects = 0;
+    size_t busy = 0;            // 409s, the upload still held after a disconnect
+
+    void Merge(Tally& other)
+    {
+        for (size_t v = 0; v < Verb_Count; ++v)
+            latency[v].insert(latency[v].end(), other.latency[v].begin(), other.latency[v].end());
+        bytes += other.bytes;
+        completed += other.completed;
+        failed += other.failed;
+        disconnects += other.disconnects;
+        busy += other.busy;
+    }
+};
+
+// One keep-alive connection, opened again whenever the server closes it
+class Connection
+{
+    asio::io_context ioc_;
+    tcp::socket sock_{ioc_};
+    const tcp::resolver::results_type endpoints_;
+    beast::flat_buffer buf_;
+    bool open_ = false;
+
+public:
+    Connection(const tcp::resolver::results_type& endpoints) : endpoints_(endpoints) {}
+
+    // The response, or nullopt if the exchange failed
+    template <typename Body>
+    std::optional<http::response<http::string_body>> Exchange(http::request<Body>& req)
+    {
+        beast::error_code ec;
+        if (!open_)
+            connect(ec);
+        if (!ec)
+            http::write(sock_, req, ec);
+        http::response_parser<http::string_body> parser;
+        parser.skip(req.method() == http::verb::head);
+        if (!ec)
+            http::read(sock_, buf_, parser, ec);
+        if (ec)
+        {
+            Close();
+            return std::nullopt;
+        }
+        auto resp = parser.release();
+        if (!resp.keep_alive())
+            Close();
+        return resp;
+    }
+
+    // Sends the headers of req, which announce size bytes of body, and only
+    // the first half of data before closing the connection
+    void SendHalf(http::request<http::empty_body>& req, const char* data, size_t size)
+    {
+        beast::error_code ec;
+        if (!open_)
+            connect(ec);
+        req.content_length(size);
+        if (!ec)
+            http::write(sock_, req, ec);
+        if (!ec)
+            asio::write(sock_, asio::buffer(data, size / 2), ec);
+        Close();
+    }
+
+    void Close()
+    {
+        beast::error_code ec;
+        sock_.shutdown(tcp::socket::shutdown_both, ec);
+        sock_.close(ec);
+        buf_.clear();
+        open_ = false;
+    }
+
+private:
+    void connect(beast::error_code& ec)
+    {
+        asio::connect(sock_, endpoints_, ec);
+        open_ = !ec;
+    }
+};
+
+class Worker
+{
+    static constexpr int Max_Conflicts = 100;
+
+    const Options& opts_;
+    const std::string& block_;
+    Connection conn_;
+    std::mt19937 rng_;
+    Tally tally_;
+
+public:
+    Worker(const Options& opts, const std::string& block,
+           const tcp::resolver::results_type& endpoints, unsigned seed)
+        : opts_(opts), block_(block), conn_(endpoints), rng_(seed)
+    {
+    }
+
+    Tally& Result() { return tally_; }
+
+    void Upload()
+    {
+        const auto target = create();
+        if (target.empty())
+        {
+            ++tally_.failed;
+            return;
+        }
+        size_t offset = 0;
+        // Conflicts in a row, before giving up on the upload
+        int conflicts = 0;
+        while (offset < opts_.upload_size && conflicts < Max_Conflicts)
+        {
+            const auto size = std::min(opts_.chunk_size, opts_.upload_size - offset);
+            // Byte o of every upload is block_[o % chunk_size]
+            const char* data = block_.data() + offset % opts_.chunk_size;
+            if (std::uniform_real_distribution<>(0, 1)(rng_) < opts_.disconnect)
+            {
+                auto req = request<http::empty_body>(http::verb::patch, target);
+                setPatch(req, offset, data, size);
+                conn_.SendHalf(req, data, size);
+                ++tally_.disconnects;
+                const auto resumed = head(target);
+                if (!resumed)
+                    break;
+                offset = *resumed;
+                continue;
+            }
+            const auto status = patch(target, offset, data, size);
+            if (status == http::status::no_content)
+            {
+                offset += size;
+                conflicts = 0;
+                continue;
+            }
+            if (status != http::status::conflict)
+                break;
+            // The server may still be holding the upload, or storing the
+            // half of a body cut off a moment ago
+            ++tally_.busy;
+            ++conflicts;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            const auto resumed = head(target);
+            if (!resumed)
+                break;
+            offset = *resumed;
+        }
+        if (offset != opts_.upload_size)
+        {
+            ++tally_.failed;
+            return;
+        }
+        ++tally_.completed;
+        if (!opts_.keep)
+        {
+            auto req = request<http::empty_body>(http::verb::delete_, target);
+            timed(Verb::Delete, req);
+        }
+    }
+
+private:
+    template <typename Body>
+    http::request<Body> request(http::verb verb, const std::string& target) const
+    {
+        http::request<Body> req{verb, target, 11};
+        req.set(http::field::host, opts_.host);
+        req.set("Tus-Resumable", "1.0.0");
+        return req;
+    }
+
+    template <typename Body>
+    std::optional<http::response<http::string_body>> timed(Verb verb, http::request<Body>& req)
+    {
+        const auto start = Clock::now();
+        auto resp = conn_.Exchange(req);
+        const std::chrono::duration<double, std::micro> us = Clock::now() - start;
+        if (resp)
+            tally_.latency[static_cast<size_t>(verb)].push_back(us.count());
+        return resp;
+    }
+
+    template <typename Body>
+    void setPatch(http::request<Body>& req, size_t offset, const char* data, size_t size) const
+    {
+        req.set(http::field::content_type, "application/offset+octet-stream");
+        req.set("Upload-Offset", std::to_string(offset));
+        if (opts_.checksum)
+        {
+            tus::Sha1 sha1;
+            sha1.Update(data, size);
+            req.set("Upload-Checksum", "sha1 " + To_Base64(sha1.Digest()));
+        }
+    }
+
+    // The /files/<uuid> target of a new upload, empty on failure
+    std::string create()
+    {
+        auto req = request<http::empty_body>(http::verb::post, "/files");
+        req.set("Upload-Length", std::to_string(opts_.upload_size));
+        const auto resp = timed(Verb::Post, req);
+        if (!resp || resp->result() != http::status::created)
+            return "";
+        const auto loc = resp->at(http::field::location);
+        const auto pos = loc.find("/files/");
+        return pos == beast::string_view::npos ? "" : std::string(loc.substr(pos));
+    }
+
+    // Status of the answer, internal_server_error if none came
+    http::status patch(const std::string& target, size_t offset, const char* data, size_t size)
+    {
+        auto req = request<http::string_body>(http::verb::patch, target);
+        setPatch(req, offset, data, size);
+        req.body().assign(data, size);
+        req.prepare_payload();
+        const auto resp = timed(Verb::Patch, req);
+        if (!resp)
+            return http::status::internal_server_error;
+        if (resp->result() == http::status::no_content)
+            tally_.bytes += size;
+        return resp->result();
+    }
+
+    // Upload-Offset of the upload, to resume from
+    std::optional<size_t> head(const std::string& target)
+    {
+        auto req = request<http::empty_body>(http::verb::head, target);
+        const auto resp = timed(Verb::Head, req);
+        if (!resp || resp->result() != http::status::no_content)
+            return std::nullopt;
+        const auto it = resp->find("Upload-Offset");
+        if (it == resp->end())
+            return std::nullopt;
+        return std::strtoull(std::string(it->value()).c_str(), nullptr, 10);
+    }
+};
+
+double Percentile(const std::vector<double>& sorted, double p)
+{
+    const auto idx = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1) + 0.5);
+    return sorted[std::min(idx, sorted.size() - 1)];
+}
+
+void Report(const Options& opts, Tally& total, std::chrono::duration<double> elapsed)
+{
+    std::cout << opts.uploads << " uploads of " << opts.upload_size << " bytes in " << opts.chunk_size
+              << " byte chunks over " << opts.concurrency << " connections"
+              << (opts.checksum ? ", sha1 checksums" : "") << '\n'
+              << "completed " << total.completed << ", failed " << total.failed << ", disconnects "
+              << total.disconnects << ", busy retries " << total.busy << '\n';
+    std::cout << std::fixed << std::setprecision(1) << std::left << std::setw(8) << "verb" << std::right
+              << std::setw(10) << "count" << std::setw(12) << "p50 us" << std::setw(12) << "p99 us"
+              << std::setw(12) << "p999 us" << std::setw(12) << "max us" << '\n';
+    for (size_t v = 0; v < Verb_Count; ++v)
+    {
+        auto& lat = total.latency[v];
+        if (lat.empty())
+            continue;
+        std::sort(lat.begin(), lat.end());
+        std::cout << std::left << std::setw(8) << Verb_Names[v] << std::right << std::setw(10) << lat.size()
+                  << std::setw(12) << Percentile(lat, 0.5) << std::setw(12) << Percentile(lat, 0.99)
+                  << std::setw(12) << Percentile(lat, 0.999) << std::setw(12) << lat.back() << '\n';
+    }
+    std::cout << std::setprecision(2) << total.bytes / (1024.0 * 1024.0) << " MiB in " << elapsed.count()
+              << " s, " << total.bytes / (1024.0 * 1024.0) / elapsed.count() << " MiB/s" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char* argv[])
+{
+    const auto opts = Parse_Args(argc, argv);
+    if (!opts)
+    {
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        asio::io_context ioc;
+        const auto endpoints = tcp::resolver(ioc).resolve(opts->host, opts->port);
+
+        // One random chunk twice over, so that a chunk resumed at any
+        // offset is a slice of it
+        std::string block(opts->chunk_size, '\0');
+        std::mt19937 rng(1);
+        for (auto& c : block)
+            c = static_cast<char>(rng());
+        block += block;
+
+        std::atomic<size_t> next{0};
+        std::mutex total_mtx;
+        Tally total;
+        std::vector<std::thread> workers;
+        const auto start = Clock::now();
+        for (unsigned t = 0; t < opts->concurrency; ++t)
+            workers.emplace_back([&, t] {
+                Worker w(*opts, block, endpoints, t + 1);
+                while (next++ < opts->uploads)
+                    w.Upload();
+                std::lock_guard lock(total_mtx);
+                total.Merge(w.Result());
+            });
+        for (auto& w : workers)
+            w.join();
+        Report(*opts, total, Clock::now() - start);
+        return total.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    catch (std::exception const& e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+}